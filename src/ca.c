@@ -58,6 +58,7 @@
     "							NOTE: Command line parameters will override any config file equivalents\n"	\
     "							Config file can also be set through environment variables\n"				\
     "							NOTE: Environment variable config file will override command line\n"		\
+    "							Set MBEDTLS_CONF_CACHE to a directory to cache the parsed config file\n"		\
 	"\n\n Certificate options:\n"																			\
     "    -startdate val			Cert notBefore, YYMMDDHHMMSSZ\n"											\
     "    -enddate val			Cert notAfter, YYMMDDHHMMSSZ\n"												\
@@ -67,6 +68,8 @@
     "    -keyfile val			The CA private key\n"														\
     "    -passin val			Key and cert input file pass phrase source\n"								\
     "    -cert infile			The CA cert\n"																\
+	USAGE_DEV_RANDOM																						\
+	USAGE_SEED_FILE																							\
 	"\n\n Revocation options:\n"																			\
 	"    -gencrl				Generate a new CRL\n"														\
 	"    -crl_reason val		UNSUPPORTED revocation reason\n"														\
@@ -93,6 +96,100 @@ int ca_main(void)
 #define SET_OID(x, oid) \
     do { x.len = MBEDTLS_OID_SIZE(oid); x.p = (unsigned char*)oid; } while( 0 )
 
+int read_ca_database(char* databasefile, ca_db* ca_database, unsigned long* database_len)
+{
+	unsigned long count = 0;
+	str_iter_t lines;
+	str_view_t line;
+	
+	ca_database->ca_database_entries = NULL;
+	ca_database->unique_subject = NULL;
+	ca_database->data = (char*)load_file(databasefile, NULL, &ca_database->data_len);
+	
+	if(ca_database->data == NULL)
+	{
+		return -1;
+	}
+	
+	initialize_str_iter(&lines, ca_database->data, ca_database->data_len, "\r\n", 2, 0);
+	while(next_str_piece(&lines, &line))
+	{
+		count++;
+	}
+	
+	ca_database->ca_database_entries = malloc(count * sizeof(ca_db_entry) + 1);
+	memset(ca_database->ca_database_entries, 0, count * sizeof(ca_db_entry));
+	initialize_str_iter(&lines, ca_database->data, ca_database->data_len, "\r\n", 2, 0);
+	for(int x = 0; x < count && next_str_piece(&lines, &line); x++)
+	{
+		// Fields are trimmed and terminated where they lie, the entry just points at them
+		char* line_pieces[6];
+		unsigned long num_line_pieces = 0;
+		str_iter_t fields;
+		str_view_t field;
+		
+		initialize_str_iter(&fields, (char*)line.str, line.len, "\t", 1, STR_ITER_TRIM | STR_ITER_TERMINATE);
+		while(num_line_pieces < 6 && next_str_piece(&fields, &field))
+		{
+			line_pieces[num_line_pieces++] = (char*)field.str;
+		}
+		if(num_line_pieces >= 5)
+		{
+			ca_database->ca_database_entries[x].status = line_pieces[0];
+			ca_database->ca_database_entries[x].expiration_date = line_pieces[1];
+			if(num_line_pieces == 5)
+			{
+				ca_database->ca_database_entries[x].revocation_date = NULL;
+				ca_database->ca_database_entries[x].serial = line_pieces[2];
+				ca_database->ca_database_entries[x].filename = line_pieces[3];
+				ca_database->ca_database_entries[x].dn = line_pieces[4];
+			}
+			else
+			{
+				ca_database->ca_database_entries[x].revocation_date = line_pieces[2];
+				ca_database->ca_database_entries[x].serial = line_pieces[3];
+				ca_database->ca_database_entries[x].filename = line_pieces[4];
+				ca_database->ca_database_entries[x].dn = line_pieces[5];
+			}
+		}
+	}
+	
+	*database_len = count;
+	
+	return 0;
+}
+
+// Only fields set after loading were allocated, the rest belong to ca_database->data
+static void free_ca_database_field(ca_db* ca_database, char* field)
+{
+	if(field < ca_database->data || field > ca_database->data + ca_database->data_len)
+	{
+		free(field);
+	}
+}
+
+void free_ca_database(ca_db* ca_database, unsigned long database_len)
+{
+	if(ca_database->ca_database_entries != NULL)
+	{
+		for(int x = 0; x < database_len; x++)
+		{
+			free_ca_database_field(ca_database, ca_database->ca_database_entries[x].status);
+			free_ca_database_field(ca_database, ca_database->ca_database_entries[x].expiration_date);
+			free_ca_database_field(ca_database, ca_database->ca_database_entries[x].revocation_date);
+			free_ca_database_field(ca_database, ca_database->ca_database_entries[x].serial);
+			free_ca_database_field(ca_database, ca_database->ca_database_entries[x].filename);
+			free_ca_database_field(ca_database, ca_database->ca_database_entries[x].dn);
+		}
+		free(ca_database->ca_database_entries);
+		ca_database->ca_database_entries = NULL;
+	}
+	free(ca_database->unique_subject);
+	ca_database->unique_subject = NULL;
+	free(ca_database->data);
+	ca_database->data = NULL;
+}
+
 int write_database_attr_old_new(char* databasefile, ca_db* ca_database)
 {
 	int ret = 0;
@@ -230,8 +327,11 @@ int ca_main(int argc, char** argv, int argi)
     mbedtls_x509write_cert crt;
     mbedtls_mpi serial;
     mbedtls_entropy_context entropy;
+    mbedtlsclu_entropy_source entropy_source;
+    mbedtlsclu_seed_file seed_file;
     mbedtls_ctr_drbg_context ctr_drbg;
     const char *pers = "ca";
+    int use_dev_random = 0;
 	
 	char* csr_infile = NULL;
 	int input_csr_format = FORMAT_PEM;
@@ -280,6 +380,8 @@ int ca_main(int argc, char** argv, int argi)
     mbedtls_mpi_init(&serial);
     mbedtls_ctr_drbg_init(&ctr_drbg);
     mbedtls_entropy_init(&entropy);
+    mbedtlsclu_entropy_source_init(&entropy_source);
+    mbedtlsclu_seed_file_init(&seed_file);
 #if defined(MBEDTLS_X509_CSR_PARSE_C)
     mbedtls_x509_csr_init(&csr);
 #endif
@@ -479,6 +581,29 @@ usage:
 			}
 			gencrl = 1;
 		}
+#if defined(MBEDTLS_FS_IO)
+		else if(strcmp(p,"-usedevrandom") == 0)
+		{
+			use_dev_random = 1;
+		}
+		else if(strcmp(p,"-randompool") == 0)
+		{
+			use_dev_random = 1;
+			entropy_source.random_pool = 1;
+		}
+#endif /* MBEDTLS_FS_IO */
+		else if(strcmp(p,"-rand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.path = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-writerand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.write_path = strdup(argv[i]);
+		}
 		else if(strcmp(p,"-crl_days") == 0 && i + 1 < argc)
 		{
 			// argv[i+1] should be the crl days. Advance i
@@ -530,6 +655,10 @@ usage:
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: cacrt_filein: %s\n", cacrt_filein);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: crtrevoke_in: %s\n", crtrevoke_in);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: gencrl: %d\n", gencrl);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: usedevrandom: %d\n", use_dev_random);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: randompool: %d\n", entropy_source.random_pool);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: rand: %s\n", seed_file.path);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: writerand: %s\n", seed_file.write_path);
 	
 	// Check if the ENV has a config file defined
 	mbedtls_env_conf = getenv(MBEDTLS_ENV_CONF);
@@ -672,57 +801,12 @@ usage:
 		ca_database_count = 0;
 		
 		// Read the database
-		filecontents = get_file_lines(ca_params.database, &ca_database_count);
-		
-		if(filecontents == NULL)
+		if((ret = read_ca_database(ca_params.database, &ca_database, &ca_database_count)) != 0)
 		{
 			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  get_file_lines Database file %s could not be read\n",ca_params.database);
 			goto exit;
 		}
 		
-		ca_database.ca_database_entries = malloc(ca_database_count * sizeof(ca_db_entry));
-		ca_database.unique_subject = NULL;
-		for(int x = 0; x < ca_database_count; x++)
-		{
-			char* line = filecontents[x];
-			unsigned long num_line_pieces;
-			char* separators = "\t";
-			char** line_pieces = split_on_separators(line, separators, 1, 6, 0, &num_line_pieces);
-			if(num_line_pieces >= 5)
-			{
-				char* trimmed = NULL;
-				trimmed = trim_flanking_whitespace(line_pieces[0]);
-				ca_database.ca_database_entries[x].status = strdup(trimmed);
-				trimmed = trim_flanking_whitespace(line_pieces[1]);
-				ca_database.ca_database_entries[x].expiration_date = strdup(trimmed);
-				if(num_line_pieces == 5)
-				{
-					ca_database.ca_database_entries[x].revocation_date = NULL;
-					trimmed = trim_flanking_whitespace(line_pieces[2]);
-					ca_database.ca_database_entries[x].serial = strdup(trimmed);
-					trimmed = trim_flanking_whitespace(line_pieces[3]);
-					ca_database.ca_database_entries[x].filename = strdup(trimmed);
-					trimmed = trim_flanking_whitespace(line_pieces[4]);
-					ca_database.ca_database_entries[x].dn = strdup(trimmed);
-				}
-				else
-				{
-					trimmed = trim_flanking_whitespace(line_pieces[2]);
-					ca_database.ca_database_entries[x].revocation_date = strdup(trimmed);
-					trimmed = trim_flanking_whitespace(line_pieces[3]);
-					ca_database.ca_database_entries[x].serial = strdup(trimmed);
-					trimmed = trim_flanking_whitespace(line_pieces[4]);
-					ca_database.ca_database_entries[x].filename = strdup(trimmed);
-					trimmed = trim_flanking_whitespace(line_pieces[5]);
-					ca_database.ca_database_entries[x].dn = strdup(trimmed);
-				}
-			}
-			
-			free_null_terminated_string_array(line_pieces);
-		}
-		
-		free_null_terminated_string_array(filecontents);
-		
 		// Print the DB for debugging purposes
 		for(int x = 0; x < ca_database_count; x++)
 		{
@@ -772,7 +856,23 @@ usage:
     mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Seeding the random number generator...");
     fflush(stdout);
 
-    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    if (use_dev_random) {
+        if ((ret = mbedtlsclu_entropy_add_source(&entropy, &entropy_source)) != 0) {
+            mbedtls_strerror(ret, buf, 1024);
+            mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_entropy_add_source returned %d - %s\n",
+                           ret, buf);
+            goto exit;
+        }
+    }
+
+    if ((ret = mbedtlsclu_seed_file_load(&seed_file, &entropy)) != 0) {
+        mbedtls_strerror(ret, buf, 1024);
+        mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_seed_file_load returned %d - %s\n",
+                       ret, buf);
+        goto exit;
+    }
+
+    if ((ret = mbedtlsclu_ctr_drbg_seed(&ctr_drbg, &entropy,
                                      (const unsigned char *) pers,
                                      strlen(pers))) != 0) {
         mbedtls_strerror(ret, buf, 1024);
@@ -781,6 +881,10 @@ usage:
         goto exit;
     }
 
+    if ((ret = mbedtlsclu_seed_file_update(&seed_file, &ctr_drbg)) != 0) {
+        mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"\n  !  Could not write seed file, mbedtlsclu_seed_file_update returned %d\n", ret);
+    }
+
     mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
 	
 	if(crtrevoke_in != NULL)
@@ -1747,8 +1851,12 @@ exit:
     mbedtls_pk_free(&loaded_subject_key);
     mbedtls_pk_free(&loaded_issuer_key);
     mbedtls_mpi_free(&serial);
+    mbedtlsclu_seed_file_finish(&seed_file, &ctr_drbg);
+    mbedtlsclu_seed_file_free(&seed_file);
     mbedtls_ctr_drbg_free(&ctr_drbg);
     mbedtls_entropy_free(&entropy);
+    mbedtlsclu_entropy_report(&entropy_source);
+    mbedtlsclu_entropy_source_free(&entropy_source);
 #if defined(MBEDTLS_USE_PSA_CRYPTO)
     mbedtls_psa_crypto_free();
 #endif /* MBEDTLS_USE_PSA_CRYPTO */
@@ -26,6 +26,10 @@
 
 int ca_main(int argc, char** argv, int argi);
 
+/* Reads an index.txt style database. Entries with fewer than 5 fields are left zeroed */
+int read_ca_database(char* databasefile, ca_db* ca_database, unsigned long* database_len);
+void free_ca_database(ca_db* ca_database, unsigned long database_len);
+
 int write_database_attr_old_new(char* databasefile, ca_db* ca_database);
 int write_database_old_new(char* databasefile, ca_db* ca_database, unsigned long database_len, int write_attr);
 int write_crl(mbedtls_x509write_crl *crl, const char *output_file,
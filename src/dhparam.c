@@ -48,6 +48,9 @@ int dhparam_main(void)
 	"\n\n Input options:\n"																			\
 	"    -in infile				Input file\n"														\
 	"    -check					Check for valid/safe DH Params\n"									\
+	"    -checkrounds n			Miller-Rabin rounds for each of P and Q when checking (default 64)\n"	\
+	"    -indir dir				Check every DH Params file in a directory (implies -check)\n"		\
+	"    -threads n				Number of threads to use (default: all cpus)\n"					\
 	"\n\n Output options:\n"																		\
 	"    -out outfile			Output file\n"														\
 	"    -outform PEM|DER		Output format, DER or PEM\n"										\
@@ -56,11 +59,18 @@ int dhparam_main(void)
 	"    -2						Generate parameters using 2 as the generator value (default)\n"		\
 	"    -3						Generate parameters using 3 as the generator value\n"				\
 	"    -5						Generate parameters using 5 as the generator value\n"				\
+	"    -progress				Report prime search progress on stderr\n"							\
+	"    -timeout secs			Give up generating after secs seconds\n"							\
+	"    -checkpoint file		Save search state to file, resume from it if it exists\n"			\
+	USAGE_DEV_RANDOM																				\
+	USAGE_SEED_FILE																					\
 	"\n\n Parameters:\n"																			\
 	"    numbits				Nubmer of bits if generating parameters (optional, default 2048)\n"
 	
 
 #define DFL_BITS    2048
+#define DFL_CHECK_ROUNDS	64
+#define MAX_THREADS			256
 
 /*
  * For historical reasons dhparam has always offered G = 2, 3 or 5, with 2 being the default
@@ -259,13 +269,393 @@ int write_dhm_params(mbedtls_mpi* G, mbedtls_mpi* P, int textout, int output_for
     return 0;
 }
 
+/*
+ * Miller-Rabin rounds on P and Q are split into jobs of at most
+ * (rounds / threads) rounds each, so a thorough check can be spread
+ * across every available core. Each worker owns an independently
+ * seeded CTR_DRBG for choosing its witnesses.
+ */
+typedef struct dhm_check_job {
+	const mbedtls_mpi* X;
+	int rounds;
+} dhm_check_job;
+
+typedef struct dhm_check_queue {
+	pthread_mutex_t lock;
+	dhm_check_job* jobs;
+	int num_jobs;
+	int next_job;
+	int failed;
+} dhm_check_queue;
+
+typedef struct dhm_check_worker {
+	dhm_check_queue* queue;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+	pthread_t thread;
+} dhm_check_worker;
+
+static void* dhm_check_mr_worker(void* arg)
+{
+	dhm_check_worker* worker = (dhm_check_worker*)arg;
+	dhm_check_queue* queue = worker->queue;
+	dhm_check_job* job;
+	int ret;
+	
+	while(1)
+	{
+		pthread_mutex_lock(&queue->lock);
+		if(queue->failed != 0 || queue->next_job >= queue->num_jobs)
+		{
+			// Either something is composite already or there is no work left
+			pthread_mutex_unlock(&queue->lock);
+			break;
+		}
+		job = &queue->jobs[queue->next_job];
+		queue->next_job += 1;
+		pthread_mutex_unlock(&queue->lock);
+		
+		if((ret = mbedtls_mpi_is_prime_ext(job->X, job->rounds, mbedtls_ctr_drbg_random, worker->ctr_drbg)) != 0)
+		{
+			pthread_mutex_lock(&queue->lock);
+			if(queue->failed == 0)
+			{
+				queue->failed = ret;
+			}
+			pthread_mutex_unlock(&queue->lock);
+		}
+	}
+	
+	return NULL;
+}
+
+/* Returns 0 if both P and Q pass the requested number of Miller-Rabin rounds */
+static int dhm_check_primality(const mbedtls_mpi* P, const mbedtls_mpi* Q, int rounds, int threads,
+								mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	int ret = 0;
+	int chunk, remaining;
+	int started = 0;
+	dhm_check_queue queue;
+	dhm_check_worker* workers;
+	const mbedtls_mpi* X[2] = { P, Q };
+	
+	chunk = (rounds + threads - 1) / threads;
+	
+	queue.jobs = (dhm_check_job*)malloc(sizeof(dhm_check_job) * 2 * threads);
+	queue.num_jobs = 0;
+	queue.next_job = 0;
+	queue.failed = 0;
+	for(int x = 0; x < 2; x++)
+	{
+		for(remaining = rounds; remaining > 0; remaining -= chunk)
+		{
+			queue.jobs[queue.num_jobs].X = X[x];
+			queue.jobs[queue.num_jobs].rounds = (remaining < chunk ? remaining : chunk);
+			queue.num_jobs += 1;
+		}
+	}
+	pthread_mutex_init(&queue.lock, NULL);
+	
+	workers = (dhm_check_worker*)malloc(sizeof(dhm_check_worker) * threads);
+	for(int i = 0; i < threads; i++)
+	{
+		workers[i].queue = &queue;
+		workers[i].ctr_drbg = &ctr_drbgs[i];
+	}
+	
+	if(threads == 1)
+	{
+		dhm_check_mr_worker(&workers[0]);
+	}
+	else
+	{
+		for(started = 0; started < threads; started++)
+		{
+			if(pthread_create(&workers[started].thread, NULL, dhm_check_mr_worker, &workers[started]) != 0)
+			{
+				break;
+			}
+		}
+		if(started == 0)
+		{
+			// Could not start any threads, do the work ourselves
+			dhm_check_mr_worker(&workers[0]);
+		}
+		for(int i = 0; i < started; i++)
+		{
+			pthread_join(workers[i].thread, NULL);
+		}
+	}
+	
+	ret = queue.failed;
+	
+	pthread_mutex_destroy(&queue.lock);
+	free(workers);
+	free(queue.jobs);
+	
+	return ret;
+}
+
+#define dhm_check_printf(verbose,priority,format,args...) \
+	if(verbose) { mbedtlsclu_prio_printf(priority, format, ## args) }
+
+int dhm_check_params(mbedtls_dhm_context* dhm, int rounds, int threads, mbedtls_ctr_drbg_context* ctr_drbgs,
+						int verbose, const char** reason)
+{
+	int ret = 0;
+	int n;
+	mbedtls_mpi Q, Pm1, T;
+	
+	mbedtls_mpi_init(&Q); mbedtls_mpi_init(&Pm1); mbedtls_mpi_init(&T);
+	
+	dhm_check_printf(verbose,MBEDTLSCLU_INFO,"  . Checking DHM modulus P size...");
+	n = mbedtls_mpi_bitlen(&dhm->P);
+	if (n < 512 || n > 10000) {
+		dhm_check_printf(verbose,MBEDTLSCLU_ERR," failed\n  ! Invalid DHM modulus size\n\n");
+		*reason = "invalid modulus size";
+		ret = -1;
+		goto exit;
+	}
+	
+	dhm_check_printf(verbose,MBEDTLSCLU_INFO," ok\n  . Checking DHM modulus P is odd...");
+	n = mbedtls_mpi_get_bit(&dhm->P, 0);
+	if(n != 1)
+	{
+		dhm_check_printf(verbose,MBEDTLSCLU_ERR," failed\n  ! mbedtls_mpi_get_bit returned %d\n\n", n);
+		*reason = "P is even";
+		ret = -1;
+		goto exit;
+	}
+	
+	if ((ret = mbedtls_mpi_sub_int(&Pm1, &dhm->P, 1)) != 0 ||
+		(ret = mbedtls_mpi_copy(&Q, &Pm1)) != 0 ||
+		(ret = mbedtls_mpi_shift_r(&Q, 1)) != 0) {
+		*reason = "internal error";
+		goto exit;
+	}
+	
+	dhm_check_printf(verbose,MBEDTLSCLU_INFO," ok\n  . Checking DHM generator 1 < G < P-1...");
+	if (mbedtls_mpi_cmp_int(&dhm->G, 1) <= 0 || mbedtls_mpi_cmp_mpi(&dhm->G, &Pm1) >= 0) {
+		dhm_check_printf(verbose,MBEDTLSCLU_ERR," failed\n  ! Generator out of range\n\n");
+		*reason = "generator out of range";
+		ret = -1;
+		goto exit;
+	}
+	
+	/*
+	 * For a safe prime P = 2Q + 1 every G in [2, P-2] has order Q or 2Q, so G^Q mod P
+	 * must be 1 (G generates the prime order subgroup) or P-1 (G generates the full group).
+	 * Anything else proves P is not a safe prime, and costs a single exponentiation to find out.
+	 */
+	dhm_check_printf(verbose,MBEDTLSCLU_INFO," ok\n  . Checking DHM generator G subgroup (G^Q mod P)...");
+	if ((ret = mbedtls_mpi_exp_mod(&T, &dhm->G, &Q, &dhm->P, NULL)) != 0) {
+		dhm_check_printf(verbose,MBEDTLSCLU_ERR," failed\n  ! mbedtls_mpi_exp_mod returned %d\n\n", ret);
+		*reason = "internal error";
+		goto exit;
+	}
+	if (mbedtls_mpi_cmp_int(&T, 1) == 0) {
+		dhm_check_printf(verbose,MBEDTLSCLU_INFO," ok (generates subgroup of order Q)");
+	}
+	else if (mbedtls_mpi_cmp_mpi(&T, &Pm1) == 0) {
+		dhm_check_printf(verbose,MBEDTLSCLU_INFO," ok (generates full group of order 2Q)");
+	}
+	else {
+		dhm_check_printf(verbose,MBEDTLSCLU_ERR," failed\n  ! G^Q mod P is neither 1 nor P-1\n\n");
+		*reason = "P is not a safe prime";
+		ret = -1;
+		goto exit;
+	}
+	
+	dhm_check_printf(verbose,MBEDTLSCLU_INFO,"\n  . Checking P and Q = (P-1)/2 are prime (%d rounds, %d thread%s)...",
+					rounds, threads, (threads == 1 ? "" : "s"));
+	fflush(stdout);
+	if ((ret = dhm_check_primality(&dhm->P, &Q, rounds, threads, ctr_drbgs)) != 0) {
+		dhm_check_printf(verbose,MBEDTLSCLU_ERR," failed\n  ! mbedtls_mpi_is_prime_ext returned %d\n\n", ret);
+		*reason = "P or Q is not prime";
+		goto exit;
+	}
+	dhm_check_printf(verbose,MBEDTLSCLU_INFO," ok\n");
+	
+	*reason = NULL;
+	
+exit:
+	mbedtls_mpi_free(&Q); mbedtls_mpi_free(&Pm1); mbedtls_mpi_free(&T);
+	
+	return ret;
+}
+
+/*
+ * Batch mode: every regular file in a directory is checked by a pool of workers,
+ * one file per worker at a time. Results are collected and reported in name order.
+ * A worker keeps its DRBG for every file it takes, so over a large directory the
+ * workers reseed concurrently. They must be seeded with mbedtlsclu_seed_ctr_drbgs,
+ * which routes those reseeds through the locked mbedtlsclu_entropy_func
+ */
+typedef struct dhm_batch_entry {
+	char* path;
+	int ret;
+	const char* reason;
+} dhm_batch_entry;
+
+typedef struct dhm_batch_queue {
+	pthread_mutex_t lock;
+	dhm_batch_entry* entries;
+	int num_entries;
+	int next_entry;
+	int rounds;
+} dhm_batch_queue;
+
+typedef struct dhm_batch_worker {
+	dhm_batch_queue* queue;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+	pthread_t thread;
+} dhm_batch_worker;
+
+static void* dhm_check_batch_worker(void* arg)
+{
+	dhm_batch_worker* worker = (dhm_batch_worker*)arg;
+	dhm_batch_queue* queue = worker->queue;
+	dhm_batch_entry* entry;
+	mbedtls_dhm_context dhm;
+	
+	while(1)
+	{
+		pthread_mutex_lock(&queue->lock);
+		if(queue->next_entry >= queue->num_entries)
+		{
+			pthread_mutex_unlock(&queue->lock);
+			break;
+		}
+		entry = &queue->entries[queue->next_entry];
+		queue->next_entry += 1;
+		pthread_mutex_unlock(&queue->lock);
+		
+		mbedtls_dhm_init(&dhm);
+		if((entry->ret = mbedtls_dhm_parse_dhmfile(&dhm, entry->path)) != 0)
+		{
+			entry->reason = "could not parse file";
+		}
+		else
+		{
+			entry->ret = dhm_check_params(&dhm, queue->rounds, 1, worker->ctr_drbg, 0, &entry->reason);
+		}
+		mbedtls_dhm_free(&dhm);
+	}
+	
+	return NULL;
+}
+
+static int dhm_batch_entry_cmp(const void* a, const void* b)
+{
+	return strcmp(((const dhm_batch_entry*)a)->path, ((const dhm_batch_entry*)b)->path);
+}
+
+/* Returns the number of files which failed the check, or -1 if the directory could not be read */
+static int dhm_check_dir(const char* indir, int rounds, int threads, mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	int failed = 0;
+	int started = 0;
+	int capacity = 16;
+	DIR* dir;
+	struct dirent* de;
+	struct stat st;
+	char* path;
+	dhm_batch_queue queue;
+	dhm_batch_worker* workers;
+	
+	if((dir = opendir(indir)) == NULL)
+	{
+		return -1;
+	}
+	
+	queue.entries = (dhm_batch_entry*)malloc(sizeof(dhm_batch_entry) * capacity);
+	queue.num_entries = 0;
+	queue.next_entry = 0;
+	queue.rounds = rounds;
+	while((de = readdir(dir)) != NULL)
+	{
+		if(de->d_name[0] == '.')
+		{
+			continue;
+		}
+		path = dynamic_strcat(3, indir, "/", de->d_name);
+		if(stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		{
+			free(path);
+			continue;
+		}
+		if(queue.num_entries == capacity)
+		{
+			capacity *= 2;
+			queue.entries = (dhm_batch_entry*)realloc(queue.entries, sizeof(dhm_batch_entry) * capacity);
+		}
+		queue.entries[queue.num_entries].path = path;
+		queue.entries[queue.num_entries].ret = 0;
+		queue.entries[queue.num_entries].reason = NULL;
+		queue.num_entries += 1;
+	}
+	closedir(dir);
+	
+	qsort(queue.entries, queue.num_entries, sizeof(dhm_batch_entry), dhm_batch_entry_cmp);
+	
+	if(threads > queue.num_entries)
+	{
+		threads = (queue.num_entries > 0 ? queue.num_entries : 1);
+	}
+	pthread_mutex_init(&queue.lock, NULL);
+	workers = (dhm_batch_worker*)malloc(sizeof(dhm_batch_worker) * threads);
+	for(int i = 0; i < threads; i++)
+	{
+		workers[i].queue = &queue;
+		workers[i].ctr_drbg = &ctr_drbgs[i];
+	}
+	
+	for(started = 0; threads > 1 && started < threads; started++)
+	{
+		if(pthread_create(&workers[started].thread, NULL, dhm_check_batch_worker, &workers[started]) != 0)
+		{
+			break;
+		}
+	}
+	if(started == 0)
+	{
+		dhm_check_batch_worker(&workers[0]);
+	}
+	for(int i = 0; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+	
+	for(int i = 0; i < queue.num_entries; i++)
+	{
+		if(queue.entries[i].ret == 0)
+		{
+			mbedtls_printf("%s: DH parameters appear to be OK\n", queue.entries[i].path);
+		}
+		else
+		{
+			mbedtls_printf("%s: DH parameters not OK (%s)\n", queue.entries[i].path, queue.entries[i].reason);
+			failed += 1;
+		}
+		free(queue.entries[i].path);
+	}
+	mbedtls_printf("%d of %d parameter files OK\n", queue.num_entries - failed, queue.num_entries);
+	
+	pthread_mutex_destroy(&queue.lock);
+	free(workers);
+	free(queue.entries);
+	
+	return failed;
+}
+
 int dhparam_main(int argc, char** argv, int argi)
 {
 	int ret = 1;
     int exit_code = MBEDTLS_EXIT_FAILURE;
 	mbedtls_mpi G, P, Q;
     mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtlsclu_entropy_source entropy_source;
+    mbedtlsclu_seed_file seed_file;
     const char* pers = "dhparam";
     FILE* fout;
     int nbits = DFL_BITS;
@@ -278,11 +668,23 @@ int dhparam_main(int argc, char** argv, int argi)
 	int noout = 0;
 	int text = 0;
 	char* infile = NULL;
+	char* indir = NULL;
 	int check = 0;
+	int check_rounds = DFL_CHECK_ROUNDS;
+	int threads = 0;
+	mbedtls_ctr_drbg_context* thread_ctr_drbgs = NULL;
+	int resumed = 0;
+	int progress = 0;
+	int timeout = 0;
+	char* checkpoint_file = NULL;
+	int use_dev_random = 0;
+	genprime_job job;
 	
+	genprime_init(&job, GENPRIME_TYPE_SAFE);
 	mbedtls_mpi_init(&G); mbedtls_mpi_init(&P); mbedtls_mpi_init(&Q);
-    mbedtls_ctr_drbg_init(&ctr_drbg);
     mbedtls_entropy_init(&entropy);
+    mbedtlsclu_entropy_source_init(&entropy_source);
+    mbedtlsclu_seed_file_init(&seed_file);
 	
 	if(argc < 3)
 	{
@@ -354,6 +756,76 @@ usage:
 		{
 			check = 1;
 		}
+		else if(strcmp(p,"-checkrounds") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of rounds. Advance i
+			i += 1;
+			check_rounds = atoi(argv[i]);
+			if(check_rounds < 1)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-indir") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the directory. Advance i
+			i += 1;
+			indir = strdup(argv[i]);
+			check = 1;
+		}
+		else if(strcmp(p,"-progress") == 0)
+		{
+			progress = 1;
+		}
+		else if(strcmp(p,"-timeout") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of seconds. Advance i
+			i += 1;
+			timeout = atoi(argv[i]);
+			if(timeout < 1)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-checkpoint") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the filepath. Advance i
+			i += 1;
+			checkpoint_file = strdup(argv[i]);
+		}
+#if defined(MBEDTLS_FS_IO)
+		else if(strcmp(p,"-usedevrandom") == 0)
+		{
+			use_dev_random = 1;
+		}
+		else if(strcmp(p,"-randompool") == 0)
+		{
+			use_dev_random = 1;
+			entropy_source.random_pool = 1;
+		}
+#endif /* MBEDTLS_FS_IO */
+		else if(strcmp(p,"-rand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.path = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-writerand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.write_path = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-threads") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of threads. Advance i
+			i += 1;
+			threads = atoi(argv[i]);
+			if(threads < 1 || threads > MAX_THREADS)
+			{
+				goto usage;
+			}
+		}
 		else if(i == argc - 1)
 		{
 			// last arg should be bits (optional) if it has not already been handled
@@ -365,7 +837,7 @@ usage:
 		}
 	}
 	
-	if((outfile == NULL && !noout && !check) || (check && infile == NULL))
+	if((outfile == NULL && !noout && !check) || (check && infile == NULL && indir == NULL))
 	{
 		goto usage;
 	}
@@ -380,6 +852,8 @@ usage:
 		gstr = strdup(GENERATOR);
 	}
 	
+	threads = mbedtlsclu_worker_threads(threads, mbedtlsclu_cpu_count());
+	
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"out: %s\n", outfile);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"outform: %s\n", (output_format == OUTPUT_FORMAT_PEM ? "PEM" : "DER"));
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"noout: %d\n", noout);
@@ -387,65 +861,85 @@ usage:
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"bits: %d\n", nbits);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"generator: %s\n", gstr);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"infile: %s\n", infile);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"indir: %s\n", indir);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"check: %d\n", check);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"checkrounds: %d\n", check_rounds);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"threads: %d\n", threads);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"progress: %d\n", progress);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"timeout: %d\n", timeout);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"checkpoint: %s\n", checkpoint_file);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"usedevrandom: %d\n", use_dev_random);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"randompool: %d\n", entropy_source.random_pool);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"rand: %s\n", seed_file.path);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"writerand: %s\n", seed_file.write_path);
+	
+	if(use_dev_random)
+	{
+		if((ret = mbedtlsclu_entropy_add_source(&entropy, &entropy_source)) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtlsclu_entropy_add_source returned -0x%04x\n", (unsigned int) -ret);
+			goto exit;
+		}
+	}
+	if((ret = mbedtlsclu_seed_file_load(&seed_file, &entropy)) != 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtlsclu_seed_file_load returned -0x%04x\n", (unsigned int) -ret);
+		goto exit;
+	}
 	
 	if(check)
 	{
 		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"Checking DH Params...\n");
 		mbedtls_dhm_context dhm;
+		const char* reason = NULL;
 		mbedtls_dhm_init(&dhm);
 		
-		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"\n  . Seeding the random number generator...");
-		if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
-										 (const unsigned char *) pers,
-										 strlen(pers))) != 0) {
-			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_ctr_drbg_seed returned %d\n", ret);
-			goto exit;
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"\n  . Seeding the random number generators...");
+		thread_ctr_drbgs = (mbedtls_ctr_drbg_context*)malloc(sizeof(mbedtls_ctr_drbg_context) * threads);
+		for(int t = 0; t < threads; t++)
+		{
+			mbedtls_ctr_drbg_init(&thread_ctr_drbgs[t]);
 		}
-		
-		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Parsing DHM File...");
-		if ((ret = mbedtls_dhm_parse_dhmfile(&dhm, infile)) != 0) {
-			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_dhm_parse_dhmfile %d\n", ret);
-			mbedtls_printf("DH parameters not OK\n");
+		if ((ret = mbedtlsclu_seed_ctr_drbgs(thread_ctr_drbgs, threads, &entropy, pers)) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_ctr_drbg_seed returned %d\n", ret);
 			goto exit;
 		}
-		
-		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Checking DHM modulus P size...");
-		int n = mbedtls_mpi_bitlen(&dhm.P);
-		if (n < 512 || n > 10000) {
-			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! Invalid DHM modulus size\n\n");
-			mbedtls_printf("DH parameters not OK\n");
-			goto exit;
+		if ((ret = mbedtlsclu_seed_file_update(&seed_file, &thread_ctr_drbgs[0])) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"\n  ! Could not write seed file, mbedtlsclu_seed_file_update returned %d\n", ret);
 		}
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
 		
-		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Checking P is (probably) prime...");
-		n = mbedtls_mpi_get_bit(&dhm.P, 0);
-		if(n != 1)
+		if(indir != NULL)
 		{
-			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_mpi_get_bit returned %d\n\n", n);
-			mbedtls_printf("DH parameters not OK\n");
-			goto exit;
-		}
-		
-		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Checking DHM generator G is suitable...");
-		// Must be > 1
-		if ((ret = mbedtls_mpi_cmp_int(&dhm.G, 1)) <= 0) {
-			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_mpi_cmp_int returned %d\n\n", ret);
-			mbedtls_printf("DH parameters not OK\n");
-			goto exit;
+			if((ret = dhm_check_dir(indir, check_rounds, threads, thread_ctr_drbgs)) != 0)
+			{
+				if(ret < 0)
+				{
+					mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  ! Could not read directory %s\n", indir);
+				}
+				goto exit;
+			}
 		}
-		
-		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Checking DHM modulus P > generator G...");
-		if ((ret = mbedtls_mpi_cmp_mpi(&dhm.P, &dhm.G)) <= 0) {
-			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_mpi_cmp_mpi returned %d\n\n", ret);
-			mbedtls_printf("DH parameters not OK\n");
-			goto exit;
+		else
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Parsing DHM File...");
+			if ((ret = mbedtls_dhm_parse_dhmfile(&dhm, infile)) != 0) {
+				mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_dhm_parse_dhmfile %d\n", ret);
+				mbedtls_printf("DH parameters not OK\n");
+				goto exit;
+			}
+			mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+			
+			if ((ret = dhm_check_params(&dhm, check_rounds, threads, thread_ctr_drbgs, 1, &reason)) != 0) {
+				mbedtls_dhm_free(&dhm);
+				mbedtls_printf("DH parameters not OK (%s)\n", reason);
+				goto exit;
+			}
+			
+			mbedtls_dhm_free(&dhm);
+			
+			mbedtls_printf("DH parameters appear to be OK\n");
 		}
-		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
-		
-		mbedtls_dhm_free(&dhm);
-		
-		mbedtls_printf("DH parameters appear to be OK\n");
 	}
 	else
 	{
@@ -456,42 +950,53 @@ usage:
 		}
 		
 		mbedtls_printf("Generating DH parameters, %d bit long safe prime\n", nbits);
-		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"\n  . Seeding the random number generator...");
-		if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
-										 (const unsigned char *) pers,
-										 strlen(pers))) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"\n  . Seeding the random number generators...");
+		thread_ctr_drbgs = (mbedtls_ctr_drbg_context*)malloc(sizeof(mbedtls_ctr_drbg_context) * threads);
+		for(int t = 0; t < threads; t++)
+		{
+			mbedtls_ctr_drbg_init(&thread_ctr_drbgs[t]);
+		}
+		if ((ret = mbedtlsclu_seed_ctr_drbgs(thread_ctr_drbgs, threads, &entropy, pers)) != 0) {
 			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_ctr_drbg_seed returned %d\n", ret);
 			goto exit;
 		}
+		if ((ret = mbedtlsclu_seed_file_update(&seed_file, &thread_ctr_drbgs[0])) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"\n  ! Could not write seed file, mbedtlsclu_seed_file_update returned %d\n", ret);
+		}
 		
-		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Generating the modulus, please wait...");
-		fflush(stdout);
-
-		//Generate the prime number. This can take a long time...
-		if ((ret = mbedtls_mpi_gen_prime(&P, nbits, 1,
-										 mbedtls_ctr_drbg_random, &ctr_drbg)) != 0) {
-			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_mpi_gen_prime returned %d\n\n", ret);
+		job.progress = progress;
+		job.timeout = timeout;
+		job.checkpoint_file = checkpoint_file;
+		if ((ret = genprime_add_search(&job, nbits)) < 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! DH parameters must be %d to %d bits\n\n", GENPRIME_MIN_BITS, MBEDTLS_MPI_MAX_BITS);
 			goto exit;
 		}
-
-		// Verify it is actually prime
-		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Verifying that Q = (P-1)/2 is prime...");
-		fflush(stdout);
-
-		if ((ret = mbedtls_mpi_sub_int(&Q, &P, 1)) != 0) {
-			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_mpi_sub_int returned %d\n\n", ret);
+		if ((ret = genprime_load_checkpoint(&job, &resumed)) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! genprime_load_checkpoint returned -0x%04x\n\n", (unsigned int) -ret);
 			goto exit;
 		}
-
-		if ((ret = mbedtls_mpi_div_int(&Q, NULL, &Q, 2)) != 0) {
-			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_mpi_div_int returned %d\n\n", ret);
-			goto exit;
+		if (resumed) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Resuming from checkpoint %s", checkpoint_file);
 		}
+		
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Generating the modulus, please wait...");
+		fflush(stdout);
 
-		if ((ret = mbedtls_mpi_is_prime_ext(&Q, 50, mbedtls_ctr_drbg_random, &ctr_drbg)) != 0) {
-			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_mpi_is_prime returned %d\n\n", ret);
+		/*
+		 * Generate the safe prime. This can take a long time...
+		 * Both P and Q = (P-1)/2 are verified with Miller-Rabin as part of the search
+		 */
+		if ((ret = genprime_run(&job, threads, thread_ctr_drbgs)) != 0 ||
+			(ret = genprime_result(&job, 0, &P)) != 0) {
+			if (ret == GENPRIME_ERR_TIMEOUT) {
+				genprime_report_timeout(&job);
+			}
+			else {
+				mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! genprime_run returned -0x%04x\n\n", (unsigned int) -ret);
+			}
 			goto exit;
 		}
+		genprime_done(&job);
 
 		if(!noout)
 		{
@@ -538,9 +1043,21 @@ usage:
     exit_code = MBEDTLS_EXIT_SUCCESS;
 
 exit:
+	genprime_free(&job);
 	mbedtls_mpi_free(&G); mbedtls_mpi_free(&P); mbedtls_mpi_free(&Q);
-    mbedtls_ctr_drbg_free(&ctr_drbg);
+	if(thread_ctr_drbgs != NULL)
+	{
+		mbedtlsclu_seed_file_finish(&seed_file, &thread_ctr_drbgs[0]);
+		for(int t = 0; t < threads; t++)
+		{
+			mbedtls_ctr_drbg_free(&thread_ctr_drbgs[t]);
+		}
+		free(thread_ctr_drbgs);
+	}
     mbedtls_entropy_free(&entropy);
+    mbedtlsclu_entropy_report(&entropy_source);
+    mbedtlsclu_entropy_source_free(&entropy_source);
+    mbedtlsclu_seed_file_free(&seed_file);
 	
 	return exit_code;
 }
@@ -17,6 +17,7 @@
  */
 
 #include "mbedtlsclu_common.h"
+#include "genprime.h"
 
 #include "mbedtls/asn1write.h"
 #include "mbedtls/base64.h"
@@ -24,6 +25,9 @@
 #include "mbedtls/pem.h"
 
 #include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 int dhparam_main(int argc, char** argv, int argi);
 
@@ -33,3 +37,5 @@ int mbedtls_pem_write_buffer(const char *header, const char *footer,
                              unsigned char *buf, size_t buf_len, size_t *olen);
 int mbedtls_dhm_params_write_pem(mbedtls_mpi* G, mbedtls_mpi* P, unsigned char* buf, size_t size);
 int write_dhm_params(mbedtls_mpi* G, mbedtls_mpi* P, int textout, int output_format, const char* output_file);
+int dhm_check_params(mbedtls_dhm_context* dhm, int rounds, int threads, mbedtls_ctr_drbg_context* ctr_drbgs,
+						int verbose, const char** reason);
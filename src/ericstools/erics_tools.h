@@ -43,11 +43,14 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <errno.h>
 
 #include <regex.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <time.h>
 
 #ifndef stricmp
@@ -67,16 +70,55 @@ typedef struct long_tree_map_node
 	struct long_tree_map_node* right;
 } long_map_node;
 
+/* nodes are handed out from blocks owned by the map, rather than malloc'd one at a time */
+typedef struct long_map_node_block_struct
+{
+	struct long_map_node_block_struct* next;
+	unsigned long num_nodes;
+	unsigned long num_used;
+} long_map_node_block;
+
 typedef struct 
 {
 	long_map_node* root;
 	unsigned long num_elements;
 
+	long_map_node_block* blocks;	/* newest first, only freed with the map */
+	long_map_node* free_nodes;	/* removed nodes waiting for reuse, chained through right */
 }long_map;
 
+/*
+ * an AVL tree of n nodes is at most 1.44*log2(n+2) deep, so this covers any
+ * tree that fits in memory, with room for the two extra entries a removal adds
+ */
+#define LONG_MAP_MAX_DEPTH	128
+
+/* ordered walk over a key range, holding the path from the root so it never allocates */
 typedef struct
 {
-	long_map lm;
+	long_map_node* path[LONG_MAP_MAX_DEPTH];
+	int depth;			/* 0 once the walk has left the range */
+	unsigned long lower_bound;
+	unsigned long upper_bound;
+} long_map_cursor;
+
+/*
+ * string_map is an open addressing hash table with robin hood probing.
+ * slots sit in one array and keep the full hash, so a miss rarely has to
+ * look at a key. probe is the distance from the home slot plus one, 0 when empty
+ */
+typedef struct
+{
+	unsigned long hash;
+	unsigned long probe;
+	char* key;
+	void* value;
+} string_map_slot;
+
+typedef struct
+{
+	string_map_slot* slots;
+	unsigned long num_slots;
 	unsigned char store_keys;
 	unsigned long num_elements;
 
@@ -86,6 +128,7 @@ typedef struct
 
 /* long map functions */
 extern long_map* initialize_long_map(void);
+extern long_map* build_long_map_from_sorted(unsigned long* keys, void** values, unsigned long num_keys); /* O(n) if keys ascend strictly, falls back to inserting them otherwise */
 extern void* get_long_map_element(long_map* map, unsigned long key);
 void* get_smallest_long_map_element(long_map* map, unsigned long* smallest_key);
 void* get_largest_long_map_element(long_map* map, unsigned long* largest_key);
@@ -98,8 +141,21 @@ extern void** get_sorted_long_map_values(long_map* map, unsigned long* num_value
 extern void** destroy_long_map(long_map* map, int destruction_type, unsigned long* num_destroyed);
 extern void apply_to_every_long_map_value(long_map* map, void (*apply_func)(unsigned long key, void* value));
 
+/*
+ * cursor over the keys in [lower_bound, upper_bound], O(log n) to seek and O(1) amortised per step.
+ * seek lands on the smallest key in range, each function returns the value and sets *key, or
+ * returns NULL once the range is used up. setting or removing elements invalidates the cursor
+ */
+extern void* seek_long_map_cursor(long_map_cursor* cursor, long_map* map, unsigned long lower_bound, unsigned long upper_bound, unsigned long* key);
+extern void* next_long_map_cursor(long_map_cursor* cursor, unsigned long* key);
+extern void* prev_long_map_cursor(long_map_cursor* cursor, unsigned long* key);
+
 
-/* string map functions */
+/*
+ * string map functions
+ * with store_keys the keys are compared on lookup, without it two keys with
+ * the same hash are the same element. keys and values come back in no particular order
+ */
 extern string_map* initialize_string_map(unsigned char store_keys);
 extern void* get_string_map_element(string_map* map, const char* key);
 extern void* set_string_map_element(string_map* map, const char* key, void* value);
@@ -190,17 +246,36 @@ extern void  push_list_node(list*l, list_node* new_node);		/* O(1) */
 
 /* priority_queue structs / prototypes */
 
+/*
+ * array backed d-ary heap, ordered by priority and then by push order so
+ * nodes with equal priority come out first in, first out.  The sort keys
+ * are copied into the heap entries so sifting never has to touch the
+ * nodes themselves.  ids maps each id to its node, and heap_index tracks
+ * where that node currently sits
+ */
+#define PRIORITY_QUEUE_ARITY 4
+
 typedef struct priority_queue_node_struct
 {
 	unsigned long priority;
 	char* id;
 	void* value;
+	unsigned long heap_index;
 } priority_queue_node;
 
+typedef struct priority_queue_entry_struct
+{
+	unsigned long priority;
+	unsigned long sequence;
+	priority_queue_node* node;
+} priority_queue_entry;
+
 
 typedef struct priority_queue_struct
 {
-	long_map* priorities;
+	priority_queue_entry* heap;
+	unsigned long heap_size;
+	unsigned long next_sequence;
 	string_map* ids;
 	priority_queue_node* first;
 	long length;
@@ -232,6 +307,46 @@ typedef struct
 	int terminator;
 } dyn_read_t;
 
+/* a piece of a larger buffer, only NUL terminated if asked for */
+typedef struct
+{
+	const char* str;
+	size_t len;
+} str_view_t;
+
+typedef struct
+{
+	char* pos;
+	char* end;
+	unsigned char is_separator[256];	/* membership table, one lookup per byte whatever the number of separators */
+	int single_separator;			/* -1, or the only separator, which memchr can find */
+	int flags;
+	int done;
+} str_iter_t;
+
+/* reads a stream a block at a time, handing out one line at a time from a buffer it reuses */
+typedef struct
+{
+	int fd;
+	char* buf;
+	size_t buf_size;
+	size_t pos;
+	size_t end;
+	int eof;
+	int error;			/* errno of the read that failed, 0 if none has */
+	char* line;
+	size_t line_size;
+	unsigned char is_terminator[256];
+	int single_terminator;
+} buffered_reader;
+
+/* the terminator dynamic_read and buffered_read return when the read failed rather than ended */
+#define DYN_READ_ERROR		(EOF - 1)
+
+#define STR_ITER_TRIM		1	/* drop flanking whitespace from each piece */
+#define STR_ITER_TERMINATE	2	/* NUL terminate each piece in place, needs a writable buffer with a spare byte at len */
+#define STR_ITER_KEEP_EMPTY	4	/* yield the empty pieces between adjacent separators rather than skipping them */
+
 /* non-dynamic functions */
 extern char* replace_prefix(char* original, char* old_prefix, char* new_prefix);
 extern char* trim_flanking_whitespace(char* str);
@@ -249,10 +364,27 @@ extern char* join_strs(char* separator, char** parts, int max_parts, int free_pa
 extern char* dynamic_replace(char* template_str, char* old_str, char* new_str);
 int convert_to_regex(char* str, regex_t* p);
 
+/*
+ * non-allocating iteration over the lines or fields of a buffer, e.g. from load_file
+ * without STR_ITER_TERMINATE the buffer is never written, so it may be read only
+ */
+extern void initialize_str_iter(str_iter_t* iter, char* buf, size_t len, const char* separators, int num_separators, int flags);
+extern int next_str_piece(str_iter_t* iter, str_view_t* piece); /* returns 0 once the buffer is used up */
+
 
 /* functions to dynamically read files */
 extern dyn_read_t dynamic_read(FILE* open_file, char* terminators, int num_terminators, unsigned long* read_length);
 extern int dyn_read_line(FILE* open_file, char** dest, unsigned long* read_len);
+
+/*
+ * the fd is read with read(2) as data arrives, so pipes and stdin stream line by line
+ * buffered_read returns the terminator that ended the line, EOF or DYN_READ_ERROR, like
+ * dynamic_read, but the line is the reader's and is only good until the next call.
+ * after DYN_READ_ERROR reader->error holds the errno and later calls return EOF
+ */
+extern void initialize_buffered_reader(buffered_reader* reader, int fd, const char* terminators, int num_terminators, size_t block_size);
+extern int buffered_read(buffered_reader* reader, char** line, unsigned long* read_len);
+extern void free_buffered_reader(buffered_reader* reader); /* does not close the fd */
 extern unsigned char* read_entire_file(FILE* in, unsigned long read_block_size, unsigned long* read_length);
 
 /* run a command and get (dynamically allocated) output lines */
@@ -303,7 +435,15 @@ returns:
  */
 extern int path_exists(const char* path);
 
-extern char** get_file_lines(char* file_path, unsigned long* lines_read);
+extern char** get_file_lines(char* file_path, unsigned long* lines_read); /* NULL if the file can't be opened or read */
+
+/*
+ * load a whole file into one NUL terminated buffer (which must be freed)
+ * regular files are sized with fstat and read in one go, pipes and devices
+ * grow the buffer geometrically. if st is not NULL it is filled with the
+ * fstat of the file actually read. returns NULL if the file can't be read
+ */
+extern unsigned char* load_file(const char* file_path, struct stat* st, unsigned long* length);
 
 
 #endif /* ERICS_TOOLS_H */
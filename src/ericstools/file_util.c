@@ -169,26 +169,70 @@ void rm_r(const char* path)
 char** get_file_lines(char* file_path, unsigned long* lines_read)
 {
 	char** result = NULL;
-	int path_type = path_exists(file_path);
+	unsigned long file_length;
+	unsigned char* file_data = load_file(file_path, NULL, &file_length);
 	*lines_read = 0;
-	if(path_type != PATH_DOES_NOT_EXIST && path_type != PATH_IS_DIRECTORY) /* exists and is not directory */
+	if(file_data != NULL)
 	{
-		FILE* read_file = fopen(file_path, "r");
-		unsigned char* file_data = NULL;
-		if(read_file != NULL)
+		char line_seps[] = {'\r', '\n'};
+		result = split_on_separators((char*)file_data, line_seps , 2, -1, 0, lines_read);
+		free(file_data);
+	}
+	return result;
+}
+
+unsigned char* load_file(const char* file_path, struct stat* st, unsigned long* length)
+{
+	struct stat local_st;
+	unsigned char* data;
+	unsigned long size;
+	unsigned long bytes_read = 0;
+	ssize_t n;
+	int fd;
+
+	*length = 0;
+	st = st == NULL ? &local_st : st;
+	fd = open(file_path, O_RDONLY);
+	if(fd < 0)
+	{
+		return NULL;
+	}
+	if(fstat(fd, st) != 0 || S_ISDIR(st->st_mode))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	/*
+	 * a regular file should arrive in a single read, the spare byte lets us see
+	 * EOF without growing. anything else starts at 4k and doubles
+	 */
+	size = S_ISREG(st->st_mode) ? (unsigned long)st->st_size + 1 : 4096;
+	data = (unsigned char*)malloc(size + 1);
+	while((n = read(fd, data + bytes_read, size - bytes_read)) != 0)
+	{
+		if(n < 0)
 		{
-			unsigned long file_length;
-			file_data =  read_entire_file(read_file, 1024, &file_length);
-			fclose(read_file);
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			free(data);
+			close(fd);
+			return NULL;
 		}
-		if(file_data != NULL)
+		bytes_read = bytes_read + n;
+		if(bytes_read == size)
 		{
-			char line_seps[] = {'\r', '\n'};
-			result = split_on_separators((char*)file_data, line_seps , 2, -1, 0, lines_read);
-			free(file_data);
+			size = size * 2;
+			data = (unsigned char*)realloc(data, size + 1);
 		}
 	}
-	return result;
+	close(fd);
+
+	data[bytes_read] = '\0';
+	*length = bytes_read;
+	return data;
 }
 
 
@@ -38,17 +38,21 @@
 #define malloc safe_malloc
 #define strdup safe_strdup
 
-typedef struct id_map_node_struct
-{
-	list* id_list;
-	list_node* id_node;
-} id_map_node;
+#define PRIORITY_QUEUE_INITIAL_SIZE 16
+
+static int priority_entry_before(priority_queue_entry* a, priority_queue_entry* b);
+static void place_priority_entry(priority_queue* pq, priority_queue_entry* entry, unsigned long heap_index);
+static void sift_priority_node_up(priority_queue* pq, unsigned long heap_index);
+static void sift_priority_node_down(priority_queue* pq, unsigned long heap_index);
+static priority_queue_node* remove_priority_queue_node_at(priority_queue* pq, unsigned long heap_index);
 
 
 priority_queue* initialize_priority_queue(void)
 {
 	priority_queue* pq = (priority_queue*)malloc(sizeof(priority_queue));
-	pq->priorities = initialize_long_map();
+	pq->heap = NULL;
+	pq->heap_size = 0;
+	pq->next_sequence = 0;
 	pq->ids = initialize_string_map(0);
 	pq->first = NULL;
 	pq->length = 0;
@@ -62,6 +66,7 @@ priority_queue_node* create_priority_node(unsigned long priority, char* id, void
 	pn->priority = priority;
 	pn->id = strdup(id);
 	pn->value = value;
+	pn->heap_index = 0;
 	return pn;
 }
 void* free_priority_queue_node(priority_queue_node* pn)
@@ -125,6 +130,7 @@ void* peek_priority_queue(priority_queue* pq, unsigned long* priority, char** id
 }
 
 
+/* node stays in the queue, so only its value is returned */
 void* get_priority_queue_element_with_id(priority_queue* pq, char* id, long* priority)
 {
 	void* return_value = NULL;
@@ -132,7 +138,7 @@ void* get_priority_queue_element_with_id(priority_queue* pq, char* id, long* pri
 	if(pn != NULL)
 	{
 		*priority = pn->priority;
-		return_value = free_priority_queue_node(pn);
+		return_value = pn->value;
 	}
 	else
 	{
@@ -162,42 +168,27 @@ void push_priority_queue_node(priority_queue* pq, priority_queue_node* pn)
 {
 	if(pq != NULL && pn != NULL)
 	{
-		/* assume that most of the time we won't have collisions */
-		list_node* lpn = create_list_node(pn);
-		list* new_list = initialize_list();
-		list* old_list;
-		id_map_node* idn;
-
-		push_list_node(new_list, lpn);
-		old_list = (list*)set_long_map_element(pq->priorities, pn->priority, new_list);
-		if(old_list != NULL)
-		{
-			push_list_node(old_list, lpn);
-			set_long_map_element(pq->priorities, pn->priority, old_list);
-			free(new_list);
-			new_list = old_list;
-		}
-
-		/* update first */
-		if(pq->first == NULL)
+		priority_queue_entry entry;
+		if((unsigned long)pq->length == pq->heap_size)
 		{
-			pq->first = pn;
+			pq->heap_size = pq->heap_size == 0 ? PRIORITY_QUEUE_INITIAL_SIZE : pq->heap_size*2;
+			pq->heap = (priority_queue_entry*)realloc(pq->heap, pq->heap_size*sizeof(priority_queue_entry));
 		}
-		else if(pn->priority < pq->first->priority)
-		{
-			pq->first = pn;
-		}
-	
-
-
-
-		/* save id */
-		idn = (id_map_node*)malloc(sizeof(id_map_node));
-		idn->id_list = new_list;
-		idn->id_node = lpn;
-		set_string_map_element(pq->ids, pn->id, idn);
-
-		pq->length = pq->length + 1;;
+		entry.priority = pn->priority;
+		entry.sequence = pq->next_sequence;
+		entry.node = pn;
+		pq->next_sequence = pq->next_sequence + 1;
+
+		/*
+		 * if id is already queued the newer node takes over the id,
+		 * the older one is left in the queue until it is shifted
+		 */
+		set_string_map_element(pq->ids, pn->id, pn);
+
+		place_priority_entry(pq, &entry, (unsigned long)pq->length);
+		pq->length = pq->length + 1;
+		sift_priority_node_up(pq, pn->heap_index);
+		pq->first = pq->heap[0].node;
 	}
 }
 
@@ -206,40 +197,15 @@ priority_queue_node* shift_priority_queue_node(priority_queue* pq)
 	priority_queue_node* return_node  = NULL;
 	if(pq != NULL)
 	{
-		if(pq->first != NULL)
+		if(pq->length > 0)
 		{
-			list* next_list = (list*)remove_long_map_element(pq->priorities, pq->first->priority);
-			list* next_first_list = NULL;
-			list_node* smallest_list_node = shift_list_node(next_list);
-			id_map_node* idn;
-
-			if(next_list->length == 0)
+			priority_queue_node* id_node;
+			return_node = remove_priority_queue_node_at(pq, 0);
+			id_node = (priority_queue_node*)remove_string_map_element(pq->ids, return_node->id);
+			if(id_node != return_node && id_node != NULL)
 			{
-				unsigned long tmp;
-				destroy_list(next_list, DESTROY_MODE_IGNORE_VALUES, &tmp);
-				next_first_list = (list*)get_smallest_long_map_element(pq->priorities, &tmp);
+				set_string_map_element(pq->ids, id_node->id, id_node);
 			}
-			else
-			{
-				set_long_map_element(pq->priorities, pq->first->priority, next_list);
-				next_first_list = next_list;
-			}
-			return_node = free_list_node(smallest_list_node);
-			idn = (id_map_node*)remove_string_map_element(pq->ids, return_node->id);
-			free(idn);
-		
-			if(next_first_list != NULL)
-			{
-				list_node* next_first_node = shift_list_node(next_first_list);
-				pq->first = (priority_queue_node*)next_first_node->value;
-				unshift_list_node(next_first_list, next_first_node);
-			}
-			else
-			{
-				pq->first = NULL;
-			}
-
-			pq->length = pq->length -1;
 		}
 	}
 		
@@ -252,11 +218,7 @@ priority_queue_node* get_priority_queue_node_with_id(priority_queue* pq, char* i
 	priority_queue_node* return_node = NULL;
 	if(pq != NULL && id != NULL)
 	{
-		id_map_node* idn = (id_map_node*)get_string_map_element(pq->ids, id);
-		if(idn != NULL)
-		{
-			return_node = (priority_queue_node*)idn->id_node->value;
-		}
+		return_node = (priority_queue_node*)get_string_map_element(pq->ids, id);
 	}
 	return return_node;
 }
@@ -267,51 +229,39 @@ priority_queue_node* remove_priority_queue_node_with_id(priority_queue* pq, char
 	priority_queue_node* return_node = NULL;
 	if(pq != NULL && id != NULL)
 	{
-		id_map_node* idn = (id_map_node*)remove_string_map_element(pq->ids, id);
-		if(idn != NULL)
+		priority_queue_node* pn = (priority_queue_node*)remove_string_map_element(pq->ids, id);
+		if(pn != NULL)
 		{
-			/* remove relevant node from list */
-			remove_internal_list_node(idn->id_list, idn->id_node);
-			return_node = free_list_node(idn->id_node);
-
-			/* if list is empty remove it from priority map */
-			if(idn->id_list->length == 0)
-			{
-				unsigned long tmp;
-				remove_long_map_element(pq->priorities, return_node->priority);
-				destroy_list(idn->id_list, DESTROY_MODE_IGNORE_VALUES, &tmp);
-			}
-			free(idn);
-
-			/* if we're removing first node, reset it */
-			if(return_node == pq->first)
-			{
-				unsigned long tmp;
-				list* next_first_list = (list*)get_smallest_long_map_element(pq->priorities, &tmp);
-				if(next_first_list != NULL)
-				{
-					list_node* next_first_node = shift_list_node(next_first_list);
-					pq->first = (priority_queue_node*)next_first_node->value;
-					unshift_list_node(next_first_list, next_first_node);
-				}
-				else
-				{
-					pq->first = NULL;
-				}
-			}
-			pq->length = pq->length -1;
+			return_node = remove_priority_queue_node_at(pq, pn->heap_index);
 		}
 	}
 	return return_node;
 }
 
+/*
+ * re-prioritized node moves behind any others of the same priority,
+ * just as if it had been removed and pushed again
+ */
 void set_priority_for_id_in_priority_queue(priority_queue* pq, char* id, unsigned long priority)
 {
 	if(pq != NULL && id != NULL)
 	{
-		priority_queue_node* id_pq_node = remove_priority_queue_node_with_id(pq, id);
-		id_pq_node->priority = priority;
-		push_priority_queue_node(pq, id_pq_node);
+		priority_queue_node* pn = (priority_queue_node*)get_string_map_element(pq->ids, id);
+		if(pn != NULL)
+		{
+			unsigned long heap_index = pn->heap_index;
+			pn->priority = priority;
+			pq->heap[heap_index].priority = priority;
+			pq->heap[heap_index].sequence = pq->next_sequence;
+			pq->next_sequence = pq->next_sequence + 1;
+
+			sift_priority_node_up(pq, heap_index);
+			if(pn->heap_index == heap_index)
+			{
+				sift_priority_node_down(pq, heap_index);
+			}
+			pq->first = pq->heap[0].node;
+		}
 	}
 }
 
@@ -350,11 +300,91 @@ void** destroy_priority_queue(priority_queue* pq, int destroy_mode, unsigned lon
 			values[*num_elements_destroyed] = NULL;
 		}
 
-		destroy_long_map(pq->priorities, DESTROY_MODE_FREE_VALUES, &tmp);
-		destroy_string_map(pq->ids, DESTROY_MODE_FREE_VALUES, &tmp);
+		destroy_string_map(pq->ids, DESTROY_MODE_IGNORE_VALUES, &tmp);
+		free(pq->heap);
 		free(pq);
 	}
 	return values;
 }
 
 
+static int priority_entry_before(priority_queue_entry* a, priority_queue_entry* b)
+{
+	return a->priority < b->priority || (a->priority == b->priority && a->sequence < b->sequence);
+}
+
+static void place_priority_entry(priority_queue* pq, priority_queue_entry* entry, unsigned long heap_index)
+{
+	pq->heap[heap_index] = *entry;
+	entry->node->heap_index = heap_index;
+}
+
+static void sift_priority_node_up(priority_queue* pq, unsigned long heap_index)
+{
+	priority_queue_entry entry = pq->heap[heap_index];
+	while(heap_index > 0)
+	{
+		unsigned long parent_index = (heap_index - 1) / PRIORITY_QUEUE_ARITY;
+		if(!priority_entry_before(&entry, pq->heap + parent_index))
+		{
+			break;
+		}
+		place_priority_entry(pq, pq->heap + parent_index, heap_index);
+		heap_index = parent_index;
+	}
+	place_priority_entry(pq, &entry, heap_index);
+}
+
+static void sift_priority_node_down(priority_queue* pq, unsigned long heap_index)
+{
+	unsigned long length = (unsigned long)pq->length;
+	priority_queue_entry entry = pq->heap[heap_index];
+	while(1)
+	{
+		unsigned long first_child = heap_index*PRIORITY_QUEUE_ARITY + 1;
+		unsigned long last_child = first_child + PRIORITY_QUEUE_ARITY;
+		unsigned long child_index;
+		unsigned long best_index;
+		if(first_child >= length)
+		{
+			break;
+		}
+		last_child = last_child > length ? length : last_child;
+		best_index = first_child;
+		for(child_index = first_child + 1; child_index < last_child; child_index++)
+		{
+			if(priority_entry_before(pq->heap + child_index, pq->heap + best_index))
+			{
+				best_index = child_index;
+			}
+		}
+		if(!priority_entry_before(pq->heap + best_index, &entry))
+		{
+			break;
+		}
+		place_priority_entry(pq, pq->heap + best_index, heap_index);
+		heap_index = best_index;
+	}
+	place_priority_entry(pq, &entry, heap_index);
+}
+
+/* fills the hole with the last entry and sifts it whichever way it needs to go */
+static priority_queue_node* remove_priority_queue_node_at(priority_queue* pq, unsigned long heap_index)
+{
+	priority_queue_node* return_node = pq->heap[heap_index].node;
+	unsigned long last_index = (unsigned long)pq->length - 1;
+
+	pq->length = pq->length - 1;
+	if(heap_index != last_index)
+	{
+		priority_queue_node* moved = pq->heap[last_index].node;
+		place_priority_entry(pq, pq->heap + last_index, heap_index);
+		sift_priority_node_up(pq, heap_index);
+		if(moved->heap_index == heap_index)
+		{
+			sift_priority_node_down(pq, heap_index);
+		}
+	}
+	pq->first = pq->length > 0 ? pq->heap[0].node : NULL;
+	return return_node;
+}
@@ -250,108 +250,38 @@ char** split_on_separators(char* line, char* separators, int num_separators, int
 	*num_pieces = 0;
 	if(line != NULL)
 	{
-		int split_index;
-		int non_separator_found;
-		char* dup_line;
-		char* start;
+		/* no counting pass, the array grows as pieces turn up unless max_pieces bounds it */
+		unsigned long split_size = max_pieces < 0 ? 8 : max_pieces;
+		unsigned long split_index = 0;
+		str_iter_t iter;
+		str_view_t piece;
 
-		if(max_pieces < 0)
-		{
-			/* count number of separator characters in line -- this count + 1 is an upperbound on number of pieces */
-			int separator_count = 0;
-			int line_index;
-			for(line_index = 0; line[line_index] != '\0'; line_index++)
-			{
-				int sep_index;
-				int found = 0;
-				for(sep_index =0; found == 0 && sep_index < num_separators; sep_index++)
-				{
-					found = separators[sep_index] == line[line_index] ? 1 : 0;
-				}
-				separator_count = separator_count+ found;
-			}
-			max_pieces = separator_count + 1;
-		}
-		split = (char**)malloc((1+max_pieces)*sizeof(char*));
-		split_index = 0;
+		split = (char**)malloc((1+split_size)*sizeof(char*));
 		split[split_index] = NULL;
 
-
-		dup_line = strdup(line);
-		start = dup_line;
-		non_separator_found = 0;
-		while(non_separator_found == 0)
+		initialize_str_iter(&iter, line, strlen(line), separators, num_separators, 0);
+		while((max_pieces < 0 || split_index < (unsigned long)max_pieces) && next_str_piece(&iter, &piece))
 		{
-			int matches = 0;
-			int sep_index;
-			for(sep_index =0; sep_index < num_separators; sep_index++)
+			char* next_piece = NULL;
+			if(split_index == split_size)
 			{
-				matches = matches == 1 || separators[sep_index] == start[0] ? 1 : 0;
-			}
-			non_separator_found = matches==0 || start[0] == '\0' ? 1 : 0;
-			if(non_separator_found == 0)
-			{
-				start++;
-			}
-		}
-
-		while(start[0] != '\0' && split_index < max_pieces)
-		{
-			/* find first separator index */
-			int first_separator_index = 0;
-			int separator_found = 0;
-			while(	separator_found == 0 )
-			{
-				int sep_index;
-				for(sep_index =0; separator_found == 0 && sep_index < num_separators; sep_index++)
-				{
-					separator_found = separators[sep_index] == start[first_separator_index] || start[first_separator_index] == '\0' ? 1 : 0;
-				}
-				if(separator_found == 0)
-				{
-					first_separator_index++;
-				}
+				split_size = split_size * 2;
+				split = (char**)realloc(split, (1+split_size)*sizeof(char*));
 			}
-			
-			/* copy next piece to split array */
-			if(first_separator_index > 0)
+			if(split_index + 1 < (unsigned long)max_pieces || max_pieces < 0 || include_remainder_at_max <= 0)
 			{
-				char* next_piece = NULL;
-				if(split_index +1 < max_pieces || include_remainder_at_max <= 0)
-				{
-					next_piece = (char*)malloc((first_separator_index+1)*sizeof(char));
-					memcpy(next_piece, start, first_separator_index);
-					next_piece[first_separator_index] = '\0';
-				}
-				else
-				{
-					next_piece = strdup(start);
-				}
-				split[split_index] = next_piece;
-				split[split_index+1] = NULL;
-				split_index++;
+				next_piece = (char*)malloc((piece.len+1)*sizeof(char));
+				memcpy(next_piece, piece.str, piece.len);
+				next_piece[piece.len] = '\0';
 			}
-
-
-			/* find next non-separator index, indicating start of next piece */
-			start = start+ first_separator_index;
-			non_separator_found = 0;
-			while(non_separator_found == 0)
+			else
 			{
-				int matches = 0;
-				int sep_index;
-				for(sep_index =0; sep_index < num_separators; sep_index++)
-				{
-					matches = matches == 1 || separators[sep_index] == start[0] ? 1 : 0;
-				}
-				non_separator_found = matches==0 || start[0] == '\0' ? 1 : 0;
-				if(non_separator_found == 0)
-				{
-					start++;
-				}
+				next_piece = strdup(piece.str);
 			}
+			split[split_index] = next_piece;
+			split[split_index+1] = NULL;
+			split_index++;
 		}
-		free(dup_line);
 		*num_pieces = split_index;
 	}
 	else
@@ -362,6 +292,95 @@ char** split_on_separators(char* line, char* separators, int num_separators, int
 	return split;
 }
 
+static int is_flanking_whitespace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' ? 1 : 0;
+}
+
+void initialize_str_iter(str_iter_t* iter, char* buf, size_t len, const char* separators, int num_separators, int flags)
+{
+	int sep_index;
+	iter->pos = buf;
+	iter->end = buf + len;
+	memset(iter->is_separator, 0, sizeof(iter->is_separator));
+	for(sep_index = 0; sep_index < num_separators; sep_index++)
+	{
+		iter->is_separator[(unsigned char)separators[sep_index]] = 1;
+	}
+	iter->single_separator = num_separators == 1 ? (unsigned char)separators[0] : -1;
+	iter->flags = flags;
+	iter->done = 0;
+}
+
+int next_str_piece(str_iter_t* iter, str_view_t* piece)
+{
+	char* start;
+	char* stop;
+
+	if(iter->done)
+	{
+		return 0;
+	}
+	if((iter->flags & STR_ITER_KEEP_EMPTY) == 0)
+	{
+		while(iter->pos < iter->end && iter->is_separator[(unsigned char)*iter->pos])
+		{
+			iter->pos++;
+		}
+		if(iter->pos == iter->end)
+		{
+			iter->done = 1;
+			return 0;
+		}
+	}
+
+	start = iter->pos;
+	if(iter->single_separator >= 0)
+	{
+		/* libc's memchr already scans a word or vector at a time */
+		stop = (char*)memchr(start, iter->single_separator, iter->end - start);
+		stop = stop == NULL ? iter->end : stop;
+	}
+	else
+	{
+		for(stop = start; stop < iter->end && !iter->is_separator[(unsigned char)*stop]; stop++){}
+	}
+
+	/*
+	 * step over the separator now, so terminating this piece (or a field
+	 * inside it) can't hide where the next one starts
+	 */
+	if(stop < iter->end)
+	{
+		iter->pos = stop + 1;
+	}
+	else
+	{
+		iter->pos = stop;
+		iter->done = 1;
+	}
+
+	if(iter->flags & STR_ITER_TRIM)
+	{
+		while(start < stop && is_flanking_whitespace(*start))
+		{
+			start++;
+		}
+		while(stop > start && is_flanking_whitespace(stop[-1]))
+		{
+			stop--;
+		}
+	}
+	if(iter->flags & STR_ITER_TERMINATE)
+	{
+		*stop = '\0';
+	}
+
+	piece->str = start;
+	piece->len = stop - start;
+	return 1;
+}
+
 char* join_strs(char* separator, char** parts, int max_parts, int free_parts, int free_parts_array)
 {
 	char* joined = NULL;
@@ -542,51 +561,52 @@ int convert_to_regex(char* str, regex_t* p)
 /* note: str element in return value is dynamically allocated, need to free */
 dyn_read_t dynamic_read(FILE* open_file, char* terminators, int num_terminators, unsigned long* read_length)
 {
-	fpos_t start_pos;
+	/*
+	 * one pass through stdio's own buffer, with no seeking back to copy the line,
+	 * so this works on pipes too
+	 */
 	unsigned long size_to_read = 0;
-	int terminator_found = 0;
-	int terminator;
-	char* str;
+	unsigned long str_size = 64;
+	int terminator = EOF;
+	char* str = (char*)malloc((str_size+1)*sizeof(char));
+	int nextch;
 	dyn_read_t ret_value;
 
-	fgetpos(open_file, &start_pos);
-	
-	while(terminator_found == 0)
+	flockfile(open_file);
+	while((nextch = getc_unlocked(open_file)) != EOF || ferror_unlocked(open_file))
 	{
-		int nextch = fgetc(open_file);
-		int terminator_index = 0;
-		for(terminator_index = 0; terminator_index < num_terminators && terminator_found == 0; terminator_index++)
+		if(nextch == EOF)
 		{
-			terminator_found = nextch == terminators[terminator_index] ? 1 : 0;
-			terminator = nextch;
+			/* a signal is no reason to give up on the line, anything else is an error, not the end */
+			if(errno == EINTR)
+			{
+				clearerr_unlocked(open_file);
+				continue;
+			}
+			terminator = DYN_READ_ERROR;
+			break;
 		}
-		terminator_found = nextch == EOF ? 1 : terminator_found;
-		terminator = nextch == EOF ? EOF : nextch;
-		if(terminator_found == 0)
+		if(memchr(terminators, nextch, num_terminators) != NULL)
 		{
-			size_to_read++;
+			terminator = nextch;
+			break;
 		}
-	}
-
-	str = (char*)malloc((size_to_read+1)*sizeof(char));
-	if(size_to_read > 0)
-	{
-		int i;
-		fsetpos(open_file, &start_pos);
-		for(i=0; i<size_to_read; i++)
+		if(size_to_read == str_size)
 		{
-			str[i] = (char)fgetc(open_file);
+			str_size = str_size * 2;
+			str = (char*)realloc(str, (str_size+1)*sizeof(char));
 		}
-		fgetc(open_file); /* read the terminator */
+		str[size_to_read] = (char)nextch;
+		size_to_read++;
 	}
+	funlockfile(open_file);
+
 	str[size_to_read] = '\0';
 	*read_length = size_to_read;
 	
-	
 	ret_value.str = str;
 	ret_value.terminator = terminator;
 
-
 	return ret_value;
 }
 
@@ -599,37 +619,121 @@ int dyn_read_line(FILE* open_file, char** dest, unsigned long* read_len)
 	return read.terminator;
 }
 
+void initialize_buffered_reader(buffered_reader* reader, int fd, const char* terminators, int num_terminators, size_t block_size)
+{
+	int term_index;
+	reader->fd = fd;
+	reader->buf_size = block_size > 0 ? block_size : 65536;
+	reader->buf = (char*)malloc(reader->buf_size);
+	reader->pos = 0;
+	reader->end = 0;
+	reader->eof = 0;
+	reader->error = 0;
+	reader->line_size = 128;
+	reader->line = (char*)malloc(reader->line_size+1);
+	memset(reader->is_terminator, 0, sizeof(reader->is_terminator));
+	for(term_index = 0; term_index < num_terminators; term_index++)
+	{
+		reader->is_terminator[(unsigned char)terminators[term_index]] = 1;
+	}
+	reader->single_terminator = num_terminators == 1 ? (unsigned char)terminators[0] : -1;
+}
 
-unsigned char* read_entire_file(FILE* in, unsigned long read_block_size, unsigned long *length)
+int buffered_read(buffered_reader* reader, char** line, unsigned long* read_len)
 {
-	int max_read_size = read_block_size;
-	unsigned char* read_string = (unsigned char*)malloc(max_read_size+1);
-	unsigned long bytes_read = 0;
-	int end_found = 0;
-	while(end_found == 0)
+	size_t line_len = 0;
+	int terminator = EOF;
+
+	while(terminator == EOF)
 	{
-		int nextch = '?';
-		while(nextch != EOF && bytes_read < max_read_size)
+		char* start;
+		char* stop;
+		char* end;
+
+		if(reader->pos == reader->end)
 		{
-			nextch = fgetc(in);
-			if(nextch != EOF)
+			ssize_t n = 0;
+			if(reader->eof == 0)
 			{
-				read_string[bytes_read] = (unsigned char)nextch;
-				bytes_read++;
+				while((n = read(reader->fd, reader->buf, reader->buf_size)) < 0 && errno == EINTR){}
 			}
+			if(n < 0)
+			{
+				reader->error = errno;
+				terminator = DYN_READ_ERROR;
+			}
+			if(n <= 0)
+			{
+				reader->eof = 1;
+				break;
+			}
+			reader->pos = 0;
+			reader->end = n;
+		}
+
+		start = reader->buf + reader->pos;
+		end = reader->buf + reader->end;
+		if(reader->single_terminator >= 0)
+		{
+			stop = (char*)memchr(start, reader->single_terminator, end - start);
+			stop = stop == NULL ? end : stop;
+		}
+		else
+		{
+			for(stop = start; stop < end && !reader->is_terminator[(unsigned char)*stop]; stop++){}
+		}
+
+		if(line_len + (stop - start) > reader->line_size)
+		{
+			while(line_len + (stop - start) > reader->line_size)
+			{
+				reader->line_size = reader->line_size * 2;
+			}
+			reader->line = (char*)realloc(reader->line, reader->line_size+1);
 		}
-		read_string[bytes_read] = '\0';
-		end_found = (nextch == EOF) ? 1 : 0;
-		if(end_found == 0)
+		memcpy(reader->line + line_len, start, stop - start);
+		line_len = line_len + (stop - start);
+		reader->pos = stop - reader->buf;
+
+		if(stop < end)
+		{
+			terminator = (unsigned char)*stop;
+			reader->pos++;
+		}
+	}
+
+	reader->line[line_len] = '\0';
+	*line = reader->line;
+	*read_len = line_len;
+	return terminator;
+}
+
+void free_buffered_reader(buffered_reader* reader)
+{
+	free(reader->buf);
+	free(reader->line);
+	reader->buf = NULL;
+	reader->line = NULL;
+}
+
+
+unsigned char* read_entire_file(FILE* in, unsigned long read_block_size, unsigned long *length)
+{
+	/* read_block_size is only the first guess, the buffer doubles from there */
+	unsigned long max_read_size = read_block_size > 0 ? read_block_size : 1024;
+	unsigned char* read_string = (unsigned char*)malloc(max_read_size+1);
+	unsigned long bytes_read = 0;
+	size_t n;
+	while((n = fread(read_string + bytes_read, 1, max_read_size - bytes_read, in)) > 0)
+	{
+		bytes_read = bytes_read + n;
+		if(bytes_read == max_read_size)
 		{
-			unsigned char *new_str;
-			max_read_size = max_read_size + read_block_size;
-		       	new_str = (unsigned char*)malloc(max_read_size+1);
-			memcpy(new_str, read_string, bytes_read);
-			free(read_string);
-			read_string = new_str;
+			max_read_size = max_read_size * 2;
+			read_string = (unsigned char*)realloc(read_string, max_read_size+1);
 		}
 	}
+	read_string[bytes_read] = '\0';
 	*length = bytes_read;
 	return read_string;
 }
@@ -1,4 +1,8 @@
 #include "erics_tools.h"
+#include <time.h>
+
+double now_seconds(void);
+long check_priority_queue(priority_queue* pq, unsigned long num_ids, unsigned long* priorities, unsigned char* queued);
 
 int main(void)
 {
@@ -86,6 +90,157 @@ int main(void)
 		free(id);
 	}
 	destroy_priority_queue(pq, DESTROY_MODE_FREE_VALUES, &dl);
-	
+
+
+	printf("-------randomized queue test-------------\n");
+	{
+		unsigned long num_ids = 500;
+		unsigned long* priorities = (unsigned long*)malloc(num_ids*sizeof(unsigned long));
+		unsigned char* queued = (unsigned char*)malloc(num_ids);
+		unsigned long op;
+		long mismatches = 0;
+		char id_buf[32];
+
+		srand(1);
+		memset(queued, 0, num_ids);
+		pq = initialize_priority_queue();
+		for(op = 0; op < 200000; op++)
+		{
+			unsigned long index = (unsigned long)rand() % num_ids;
+			unsigned long new_priority = (unsigned long)rand() % 100;
+			sprintf(id_buf, "id_%lu", index);
+			switch(rand() % 4)
+			{
+				case 0:
+					if(!queued[index])
+					{
+						push_priority_queue(pq, new_priority, id_buf, NULL);
+						priorities[index] = new_priority;
+						queued[index] = 1;
+					}
+					break;
+				case 1:
+					if(queued[index])
+					{
+						set_priority_for_id_in_priority_queue(pq, id_buf, new_priority);
+						priorities[index] = new_priority;
+					}
+					break;
+				case 2:
+					if(queued[index])
+					{
+						long removed_priority;
+						remove_priority_queue_element_with_id(pq, id_buf, &removed_priority);
+						mismatches = mismatches + ((unsigned long)removed_priority == priorities[index] ? 0 : 1);
+						queued[index] = 0;
+					}
+					break;
+				default:
+					mismatches = mismatches + check_priority_queue(pq, num_ids, priorities, queued);
+			}
+		}
+		mismatches = mismatches + check_priority_queue(pq, num_ids, priorities, queued);
+		while(pq->length > 0)
+		{
+			mismatches = mismatches + check_priority_queue(pq, num_ids, priorities, queued);
+		}
+		destroy_priority_queue(pq, DESTROY_MODE_IGNORE_VALUES, &dl);
+		printf("200000 random push/set/remove/shift operations on %lu ids: %ld mismatches\n", num_ids, mismatches);
+		free(priorities);
+		free(queued);
+	}
+
+
+	printf("-------queue throughput test-------------\n");
+	{
+		unsigned long num_nodes = 1000000;
+		unsigned long num_updates = 1000000;
+		unsigned long index;
+		unsigned long last_priority = 0;
+		long out_of_order = 0;
+		char id_buf[32];
+		double start;
+
+		srand(2);
+		pq = initialize_priority_queue();
+		start = now_seconds();
+		for(index = 0; index < num_nodes; index++)
+		{
+			sprintf(id_buf, "%lu", index);
+			push_priority_queue(pq, (unsigned long)rand(), id_buf, NULL);
+		}
+		printf("pushed %lu random priorities in %.3fs\n", num_nodes, now_seconds() - start);
+
+		start = now_seconds();
+		for(index = 0; index < num_updates; index++)
+		{
+			/* deadlines get pushed out, like a renewal being rescheduled */
+			priority_queue_node* pn;
+			sprintf(id_buf, "%lu", (unsigned long)rand() % num_nodes);
+			pn = get_priority_queue_node_with_id(pq, id_buf);
+			set_priority_for_id_in_priority_queue(pq, id_buf, pn->priority + (unsigned long)rand() % 100000);
+		}
+		printf("rescheduled %lu random ids in %.3fs\n", num_updates, now_seconds() - start);
+
+		start = now_seconds();
+		while(pq->length > 0)
+		{
+			priority_queue_node* pn = shift_priority_queue_node(pq);
+			out_of_order = out_of_order + (pn->priority < last_priority ? 1 : 0);
+			last_priority = pn->priority;
+			free_priority_queue_node(pn);
+		}
+		printf("shifted %lu nodes in %.3fs, %ld out of order\n", num_nodes, now_seconds() - start, out_of_order);
+		destroy_priority_queue(pq, DESTROY_MODE_IGNORE_VALUES, &dl);
+	}
+
 	return 0;
 }
+
+/*
+ * shifts the first node and checks it against the smallest priority
+ * we expect to be queued, then checks that every id is still found
+ */
+long check_priority_queue(priority_queue* pq, unsigned long num_ids, unsigned long* priorities, unsigned char* queued)
+{
+	long mismatches = 0;
+	unsigned long index;
+	unsigned long smallest = 0;
+	unsigned long num_queued = 0;
+	char id_buf[32];
+	for(index = 0; index < num_ids; index++)
+	{
+		if(queued[index])
+		{
+			smallest = num_queued == 0 || priorities[index] < smallest ? priorities[index] : smallest;
+			num_queued++;
+		}
+	}
+	mismatches = mismatches + ((unsigned long)pq->length == num_queued ? 0 : 1);
+	if(num_queued > 0)
+	{
+		unsigned long priority;
+		char* id;
+		shift_priority_queue(pq, &priority, &id);
+		index = strtoul(id + 3, NULL, 10);
+		mismatches = mismatches + (priority == smallest && queued[index] && priorities[index] == priority ? 0 : 1);
+		queued[index] = 0;
+		free(id);
+	}
+	for(index = 0; index < num_ids; index++)
+	{
+		priority_queue_node* pn;
+		sprintf(id_buf, "id_%lu", index);
+		pn = get_priority_queue_node_with_id(pq, id_buf);
+		mismatches = mismatches + ((pn != NULL) == (queued[index] != 0) ? 0 : 1);
+		mismatches = mismatches + (pn == NULL || pn->priority == priorities[index] ? 0 : 1);
+	}
+	return mismatches;
+}
+
+double now_seconds(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
@@ -44,6 +44,10 @@
 void get_max_depth(long_map_node* n, unsigned long* max_depth, unsigned long current_depth);
 void get_min_depth(long_map_node* n, unsigned long* min_depth, unsigned long current_depth);
 void print_map(long_map_node* n, int depth);
+unsigned long get_max_probe(string_map* sm);
+long check_avl(long_map_node* n, unsigned long* bad_nodes);
+unsigned long sdbm_hash(const char* key);
+double now_seconds(void);
 
 int main (void)
 {
@@ -168,7 +172,177 @@ int main (void)
 	}
 
 
-	printf("LONG MAP TESTING COMPLETE.  TESTING STRING MAP (WITH KEY STORAGE) \n\n");
+	printf("LONG MAP TESTING COMPLETE.  TESTING SORTED BUILD OF LONG MAP\n\n");
+
+	{
+		unsigned long build_sizes[] = { 1, 2, 7, 1000, 1000000, 0 };
+		int b;
+		for(b = 0; build_sizes[b] != 0; b++)
+		{
+			unsigned long n = build_sizes[b];
+			unsigned long* keys = (unsigned long*)malloc(n*sizeof(unsigned long));
+			void** values = (void**)malloc(n*sizeof(void*));
+			unsigned long i;
+			unsigned long bad_nodes = 0;
+			unsigned long missing = 0;
+			unsigned long num_destroyed;
+			double start;
+			double build_time;
+			double insert_time;
+			for(i = 0; i < n; i++)
+			{
+				keys[i] = 3*i + 1; /* gaps, so misses can be looked up too */
+				values[i] = keys + i;
+			}
+
+			start = now_seconds();
+			long_map* built = build_long_map_from_sorted(keys, values, n);
+			build_time = now_seconds() - start;
+			long height = check_avl(built->root, &bad_nodes);
+			for(i = 0; i < n; i++)
+			{
+				missing += get_long_map_element(built, keys[i]) != keys + i;
+				missing += get_long_map_element(built, keys[i] + 1) != NULL;
+			}
+
+			/* the built tree has to keep working as an ordinary AVL tree, reusing removed nodes */
+			for(i = 0; i < n && i < 20000; i++)
+			{
+				unsigned long r = (unsigned long)(3*n*((double)rand()/(double)RAND_MAX));
+				if(rand() % 2)
+				{
+					set_long_map_element(built, r, keys);
+				}
+				else
+				{
+					remove_long_map_element(built, r);
+				}
+			}
+			check_avl(built->root, &bad_nodes);
+			destroy_long_map(built, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+
+			long_map* inserted = initialize_long_map();
+			start = now_seconds();
+			for(i = 0; i < n; i++)
+			{
+				set_long_map_element(inserted, keys[i], values[i]);
+			}
+			insert_time = now_seconds() - start;
+			destroy_long_map(inserted, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+
+			printf("%8ld keys: height %ld, %ld bad balances, %ld bad lookups, build %.2f ms vs sorted inserts %.2f ms\n",
+				n, height, bad_nodes, missing, build_time*1e3, insert_time*1e3);
+			if(bad_nodes > 0 || missing > 0)
+			{
+				printf("SORTED BUILD IS BAD !!!!\n");
+			}
+			free(keys);
+			free(values);
+		}
+
+		unsigned long unsorted_keys[] = { 5, 3, 9, 3 };
+		void* unsorted_values[] = { "5", "3", "9", "3 again" };
+		long_map* fallback = build_long_map_from_sorted(unsorted_keys, unsorted_values, 4);
+		printf("unsorted keys fall back to inserts: %ld elements, key 3 is \"%s\"\n\n", fallback->num_elements, (char*)get_long_map_element(fallback, 3));
+		unsigned long num_destroyed;
+		destroy_long_map(fallback, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+	}
+
+
+	printf("SORTED BUILD TESTING COMPLETE.  TESTING LONG MAP CURSOR\n\n");
+
+	/* every range walked forwards and backwards must match the same slice of get_sorted_long_map_keys */
+	{
+		long_map* cm = initialize_long_map();
+		unsigned long i;
+		unsigned long num_keys;
+		unsigned long mismatches = 0;
+		unsigned long num_destroyed;
+		int q;
+		for(i = 0; i < num_insertions; i++)
+		{
+			unsigned long r = (unsigned long)(max_insertion*((double)rand()/(double)RAND_MAX));
+			set_long_map_element(cm, r, cm);
+		}
+		unsigned long* sorted_keys = get_sorted_long_map_keys(cm, &num_keys);
+		for(q = 0; q < 2000; q++)
+		{
+			unsigned long lower = (unsigned long)((max_insertion+10)*((double)rand()/(double)RAND_MAX));
+			unsigned long upper = lower + (unsigned long)(500*((double)rand()/(double)RAND_MAX));
+			unsigned long first;
+			unsigned long last;
+			unsigned long key;
+			long_map_cursor cursor;
+			for(first = 0; first < num_keys && sorted_keys[first] < lower; first++){}
+			for(last = first; last < num_keys && sorted_keys[last] <= upper; last++){}
+
+			i = first;
+			void* v = seek_long_map_cursor(&cursor, cm, lower, upper, &key);
+			for(; v != NULL; v = next_long_map_cursor(&cursor, &key))
+			{
+				mismatches += (i >= last || sorted_keys[i] != key) ? 1 : 0;
+				i++;
+			}
+			mismatches += i != last ? 1 : 0;
+
+			/* walk back down from the top of the range */
+			if(last > first)
+			{
+				seek_long_map_cursor(&cursor, cm, sorted_keys[last-1], upper, &key);
+				cursor.lower_bound = lower;
+				i = last;
+				for(v = cm; v != NULL; v = prev_long_map_cursor(&cursor, &key))
+				{
+					i--;
+					mismatches += (i < first || sorted_keys[i] != key) ? 1 : 0;
+				}
+				mismatches += i != first ? 1 : 0;
+			}
+		}
+		printf("2000 random ranges over %ld keys, forwards and backwards: %ld mismatches\n", num_keys, mismatches);
+		if(mismatches > 0)
+		{
+			printf("CURSOR DISAGREES WITH SORTED KEYS !!!!\n");
+		}
+		free(sorted_keys);
+		destroy_long_map(cm, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+
+		/* a 100 key window out of a million, against copying out every key to find it */
+		unsigned long n = 1000000;
+		unsigned long* keys = (unsigned long*)malloc(n*sizeof(unsigned long));
+		void** values = (void**)malloc(n*sizeof(void*));
+		for(i = 0; i < n; i++)
+		{
+			keys[i] = i*10;
+			values[i] = keys + i;
+		}
+		long_map* big = build_long_map_from_sorted(keys, values, n);
+		unsigned long found = 0;
+		unsigned long key;
+		long_map_cursor cursor;
+		double start = now_seconds();
+		for(q = 0; q < 1000; q++)
+		{
+			unsigned long lower = (unsigned long)(q*9973UL % n)*10;
+			void* v;
+			for(v = seek_long_map_cursor(&cursor, big, lower, lower + 999, &key); v != NULL; v = next_long_map_cursor(&cursor, &key))
+			{
+				found++;
+			}
+		}
+		double cursor_time = (now_seconds() - start)/1000;
+		start = now_seconds();
+		unsigned long* all_keys = get_sorted_long_map_keys(big, &num_keys);
+		double copy_time = now_seconds() - start;
+		free(all_keys);
+		printf("100 key window of %ld: cursor %.2f us, get_sorted_long_map_keys %.2f ms (%ld found of 100000)\n\n", n, cursor_time*1e6, copy_time*1e3, found);
+		destroy_long_map(big, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+		free(keys);
+		free(values);
+	}
+
+
+	printf("CURSOR TESTING COMPLETE.  TESTING STRING MAP (WITH KEY STORAGE) \n\n");
 
 
 
@@ -199,18 +373,12 @@ int main (void)
 			free(new_str);
 		}
 
-		unsigned long right_depth = 0;
-		unsigned long left_depth = 0;
-		get_max_depth(sm->lm.root->left, &left_depth, 0);
-		get_max_depth(sm->lm.root->right, &right_depth, 0);
-		
-
 		unsigned long original_size = sm->num_elements;
 		printf("insertion complete\n");
-		printf("after insertion, tree size = %ld \n", original_size);
+		printf("after insertion, map size = %ld \n", original_size);
 		printf("(note this may be less than %ld because the same numbers can be selected for insertion more than once, replacing the original node)\n", num_insertions); 
 		printf("dupes = %ld\n", dupes);	
-		printf("depth of left branch = %ld, depth of right branch = %ld\n\n", left_depth, right_depth);
+		printf("slots = %ld, longest probe = %ld\n\n", sm->num_slots, get_max_probe(sm));
 
 
 		if(repeat+1 < num_repeats)
@@ -232,14 +400,9 @@ int main (void)
 				}
 				free(new_str);
 			}
-			right_depth = 0;
-			left_depth = 0;
-			get_max_depth(sm->lm.root->left, &left_depth, 0);
-			get_max_depth(sm->lm.root->right, &right_depth, 0);
-
 			printf("removal complete\n");
-			printf("after removal, tree size = %ld \n", sm->num_elements);
-			printf("depth of left branch = %ld, depth of right branch = %ld\n", left_depth, right_depth);
+			printf("after removal, map size = %ld \n", sm->num_elements);
+			printf("slots = %ld, longest probe = %ld\n", sm->num_slots, get_max_probe(sm));
 			if(original_size - found == sm->num_elements)
 			{
 				printf("size consistent with number of nodes successfully removed\n\n");
@@ -252,7 +415,7 @@ int main (void)
 			printf("removing remaining nodes in tree in random order\n");
 			unsigned long length = sm->num_elements;
 			char** keys = get_string_map_keys(sm, &length);
-			while(sm->lm.root != NULL && sm->num_elements > 0)
+			while(sm->num_elements > 0)
 			{
 				unsigned long r = (unsigned long)(length*((double)rand()/(double)RAND_MAX));
 				if( remove_string_map_element(sm, keys[r]) != NULL)
@@ -273,7 +436,7 @@ int main (void)
 			free(keys);
 
 			printf("done removing remaining nodes\n");
-			printf("tree size is now %ld, and root is %s\n\n", sm->num_elements, sm->lm.root == NULL ? "null" : "not null");
+			printf("map size is now %ld, longest probe is %ld\n\n", sm->num_elements, get_max_probe(sm));
 
 			printf("repeating insertion/deletion\n\n");
 		}
@@ -294,10 +457,168 @@ int main (void)
 	}
 
 
-	
+	printf("STRING MAP TESTING COMPLETE.  CHECKING STRING MAP AGAINST A PLAIN ARRAY\n\n");
+
+	/* every key "0".."max_insertion" has a known slot in present[], so any disagreement is a map bug */
+	{
+		char present[5001];
+		unsigned long mismatches = 0;
+		unsigned long op;
+		int store_keys;
+		for(store_keys = 0; store_keys < 2; store_keys++)
+		{
+			string_map* check = initialize_string_map((unsigned char)store_keys);
+			unsigned long expected = 0;
+			memset(present, 0, sizeof(present));
+			for(op = 0; op < 200000; op++)
+			{
+				unsigned long r = (unsigned long)(max_insertion*((double)rand()/(double)RAND_MAX));
+				char key[40];
+				void* old;
+				sprintf(key, "%ld", r);
+				switch(rand() % 3)
+				{
+					case 0:
+						old = set_string_map_element(check, key, present + r);
+						mismatches += (old != NULL) != present[r];
+						expected += present[r] ? 0 : 1;
+						present[r] = 1;
+						break;
+					case 1:
+						old = remove_string_map_element(check, key);
+						mismatches += (old != NULL) != present[r];
+						expected -= present[r] ? 1 : 0;
+						present[r] = 0;
+						break;
+					default:
+						old = get_string_map_element(check, key);
+						mismatches += present[r] ? old != present + r : old != NULL;
+				}
+				mismatches += check->num_elements != expected;
+			}
+			unsigned long num_destroyed;
+			destroy_string_map(check, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+			printf("store_keys=%d: 200000 random operations, %ld mismatches, %ld left at destruction (expected %ld)\n", store_keys, mismatches, num_destroyed, expected);
+		}
+		if(mismatches > 0)
+		{
+			printf("STRING MAP DISAGREES WITH THE ARRAY !!!!\n");
+		}
+		printf("\n");
+	}
+
+
+	printf("BENCHMARKING STRING MAP AGAINST A LONG MAP OF SDBM HASHES (THE OLD STRING MAP)\n\n");
+	{
+		unsigned long bench_sizes[] = { 1000, 100000, 1000000, 0 };
+		int s;
+		for(s = 0; bench_sizes[s] != 0; s++)
+		{
+			unsigned long n = bench_sizes[s];
+			char** keys = (char**)malloc(n*sizeof(char*));
+			unsigned long i;
+			unsigned long found = 0;
+			unsigned long num_destroyed;
+			double start;
+			double set_time[2];
+			double get_time[2];
+			for(i = 0; i < n; i++)
+			{
+				keys[i] = (char*)malloc(40);
+				sprintf(keys[i], "/CN=client%ld", i);
+			}
+
+			string_map* bench_sm = initialize_string_map(1);
+			start = now_seconds();
+			for(i = 0; i < n; i++)
+			{
+				set_string_map_element(bench_sm, keys[i], keys[i]);
+			}
+			set_time[0] = now_seconds() - start;
+			start = now_seconds();
+			for(i = 0; i < n; i++)
+			{
+				found += get_string_map_element(bench_sm, keys[(i*7919) % n]) != NULL;
+			}
+			get_time[0] = now_seconds() - start;
+			destroy_string_map(bench_sm, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+
+			long_map* bench_lm = initialize_long_map();
+			start = now_seconds();
+			for(i = 0; i < n; i++)
+			{
+				set_long_map_element(bench_lm, sdbm_hash(keys[i]), keys[i]);
+			}
+			set_time[1] = now_seconds() - start;
+			start = now_seconds();
+			for(i = 0; i < n; i++)
+			{
+				found += get_long_map_element(bench_lm, sdbm_hash(keys[(i*7919) % n])) != NULL;
+			}
+			get_time[1] = now_seconds() - start;
+			destroy_long_map(bench_lm, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+
+			printf("%8ld keys: string map set %7.1f ns get %7.1f ns, long map set %7.1f ns get %7.1f ns (%ld found of %ld)\n", n,
+				set_time[0]*1e9/n, get_time[0]*1e9/n, set_time[1]*1e9/n, get_time[1]*1e9/n, found, 2*n);
+
+			for(i = 0; i < n; i++)
+			{
+				free(keys[i]);
+			}
+			free(keys);
+		}
+	}
 	
 	return(0);
 }
+
+/* returns the height, counting nodes whose stored balance isn't right height - left height or is out of AVL range */
+long check_avl(long_map_node* n, unsigned long* bad_nodes)
+{
+	long left_height;
+	long right_height;
+	if(n == NULL)
+	{
+		return 0;
+	}
+	left_height = check_avl(n->left, bad_nodes);
+	right_height = check_avl(n->right, bad_nodes);
+	if(n->balance != right_height - left_height || n->balance < -1 || n->balance > 1)
+	{
+		*bad_nodes = *bad_nodes + 1;
+	}
+	return (left_height > right_height ? left_height : right_height) + 1;
+}
+
+unsigned long get_max_probe(string_map* sm)
+{
+	unsigned long max_probe = 0;
+	unsigned long slot_index;
+	for(slot_index = 0; slot_index < sm->num_slots; slot_index++)
+	{
+		max_probe = sm->slots[slot_index].probe > max_probe ? sm->slots[slot_index].probe : max_probe;
+	}
+	return max_probe;
+}
+
+/* same as the sdbm hash in tree_map.c, which the old string map keyed its tree by */
+unsigned long sdbm_hash(const char* key)
+{
+	unsigned long hashed_key = 0;
+	int index;
+	for(index = 0; key[index] != '\0'; index++)
+	{
+		hashed_key = (unsigned int)key[index] + (hashed_key << 6) + (hashed_key << 16) - hashed_key;
+	}
+	return hashed_key;
+}
+
+double now_seconds(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
 void get_max_depth(long_map_node* n, unsigned long* max_depth, unsigned long current_depth)
 {
 	if(n == NULL)
@@ -1,5 +1,116 @@
 #include "erics_tools.h"
 
+/*
+ * the obvious byte at a time split, to check split_on_separators and the iterator against.
+ * keep_empty returns the empty pieces between adjacent separators and at either end too
+ */
+static char** reference_split(const char* line, const char* separators, int max_pieces, int include_remainder_at_max, int keep_empty, unsigned long* num_pieces)
+{
+	size_t len = strlen(line);
+	char** pieces = (char**)malloc((len+2)*sizeof(char*));
+	size_t pos = 0;
+	*num_pieces = 0;
+	while(max_pieces < 0 || *num_pieces < (unsigned long)max_pieces)
+	{
+		size_t start;
+		if(!keep_empty)
+		{
+			while(pos < len && strchr(separators, line[pos]) != NULL)
+			{
+				pos++;
+			}
+			if(pos == len)
+			{
+				break;
+			}
+		}
+		start = pos;
+		while(pos < len && strchr(separators, line[pos]) == NULL)
+		{
+			pos++;
+		}
+		if(include_remainder_at_max > 0 && *num_pieces + 1 == (unsigned long)max_pieces)
+		{
+			pieces[*num_pieces] = strdup(line + start);
+		}
+		else
+		{
+			pieces[*num_pieces] = (char*)malloc(pos - start + 1);
+			memcpy(pieces[*num_pieces], line + start, pos - start);
+			pieces[*num_pieces][pos - start] = '\0';
+		}
+		(*num_pieces)++;
+		if(pos == len)
+		{
+			break;
+		}
+		pos++;
+	}
+	pieces[*num_pieces] = NULL;
+	return pieces;
+}
+
+/* random lines over a small alphabet, so runs of separators and separators at either end are common */
+static unsigned long random_split_mismatches(unsigned long num_lines)
+{
+	const char alphabet[] = "ab,;\t x";
+	unsigned long mismatches = 0;
+	unsigned long test;
+	srand(1);
+	for(test = 0; test < num_lines; test++)
+	{
+		char line[64];
+		char separators[4];
+		int line_len = rand() % (sizeof(line) - 1);
+		int num_separators = 1 + rand() % (sizeof(separators) - 1);
+		int max_pieces = (rand() % 4 == 0) ? 1 + rand() % 4 : -1;
+		int include_remainder_at_max = rand() % 2;
+		int i;
+		for(i = 0; i < line_len; i++)
+		{
+			line[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+		}
+		line[line_len] = '\0';
+		for(i = 0; i < num_separators; i++)
+		{
+			separators[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+		}
+		separators[num_separators] = '\0';
+
+		unsigned long expected_num;
+		unsigned long got_num;
+		char** expected = reference_split(line, separators, max_pieces, include_remainder_at_max, 0, &expected_num);
+		char** got = split_on_separators(line, separators, num_separators, max_pieces, include_remainder_at_max, &got_num);
+		int same = (expected_num == got_num);
+		for(i = 0; same && expected[i] != NULL; i++)
+		{
+			same = (got[i] != NULL && strcmp(expected[i], got[i]) == 0);
+		}
+		same = same && got[expected_num] == NULL;
+		free_null_terminated_string_array(expected);
+		free_null_terminated_string_array(got);
+
+		/* and with STR_ITER_KEEP_EMPTY the iterator hands back the empty pieces too */
+		str_iter_t iter;
+		str_view_t piece;
+		expected = reference_split(line, separators, -1, 0, 1, &expected_num);
+		initialize_str_iter(&iter, line, line_len, separators, num_separators, STR_ITER_KEEP_EMPTY);
+		for(got_num = 0; same && next_str_piece(&iter, &piece); got_num++)
+		{
+			same = (got_num < expected_num && piece.len == strlen(expected[got_num]) && memcmp(piece.str, expected[got_num], piece.len) == 0);
+		}
+		same = same && got_num == expected_num;
+		free_null_terminated_string_array(expected);
+
+		if(!same)
+		{
+			printf("split mismatch on \"%s\" with separators \"%s\", max %d, remainder %d\n", line, separators, max_pieces, include_remainder_at_max);
+			mismatches++;
+		}
+	}
+	return mismatches;
+}
+
 int main(void)
 {
 	FILE* f = fopen("tmp", "r");	
@@ -22,5 +133,116 @@ int main(void)
 	}
 	fclose(f);
 
+	/* load_file must hand back exactly what read_entire_file sees, for files and pipes */
+	f = fopen("tmp_load", "w");
+	unsigned long line;
+	for(line=0; line < 20000; line++)
+	{
+		fprintf(f, "line %lu\tsome padding to push past the first block\r\n", line);
+	}
+	fclose(f);
+
+	struct stat st;
+	unsigned long loaded_length;
+	unsigned char* loaded = load_file("tmp_load", &st, &loaded_length);
+	f = fopen("tmp_load", "r");
+	free(file_data);
+	file_data = (char*)read_entire_file(f, 100, &length);
+	fclose(f);
+	printf("load_file %lu bytes, read_entire_file %lu bytes, stat %lu bytes: %s\n", loaded_length, length, (unsigned long)st.st_size,
+		(loaded != NULL && loaded_length == length && length == (unsigned long)st.st_size && memcmp(loaded, file_data, length) == 0) ? "match" : "MISMATCH");
+	free(loaded);
+
+	/* proc files claim a size of 0, so this exercises the growth path */
+	loaded = load_file("/proc/self/cmdline", NULL, &loaded_length);
+	/* how we were started varies, so only check for a non empty, NUL terminated argv[0] */
+	printf("proc read: %s\n", loaded != NULL && loaded_length > 0 && loaded[0] != '\0' && memchr(loaded, '\0', loaded_length) != NULL ? "match" : "MISMATCH");
+	free(loaded);
+
+	f = popen("cat tmp_load", "r");
+	free(file_data);
+	file_data = (char*)read_entire_file(f, 100, &length);
+	pclose(f);
+	printf("pipe read %lu bytes: %s\n", length, length == (unsigned long)st.st_size ? "match" : "MISMATCH");
+
+	char** lines = get_file_lines("tmp_load", &line);
+	printf("get_file_lines %lu lines: %s\n", line, line == 20000 && strcmp(lines[19999], "line 19999\tsome padding to push past the first block") == 0 ? "match" : "MISMATCH");
+	free_null_terminated_string_array(lines);
+	free(file_data);
+
+	/* the iterator should see the same pieces split_on_separators does, without copying them */
+	char db_line[] = "V\t280907062105Z\t\t01\tunknown\t /CN=client1 \r\n\r\nR\t280829062105Z\t261019062125Z\t02\tunknown\t/CN=client2";
+	str_iter_t lines_iter;
+	str_iter_t fields_iter;
+	str_view_t piece;
+	str_view_t field;
+	initialize_str_iter(&lines_iter, db_line, strlen(db_line), "\r\n", 2, 0);
+	while(next_str_piece(&lines_iter, &piece))
+	{
+		unsigned long num_fields = 0;
+		initialize_str_iter(&fields_iter, (char*)piece.str, piece.len, "\t", 1, STR_ITER_TRIM | STR_ITER_TERMINATE);
+		printf("line:");
+		while(next_str_piece(&fields_iter, &field))
+		{
+			printf(" [%s]", field.str);
+			num_fields++;
+		}
+		printf(" %lu fields\n", num_fields);
+	}
+
+	char csv[] = "a,,b,";
+	unsigned long num_fields = 0;
+	initialize_str_iter(&fields_iter, csv, strlen(csv), ",", 1, STR_ITER_KEEP_EMPTY);
+	while(next_str_piece(&fields_iter, &field))
+	{
+		printf("csv field %lu: [%.*s]\n", num_fields++, (int)field.len, field.str);
+	}
+	printf("csv %lu fields: %s\n", num_fields, num_fields == 4 ? "match" : "MISMATCH");
+
+	unsigned long mismatches = random_split_mismatches(100000);
+	printf("split 100000 random lines: %s\n", mismatches == 0 ? "match" : "MISMATCH");
+
+	/* buffered_read has to manage with a pipe, which dynamic_read used to fsetpos on */
+	buffered_reader reader;
+	char* reader_line;
+	unsigned long reader_lines = 0;
+	f = popen("cat tmp_load", "r");
+	initialize_buffered_reader(&reader, fileno(f), "\n", 1, 4096);
+	while(buffered_read(&reader, &reader_line, &length) != EOF)
+	{
+		reader_lines++;
+	}
+	free_buffered_reader(&reader);
+	pclose(f);
+	printf("buffered_read %lu lines from a pipe: %s\n", reader_lines, reader_lines == 20000 ? "match" : "MISMATCH");
+
+	/* a directory opens but can't be read, which has to come back as an error rather than the end of the file */
+	int dir_fd = open(".", O_RDONLY);
+	initialize_buffered_reader(&reader, dir_fd, "\n", 1, 0);
+	int dir_term = buffered_read(&reader, &reader_line, &length);
+	printf("buffered_read of a directory: %s\n", dir_term == DYN_READ_ERROR && reader.error == EISDIR && buffered_read(&reader, &reader_line, &length) == EOF ? "match" : "MISMATCH");
+	free_buffered_reader(&reader);
+	close(dir_fd);
+
+	f = fopen(".", "r");
+	next = dynamic_read(f, terminators, 2, &length);
+	free(next.str);
+	fclose(f);
+	printf("dynamic_read of a directory: %s\n", next.terminator == DYN_READ_ERROR ? "match" : "MISMATCH");
+	printf("get_file_lines of a directory: %s\n", get_file_lines(".", &line) == NULL ? "match" : "MISMATCH");
+
+	f = popen("cat tmp_load", "r");
+	reader_lines = 0;
+	while(dyn_read_line(f, &reader_line, &length) != EOF)
+	{
+		reader_lines += length > 0 ? 1 : 0;
+		free(reader_line);
+	}
+	free(reader_line);
+	pclose(f);
+	printf("dyn_read_line %lu lines from a pipe: %s\n", reader_lines, reader_lines == 20000 ? "match" : "MISMATCH");
+
+	unlink("tmp_load");
+
 	return 0;
 }
@@ -46,9 +46,133 @@ typedef struct stack_node_struct
 	struct stack_node_struct* previous;
 } stack_node;
 
-static void** destroy_long_map_values(long_map* map, int destruction_type, unsigned long* num_destroyed);
+#define LONG_MAP_MIN_BLOCK_NODES	16
+#define LONG_MAP_MAX_BLOCK_NODES	4096
+
+static long_map_node* new_long_map_node(long_map* map, unsigned long key, void* value);
+static void free_long_map_node(long_map* map, long_map_node* node);
+static long_map_node_block* add_long_map_node_block(long_map* map, unsigned long num_nodes);
+static void free_long_map_node_blocks(long_map* map);
+static signed char build_sorted_long_map_nodes(long_map_node** node, long_map_node* nodes, unsigned long* keys, void** values, unsigned long num_keys);
+static void** collect_long_map_values(long_map_node* node, int destruction_type, void** return_values, unsigned long* num_destroyed);
+static void* long_map_cursor_value(long_map_cursor* cursor, unsigned long* key);
+
 static void apply_to_every_long_map_node(long_map_node* node, void (*apply_func)(unsigned long key, void* value));
-static void apply_to_every_string_map_node(long_map_node* node, unsigned char has_key, void (*apply_func)(char* key, void* value));
+static long_map_node* new_long_map_node(long_map* map, unsigned long key, void* value)
+{
+	long_map_node* node = map->free_nodes;
+	if(node != NULL)
+	{
+		map->free_nodes = node->right;
+	}
+	else
+	{
+		long_map_node_block* block = map->blocks;
+		if(block == NULL || block->num_used == block->num_nodes)
+		{
+			/* blocks double up to a cap, so small maps stay small and big ones take few mallocs */
+			unsigned long num_nodes = block == NULL ? LONG_MAP_MIN_BLOCK_NODES : block->num_nodes*2;
+			num_nodes = num_nodes > LONG_MAP_MAX_BLOCK_NODES ? LONG_MAP_MAX_BLOCK_NODES : num_nodes;
+			block = add_long_map_node_block(map, num_nodes);
+		}
+		node = ((long_map_node*)(block+1)) + block->num_used;
+		block->num_used++;
+	}
+	node->key = key;
+	node->value = value;
+	node->left = NULL;
+	node->right = NULL;
+	node->balance = 0;
+	return node;
+}
+
+static void free_long_map_node(long_map* map, long_map_node* node)
+{
+	node->right = map->free_nodes;
+	map->free_nodes = node;
+}
+
+/* the nodes follow the block header in the same allocation */
+static long_map_node_block* add_long_map_node_block(long_map* map, unsigned long num_nodes)
+{
+	long_map_node_block* block = (long_map_node_block*)malloc(sizeof(long_map_node_block) + num_nodes*sizeof(long_map_node));
+	block->num_nodes = num_nodes;
+	block->num_used = 0;
+	block->next = map->blocks;
+	map->blocks = block;
+	return block;
+}
+
+static void free_long_map_node_blocks(long_map* map)
+{
+	while(map->blocks != NULL)
+	{
+		long_map_node_block* next = map->blocks->next;
+		free(map->blocks);
+		map->blocks = next;
+	}
+	map->free_nodes = NULL;
+	map->root = NULL;
+	map->num_elements = 0;
+}
+
+/* returns the height of the subtree built, the left half gets the extra node so balance is 0 or -1 */
+static signed char build_sorted_long_map_nodes(long_map_node** node, long_map_node* nodes, unsigned long* keys, void** values, unsigned long num_keys)
+{
+	unsigned long middle = num_keys/2;
+	signed char left_height;
+	signed char right_height;
+	if(num_keys == 0)
+	{
+		*node = NULL;
+		return 0;
+	}
+	*node = nodes + middle;
+	(*node)->key = keys[middle];
+	(*node)->value = values[middle];
+	left_height = build_sorted_long_map_nodes(&((*node)->left), nodes, keys, values, middle);
+	right_height = build_sorted_long_map_nodes(&((*node)->right), nodes + middle + 1, keys + middle + 1, values + middle + 1, num_keys - middle - 1);
+	(*node)->balance = right_height - left_height;
+	return (left_height > right_height ? left_height : right_height) + 1;
+}
+
+static void** collect_long_map_values(long_map_node* node, int destruction_type, void** return_values, unsigned long* num_destroyed)
+{
+	if(node != NULL)
+	{
+		collect_long_map_values(node->left, destruction_type, return_values, num_destroyed);
+		if(destruction_type == DESTROY_MODE_RETURN_VALUES)
+		{
+			return_values[*num_destroyed] = node->value;
+		}
+		if(destruction_type == DESTROY_MODE_FREE_VALUES)
+		{
+			free(node->value);
+		}
+		*num_destroyed = *num_destroyed + 1;
+		collect_long_map_values(node->right, destruction_type, return_values, num_destroyed);
+	}
+	return return_values;
+}
+
+/* value under the cursor, or NULL (and the cursor finished) if it has walked out of range */
+static void* long_map_cursor_value(long_map_cursor* cursor, unsigned long* key)
+{
+	long_map_node* node;
+	if(cursor->depth == 0)
+	{
+		return NULL;
+	}
+	node = cursor->path[cursor->depth-1];
+	if(node->key < cursor->lower_bound || node->key > cursor->upper_bound)
+	{
+		cursor->depth = 0;
+		return NULL;
+	}
+	*key = node->key;
+	return node->value;
+}
+
 static void get_sorted_node_keys(long_map_node* node, unsigned long* key_list, unsigned long* next_key_index, int depth);
 static void get_sorted_node_values(long_map_node* node, void** value_list, unsigned long* next_value_index, int depth);
 static signed char rebalance (long_map_node** n, signed char direction, signed char update_op);
@@ -56,14 +180,13 @@ static void rotate_right (long_map_node** parent);
 static void rotate_left (long_map_node** parent);
 
 /* internal for string map */
-typedef struct 
-{
-	char* key;
-	void* value;
-} string_map_key_value;
-
+#define STRING_MAP_MIN_SLOTS	8
 
 static unsigned long sdbm_string_hash(const char *key);
+static unsigned long string_map_home_slot(string_map* map, unsigned long hash);
+static long find_string_map_slot(string_map* map, const char* key, unsigned long hash);
+static void place_string_map_slot(string_map* map, string_map_slot entry);
+static void resize_string_map(string_map* map, unsigned long num_slots);
 
 
 /***************************************************
@@ -96,65 +219,71 @@ string_map* initialize_string_map(unsigned char store_keys)
 {
 	string_map* map = (string_map*)malloc(sizeof(string_map));
 	map->store_keys = store_keys;
-	map->lm.root = NULL;
-	map->lm.num_elements = 0;
-	map->num_elements = map->lm.num_elements;
+	map->slots = NULL; /* allocated on the first set, plenty of maps stay empty */
+	map->num_slots = 0;
+	map->num_elements = 0;
 	
 	return map;
 }
 
 void* get_string_map_element(string_map* map, const char* key)
 {
-	unsigned long hashed_key = sdbm_string_hash(key);
-	void* return_value =  get_long_map_element( &(map->lm), hashed_key);
-	if(return_value != NULL && map->store_keys)
-	{
-		string_map_key_value* r = (string_map_key_value*)return_value;
-		return_value = r->value;
-	}
-	map->num_elements = map->lm.num_elements;
-	return return_value;
+	long slot_index = find_string_map_slot(map, key, sdbm_string_hash(key));
+	return slot_index < 0 ? NULL : map->slots[slot_index].value;
 }
 
 void* set_string_map_element(string_map* map, const char* key, void* value)
 {
 	unsigned long hashed_key = sdbm_string_hash(key);
+	long slot_index = find_string_map_slot(map, key, hashed_key);
 	void* return_value = NULL;
-	if(map->store_keys)
+	if(slot_index >= 0)
 	{
-		string_map_key_value* kv = (string_map_key_value*)malloc(sizeof(string_map_key_value));
-		kv->key = strdup(key);
-		kv->value = value;
-		return_value = set_long_map_element(  &(map->lm), hashed_key, kv);
-		if(return_value != NULL)
-		{
-			string_map_key_value* r = (string_map_key_value*)return_value;
-			return_value = r->value;
-			free(r->key);
-			free(r);
-		}
+		return_value = map->slots[slot_index].value;
+		map->slots[slot_index].value = value;
 	}
 	else
 	{
-		return_value = set_long_map_element( &(map->lm), hashed_key, value);
+		string_map_slot entry;
+		/* grow at 3/4 full, robin hood keeps probes short well past that but lookups stay in cache */
+		if((map->num_elements + 1)*4 > map->num_slots*3)
+		{
+			resize_string_map(map, map->num_slots == 0 ? STRING_MAP_MIN_SLOTS : map->num_slots*2);
+		}
+		entry.hash = hashed_key;
+		entry.key = map->store_keys ? strdup(key) : NULL;
+		entry.value = value;
+		place_string_map_slot(map, entry);
+		map->num_elements++;
 	}
-	map->num_elements = map->lm.num_elements;
 	return return_value;
 }
 
 void* remove_string_map_element(string_map* map, const char* key)
 {
-	unsigned long hashed_key = sdbm_string_hash(key);
-	void* return_value =  remove_long_map_element( &(map->lm), hashed_key);
-	
-	if(return_value != NULL && map->store_keys)
+	long slot_index = find_string_map_slot(map, key, sdbm_string_hash(key));
+	void* return_value = NULL;
+	if(slot_index >= 0)
 	{
-		string_map_key_value* r = (string_map_key_value*)return_value;
-		return_value = r->value;
-		free(r->key);
-		free(r);
+		unsigned long mask = map->num_slots - 1;
+		unsigned long index = (unsigned long)slot_index;
+		unsigned long next = (index + 1) & mask;
+		return_value = map->slots[index].value;
+		free(map->slots[index].key);
+
+		/* backward shift, so no tombstones are left for lookups to wade through */
+		while(map->slots[next].probe > 1)
+		{
+			map->slots[index] = map->slots[next];
+			map->slots[index].probe--;
+			index = next;
+			next = (next + 1) & mask;
+		}
+		map->slots[index].probe = 0;
+		map->slots[index].key = NULL;
+		map->slots[index].value = NULL;
+		map->num_elements--;
 	}
-	map->num_elements = map->lm.num_elements;
 	return return_value;
 }
 
@@ -166,16 +295,16 @@ char** get_string_map_keys(string_map* map, unsigned long* num_keys_returned)
 	*num_keys_returned = 0;
 	if(map->store_keys && map->num_elements > 0)
 	{
-		unsigned long list_length;
-		void** long_values = get_sorted_long_map_values( &(map->lm),  &list_length);
-		unsigned long key_index;
-		for(key_index = 0; key_index < list_length; key_index++)
+		unsigned long slot_index;
+		for(slot_index = 0; slot_index < map->num_slots; slot_index++)
 		{
-			str_keys[key_index] = strdup( ((string_map_key_value*)(long_values[key_index]))->key);
-			*num_keys_returned = *num_keys_returned + 1;
+			if(map->slots[slot_index].probe > 0)
+			{
+				str_keys[*num_keys_returned] = strdup(map->slots[slot_index].key);
+				*num_keys_returned = *num_keys_returned + 1;
+			}
 		}
-		str_keys[list_length] = NULL;
-		free(long_values);
+		str_keys[*num_keys_returned] = NULL;
 	}
 	return str_keys;
 }
@@ -185,7 +314,18 @@ void** get_string_map_values(string_map* map, unsigned long* num_values_returned
 	void** values = NULL;
 	if(map != NULL)
 	{
-		values = get_sorted_long_map_values ( &(map->lm), num_values_returned );
+		unsigned long slot_index;
+		values = (void**)malloc((map->num_elements+1)*sizeof(void*));
+		*num_values_returned = 0;
+		for(slot_index = 0; slot_index < map->num_slots; slot_index++)
+		{
+			if(map->slots[slot_index].probe > 0)
+			{
+				values[*num_values_returned] = map->slots[slot_index].value;
+				*num_values_returned = *num_values_returned + 1;
+			}
+		}
+		values[*num_values_returned] = NULL;
 	}
 	return values;
 }
@@ -195,41 +335,36 @@ void** get_string_map_values(string_map* map, unsigned long* num_values_returned
 void** destroy_string_map(string_map* map, int destruction_type, unsigned long* num_destroyed)
 {
 	void** return_values = NULL;
+	*num_destroyed = 0;
 	if(map != NULL)
 	{
-		if(map->store_keys)
+		unsigned long slot_index;
+		if(destruction_type == DESTROY_MODE_RETURN_VALUES)
+		{
+			return_values = (void**)malloc((map->num_elements+1)*sizeof(void*));
+		}
+		for(slot_index = 0; slot_index < map->num_slots; slot_index++)
 		{
-			void** kvs = destroy_long_map_values( &(map->lm), DESTROY_MODE_RETURN_VALUES, num_destroyed );
-			unsigned long kv_index = 0;
-			for(kv_index=0; kv_index < *num_destroyed; kv_index++)
+			string_map_slot* slot = &(map->slots[slot_index]);
+			if(slot->probe > 0)
 			{
-				string_map_key_value* kv = (string_map_key_value*)kvs[kv_index];
-				void* value = kv->value;
-				
-				free(kv->key);
-				free(kv);
+				free(slot->key);
 				if(destruction_type == DESTROY_MODE_FREE_VALUES)
 				{
-					free(value);
+					free(slot->value);
 				}
 				if(destruction_type == DESTROY_MODE_RETURN_VALUES)
 				{
-					kvs[kv_index] = value;
+					return_values[*num_destroyed] = slot->value;
 				}
-			}
-			if(destruction_type == DESTROY_MODE_RETURN_VALUES)
-			{
-				return_values = kvs;
-			}
-			else
-			{
-				free(kvs);
+				*num_destroyed = *num_destroyed + 1;
 			}
 		}
-		else
+		if(return_values != NULL)
 		{
-			return_values = destroy_long_map_values( &(map->lm), destruction_type, num_destroyed );
+			return_values[*num_destroyed] = NULL;
 		}
+		free(map->slots);
 		free(map);
 	}
 	return return_values;
@@ -246,7 +381,40 @@ long_map* initialize_long_map(void)
 	long_map* map = (long_map*)malloc(sizeof(long_map));
 	map->root = NULL;
 	map->num_elements = 0;
+	map->blocks = NULL;
+	map->free_nodes = NULL;
+
+	return map;
+}
 
+/*
+ * sorted keys make the middle one the root and each half a subtree, all from one block,
+ * with no rotations. keys are copied, values are taken as they are
+ */
+long_map* build_long_map_from_sorted(unsigned long* keys, void** values, unsigned long num_keys)
+{
+	long_map* map = initialize_long_map();
+	unsigned long key_index;
+	int strictly_sorted = 1;
+
+	for(key_index = 1; key_index < num_keys && strictly_sorted; key_index++)
+	{
+		strictly_sorted = keys[key_index-1] < keys[key_index] ? 1 : 0;
+	}
+	if(strictly_sorted && num_keys > 0)
+	{
+		long_map_node_block* block = add_long_map_node_block(map, num_keys);
+		block->num_used = num_keys;
+		build_sorted_long_map_nodes(&(map->root), (long_map_node*)(block+1), keys, values, num_keys);
+		map->num_elements = num_keys;
+	}
+	else
+	{
+		for(key_index = 0; key_index < num_keys; key_index++)
+		{
+			set_long_map_element(map, keys[key_index], values[key_index]);
+		}
+	}
 	return map;
 }
 
@@ -328,32 +496,27 @@ void* set_long_map_element(long_map* map, unsigned long key, void* value)
 	stack_node* previous_parent;
 	signed char new_balance;
 
+	/* the path back up for rebalancing lives on the stack, nothing to allocate or free */
+	stack_node path[LONG_MAP_MAX_DEPTH];
+	int path_length = 0;
 
-	long_map_node* new_node = (long_map_node*)malloc(sizeof(long_map_node));
-	new_node->value = value;
-	new_node->key = key;
-	new_node->left = NULL;
-	new_node->right = NULL;
-	new_node->balance = 0;
-
-	
 
 	if(map->root == NULL)
 	{
-		map->root = new_node;	
+		map->root = new_long_map_node(map, key, value);
 	}
 	else
 	{
 		parent_node = map->root;
 			
-		next_parent = (stack_node*)malloc(sizeof(stack_node));
+		next_parent = &(path[path_length++]);
 		next_parent->node_ptr =  &(map->root);
 		next_parent->previous = parent_list;
 		parent_list = next_parent;	
 			
 		while( key != parent_node->key && (next_node = (key < parent_node->key ? parent_node->left : parent_node->right) )  != NULL)
 		{
-			next_parent = (stack_node*)malloc(sizeof(stack_node));
+			next_parent = &(path[path_length++]);
 			next_parent->node_ptr = key < parent_node->key ? &(parent_node->left) : &(parent_node->right);
 			next_parent->previous = parent_list;
 			next_parent->previous->direction = key < parent_node->key ? -1 : 1;
@@ -368,11 +531,11 @@ void* set_long_map_element(long_map* map, unsigned long key, void* value)
 			old_value = parent_node->value;
 			old_value_found = 1;
 			parent_node->value = value;
-			free(new_node);
 			/* we merely replaced a node, no need to rebalance */
 		}
 		else
 		{	
+			long_map_node* new_node = new_long_map_node(map, key, value);
 			if(key < parent_node->key)
 			{
 				parent_node->left = (void*)new_node;
@@ -398,13 +561,6 @@ void* set_long_map_element(long_map* map, unsigned long key, void* value)
 		}
 	}
 
-	while(parent_list != NULL)
-	{
-		previous_parent = parent_list;
-		parent_list = previous_parent->previous;
-		free(previous_parent);
-	}
-
 	if(old_value_found == 0)
 	{
 		map->num_elements = map->num_elements + 1;
@@ -438,6 +594,8 @@ void* remove_long_map_element(long_map* map, unsigned long key)
 
 	signed char new_balance;
 
+	stack_node path[LONG_MAP_MAX_DEPTH];
+	int path_length = 0;
 
 
 	if(root_node != NULL)
@@ -447,13 +605,13 @@ void* remove_long_map_element(long_map* map, unsigned long key)
 		
 		if(remove_node != NULL && key != remove_parent->key)
 		{
-			next_parent = (stack_node*)malloc(sizeof(stack_node));
+			next_parent = &(path[path_length++]);
 			next_parent->node_ptr =  &(map->root);
 			next_parent->previous = parent_list;
 			parent_list = next_parent;	
 			while( key != remove_node->key && (next_node = (key < remove_node->key ? remove_node->left : remove_node->right))  != NULL)
 			{
-				next_parent = (stack_node*)malloc(sizeof(stack_node));
+				next_parent = &(path[path_length++]);
 				next_parent->node_ptr = key < remove_parent->key ? &(remove_parent->left) : &(remove_parent->right);
 				next_parent->previous = parent_list;
 				next_parent->previous->direction = key < remove_parent->key ? -1 : 1; 
@@ -487,7 +645,7 @@ void* remove_long_map_element(long_map* map, unsigned long key)
 				replacement->balance = remove_node->balance;
 
 				/* put pointer to replacement node into list for balance update */
-				replacement_stack_node = (stack_node*)malloc(sizeof(stack_node));;
+				replacement_stack_node = &(path[path_length++]);
 				replacement_stack_node->previous = parent_list;
 				replacement_stack_node->direction = 1; /* replacement is from right */
 				if(remove_node == remove_parent) /* special case for root node */
@@ -504,7 +662,7 @@ void* remove_long_map_element(long_map* map, unsigned long key)
 			else
 			{
 				/* put pointer to replacement node into list for balance update */
-				replacement_stack_node = (stack_node*)malloc(sizeof(stack_node));
+				replacement_stack_node = &(path[path_length++]);
 				replacement_stack_node->previous = parent_list;
 				replacement_stack_node->direction = 1; /* we always look for replacement on right */
 				if(remove_node == remove_parent) /* special case for root node */
@@ -524,7 +682,7 @@ void* remove_long_map_element(long_map* map, unsigned long key)
 				 * this node will have to be updated with the proper pointer
 				 * after we have identified the replacement
 				 */
-				replacement_stack_node = (stack_node*)malloc(sizeof(stack_node));
+				replacement_stack_node = &(path[path_length++]);
 				replacement_stack_node->previous = parent_list;
 				replacement_stack_node->direction = -1; /* we always look for replacement to left of this node */
 				parent_list = replacement_stack_node;
@@ -535,7 +693,7 @@ void* remove_long_map_element(long_map* map, unsigned long key)
 				
 				while((replacement_next = replacement->left)  != NULL)
 				{
-					next_parent = (stack_node*)malloc(sizeof(stack_node));
+					next_parent = &(path[path_length++]);
 					next_parent->node_ptr = &(replacement_parent->left);
 					next_parent->previous = parent_list;
 					next_parent->direction = -1; /* we always go left */
@@ -584,17 +742,9 @@ void* remove_long_map_element(long_map* map, unsigned long key)
 			 */
 			map->num_elements = map->num_elements - 1;
 			value = remove_node->value;
-			free(remove_node);
+			free_long_map_node(map, remove_node);
 		}
 	}
-
-
-	while(parent_list != NULL)
-	{
-		previous_parent = parent_list;
-		parent_list = previous_parent->previous;
-		free(previous_parent);
-	}
 	
 	return value;
 }
@@ -631,7 +781,6 @@ void** get_sorted_long_map_values(long_map* map, unsigned long* num_values_retur
 void** destroy_long_map(long_map* map, int destruction_type, unsigned long* num_destroyed)
 {
 	void** return_values = NULL;
-	unsigned long return_index = 0;
 
 	*num_destroyed = 0;
 
@@ -640,21 +789,9 @@ void** destroy_long_map(long_map* map, int destruction_type, unsigned long* num_
 		return_values = (void**)malloc((map->num_elements+1)*sizeof(void*));
 		return_values[map->num_elements] = NULL;
 	}
-	while(map->num_elements > 0)
-	{
-		unsigned long smallest_key = 0;
-		void* removed_value = remove_smallest_long_map_element(map, &smallest_key);
-		if(destruction_type == DESTROY_MODE_RETURN_VALUES)
-		{
-			return_values[return_index] = removed_value;
-		}
-		if(destruction_type == DESTROY_MODE_FREE_VALUES)
-		{
-			free(removed_value);
-		}
-		return_index++;
-		*num_destroyed = *num_destroyed + 1;
-	}
+	/* no need to unlink node by node, the blocks go all at once */
+	collect_long_map_values(map->root, destruction_type, return_values, num_destroyed);
+	free_long_map_node_blocks(map);
 	free(map);
 
 	return return_values;
@@ -666,43 +803,110 @@ void apply_to_every_long_map_value(long_map* map, void (*apply_func)(unsigned lo
 }
 void apply_to_every_string_map_value(string_map* map, void (*apply_func)(char* key, void* value))
 {
-	apply_to_every_string_map_node( (map->lm).root, map->store_keys, apply_func);
+	unsigned long slot_index;
+	for(slot_index = 0; slot_index < map->num_slots; slot_index++)
+	{
+		if(map->slots[slot_index].probe > 0)
+		{
+			apply_func(map->slots[slot_index].key, map->slots[slot_index].value);
+		}
+	}
 }
 
 
-/***************************************************
- * internal utility function definitions
- ***************************************************/
-static void** destroy_long_map_values(long_map* map, int destruction_type, unsigned long* num_destroyed)
+void* seek_long_map_cursor(long_map_cursor* cursor, long_map* map, unsigned long lower_bound, unsigned long upper_bound, unsigned long* key)
 {
-	void** return_values = NULL;
-	unsigned long return_index = 0;
+	long_map_node* node = map->root;
+	int lower_bound_depth = 0;
 
-	*num_destroyed = 0;
+	cursor->lower_bound = lower_bound;
+	cursor->upper_bound = upper_bound;
+	cursor->depth = 0;
 
-	if(destruction_type == DESTROY_MODE_RETURN_VALUES)
+	/* the last node we went left at is the smallest key >= lower_bound, the path above it is the way back up */
+	while(node != NULL)
 	{
-		return_values = (void**)malloc((map->num_elements+1)*sizeof(void*));
-		return_values[map->num_elements] = NULL;
+		cursor->path[cursor->depth++] = node;
+		if(node->key == lower_bound)
+		{
+			lower_bound_depth = cursor->depth;
+			break;
+		}
+		if(lower_bound < node->key)
+		{
+			lower_bound_depth = cursor->depth;
+			node = node->left;
+		}
+		else
+		{
+			node = node->right;
+		}
 	}
-	while(map->num_elements > 0)
+	cursor->depth = lower_bound_depth;
+
+	return long_map_cursor_value(cursor, key);
+}
+
+void* next_long_map_cursor(long_map_cursor* cursor, unsigned long* key)
+{
+	if(cursor->depth > 0)
 	{
-		unsigned long smallest_key = 0;
-		void* removed_value = remove_smallest_long_map_element(map, &smallest_key);
-		if(destruction_type == DESTROY_MODE_RETURN_VALUES)
+		long_map_node* node = cursor->path[cursor->depth-1];
+		if(node->right != NULL)
 		{
-			return_values[return_index] = removed_value;
+			/* smallest key of the right subtree */
+			node = node->right;
+			cursor->path[cursor->depth++] = node;
+			while(node->left != NULL)
+			{
+				node = node->left;
+				cursor->path[cursor->depth++] = node;
+			}
 		}
-		if(destruction_type == DESTROY_MODE_FREE_VALUES)
+		else
 		{
-			free(removed_value);
+			/* climb until we come up from a left child, that parent is next */
+			long_map_node* child;
+			do
+			{
+				child = cursor->path[--cursor->depth];
+			} while(cursor->depth > 0 && cursor->path[cursor->depth-1]->right == child);
 		}
-		return_index++;
-		*num_destroyed = *num_destroyed + 1;
 	}
-	return return_values;
+	return long_map_cursor_value(cursor, key);
+}
+
+void* prev_long_map_cursor(long_map_cursor* cursor, unsigned long* key)
+{
+	if(cursor->depth > 0)
+	{
+		long_map_node* node = cursor->path[cursor->depth-1];
+		if(node->left != NULL)
+		{
+			node = node->left;
+			cursor->path[cursor->depth++] = node;
+			while(node->right != NULL)
+			{
+				node = node->right;
+				cursor->path[cursor->depth++] = node;
+			}
+		}
+		else
+		{
+			long_map_node* child;
+			do
+			{
+				child = cursor->path[--cursor->depth];
+			} while(cursor->depth > 0 && cursor->path[cursor->depth-1]->left == child);
+		}
+	}
+	return long_map_cursor_value(cursor, key);
 }
 
+
+/***************************************************
+ * internal utility function definitions
+ ***************************************************/
 static void apply_to_every_long_map_node(long_map_node* node, void (*apply_func)(unsigned long key, void* value))
 {
 	if(node != NULL)
@@ -714,25 +918,81 @@ static void apply_to_every_long_map_node(long_map_node* node, void (*apply_func)
 		apply_to_every_long_map_node(node->right, apply_func);
 	}
 }
-static void apply_to_every_string_map_node(long_map_node* node, unsigned char has_key, void (*apply_func)(char* key, void* value))
+static unsigned long string_map_home_slot(string_map* map, unsigned long hash)
 {
-	if(node != NULL)
+	/*
+	 * sdbm leaves the low bits weak, and the table size is a power of 2,
+	 * so run the hash through a multiply/xorshift finalizer first
+	 */
+	hash = hash ^ (hash >> 16);
+	hash = hash * 0x45d9f3bUL;
+	hash = hash ^ (hash >> 16);
+	return hash & (map->num_slots - 1);
+}
+
+static long find_string_map_slot(string_map* map, const char* key, unsigned long hash)
+{
+	unsigned long index;
+	unsigned long probe = 1;
+	if(map->num_elements == 0)
 	{
-		apply_to_every_string_map_node(node->left, has_key,  apply_func);
-		
-		if(has_key)
+		return -1;
+	}
+	index = string_map_home_slot(map, hash);
+	/* a slot closer to home than we are means the key would have taken it, so stop there */
+	while(map->slots[index].probe >= probe)
+	{
+		string_map_slot* slot = &(map->slots[index]);
+		if(slot->hash == hash && (!map->store_keys || strcmp(slot->key, key) == 0))
 		{
-			string_map_key_value* kv = (string_map_key_value*)(node->value);
-			apply_func(kv->key, kv->value);
+			return (long)index;
 		}
-		else
+		index = (index + 1) & (map->num_slots - 1);
+		probe++;
+	}
+	return -1;
+}
+
+static void place_string_map_slot(string_map* map, string_map_slot entry)
+{
+	unsigned long index = string_map_home_slot(map, entry.hash);
+	entry.probe = 1;
+	while(map->slots[index].probe != 0)
+	{
+		/* take from the rich: whichever is closer to home moves on */
+		if(map->slots[index].probe < entry.probe)
 		{
-			apply_func(NULL, node->value);
+			string_map_slot displaced = map->slots[index];
+			map->slots[index] = entry;
+			entry = displaced;
 		}
-		apply_to_every_string_map_node(node->right, has_key, apply_func);
+		index = (index + 1) & (map->num_slots - 1);
+		entry.probe++;
 	}
+	map->slots[index] = entry;
 }
 
+static void resize_string_map(string_map* map, unsigned long num_slots)
+{
+	string_map_slot* old_slots = map->slots;
+	unsigned long old_num_slots = map->num_slots;
+	unsigned long slot_index;
+
+	map->slots = (string_map_slot*)malloc(num_slots*sizeof(string_map_slot));
+	memset(map->slots, 0, num_slots*sizeof(string_map_slot));
+	map->num_slots = num_slots;
+	for(slot_index = 0; slot_index < old_num_slots; slot_index++)
+	{
+		if(old_slots[slot_index].probe > 0)
+		{
+			place_string_map_slot(map, old_slots[slot_index]);
+		}
+	}
+	free(old_slots);
+}
+
+
+
 
 static void get_sorted_node_keys(long_map_node* node, unsigned long* key_list, unsigned long* next_key_index, int depth)
 {
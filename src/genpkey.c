@@ -29,58 +29,12 @@
 
 #include "genpkey.h"
 
-#if defined(MBEDTLS_PK_WRITE_C) && defined(MBEDTLS_FS_IO) && \
-    defined(MBEDTLS_ENTROPY_C) && defined(MBEDTLS_CTR_DRBG_C)
-
-#define DEV_RANDOM_THRESHOLD        32
-
-int dev_random_entropy_poll(void *data, unsigned char *output,
-                            size_t len, size_t *olen)
-{
-    FILE *file;
-    size_t ret, left = len;
-    unsigned char *p = output;
-    ((void) data);
-
-    *olen = 0;
-
-    file = fopen("/dev/random", "rb");
-    if (file == NULL) {
-        return MBEDTLS_ERR_ENTROPY_SOURCE_FAILED;
-    }
-
-    while (left > 0) {
-        /* /dev/random can return much less than requested. If so, try again */
-        ret = fread(p, 1, left, file);
-        if (ret == 0 && ferror(file)) {
-            fclose(file);
-            return MBEDTLS_ERR_ENTROPY_SOURCE_FAILED;
-        }
-
-        p += ret;
-        left -= ret;
-        sleep(1);
-    }
-    fclose(file);
-    *olen = len;
-
-    return 0;
-}
-#endif
-
 #if defined(MBEDTLS_ECP_C)
 #define DFL_EC_CURVE            mbedtls_ecp_curve_list()->grp_id
 #else
 #define DFL_EC_CURVE            0
 #endif
 
-#if defined(MBEDTLS_FS_IO)
-#define USAGE_DEV_RANDOM \
-	"    -usedevrandom			Use /dev/random (default no)\n"
-#else
-#define USAGE_DEV_RANDOM ""
-#endif /* MBEDTLS_FS_IO */
-
 #if defined(MBEDTLS_ECP_C)
 #define USAGE_EC_PKEYOPT \
 	"    ec_paramgen_curve:curve			Sets which curve for EC key. See available curves\n"	\
@@ -98,12 +52,19 @@ int dev_random_entropy_poll(void *data, unsigned char *output,
 #define EC_PUB_FORMAT_COMPRESSED 0
 #define EC_PUB_FORMAT_UNCOMPRESSED 1
 
+#define NAMING_INDEX 0
+#define NAMING_FINGERPRINT 1
+
+/* Large enough for the SubjectPublicKeyInfo of an 8192 bit RSA key */
+#define PUB_DER_MAX_BYTES 2100
+
 #define DFL_TYPE                MBEDTLS_PK_RSA
 #define DFL_RSA_KEYSIZE         2048
 #define DFL_FILENAME            "keyfile.key"
 #define DFL_FORMAT              FORMAT_PEM
 #define DFL_EC_PARAMENC         FORMAT_NAMED_CURVE
 #define DFL_USE_DEV_RANDOM      0
+#define MAX_THREADS             GENPRIME_MAX_THREADS
 
 #define USAGE \
     "\n usage: genpkey [options]\n"																	\
@@ -112,9 +73,18 @@ int dev_random_entropy_poll(void *data, unsigned char *output,
     "    -algorithm val			The public key algorithm (rsa or ec)\n"								\
     "    -pkeyopt val			Set the public key algorithm option as opt:value\n"					\
     USAGE_DEV_RANDOM																				\
+    USAGE_SEED_FILE																					\
+	"    -progress				Report RSA prime search progress on stderr\n"						\
+	"    -timeout secs			Give up generating an RSA key after secs seconds\n"				\
+	"    -checkpoint file		Save RSA search state to file, resume from it if it exists\n"		\
+	"    -threads n				Threads for the RSA prime search or batch (default: all cpus)\n"	\
+	"    -count n				Generate n keys into -outdir instead of a single -out\n"			\
+	"							NOTE: Not with -timeout or -checkpoint\n"						\
 	"\n\n Output options:\n"																		\
 	"    -out outfile			Output file\n"														\
 	"    -outform PEM|DER		Output format (DER or PEM)\n"										\
+	"    -outdir dir				Output directory for -count\n"										\
+	"    -naming index|fingerprint	Name -count keys by index or SHA-256 of the public key\n"		\
 	"    -pass val				UNSUPPORTED Output file pass phrase source\n"						\
 	"    -text					Print the private key in text\n"									\
 	"    -*						UNSUPPORTED Cipher to use to encrypt the key\n"						\
@@ -192,7 +162,7 @@ static int print_mpi_ec_pub_hex_text(mbedtls_mpi* X, mbedtls_mpi* Y, char* headi
 	return ret;
 }
 
-static int write_private_key(mbedtls_pk_context *key, int textout, int format, const char *output_file)
+int genpkey_write_key(mbedtls_pk_context *key, int textout, int format, const char *output_file)
 {
     int ret;
     FILE *f;
@@ -316,6 +286,385 @@ static int write_private_key(mbedtls_pk_context *key, int textout, int format, c
     return 0;
 }
 
+void genpkey_params_init(genpkey_params* params)
+{
+	memset(params, 0, sizeof(genpkey_params));
+	params->algo = DFL_TYPE;
+	params->rsa_keysize = DFL_RSA_KEYSIZE;
+	params->ec_curve = DFL_EC_CURVE;
+	params->threads = 1;
+}
+
+int genpkey_gen_key(mbedtls_pk_context* key, const genpkey_params* params, mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	int ret;
+	
+	if((ret = mbedtls_pk_setup(key, mbedtls_pk_info_from_type((mbedtls_pk_type_t) params->algo))) != 0)
+	{
+		return ret;
+	}
+	
+#if defined(MBEDTLS_RSA_C) && defined(MBEDTLS_GENPRIME)
+	if(params->algo == MBEDTLS_PK_RSA)
+	{
+		genprime_job job;
+		
+		genprime_init(&job, GENPRIME_TYPE_RSA);
+		job.progress = params->progress;
+		job.timeout = params->timeout;
+		job.checkpoint_file = params->checkpoint_file;
+		ret = genprime_rsa_gen_key(&job, mbedtls_pk_rsa(*key), params->rsa_keysize, 65537,
+									params->threads, ctr_drbgs);
+		if(ret == GENPRIME_ERR_TIMEOUT)
+		{
+			genprime_report_timeout(&job);
+		}
+		genprime_free(&job);
+		
+		return ret;
+	}
+#endif /* MBEDTLS_RSA_C && MBEDTLS_GENPRIME */
+#if defined(MBEDTLS_ECP_C)
+	if(params->algo == MBEDTLS_PK_ECKEY)
+	{
+		mbedtls_ecp_keypair* ecp = mbedtls_pk_ec(*key);
+		
+		if(params->grp == NULL)
+		{
+			return mbedtls_ecp_gen_key((mbedtls_ecp_group_id) params->ec_curve, ecp,
+										mbedtls_ctr_drbg_random, &ctr_drbgs[0]);
+		}
+		if((ret = mbedtls_ecp_group_copy(&ecp->grp, params->grp)) != 0)
+		{
+			return ret;
+		}
+		return mbedtls_ecp_gen_keypair(params->grp, &ecp->d, &ecp->Q, mbedtls_ctr_drbg_random, &ctr_drbgs[0]);
+	}
+#endif /* MBEDTLS_ECP_C */
+	
+	return MBEDTLS_ERR_PK_BAD_INPUT_DATA;
+}
+
+#if defined(MBEDTLS_ECP_C)
+int genpkey_read_ec_paramfile(const char* path, int* ec_curve)
+{
+	int ret;
+	unsigned char* buf = NULL;
+	unsigned char* der;
+	unsigned char* p;
+	size_t n, derlen, use_len;
+	mbedtls_asn1_buf oid;
+	mbedtls_ecp_group_id grp_id;
+	mbedtls_pem_context pem;
+	mbedtls_x509_crt crt;
+	
+	mbedtls_pem_init(&pem);
+	mbedtls_x509_crt_init(&crt);
+	
+	if((ret = mbedtls_pk_load_file(path, &buf, &n)) != 0)
+	{
+		goto exit;
+	}
+	
+	ret = mbedtls_pem_read_buffer(&pem, "-----BEGIN EC PARAMETERS-----", "-----END EC PARAMETERS-----",
+									buf, NULL, 0, &use_len);
+	if(ret == 0)
+	{
+		der = pem.buf;
+		derlen = pem.buflen;
+	}
+	else if(ret == MBEDTLS_ERR_PEM_NO_HEADER_FOOTER_PRESENT)
+	{
+		der = buf;
+		derlen = n;
+	}
+	else
+	{
+		goto exit;
+	}
+	
+	// ECParameters ::= CHOICE { namedCurve OBJECT IDENTIFIER, ... }, only named curves are supported
+	p = der;
+	if(mbedtls_asn1_get_tag(&p, der + derlen, &oid.len, MBEDTLS_ASN1_OID) == 0)
+	{
+		oid.tag = MBEDTLS_ASN1_OID;
+		oid.p = p;
+		if((ret = mbedtls_oid_get_ec_grp(&oid, &grp_id)) == 0)
+		{
+			*ec_curve = grp_id;
+		}
+		goto exit;
+	}
+	
+	// Not parameters, borrow the curve of a certificate's key instead
+	if((ret = mbedtls_x509_crt_parse(&crt, buf, n)) != 0)
+	{
+		goto exit;
+	}
+	if(!mbedtls_pk_can_do(&crt.pk, MBEDTLS_PK_ECKEY))
+	{
+		ret = MBEDTLS_ERR_PK_BAD_INPUT_DATA;
+		goto exit;
+	}
+	*ec_curve = mbedtls_pk_ec(crt.pk)->grp.id;
+	
+exit:
+	mbedtls_x509_crt_free(&crt);
+	mbedtls_pem_free(&pem);
+	if(buf != NULL)
+	{
+		mbedtls_platform_zeroize(buf, n);
+		mbedtls_free(buf);
+	}
+	
+	return ret;
+}
+#endif /* MBEDTLS_ECP_C */
+
+int genpkey_parse_spec(char* spec, genpkey_params* params, int default_bits,
+						int rsa_keysize_override, int ec_curve_override)
+{
+	int ret;
+	char* q;
+#if defined(MBEDTLS_ECP_C)
+	const mbedtls_ecp_curve_info* curve_info;
+#endif
+	
+	if((q = strchr(spec, ':')) != NULL)
+	{
+		*q++ = '\0';
+	}
+	
+	if(strcmp(spec,"rsa") == 0 || (spec[0] >= '0' && spec[0] <= '9'))
+	{
+		//[rsa:]bits, or rsa alone for default_bits
+		params->algo = MBEDTLS_PK_RSA;
+		if(q == NULL && spec[0] >= '0' && spec[0] <= '9')
+		{
+			q = spec;
+		}
+		if(q != NULL)
+		{
+			params->rsa_keysize = atoi(q);
+		}
+		else if(default_bits != 0)
+		{
+			params->rsa_keysize = default_bits;
+		}
+	}
+#if defined(MBEDTLS_ECP_C)
+	else if(strcmp(spec,"ec") == 0 || (strcmp(spec,"param") == 0 && q != NULL))
+	{
+		//ec[:curve or paramfile] or param:paramfile, the curve is otherwise set with -pkeyopt
+		params->algo = MBEDTLS_PK_ECKEY;
+		if(q != NULL && (curve_info = mbedtls_ecp_curve_info_from_name(q)) != NULL)
+		{
+			params->ec_curve = curve_info->grp_id;
+		}
+		else if(q != NULL && (ret = genpkey_read_ec_paramfile(q, &params->ec_curve)) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  Could not read EC parameters from %s, genpkey_read_ec_paramfile returned -0x%04x\n",
+									q, (unsigned int) -ret);
+			return ret;
+		}
+	}
+#endif /* MBEDTLS_ECP_C */
+	else
+	{
+		return -1;
+	}
+	
+	// -pkeyopt wins over the -newkey spec, as with openssl
+	if(rsa_keysize_override != 0)
+	{
+		params->rsa_keysize = rsa_keysize_override;
+	}
+	if(ec_curve_override != 0)
+	{
+		params->ec_curve = ec_curve_override;
+	}
+	if(params->algo == MBEDTLS_PK_RSA &&
+		(params->rsa_keysize < 1024 || params->rsa_keysize > MBEDTLS_MPI_MAX_BITS))
+	{
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Batch mode: -count keys are shared out between a pool of workers, each
+ * with its own DRBG. EC workers share one group whose comb table has already
+ * been built, so only the first key on a curve pays for the precomputation.
+ */
+typedef struct genpkey_batch {
+	pthread_mutex_t lock;
+	int next;
+	int count;
+	int done;
+	int ret;
+	
+	genpkey_params params;
+	int format;
+	int naming;
+	const char* outdir;
+	int progress;
+}
+genpkey_batch;
+
+typedef struct genpkey_batch_worker {
+	genpkey_batch* batch;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+	pthread_t thread;
+}
+genpkey_batch_worker;
+
+/* Lower case hex SHA-256 of the DER SubjectPublicKeyInfo */
+static int genpkey_fingerprint(mbedtls_pk_context* key, char* fingerprint)
+{
+	int ret;
+	unsigned char buf[PUB_DER_MAX_BYTES];
+	unsigned char hash[32];
+	
+	if((ret = mbedtls_pk_write_pubkey_der(key, buf, sizeof(buf))) < 0)
+	{
+		return ret;
+	}
+	if((ret = mbedtls_sha256_ret(buf + sizeof(buf) - ret, ret, hash, 0)) != 0)
+	{
+		return ret;
+	}
+	for(int i = 0; i < 32; i++)
+	{
+		sprintf(fingerprint + 2 * i, "%02x", hash[i]);
+	}
+	
+	return 0;
+}
+
+static int genpkey_batch_key(genpkey_batch* batch, int idx, mbedtls_ctr_drbg_context* ctr_drbg)
+{
+	int ret;
+	mbedtls_pk_context key;
+	char name[65];
+	char* path;
+	
+	mbedtls_pk_init(&key);
+	
+	// params.threads is 1: the pool already keeps every core busy, so one lane per key
+	if((ret = genpkey_gen_key(&key, &batch->params, ctr_drbg)) != 0)
+	{
+		goto exit;
+	}
+	
+	if(batch->naming == NAMING_FINGERPRINT)
+	{
+		if((ret = genpkey_fingerprint(&key, name)) != 0)
+		{
+			goto exit;
+		}
+	}
+	else
+	{
+		snprintf(name, sizeof(name), "%0*d", (int)snprintf(NULL, 0, "%d", batch->count - 1), idx);
+	}
+	path = dynamic_strcat(4, batch->outdir, "/", name, (batch->format == FORMAT_PEM ? ".key" : ".der"));
+	ret = genpkey_write_key(&key, 0, batch->format, path);
+	free(path);
+	
+exit:
+	mbedtls_pk_free(&key);
+	
+	return ret;
+}
+
+static void* genpkey_batch_worker_run(void* arg)
+{
+	genpkey_batch_worker* worker = (genpkey_batch_worker*)arg;
+	genpkey_batch* batch = worker->batch;
+	int idx, ret;
+	
+	while(1)
+	{
+		pthread_mutex_lock(&batch->lock);
+		idx = batch->next;
+		batch->next += 1;
+		pthread_mutex_unlock(&batch->lock);
+		if(idx >= batch->count)
+		{
+			break;
+		}
+		
+		ret = genpkey_batch_key(batch, idx, worker->ctr_drbg);
+		
+		pthread_mutex_lock(&batch->lock);
+		if(ret != 0)
+		{
+			if(batch->ret == 0)
+			{
+				batch->ret = ret;
+			}
+			// Stop handing out work
+			batch->next = batch->count;
+		}
+		else
+		{
+			batch->done += 1;
+			if(batch->progress)
+			{
+				mbedtls_fprintf(stderr, "\r  . %d of %d keys", batch->done, batch->count);
+				fflush(stderr);
+			}
+		}
+		pthread_mutex_unlock(&batch->lock);
+	}
+	
+	return NULL;
+}
+
+static int genpkey_batch_run(genpkey_batch* batch, int threads, mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	int started = 0;
+	genpkey_batch_worker* workers;
+	
+	pthread_mutex_init(&batch->lock, NULL);
+	batch->next = 0;
+	batch->done = 0;
+	batch->ret = 0;
+	
+	workers = (genpkey_batch_worker*)malloc(sizeof(genpkey_batch_worker) * threads);
+	for(int i = 0; i < threads; i++)
+	{
+		workers[i].batch = batch;
+		workers[i].ctr_drbg = &ctr_drbgs[i];
+	}
+	
+	for(started = 0; threads > 1 && started < threads; started++)
+	{
+		if(pthread_create(&workers[started].thread, NULL, genpkey_batch_worker_run, &workers[started]) != 0)
+		{
+			break;
+		}
+	}
+	if(started == 0)
+	{
+		genpkey_batch_worker_run(&workers[0]);
+	}
+	for(int i = 0; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+	if(batch->progress)
+	{
+		mbedtls_fprintf(stderr, "\n");
+	}
+	
+	free(workers);
+	pthread_mutex_destroy(&batch->lock);
+	
+	return batch->ret;
+}
+
 int genpkey_main(int argc, char** argv, int argi)
 {
 	int ret = 1;
@@ -325,6 +674,8 @@ int genpkey_main(int argc, char** argv, int argi)
 	int i;
 	char *p, *q;
     mbedtls_entropy_context entropy;
+    mbedtlsclu_entropy_source entropy_source;
+    mbedtlsclu_seed_file seed_file;
     mbedtls_ctr_drbg_context ctr_drbg;
     const char* pers = "genpkey";
 #if defined(MBEDTLS_ECP_C)
@@ -335,12 +686,35 @@ int genpkey_main(int argc, char** argv, int argi)
 	int output_format = DFL_FORMAT;
 	int algo = DFL_TYPE;
 	int rsa_keysize = DFL_RSA_KEYSIZE;
-	int ec_curve = 0;
+	int ec_curve = DFL_EC_CURVE;
 	int ec_curve_paramenc = DFL_EC_PARAMENC;
 	int use_dev_random = DFL_USE_DEV_RANDOM;
+	int progress = 0;
+	int timeout = 0;
+	char* checkpoint_file = NULL;
+	int threads = 0;
+	mbedtls_ctr_drbg_context* thread_ctr_drbgs = NULL;
+	int count = 0;
+	char* outdir = NULL;
+	int naming = NAMING_INDEX;
+	genpkey_batch batch;
+#if defined(MBEDTLS_ECP_C)
+	mbedtls_ecp_group grp;
+	mbedtls_mpi warm_d;
+	mbedtls_ecp_point warm_Q;
+#endif
+	genpkey_params params;
 	
+	genpkey_params_init(&params);
+#if defined(MBEDTLS_ECP_C)
+	mbedtls_ecp_group_init(&grp);
+	mbedtls_mpi_init(&warm_d);
+	mbedtls_ecp_point_init(&warm_Q);
+#endif
     mbedtls_pk_init(&key);
     mbedtls_ctr_drbg_init(&ctr_drbg);
+    mbedtlsclu_entropy_source_init(&entropy_source);
+    mbedtlsclu_seed_file_init(&seed_file);
     memset(buf, 0, sizeof(buf));
 	
 #if defined(MBEDTLS_USE_PSA_CRYPTO)
@@ -472,17 +846,105 @@ usage:
 		{
 			use_dev_random = 1;
 		}
+		else if(strcmp(p,"-randompool") == 0)
+		{
+			use_dev_random = 1;
+			entropy_source.random_pool = 1;
+		}
+		else if(strcmp(p,"-rand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.path = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-writerand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.write_path = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-progress") == 0)
+		{
+			progress = 1;
+		}
+		else if(strcmp(p,"-timeout") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of seconds. Advance i
+			i += 1;
+			timeout = atoi(argv[i]);
+			if(timeout < 1)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-checkpoint") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the filepath. Advance i
+			i += 1;
+			checkpoint_file = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-count") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of keys. Advance i
+			i += 1;
+			count = atoi(argv[i]);
+			if(count < 1)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-outdir") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the directory. Advance i
+			i += 1;
+			outdir = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-naming") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the naming scheme. Advance i
+			i += 1;
+			p = argv[i];
+			if(strcmp(p,"index") == 0)
+			{
+				naming = NAMING_INDEX;
+			}
+			else if(strcmp(p,"fingerprint") == 0)
+			{
+				naming = NAMING_FINGERPRINT;
+			}
+			else
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-threads") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of threads. Advance i
+			i += 1;
+			threads = atoi(argv[i]);
+			if(threads < 1 || threads > MAX_THREADS)
+			{
+				goto usage;
+			}
+		}
 		else
 		{
 			goto usage;
 		}
 	}
 	
-	if(outfile == NULL)
+	if((count == 0 && outfile == NULL) || (count > 0 && outdir == NULL))
+	{
+		goto usage;
+	}
+	if(count > 0 && (timeout > 0 || checkpoint_file != NULL))
 	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  ! -timeout and -checkpoint apply to a single RSA key, not -count\n");
 		goto usage;
 	}
 	
+	threads = mbedtlsclu_worker_threads(threads, mbedtlsclu_cpu_count());
+	
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"out: %s\n", outfile);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"outform: %s\n", (output_format == FORMAT_PEM ? "PEM" : "DER"));
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"text: %d\n", text);
@@ -500,6 +962,16 @@ usage:
 	}
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"ec_param_enc: %s\n", (ec_curve_paramenc == FORMAT_NAMED_CURVE ? "named curve" : "explicit"));
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"usedevrandom: %d\n", use_dev_random);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"randompool: %d\n", entropy_source.random_pool);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"rand: %s\n", seed_file.path);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"writerand: %s\n", seed_file.write_path);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"progress: %d\n", progress);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"timeout: %d\n", timeout);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"checkpoint: %s\n", checkpoint_file);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"threads: %d\n", threads);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"count: %d\n", count);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"outdir: %s\n", outdir);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"naming: %s\n", (naming == NAMING_INDEX ? "index" : "fingerprint"));
 	
 	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"\n  . Seeding the random number generator...");
 	fflush(stdout);
@@ -507,26 +979,98 @@ usage:
     mbedtls_entropy_init(&entropy);
 #if defined(MBEDTLS_FS_IO)
     if (use_dev_random) {
-        if ((ret = mbedtls_entropy_add_source(&entropy, dev_random_entropy_poll,
-                                              NULL, DEV_RANDOM_THRESHOLD,
-                                              MBEDTLS_ENTROPY_SOURCE_STRONG)) != 0) {
+        if ((ret = mbedtlsclu_entropy_add_source(&entropy, &entropy_source)) != 0) {
             mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_entropy_add_source returned -0x%04x\n",
                            (unsigned int) -ret);
             goto exit;
         }
 
-        mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"\n    Using /dev/random, so can take a long time! ");
+        mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"\n    Using /dev/random, may wait for the kernel pool ");
         fflush(stdout);
     }
 #endif /* MBEDTLS_FS_IO */
 
-	if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    if ((ret = mbedtlsclu_seed_file_load(&seed_file, &entropy)) != 0) {
+        mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtlsclu_seed_file_load returned -0x%04x\n",
+                       (unsigned int) -ret);
+        goto exit;
+    }
+
+	if ((ret = mbedtlsclu_ctr_drbg_seed(&ctr_drbg, &entropy,
                                      (const unsigned char *) pers,
                                      strlen(pers))) != 0) {
         mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_ctr_drbg_seed returned -0x%04x\n",
                        (unsigned int) -ret);
         goto exit;
     }
+
+    if ((ret = mbedtlsclu_seed_file_update(&seed_file, &ctr_drbg)) != 0) {
+        mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"\n  ! Could not write seed file, mbedtlsclu_seed_file_update returned -0x%04x\n",
+                       (unsigned int) -ret);
+    }
+	
+	if(count > 0)
+	{
+		if(threads > count)
+		{
+			threads = count;
+		}
+		
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Seeding %d worker random number generators...", threads);
+		thread_ctr_drbgs = (mbedtls_ctr_drbg_context*)malloc(sizeof(mbedtls_ctr_drbg_context) * threads);
+		for (i = 0; i < threads; i++) {
+			mbedtls_ctr_drbg_init(&thread_ctr_drbgs[i]);
+		}
+		if ((ret = mbedtlsclu_seed_ctr_drbgs(thread_ctr_drbgs, threads, &entropy, pers)) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_ctr_drbg_seed returned -0x%04x\n",
+						   (unsigned int) -ret);
+			goto exit;
+		}
+		
+		if (mkdir_p(outdir, 0700) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! Could not create %s\n", outdir);
+			goto exit;
+		}
+		
+		genpkey_params_init(&batch.params);
+		batch.count = count;
+		batch.params.algo = algo;
+		batch.params.rsa_keysize = rsa_keysize;
+		batch.params.ec_curve = ec_curve;
+		batch.format = output_format;
+		batch.naming = naming;
+		batch.outdir = outdir;
+		batch.progress = progress;
+		
+#if defined(MBEDTLS_ECP_C)
+		if (algo == MBEDTLS_PK_ECKEY) {
+			/*
+			 * Load the curve once and generate a throwaway key with it, which builds the
+			 * comb table for the generator inside grp. After that the workers only read grp
+			 */
+			mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Precomputing the curve tables...");
+			if ((ret = mbedtls_ecp_group_load(&grp, (mbedtls_ecp_group_id) ec_curve)) != 0 ||
+				(ret = mbedtls_ecp_gen_keypair(&grp, &warm_d, &warm_Q, mbedtls_ctr_drbg_random, &ctr_drbg)) != 0) {
+				mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_ecp_gen_keypair returned -0x%04x",
+							   (unsigned int) -ret);
+				goto exit;
+			}
+			batch.params.grp = &grp;
+		}
+#endif /* MBEDTLS_ECP_C */
+		
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n  . Generating %d keys in %s with %d threads...\n", count, outdir, threads);
+		fflush(stdout);
+		if ((ret = genpkey_batch_run(&batch, threads, thread_ctr_drbgs)) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  ! Batch generation failed, genpkey returned -0x%04x\n",
+						   (unsigned int) -ret);
+			goto exit;
+		}
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . %d keys written\n", count);
+		
+		exit_code = MBEDTLS_EXIT_SUCCESS;
+		goto exit;
+	}
 	
 	/*
      * 1.1. Generate the key
@@ -534,37 +1078,39 @@ usage:
     mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"\n  . Generating the private key ...");
     fflush(stdout);
 
-    if ((ret = mbedtls_pk_setup(&key,
-                                mbedtls_pk_info_from_type((mbedtls_pk_type_t) algo))) != 0) {
-        mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_pk_setup returned -0x%04x", (unsigned int) -ret);
-        goto exit;
-    }
-	
-#if defined(MBEDTLS_RSA_C) && defined(MBEDTLS_GENPRIME)
+    params.algo = algo;
+    params.rsa_keysize = rsa_keysize;
+    params.ec_curve = ec_curve;
+    params.progress = progress;
+    params.timeout = timeout;
+    params.checkpoint_file = checkpoint_file;
+
     if (algo == MBEDTLS_PK_RSA) {
-        ret = mbedtls_rsa_gen_key(mbedtls_pk_rsa(key), mbedtls_ctr_drbg_random, &ctr_drbg,
-                                  rsa_keysize, 65537);
-        if (ret != 0) {
-            mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_rsa_gen_key returned -0x%04x",
-                           (unsigned int) -ret);
-            goto exit;
+        /*
+         * P and Q are searched for concurrently, each lane with its own DRBG.
+         * The lanes reseed from the shared entropy context during long searches,
+         * which mbedtlsclu_seed_ctr_drbgs makes safe by locking around it
+         */
+        thread_ctr_drbgs = (mbedtls_ctr_drbg_context*)malloc(sizeof(mbedtls_ctr_drbg_context) * threads);
+        for (i = 0; i < threads; i++) {
+            mbedtls_ctr_drbg_init(&thread_ctr_drbgs[i]);
         }
-    } else
-#endif /* MBEDTLS_RSA_C */
-#if defined(MBEDTLS_ECP_C)
-    if (algo == MBEDTLS_PK_ECKEY) {
-        ret = mbedtls_ecp_gen_key((mbedtls_ecp_group_id) ec_curve,
-                                  mbedtls_pk_ec(key),
-                                  mbedtls_ctr_drbg_random, &ctr_drbg);
-        if (ret != 0) {
-            mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_ecp_gen_key returned -0x%04x",
+        if ((ret = mbedtlsclu_seed_ctr_drbgs(thread_ctr_drbgs, threads, &entropy, pers)) != 0) {
+            mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! mbedtls_ctr_drbg_seed returned -0x%04x\n",
                            (unsigned int) -ret);
             goto exit;
         }
-    } else
-#endif /* MBEDTLS_ECP_C */
-    {
-        mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  key type not supported\n");
+        params.threads = threads;
+        ret = genpkey_gen_key(&key, &params, thread_ctr_drbgs);
+    } else {
+        ret = genpkey_gen_key(&key, &params, &ctr_drbg);
+    }
+    if (ret == GENPRIME_ERR_TIMEOUT) {
+        // Already reported, with how to resume
+        goto exit;
+    } else if (ret != 0) {
+        mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  genpkey_gen_key returned -0x%04x",
+                       (unsigned int) -ret);
         goto exit;
     }
 	
@@ -624,7 +1170,7 @@ usage:
      */
     mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Writing key to file...");
 
-    if ((ret = write_private_key(&key, text, output_format, outfile)) != 0) {
+    if ((ret = genpkey_write_key(&key, text, output_format, outfile)) != 0) {
         mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n");
         goto exit;
     }
@@ -635,9 +1181,24 @@ usage:
 
 exit:
 
+#if defined(MBEDTLS_ECP_C)
+    mbedtls_ecp_group_free(&grp);
+    mbedtls_mpi_free(&warm_d);
+    mbedtls_ecp_point_free(&warm_Q);
+#endif
     mbedtls_pk_free(&key);
+    mbedtlsclu_seed_file_finish(&seed_file, &ctr_drbg);
+    mbedtlsclu_seed_file_free(&seed_file);
     mbedtls_ctr_drbg_free(&ctr_drbg);
+    if (thread_ctr_drbgs != NULL) {
+        for (i = 0; i < threads; i++) {
+            mbedtls_ctr_drbg_free(&thread_ctr_drbgs[i]);
+        }
+        free(thread_ctr_drbgs);
+    }
     mbedtls_entropy_free(&entropy);
+    mbedtlsclu_entropy_report(&entropy_source);
+    mbedtlsclu_entropy_source_free(&entropy_source);
 #if defined(MBEDTLS_USE_PSA_CRYPTO)
     mbedtls_psa_crypto_free();
 #endif /* MBEDTLS_USE_PSA_CRYPTO */
@@ -17,13 +17,60 @@
  */
 
 #include "mbedtlsclu_common.h"
+#include "genprime.h"
 
+#include "mbedtls/asn1.h"
 #include "mbedtls/error.h"
+#include "mbedtls/oid.h"
+#include "mbedtls/pem.h"
 #include "mbedtls/pk.h"
 #include "mbedtls/ecdsa.h"
 #include "mbedtls/rsa.h"
+#include "mbedtls/sha256.h"
+
+#include <pthread.h>
+
+/* What to generate, see genpkey_params_init for the defaults */
+typedef struct genpkey_params {
+	int algo;						/* MBEDTLS_PK_RSA or MBEDTLS_PK_ECKEY */
+	int rsa_keysize;
+	int ec_curve;					/* mbedtls_ecp_group_id */
+	mbedtls_ecp_group* grp;			/* Optional loaded group for ec_curve, shared read-only once its comb table is built */
+	
+	/* RSA prime search */
+	int threads;					/* Lanes, one DRBG each */
+	int progress;
+	int timeout;
+	const char* checkpoint_file;
+}
+genpkey_params;
 
 int genpkey_main(int argc, char** argv, int argi);
 
-int dev_random_entropy_poll(void *data, unsigned char *output,
-                            size_t len, size_t *olen);
+void genpkey_params_init(genpkey_params* params);
+
+/*
+ * Generates a key into key, which must be initialised but not set up.
+ * ctr_drbgs must hold params->threads seeded contexts for RSA, EC only uses the first.
+ * A single caller owned DRBG is fine with the default of one thread
+ */
+int genpkey_gen_key(mbedtls_pk_context* key, const genpkey_params* params, mbedtls_ctr_drbg_context* ctr_drbgs);
+
+/*
+ * Reads the curve out of an EC parameter file for ec:<file>: PEM or DER ECParameters naming a
+ * curve (as written by openssl ecparam), or a certificate with an EC key
+ */
+int genpkey_read_ec_paramfile(const char* path, int* ec_curve);
+
+/*
+ * Parses a -newkey style spec into params: [rsa:]bits, rsa, ec[:curve or paramfile] or param:paramfile.
+ * A bare rsa uses default_bits when non zero. The overrides (from -pkeyopt) win over the spec when
+ * non zero. spec is split in place. Returns 0, -1 if the spec is malformed or an error from reading
+ * the EC parameter file
+ */
+int genpkey_parse_spec(char* spec, genpkey_params* params, int default_bits,
+						int rsa_keysize_override, int ec_curve_override);
+
+/* Writes key to output_file as PEM or DER (FORMAT_*), printing it first if textout */
+int genpkey_write_key(mbedtls_pk_context* key, int textout, int format, const char* output_file);
+
@@ -0,0 +1,968 @@
+/* genprime -	Incremental prime search with progress reporting, a time budget
+ *				and resumable checkpoints, used by dhparam and genpkey
+ *
+ *			Safe prime and RSA prime searches follow the same approach as
+ *			mbedtls_mpi_gen_prime: a random odd starting point is stepped
+ *			until a candidate passes trial division and Miller-Rabin. Doing
+ *			the stepping here means we can count what happens, stop when
+ *			told to, and pick up where we left off.
+ *
+ * Copyright © 2024 by Michael Gray <support@lantisproject.com>
+ *
+ * This file is free software: you may copy, redistribute and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "genprime.h"
+
+#define CHECKPOINT_HEADER	"# mbedtls-clu prime search checkpoint"
+
+typedef struct genprime_worker {
+	genprime_job* job;
+	int idx;
+	int lane;
+	int lanes;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+	pthread_t thread;
+}
+genprime_worker;
+
+static time_t genprime_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* Seconds since genprime_init, for this run only */
+static double genprime_elapsed(genprime_job* job)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - job->start.tv_sec) + (now.tv_nsec - job->start.tv_nsec) / 1e9;
+}
+
+/*
+ * Miller-Rabin rounds for an error probability below 2^-100,
+ * as used by mbedtls_mpi_gen_prime with MBEDTLS_MPI_GEN_PRIME_FLAG_LOW_ERR
+ */
+static int genprime_mr_rounds(size_t nbits)
+{
+	return ((nbits >= 1450) ?  4 : (nbits >= 1150) ?  5 :
+			(nbits >= 1000) ?  6 : (nbits >=  850) ?  7 :
+			(nbits >=  750) ?  8 : (nbits >=  500) ? 13 :
+			(nbits >=  250) ? 28 : (nbits >=  150) ? 40 : 51);
+}
+
+void genprime_init(genprime_job* job, int type)
+{
+	unsigned char* composite;
+
+	memset(job, 0, sizeof(genprime_job));
+	job->type = type;
+	for(int i = 0; i < GENPRIME_MAX_SEARCHES; i++)
+	{
+		mbedtls_mpi_init(&job->searches[i].base);
+	}
+	mbedtls_mpi_init(&job->E);
+	pthread_mutex_init(&job->lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	job->last_report = job->start.tv_sec;
+	job->last_checkpoint = job->start.tv_sec;
+
+	// Sieve of Eratosthenes for the odd primes used in trial division
+	composite = (unsigned char*)malloc(GENPRIME_SIEVE_LIMIT);
+	memset(composite, 0, GENPRIME_SIEVE_LIMIT);
+	job->sieve_primes = (unsigned int*)malloc(sizeof(unsigned int) * GENPRIME_SIEVE_LIMIT / 2);
+	job->sieve_size = 0;
+	for(unsigned int p = 3; p < GENPRIME_SIEVE_LIMIT; p += 2)
+	{
+		if(!composite[p])
+		{
+			job->sieve_primes[job->sieve_size++] = p;
+			for(unsigned int m = p * p; m < GENPRIME_SIEVE_LIMIT; m += 2 * p)
+			{
+				composite[m] = 1;
+			}
+		}
+	}
+	free(composite);
+}
+
+void genprime_free(genprime_job* job)
+{
+	for(int i = 0; i < GENPRIME_MAX_SEARCHES; i++)
+	{
+		mbedtls_mpi_free(&job->searches[i].base);
+		free(job->searches[i].residues);
+		job->searches[i].residues = NULL;
+	}
+	mbedtls_mpi_free(&job->E);
+	pthread_mutex_destroy(&job->lock);
+	free(job->sieve_primes);
+	job->sieve_primes = NULL;
+}
+
+int genprime_add_search(genprime_job* job, size_t nbits)
+{
+	if(job->num_searches >= GENPRIME_MAX_SEARCHES || nbits < GENPRIME_MIN_BITS || nbits > MBEDTLS_MPI_MAX_BITS)
+	{
+		return MBEDTLS_ERR_MPI_BAD_INPUT_DATA;
+	}
+
+	job->searches[job->num_searches].nbits = nbits;
+	job->searches[job->num_searches].offset = 0;
+	job->searches[job->num_searches].state = GENPRIME_SEARCH_NEW;
+
+	return job->num_searches++;
+}
+
+static void genprime_report(genprime_job* job, int final)
+{
+	double elapsed;
+
+	if(!job->progress)
+	{
+		return;
+	}
+
+	// Counters carry over from a checkpoint, the rate is for this run only
+	elapsed = genprime_elapsed(job);
+	mbedtls_fprintf(stderr, "\r  . %lu candidates, %lu sieve rejects, %lu MR rounds (%.1f/s), %lds elapsed%s",
+					job->candidates, job->sieve_rejects, job->mr_rounds,
+					(elapsed > 0 ? (job->mr_rounds - job->resumed_mr_rounds) / elapsed : 0.0), (long)elapsed,
+					(final ? "\n" : ""));
+	fflush(stderr);
+	job->last_report = genprime_now();
+}
+
+/* The next offset not yet tested by every lane. Called with job->lock held, or with no lanes running */
+static unsigned long genprime_committed_offset(genprime_search* search)
+{
+	unsigned long offset = search->offset;
+
+	if(search->state == GENPRIME_SEARCH_RUNNING && search->lanes > 0)
+	{
+		offset = search->lane_offsets[0];
+		for(int i = 1; i < search->lanes; i++)
+		{
+			if(search->lane_offsets[i] < offset)
+			{
+				offset = search->lane_offsets[i];
+			}
+		}
+	}
+
+	return offset;
+}
+
+int genprime_write_checkpoint(genprime_job* job)
+{
+	int ret = 0;
+	int fd;
+	FILE* f;
+	char* tmpfile;
+	char s[MBEDTLS_MPI_RW_BUFFER_SIZE];
+	size_t n;
+
+	if(job->checkpoint_file == NULL)
+	{
+		return 0;
+	}
+
+	// Write beside the real file then rename, so a power cut never leaves a torn checkpoint.
+	// The search state is as sensitive as the key it produces, so keep it private.
+	tmpfile = dynamic_strcat(2, job->checkpoint_file, ".tmp");
+	if((fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 || (f = fdopen(fd, "w")) == NULL)
+	{
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+		free(tmpfile);
+		return GENPRIME_ERR_CHECKPOINT_IO;
+	}
+
+	fprintf(f, "%s\n", CHECKPOINT_HEADER);
+	fprintf(f, "type=%s\n", (job->type == GENPRIME_TYPE_SAFE ? "safe" : "rsa"));
+	fprintf(f, "searches=%d\n", job->num_searches);
+	fprintf(f, "candidates=%lu\n", job->candidates);
+	fprintf(f, "sieve_rejects=%lu\n", job->sieve_rejects);
+	fprintf(f, "mr_rounds=%lu\n", job->mr_rounds);
+	for(int i = 0; i < job->num_searches; i++)
+	{
+		genprime_search* search = &job->searches[i];
+		fprintf(f, "bits.%d=%zu\n", i, search->nbits);
+		if(search->state == GENPRIME_SEARCH_NEW)
+		{
+			continue;
+		}
+		if((ret = mbedtls_mpi_write_string(&search->base, 16, s, sizeof(s), &n)) != 0)
+		{
+			break;
+		}
+		fprintf(f, "state.%d=%s\n", i, (search->state == GENPRIME_SEARCH_FOUND ? "found" : "running"));
+		fprintf(f, "base.%d=%s\n", i, s);
+		fprintf(f, "offset.%d=%lu\n", i, genprime_committed_offset(search));
+	}
+	mbedtls_platform_zeroize(s, sizeof(s));
+
+	if(fflush(f) != 0 || fsync(fileno(f)) != 0)
+	{
+		ret = GENPRIME_ERR_CHECKPOINT_IO;
+	}
+	if(fclose(f) != 0 && ret == 0)
+	{
+		ret = GENPRIME_ERR_CHECKPOINT_IO;
+	}
+	if(ret == 0 && rename(tmpfile, job->checkpoint_file) != 0)
+	{
+		ret = GENPRIME_ERR_CHECKPOINT_IO;
+	}
+	if(ret != 0)
+	{
+		unlink(tmpfile);
+	}
+	free(tmpfile);
+
+	job->last_checkpoint = genprime_now();
+
+	return ret;
+}
+
+/* Checkpoint numbers are plain decimal, anything else (sign, spaces, trailing junk, overflow) is invalid */
+static int genprime_parse_ulong(const char* value, unsigned long* out)
+{
+	char* end;
+
+	if(value[0] < '0' || value[0] > '9')
+	{
+		return -1;
+	}
+	errno = 0;
+	*out = strtoul(value, &end, 10);
+	if(errno != 0 || *end != '\0')
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+int genprime_load_checkpoint(genprime_job* job, int* resumed)
+{
+	int ret = 0;
+	char** lines;
+	unsigned long num_lines = 0;
+	char name[32];
+	int idx, end;
+	unsigned long n;
+
+	*resumed = 0;
+
+	if(job->checkpoint_file == NULL || !path_exists(job->checkpoint_file))
+	{
+		return 0;
+	}
+
+	if((lines = get_file_lines((char*)job->checkpoint_file, &num_lines)) == NULL)
+	{
+		return GENPRIME_ERR_CHECKPOINT_IO;
+	}
+
+	if(num_lines < 1 || strcmp(lines[0], CHECKPOINT_HEADER) != 0)
+	{
+		ret = GENPRIME_ERR_CHECKPOINT_INVALID;
+		goto exit;
+	}
+
+	for(unsigned long l = 1; l < num_lines && ret == 0; l++)
+	{
+		char* key = lines[l];
+		char* value = strchr(key, '=');
+		if(key[0] == '\0' || key[0] == '#')
+		{
+			continue;
+		}
+		if(value == NULL)
+		{
+			ret = GENPRIME_ERR_CHECKPOINT_INVALID;
+			break;
+		}
+		*value++ = '\0';
+
+		if(strcmp(key, "type") == 0)
+		{
+			if(strcmp(value, (job->type == GENPRIME_TYPE_SAFE ? "safe" : "rsa")) != 0)
+			{
+				ret = GENPRIME_ERR_CHECKPOINT_MISMATCH;
+			}
+		}
+		else if(strcmp(key, "searches") == 0)
+		{
+			if(genprime_parse_ulong(value, &n) != 0)
+			{
+				ret = GENPRIME_ERR_CHECKPOINT_INVALID;
+			}
+			else if(n != (unsigned long)job->num_searches)
+			{
+				ret = GENPRIME_ERR_CHECKPOINT_MISMATCH;
+			}
+		}
+		else if(strcmp(key, "candidates") == 0)
+		{
+			ret = (genprime_parse_ulong(value, &job->candidates) != 0 ? GENPRIME_ERR_CHECKPOINT_INVALID : 0);
+		}
+		else if(strcmp(key, "sieve_rejects") == 0)
+		{
+			ret = (genprime_parse_ulong(value, &job->sieve_rejects) != 0 ? GENPRIME_ERR_CHECKPOINT_INVALID : 0);
+		}
+		else if(strcmp(key, "mr_rounds") == 0)
+		{
+			ret = (genprime_parse_ulong(value, &job->mr_rounds) != 0 ? GENPRIME_ERR_CHECKPOINT_INVALID : 0);
+			job->resumed_mr_rounds = job->mr_rounds;
+		}
+		else if(sscanf(key, "%31[a-z].%d%n", name, &idx, &end) == 2 && key[end] == '\0')
+		{
+			if(idx < 0 || idx >= job->num_searches)
+			{
+				ret = GENPRIME_ERR_CHECKPOINT_MISMATCH;
+			}
+			else if(strcmp(name, "bits") == 0)
+			{
+				if(genprime_parse_ulong(value, &n) != 0)
+				{
+					ret = GENPRIME_ERR_CHECKPOINT_INVALID;
+				}
+				else if((size_t)n != job->searches[idx].nbits)
+				{
+					ret = GENPRIME_ERR_CHECKPOINT_MISMATCH;
+				}
+			}
+			else if(strcmp(name, "state") == 0)
+			{
+				if(strcmp(value, "found") == 0)
+				{
+					job->searches[idx].state = GENPRIME_SEARCH_FOUND;
+					job->searches[idx].unverified = 1;
+				}
+				else if(strcmp(value, "running") == 0)
+				{
+					job->searches[idx].state = GENPRIME_SEARCH_RUNNING;
+					job->searches[idx].unverified = 0;
+				}
+				else
+				{
+					ret = GENPRIME_ERR_CHECKPOINT_INVALID;
+				}
+			}
+			else if(strcmp(name, "base") == 0)
+			{
+				if(mbedtls_mpi_read_string(&job->searches[idx].base, 16, value) != 0 ||
+					mbedtls_mpi_bitlen(&job->searches[idx].base) != job->searches[idx].nbits)
+				{
+					ret = GENPRIME_ERR_CHECKPOINT_INVALID;
+				}
+			}
+			else if(strcmp(name, "offset") == 0)
+			{
+				ret = (genprime_parse_ulong(value, &job->searches[idx].offset) != 0 ? GENPRIME_ERR_CHECKPOINT_INVALID : 0);
+			}
+			else
+			{
+				ret = GENPRIME_ERR_CHECKPOINT_INVALID;
+			}
+		}
+		else
+		{
+			ret = GENPRIME_ERR_CHECKPOINT_INVALID;
+		}
+	}
+
+	for(int i = 0; i < job->num_searches && ret == 0; i++)
+	{
+		if(job->searches[i].state != GENPRIME_SEARCH_NEW &&
+			mbedtls_mpi_bitlen(&job->searches[i].base) != job->searches[i].nbits)
+		{
+			ret = GENPRIME_ERR_CHECKPOINT_INVALID;
+		}
+	}
+
+	if(ret == 0)
+	{
+		*resumed = 1;
+	}
+	else
+	{
+		// Never run with half a checkpoint applied
+		for(int i = 0; i < job->num_searches; i++)
+		{
+			job->searches[i].state = GENPRIME_SEARCH_NEW;
+			job->searches[i].offset = 0;
+			job->searches[i].unverified = 0;
+		}
+		job->candidates = job->sieve_rejects = job->mr_rounds = job->resumed_mr_rounds = 0;
+	}
+
+exit:
+	for(unsigned long l = 0; l < num_lines; l++)
+	{
+		mbedtls_platform_zeroize(lines[l], strlen(lines[l]));
+	}
+	free_null_terminated_string_array(lines);
+
+	return ret;
+}
+
+/* Random odd starting point of exactly nbits with the top two bits set */
+static int genprime_new_base(genprime_job* job, genprime_search* search,
+								int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+	int ret;
+	size_t nbytes = (search->nbits + 7) / 8;
+
+	if((ret = mbedtls_mpi_fill_random(&search->base, nbytes, f_rng, p_rng)) != 0 ||
+		(ret = mbedtls_mpi_shift_r(&search->base, nbytes * 8 - search->nbits)) != 0 ||
+		(ret = mbedtls_mpi_set_bit(&search->base, search->nbits - 1, 1)) != 0 ||
+		(ret = mbedtls_mpi_set_bit(&search->base, search->nbits - 2, 1)) != 0 ||
+		(ret = mbedtls_mpi_set_bit(&search->base, 0, 1)) != 0)
+	{
+		return ret;
+	}
+
+	if(job->type == GENPRIME_TYPE_SAFE)
+	{
+		// P = 3 mod 4 so that Q = (P-1)/2 is odd
+		if((ret = mbedtls_mpi_set_bit(&search->base, 1, 1)) != 0)
+		{
+			return ret;
+		}
+	}
+
+	search->offset = 0;
+	search->state = GENPRIME_SEARCH_RUNNING;
+
+	return 0;
+}
+
+/*
+ * One lane of a search. With n lanes, lane k tests base + step * (k + n * t) for t = 0, 1, ...
+ * so every lane shares the same starting point and the checkpointed offset stays meaningful.
+ * Shared state is only touched under job->lock, once per candidate.
+ */
+static void* genprime_lane(void* arg)
+{
+	genprime_worker* worker = (genprime_worker*)arg;
+	genprime_job* job = worker->job;
+	genprime_search* search = &job->searches[worker->idx];
+	int (*f_rng)(void *, unsigned char *, size_t) = mbedtls_ctr_drbg_random;
+	void* p_rng = worker->ctr_drbg;
+	mbedtls_mpi X, Q, T;
+	unsigned long step = (job->type == GENPRIME_TYPE_SAFE ? 4 : 2);
+	unsigned long offset = search->offset + step * worker->lane;
+	unsigned long sieve_rejects = 0, mr_rounds = 0;
+	int rounds = genprime_mr_rounds(search->nbits);
+	int rejected, stop;
+	int ret = 0;
+	time_t now;
+
+	mbedtls_mpi_init(&X); mbedtls_mpi_init(&Q); mbedtls_mpi_init(&T);
+
+	for( ; ; offset += step * worker->lanes)
+	{
+		now = genprime_now();
+		pthread_mutex_lock(&job->lock);
+		job->candidates += 1;
+		job->sieve_rejects += sieve_rejects;
+		job->mr_rounds += mr_rounds;
+		sieve_rejects = mr_rounds = 0;
+		search->lane_offsets[worker->lane] = offset;
+		stop = (job->ret != 0 || search->state != GENPRIME_SEARCH_RUNNING);
+		if(!stop && job->progress && now - job->last_report >= GENPRIME_PROGRESS_INTERVAL)
+		{
+			genprime_report(job, 0);
+		}
+		if(!stop && job->checkpoint_file != NULL && now - job->last_checkpoint >= GENPRIME_CHECKPOINT_INTERVAL)
+		{
+			stop = ((job->ret = genprime_write_checkpoint(job)) != 0);
+		}
+		if(!stop && job->timeout > 0 && genprime_elapsed(job) >= job->timeout)
+		{
+			job->ret = GENPRIME_ERR_TIMEOUT;
+			stop = 1;
+		}
+		pthread_mutex_unlock(&job->lock);
+		if(stop)
+		{
+			break;
+		}
+
+		// Trial division of P (and Q = (P-1)/2, i.e. P = 1 mod p) by the small primes
+		rejected = 0;
+		for(int i = 0; i < job->sieve_size && !rejected; i++)
+		{
+			mbedtls_mpi_uint r = (search->residues[i] + offset % job->sieve_primes[i]) % job->sieve_primes[i];
+			rejected = (r == 0 || (job->type == GENPRIME_TYPE_SAFE && r == 1));
+		}
+		if(rejected)
+		{
+			sieve_rejects += 1;
+			continue;
+		}
+
+		if((ret = mbedtls_mpi_copy(&X, &search->base)) != 0 ||
+			(ret = mbedtls_mpi_add_int(&X, &X, offset)) != 0)
+		{
+			break;
+		}
+		if(mbedtls_mpi_bitlen(&X) != search->nbits)
+		{
+			// Stepped off the top, the search has to start again somewhere else
+			pthread_mutex_lock(&job->lock);
+			if(search->state == GENPRIME_SEARCH_RUNNING)
+			{
+				search->state = GENPRIME_SEARCH_NEW;
+			}
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+
+		// A single round weeds out nearly every composite before paying for the full count
+		if(job->type == GENPRIME_TYPE_SAFE)
+		{
+			if((ret = mbedtls_mpi_copy(&Q, &X)) != 0 ||
+				(ret = mbedtls_mpi_shift_r(&Q, 1)) != 0)
+			{
+				break;
+			}
+			mr_rounds += 1;
+			if((ret = mbedtls_mpi_is_prime_ext(&Q, 1, f_rng, p_rng)) != 0)
+			{
+				goto composite;
+			}
+			mr_rounds += 1;
+			if((ret = mbedtls_mpi_is_prime_ext(&X, 1, f_rng, p_rng)) != 0)
+			{
+				goto composite;
+			}
+			mr_rounds += rounds;
+			if((ret = mbedtls_mpi_is_prime_ext(&Q, rounds, f_rng, p_rng)) != 0)
+			{
+				goto composite;
+			}
+		}
+		else
+		{
+			mr_rounds += 1;
+			if((ret = mbedtls_mpi_is_prime_ext(&X, 1, f_rng, p_rng)) != 0)
+			{
+				goto composite;
+			}
+		}
+		mr_rounds += rounds;
+		if((ret = mbedtls_mpi_is_prime_ext(&X, rounds, f_rng, p_rng)) != 0)
+		{
+			goto composite;
+		}
+
+		if(job->type == GENPRIME_TYPE_RSA && mbedtls_mpi_cmp_int(&job->E, 0) != 0)
+		{
+			// E must be invertible mod P-1
+			if((ret = mbedtls_mpi_sub_int(&T, &X, 1)) != 0 ||
+				(ret = mbedtls_mpi_gcd(&T, &T, &job->E)) != 0)
+			{
+				break;
+			}
+			if(mbedtls_mpi_cmp_int(&T, 1) != 0)
+			{
+				continue;
+			}
+		}
+
+		// First lane to find a prime wins, the others stop at their next candidate
+		pthread_mutex_lock(&job->lock);
+		job->sieve_rejects += sieve_rejects;
+		job->mr_rounds += mr_rounds;
+		sieve_rejects = mr_rounds = 0;
+		if(search->state == GENPRIME_SEARCH_RUNNING)
+		{
+			search->state = GENPRIME_SEARCH_FOUND;
+			search->offset = offset;
+			if(job->checkpoint_file != NULL && job->ret == 0)
+			{
+				job->ret = genprime_write_checkpoint(job);
+			}
+		}
+		pthread_mutex_unlock(&job->lock);
+		break;
+
+composite:
+		if(ret != MBEDTLS_ERR_MPI_NOT_ACCEPTABLE)
+		{
+			break;
+		}
+		ret = 0;
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->sieve_rejects += sieve_rejects;
+	job->mr_rounds += mr_rounds;
+	if(ret != 0 && job->ret == 0)
+	{
+		job->ret = ret;
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	mbedtls_mpi_free(&X); mbedtls_mpi_free(&Q); mbedtls_mpi_free(&T);
+
+	return NULL;
+}
+
+/* Runs lanes over the given searches, threads split as evenly as possible between them */
+static int genprime_run_searches(genprime_job* job, int* idxs, int num_idxs, int threads,
+									mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	int ret = 0;
+	int started = 0;
+	int lane_start = 0;
+	genprime_worker* workers;
+
+	for(int s = 0; s < num_idxs; s++)
+	{
+		genprime_search* search = &job->searches[idxs[s]];
+		if(search->state == GENPRIME_SEARCH_NEW)
+		{
+			if((ret = genprime_new_base(job, search, mbedtls_ctr_drbg_random, &ctr_drbgs[0])) != 0)
+			{
+				return ret;
+			}
+		}
+		for(int i = 0; i < job->sieve_size; i++)
+		{
+			if((ret = mbedtls_mpi_mod_int(&search->residues[i], &search->base, job->sieve_primes[i])) != 0)
+			{
+				return ret;
+			}
+		}
+		search->lanes = threads / num_idxs + (s < threads % num_idxs ? 1 : 0);
+		for(int l = 0; l < search->lanes; l++)
+		{
+			search->lane_offsets[l] = search->offset + (job->type == GENPRIME_TYPE_SAFE ? 4 : 2) * l;
+		}
+	}
+
+	workers = (genprime_worker*)malloc(sizeof(genprime_worker) * threads);
+	for(int s = 0; s < num_idxs; s++)
+	{
+		genprime_search* search = &job->searches[idxs[s]];
+		for(int l = 0; l < search->lanes; l++)
+		{
+			genprime_worker* worker = &workers[lane_start + l];
+			worker->job = job;
+			worker->idx = idxs[s];
+			worker->lane = l;
+			worker->lanes = search->lanes;
+			worker->ctr_drbg = &ctr_drbgs[lane_start + l];
+		}
+		lane_start += search->lanes;
+	}
+
+	if(threads == 1)
+	{
+		genprime_lane(&workers[0]);
+	}
+	else
+	{
+		for(started = 0; started < threads; started++)
+		{
+			if(pthread_create(&workers[started].thread, NULL, genprime_lane, &workers[started]) != 0)
+			{
+				pthread_mutex_lock(&job->lock);
+				job->ret = (job->ret == 0 ? MBEDTLS_ERR_ERROR_CORRUPTION_DETECTED : job->ret);
+				pthread_mutex_unlock(&job->lock);
+				break;
+			}
+		}
+		for(int i = 0; i < started; i++)
+		{
+			pthread_join(workers[i].thread, NULL);
+		}
+	}
+	free(workers);
+
+	// Fold lane progress back into the search so it can be checkpointed or resumed
+	for(int s = 0; s < num_idxs; s++)
+	{
+		genprime_search* search = &job->searches[idxs[s]];
+		search->offset = genprime_committed_offset(search);
+		search->lanes = 0;
+	}
+
+	return job->ret;
+}
+
+/*
+ * A checkpoint only says a search was found, so before base + offset is trusted it gets
+ * the same full checks as a fresh result: the size, Miller-Rabin on P (and on Q = (P-1)/2
+ * for safe primes) and, for RSA, gcd(P-1, E) = 1
+ */
+static int genprime_verify_found(genprime_job* job, genprime_search* search,
+									int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+	int ret;
+	int rounds = genprime_mr_rounds(search->nbits);
+	mbedtls_mpi X, T;
+
+	mbedtls_mpi_init(&X); mbedtls_mpi_init(&T);
+
+	if((ret = mbedtls_mpi_copy(&X, &search->base)) != 0 ||
+		(ret = mbedtls_mpi_add_int(&X, &X, search->offset)) != 0)
+	{
+		goto exit;
+	}
+	if(mbedtls_mpi_bitlen(&X) != search->nbits)
+	{
+		ret = MBEDTLS_ERR_MPI_NOT_ACCEPTABLE;
+		goto exit;
+	}
+	if((ret = mbedtls_mpi_is_prime_ext(&X, rounds, f_rng, p_rng)) != 0)
+	{
+		goto exit;
+	}
+	if(job->type == GENPRIME_TYPE_SAFE)
+	{
+		if((ret = mbedtls_mpi_shift_r(&X, 1)) != 0 ||
+			(ret = mbedtls_mpi_is_prime_ext(&X, rounds, f_rng, p_rng)) != 0)
+		{
+			goto exit;
+		}
+	}
+	else if(mbedtls_mpi_cmp_int(&job->E, 0) != 0)
+	{
+		if((ret = mbedtls_mpi_sub_int(&T, &X, 1)) != 0 ||
+			(ret = mbedtls_mpi_gcd(&T, &T, &job->E)) != 0)
+		{
+			goto exit;
+		}
+		ret = (mbedtls_mpi_cmp_int(&T, 1) == 0 ? 0 : MBEDTLS_ERR_MPI_NOT_ACCEPTABLE);
+	}
+
+exit:
+	mbedtls_mpi_free(&X); mbedtls_mpi_free(&T);
+
+	return (ret == MBEDTLS_ERR_MPI_NOT_ACCEPTABLE ? GENPRIME_ERR_CHECKPOINT_INVALID : ret);
+}
+
+int genprime_run(genprime_job* job, int threads, mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	int ret = 0;
+	int pending[GENPRIME_MAX_SEARCHES];
+	int num_pending;
+
+	if(threads < 1 || threads > GENPRIME_MAX_THREADS)
+	{
+		return MBEDTLS_ERR_MPI_BAD_INPUT_DATA;
+	}
+	for(int i = 0; i < job->num_searches; i++)
+	{
+		if(job->searches[i].nbits < GENPRIME_MIN_BITS || job->searches[i].nbits > MBEDTLS_MPI_MAX_BITS)
+		{
+			return MBEDTLS_ERR_MPI_BAD_INPUT_DATA;
+		}
+	}
+
+	for(int i = 0; i < job->num_searches; i++)
+	{
+		if(job->searches[i].residues == NULL)
+		{
+			job->searches[i].residues = (mbedtls_mpi_uint*)malloc(sizeof(mbedtls_mpi_uint) * job->sieve_size);
+		}
+		if(job->searches[i].unverified)
+		{
+			if((ret = genprime_verify_found(job, &job->searches[i], mbedtls_ctr_drbg_random, &ctr_drbgs[0])) != 0)
+			{
+				return ret;
+			}
+			job->searches[i].unverified = 0;
+		}
+	}
+
+	job->ret = 0;
+	while(ret == 0)
+	{
+		num_pending = 0;
+		for(int i = 0; i < job->num_searches; i++)
+		{
+			if(job->searches[i].state != GENPRIME_SEARCH_FOUND)
+			{
+				pending[num_pending++] = i;
+			}
+		}
+		if(num_pending == 0)
+		{
+			break;
+		}
+
+		if(threads < num_pending)
+		{
+			// Not enough threads to go round, one search at a time with everything we have
+			num_pending = 1;
+		}
+		ret = genprime_run_searches(job, pending, num_pending, threads, ctr_drbgs);
+	}
+
+	if(ret == GENPRIME_ERR_TIMEOUT)
+	{
+		genprime_write_checkpoint(job);
+	}
+
+	return ret;
+}
+
+int genprime_result(genprime_job* job, int idx, mbedtls_mpi* X)
+{
+	int ret;
+	genprime_search* search = &job->searches[idx];
+
+	if(search->state != GENPRIME_SEARCH_FOUND || search->unverified)
+	{
+		return MBEDTLS_ERR_MPI_BAD_INPUT_DATA;
+	}
+
+	if((ret = mbedtls_mpi_copy(X, &search->base)) != 0)
+	{
+		return ret;
+	}
+
+	return mbedtls_mpi_add_int(X, X, search->offset);
+}
+
+void genprime_done(genprime_job* job)
+{
+	genprime_report(job, 1);
+
+	if(job->checkpoint_file != NULL)
+	{
+		unlink(job->checkpoint_file);
+	}
+}
+
+void genprime_report_timeout(genprime_job* job)
+{
+	genprime_report(job, 1);
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  ! Timed out after %d seconds\n", job->timeout);
+	if(job->checkpoint_file != NULL)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  ! Search state saved, run again with -checkpoint %s to resume\n", job->checkpoint_file);
+	}
+}
+
+int genprime_rsa_gen_key(genprime_job* job, mbedtls_rsa_context* rsa, unsigned int nbits, int exponent,
+							int threads, mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	int ret = 0;
+	int resumed = 0;
+	mbedtls_mpi N, P, Q, D, H, G;
+
+	if(nbits < 128 || exponent < 3)
+	{
+		return MBEDTLS_ERR_RSA_BAD_INPUT_DATA;
+	}
+
+	mbedtls_mpi_init(&N); mbedtls_mpi_init(&P); mbedtls_mpi_init(&Q);
+	mbedtls_mpi_init(&D); mbedtls_mpi_init(&H); mbedtls_mpi_init(&G);
+
+	if((ret = mbedtls_mpi_lset(&job->E, exponent)) != 0)
+	{
+		goto exit;
+	}
+	if(job->num_searches == 0 &&
+		((ret = genprime_add_search(job, (nbits + 1) / 2)) < 0 ||
+		(ret = genprime_add_search(job, nbits / 2)) < 0))
+	{
+		goto exit;
+	}
+	if((ret = genprime_load_checkpoint(job, &resumed)) != 0)
+	{
+		goto exit;
+	}
+	if(resumed)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"\n  . Resuming from checkpoint %s...", job->checkpoint_file);
+	}
+
+	while(1)
+	{
+		// With two or more threads P and Q are searched for at the same time
+		if((ret = genprime_run(job, threads, ctr_drbgs)) != 0 ||
+			(ret = genprime_result(job, 0, &P)) != 0 ||
+			(ret = genprime_result(job, 1, &Q)) != 0)
+		{
+			goto exit;
+		}
+
+		/*
+		 * Same acceptance criteria as mbedtls_rsa_gen_key (FIPS 186-4 B.3.1):
+		 * |P - Q| > 2^(nbits/2 - 100) and D > 2^(nbits/2). If either fails, search for another Q.
+		 */
+		if((ret = mbedtls_mpi_sub_mpi(&H, &P, &Q)) != 0)
+		{
+			goto exit;
+		}
+		if(mbedtls_mpi_bitlen(&H) <= ((nbits >= 200) ? ((nbits >> 1) - 99) : 0))
+		{
+			job->searches[1].state = GENPRIME_SEARCH_NEW;
+			continue;
+		}
+
+		// D = E^-1 mod lcm(P-1, Q-1)
+		if((ret = mbedtls_mpi_sub_int(&P, &P, 1)) != 0 ||
+			(ret = mbedtls_mpi_sub_int(&Q, &Q, 1)) != 0 ||
+			(ret = mbedtls_mpi_mul_mpi(&H, &P, &Q)) != 0 ||
+			(ret = mbedtls_mpi_gcd(&G, &P, &Q)) != 0 ||
+			(ret = mbedtls_mpi_div_mpi(&H, NULL, &H, &G)) != 0 ||
+			(ret = mbedtls_mpi_inv_mod(&D, &job->E, &H)) != 0 ||
+			(ret = mbedtls_mpi_add_int(&P, &P, 1)) != 0 ||
+			(ret = mbedtls_mpi_add_int(&Q, &Q, 1)) != 0)
+		{
+			goto exit;
+		}
+		if(mbedtls_mpi_bitlen(&D) <= ((nbits + 1) / 2))
+		{
+			job->searches[1].state = GENPRIME_SEARCH_NEW;
+			continue;
+		}
+		break;
+	}
+
+	if((ret = mbedtls_mpi_mul_mpi(&N, &P, &Q)) != 0 ||
+		(ret = mbedtls_rsa_import(rsa, &N, &P, &Q, &D, &job->E)) != 0 ||
+		(ret = mbedtls_rsa_complete(rsa)) != 0)
+	{
+		goto exit;
+	}
+
+	if((ret = mbedtls_rsa_check_privkey(rsa)) != 0)
+	{
+		goto exit;
+	}
+
+	genprime_done(job);
+
+exit:
+	mbedtls_mpi_free(&N); mbedtls_mpi_free(&P); mbedtls_mpi_free(&Q);
+	mbedtls_mpi_free(&D); mbedtls_mpi_free(&H); mbedtls_mpi_free(&G);
+
+	return ret;
+}
@@ -0,0 +1,143 @@
+/* genprime -	Prime search header file
+ *
+ * Copyright © 2024 by Michael Gray <support@lantisproject.com>
+ *
+ * This file is free software: you may copy, redistribute and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GENPRIME_H
+#define GENPRIME_H
+
+#include "mbedtlsclu_common.h"
+
+#include "mbedtls/rsa.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#define GENPRIME_TYPE_RSA		0	/* Prime P with gcd(P-1, E) = 1 */
+#define GENPRIME_TYPE_SAFE		1	/* Safe prime P = 2Q + 1 */
+
+#define GENPRIME_SEARCH_NEW		0
+#define GENPRIME_SEARCH_RUNNING	1
+#define GENPRIME_SEARCH_FOUND	2
+
+#define GENPRIME_MAX_SEARCHES	2
+#define GENPRIME_MAX_THREADS	256
+
+/* Odd primes below this value are used to sieve candidates before Miller-Rabin */
+#define GENPRIME_SIEVE_LIMIT	16384
+
+/*
+ * Smallest prime a search can ask for. Smaller candidates could be sieve primes themselves,
+ * which the sieve always rejects, and the search would never finish
+ */
+#define GENPRIME_MIN_BITS		64
+
+/* Seconds between progress lines and between checkpoint writes */
+#define GENPRIME_PROGRESS_INTERVAL		1
+#define GENPRIME_CHECKPOINT_INTERVAL	10
+
+#define GENPRIME_ERR_TIMEOUT				-0x7F01	/* The time budget ran out */
+#define GENPRIME_ERR_CHECKPOINT_IO			-0x7F02	/* The checkpoint file could not be read or written */
+#define GENPRIME_ERR_CHECKPOINT_INVALID		-0x7F03	/* The checkpoint file is malformed */
+#define GENPRIME_ERR_CHECKPOINT_MISMATCH	-0x7F04	/* The checkpoint file is for a different request */
+
+/*
+ * One incremental search: candidates are base + offset, stepping through offset.
+ * Once a prime is found base + offset is that prime, so a checkpoint of
+ * (base, offset, state) is enough to either resume the search or recover the result.
+ * While running, the offsets are split between lanes (one per thread).
+ */
+typedef struct genprime_search {
+	size_t nbits;
+	mbedtls_mpi base;
+	unsigned long offset;
+	int state;
+	int unverified;					/* Found according to a checkpoint, not checked yet */
+
+	mbedtls_mpi_uint* residues;		/* base mod each sieve prime */
+	int lanes;
+	unsigned long lane_offsets[GENPRIME_MAX_THREADS];
+}
+genprime_search;
+
+typedef struct genprime_job {
+	int type;
+	int num_searches;
+	genprime_search searches[GENPRIME_MAX_SEARCHES];
+	mbedtls_mpi E;
+
+	/* Options */
+	int progress;					/* Print progress to stderr */
+	int timeout;					/* Seconds, 0 for none */
+	const char* checkpoint_file;	/* NULL for none */
+
+	/* Statistics */
+	unsigned long candidates;
+	unsigned long sieve_rejects;
+	unsigned long mr_rounds;
+	unsigned long resumed_mr_rounds;
+	struct timespec start;
+	time_t last_report;
+	time_t last_checkpoint;
+
+	unsigned int* sieve_primes;
+	int sieve_size;
+
+	/* Guards the statistics, search states and ret while lanes are running */
+	pthread_mutex_t lock;
+	int ret;
+}
+genprime_job;
+
+void genprime_init(genprime_job* job, int type);
+void genprime_free(genprime_job* job);
+
+/*
+ * Adds a search for an nbits prime, returns its index. Returns MBEDTLS_ERR_MPI_BAD_INPUT_DATA
+ * if nbits is not between GENPRIME_MIN_BITS and MBEDTLS_MPI_MAX_BITS or there is no room
+ */
+int genprime_add_search(genprime_job* job, size_t nbits);
+
+/*
+ * Loads job->checkpoint_file if it exists. *resumed is set to 1 if state was restored.
+ * Searches the file says are found are checked again by genprime_run before they are used
+ */
+int genprime_load_checkpoint(genprime_job* job, int* resumed);
+int genprime_write_checkpoint(genprime_job* job);
+
+/*
+ * Runs (or resumes) every search that has not found its prime yet, using threads lanes.
+ * ctr_drbgs must hold threads independently seeded contexts, one per lane. Long searches
+ * reseed them from their lanes at the same time, so seed them with mbedtlsclu_seed_ctr_drbgs
+ */
+int genprime_run(genprime_job* job, int threads, mbedtls_ctr_drbg_context* ctr_drbgs);
+
+/* Copies the prime found by search idx into X */
+int genprime_result(genprime_job* job, int idx, mbedtls_mpi* X);
+
+/* Prints the final progress line and removes the checkpoint file after success */
+void genprime_done(genprime_job* job);
+
+/* Prints the final progress line and a timeout message, including how to resume */
+void genprime_report_timeout(genprime_job* job);
+
+/* Generates an RSA key of nbits with public exponent using the searches of a GENPRIME_TYPE_RSA job */
+int genprime_rsa_gen_key(genprime_job* job, mbedtls_rsa_context* rsa, unsigned int nbits, int exponent,
+							int threads, mbedtls_ctr_drbg_context* ctr_drbgs);
+
+#endif
@@ -34,10 +34,14 @@
     "    ca						Mini Certificate Authority\n"									\
     "    dhparam				Generate Diffie-Hellman Parameters\n"							\
     "    genpkey				Generate Private Keys\n"										\
+    "    pki-init				Bootstrap an EasyRSA style PKI (CA, server, clients, DH)\n"	\
     "    req					Generate Certificates and Certificate Signing Requests\n"		\
+    "    speed					Benchmark key generation, signing, CRLs, the CA database and more\n"	\
+    "    workload				Fabricate a PKI at scale (index.txt, certificates, CSRs) for testing\n"	\
     "    x509					Certificate display\n"											\
 	"\n\n Utility options:\n"																	\
-	"    -help					See the help/usage summary for each utility\n"
+	"    -help					See the help/usage summary for each utility\n"			\
+	USAGE_TEST_SEED
 
 
 int main(int argc, char** argv)
@@ -52,8 +56,11 @@ int main(int argc, char** argv)
 	int launchCA = 0;
 	int launchDHParam = 0;
 	int launchGenPKey = 0;
+	int launchPKIInit = 0;
 	int launchRand = 0;
 	int launchReq = 0;
+	int launchSpeed = 0;
+	int launchWorkload = 0;
 	int launchX509 = 0;
 	
 	if(argc < 2)
@@ -75,6 +82,20 @@ usage:
 		{
 			mbedtls_printf("MbedTLS-CLU %s (Library: %s)\n",MBEDTLSCLU_VERSION,MBEDTLS_VERSION_STRING_FULL);
 		}
+#if defined(MBEDTLSCLU_TEST_SEED)
+		else if(strcmp(p,"-seed") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed in hex. Advance i
+			i++;
+			if(mbedtlsclu_set_test_seed(argv[i]) != 0)
+			{
+				mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"Invalid -seed, expected 1 to %d bytes of hex\n", MBEDTLSCLU_TEST_SEED_MAX);
+				goto exit;
+			}
+			mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"WARNING: -seed makes every key, prime and serial predictable. For benchmarks and fixtures only\n");
+			mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Test seed: %s\n", argv[i]);
+		}
+#endif /* MBEDTLSCLU_TEST_SEED */
 		else if(strcmp(p,"ca") == 0)
 		{
 			launchCA = 1;
@@ -90,6 +111,11 @@ usage:
 			launchGenPKey = 1;
 			break;
 		}
+		else if(strcmp(p,"pki-init") == 0)
+		{
+			launchPKIInit = 1;
+			break;
+		}
 		else if(strcmp(p,"rand") == 0)
 		{
 			launchRand = 1;
@@ -100,6 +126,16 @@ usage:
 			launchReq = 1;
 			break;
 		}
+		else if(strcmp(p,"speed") == 0)
+		{
+			launchSpeed = 1;
+			break;
+		}
+		else if(strcmp(p,"workload") == 0)
+		{
+			launchWorkload = 1;
+			break;
+		}
 		else if(strcmp(p,"x509") == 0)
 		{
 			launchX509 = 1;
@@ -126,6 +162,11 @@ usage:
 		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Calling genpkey...\n");
 		exit_code = genpkey_main(argc, argv, i+1);
 	}
+	else if(launchPKIInit)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Calling pki-init...\n");
+		exit_code = pki_init_main(argc, argv, i+1);
+	}
 	else if(launchRand)
 	{
 		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Calling rand...\n");
@@ -136,6 +177,16 @@ usage:
 		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Calling req...\n");
 		exit_code = req_main(argc, argv, i+1);
 	}
+	else if(launchSpeed)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Calling speed...\n");
+		exit_code = speed_main(argc, argv, i+1);
+	}
+	else if(launchWorkload)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Calling workload...\n");
+		exit_code = workload_main(argc, argv, i+1);
+	}
 	else if(launchX509)
 	{
 		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Calling x509...\n");
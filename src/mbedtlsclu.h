@@ -21,6 +21,9 @@
 #include "ca.h"
 #include "rand.h"
 #include "req.h"
+#include "speed.h"
 #include "dhparam.h"
 #include "genpkey.h"
+#include "pki_init.h"
+#include "workload.h"
 #include "x509.h"
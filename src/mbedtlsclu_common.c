@@ -20,6 +20,16 @@
 
 int log_level = MBEDTLSCLU_DFL_MSG_LEVEL;
 
+/* Guards the entropy context shared by the DRBGs of every thread */
+static pthread_mutex_t entropy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if !defined(GRND_NONBLOCK)
+#define GRND_NONBLOCK	0x0001
+#endif
+#if !defined(GRND_RANDOM)
+#define GRND_RANDOM		0x0002
+#endif
+
 int print_mpi_inthex_text(mbedtls_mpi* X, char* heading)
 {
 	int ret = 0;
@@ -96,6 +106,7 @@ int print_mpi_hex_text(mbedtls_mpi* X, char* heading)
 
 void initialise_conf_req_csr_parameters(conf_req_csr_parameters* X)
 {
+	X->default_bits = NULL;
 	X->default_keyfile = NULL;
 	X->default_md = NULL;
 	X->distinguished_name_tag = NULL;
@@ -165,430 +176,1032 @@ void initialise_conf_req_crt_parameters(conf_req_crt_parameters* X)
 	return;
 }
 
-int read_config_file(char* conffile, char*** contents, unsigned long* lines)
+void free_conf_req_csr_parameters(conf_req_csr_parameters* X)
 {
-	int ret = 0;
-	char** filecontents = NULL;
-	unsigned long lines_read = 0;
-	
-	filecontents = get_file_lines(conffile, &lines_read);
+	char** fields[] = {
+		&X->default_bits, &X->default_keyfile, &X->default_md, &X->distinguished_name_tag, &X->x509_extensions_tag,
+		&X->default_country, &X->default_state, &X->default_locality, &X->default_org, &X->default_orgunit,
+		&X->default_commonname, &X->default_email, &X->default_serial,
+		&X->subject_key_identifier, &X->authority_key_identifier, &X->basic_contraints, &X->key_usage,
+		&X->extended_key_usage, &X->ns_cert_type
+	};
 	
-	if(filecontents == NULL)
+	for(int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
 	{
-		ret = -1;
-		return ret;
+		free(*fields[i]);
+		*fields[i] = NULL;
 	}
+}
+
+void free_conf_req_crt_parameters(conf_req_crt_parameters* X)
+{
+	char** fields[] = {
+		&X->default_ca_tag, &X->x509_extensions_tag, &X->crl_extensions_tag, &X->policy_tag,
+		&X->pki_dir, &X->certs_dir, &X->crl_dir, &X->database, &X->new_certs_dir,
+		&X->certificate, &X->serial, &X->crl, &X->private_key,
+		&X->default_days, &X->default_crl_days, &X->default_md, &X->preserve, &X->unique_subject,
+		&X->policy_country, &X->policy_state, &X->policy_locality, &X->policy_org, &X->policy_orgunit,
+		&X->policy_commonname, &X->policy_email,
+		&X->subject_key_identifier, &X->authority_key_identifier, &X->basic_contraints, &X->key_usage,
+		&X->extended_key_usage, &X->ns_cert_type, &X->crl_authority_key_identifier
+	};
 	
-	*contents = filecontents;
-	*lines = lines_read;
-	
-	return ret;
+	for(int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+	{
+		free(*fields[i]);
+		*fields[i] = NULL;
+	}
+}
+
+#define CONF_CACHE_MAGIC		"MCLUCNF1"
+#define CONF_CACHE_UNSET		UINT32_MAX	/* $ENV:: value of a variable that was not set */
+
+/*
+ * A config cache file is this header, then the section names and the entries, both sorted so they
+ * can be binary searched in place, then the $ENV:: variables used and last the strings, which every
+ * other part refers to by offset. It is only valid for the exact file, and environment, it came from
+ */
+typedef struct conf_cache_header {
+	char magic[8];
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	unsigned char hash[32];			/* SHA-256 of the contents */
+	uint32_t path;
+	uint32_t num_sections;
+	uint32_t num_entries;
+	uint32_t num_env;
+	uint32_t strings_len;
+}
+conf_cache_header;
+
+typedef struct conf_cache_entry {
+	uint32_t section;
+	uint32_t key;
+	uint32_t value;
+}
+conf_cache_entry;
+
+typedef struct conf_cache_env {
+	uint32_t name;
+	uint32_t value;
 }
+conf_cache_env;
 
-int locate_tag(char** haystack, unsigned long haystack_size, char* needle, int* needleLoc, int* endNeedleLoc)
+void conf_file_init(conf_file* conf)
 {
-	int ret = -1;
-	int local_needleLoc = -1;
-	int local_endNeedleLoc = -1;
+	conf->sections = NULL;
+	conf->env = NULL;
+	conf->cache = NULL;
+	conf->cache_len = 0;
+}
+
+void conf_file_free(conf_file* conf)
+{
+	unsigned long num_sections = 0;
+	unsigned long num_keys = 0;
+	void** sections;
 	
-	for(int i = 0; i < haystack_size; i++)
+	if(conf->sections != NULL)
 	{
-		char* line = haystack[i];
-		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"locate_tag: line: %s\n", line);
-		if(line[0] == '[' && local_needleLoc == -1)
-		{
-			// We have a tag, interrogate
-			mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"locate_tag: potential tag found\n");
-			unsigned long num_line_pieces;
-			char* separators = "[]#";
-			char** line_pieces = split_on_separators(line, separators, 3, 1, 0, &num_line_pieces);
-			
-			if(num_line_pieces == 1)
-			{
-				// cleanup potential tag
-				mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"locate_tag: potential tag: %s\n", line_pieces[0]);
-				char* trimmed = trim_flanking_whitespace(line_pieces[0]);
-				mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"locate_tag: trimmed potential tag: %s\n", trimmed);
-				if(strcmp(trimmed,needle) == 0)
-				{
-					// Found our needle
-					local_needleLoc = i;
-					//return local_needleLoc;
-					*needleLoc = local_needleLoc;
-				}
-			}
-			
-			free_null_terminated_string_array(line_pieces);
-		}
-		else if(line[0] == '[')
+		sections = destroy_string_map(conf->sections, DESTROY_MODE_RETURN_VALUES, &num_sections);
+		for(unsigned long i = 0; i < num_sections; i++)
 		{
-			local_endNeedleLoc = i;
-			//return local_needleLoc;
-			*endNeedleLoc = local_endNeedleLoc;
-			return 0;
+			destroy_string_map((string_map*)sections[i], DESTROY_MODE_FREE_VALUES, &num_keys);
 		}
+		free(sections);
+		conf->sections = NULL;
 	}
-	if(local_needleLoc > -1)
+	if(conf->env != NULL)
 	{
-		// We reached the end of the file without finding another tag
-		// Set the last line as the end
-		local_endNeedleLoc = haystack_size - 1;
-		//return local_needleLoc;
-		*endNeedleLoc = local_endNeedleLoc;
-		return 0;
+		destroy_string_map(conf->env, DESTROY_MODE_FREE_VALUES, &num_keys);
+		conf->env = NULL;
+	}
+	if(conf->cache != NULL)
+	{
+		munmap(conf->cache, conf->cache_len);
+		conf->cache = NULL;
 	}
-	
-	return ret;
 }
 
-/*
- * When parsing the config file, sometimes options may be specified twice. Setting the last input to TRUE 
- * continues searching the file and takes the last value if it appears more than once.
- * FALSE returns immediately after locating the first instance.
- */
-int locate_value(char** haystack, int startline, int endline, char* needle, char** value, int keepsearching)
+static const char* conf_cache_strings(const conf_file* conf)
 {
-	int ret = -1;
+	const conf_cache_header* header = (const conf_cache_header*)conf->cache;
 	
-	for(int i = startline; i <= endline; i++)
+	return (const char*)conf->cache + conf->cache_len - header->strings_len;
+}
+
+int has_conf_section(conf_file* conf, const char* section)
+{
+	if(conf->cache != NULL)
 	{
-		char* line = haystack[i];
-		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"locate_value: line: %s\n", line);
-		unsigned long num_line_pieces;
-		char* separators = "=#";
-		char** line_pieces = split_on_separators(line, separators, 2, 2, 0, &num_line_pieces);
+		const conf_cache_header* header = (const conf_cache_header*)conf->cache;
+		const uint32_t* sections = (const uint32_t*)(conf->cache + sizeof(conf_cache_header));
+		const char* strings = conf_cache_strings(conf);
+		uint32_t low = 0;
+		uint32_t high = header->num_sections;
 		
-		if(num_line_pieces == 2)
+		while(low < high)
 		{
-			char* trimmed = trim_flanking_whitespace(line_pieces[0]);
-			if(strcmp(trimmed,needle) == 0)
+			uint32_t mid = low + (high - low) / 2;
+			int cmp = strcmp(strings + sections[mid], section);
+			if(cmp == 0)
 			{
-				// Found our tag, copy out the value
-				char* trimmed = trim_flanking_whitespace(line_pieces[1]);
-				// Strip quotes which may be added by easyrsa expand_ssl_config()
-				char* stripped = dynamic_replace(trimmed,"\"","");
-				if(*value != NULL)
-				{
-					// We already found a previous value, free it first
-					free(*value);
-				}
-				*value = strdup(stripped);
-				ret = 0;
-				if(!keepsearching)
-				{
-					free_null_terminated_string_array(line_pieces);
-					return ret;
-				}
+				return 1;
+			}
+			if(cmp < 0)
+			{
+				low = mid + 1;
+			}
+			else
+			{
+				high = mid;
 			}
 		}
-		
-		free_null_terminated_string_array(line_pieces);
+		return 0;
 	}
 	
-	return ret;
+	return (conf->sections != NULL && get_string_map_element(conf->sections, section) != NULL);
 }
 
-int parse_x509_extensions(char** contents, int start_line, int end_line, int reqtype, void* void_params)
+char* get_conf_value(conf_file* conf, const char* section, const char* key)
 {
-	int ret = 0;
+	string_map* keys;
 	
-	if(reqtype == REQ_TYPE_CSR)
+	if(conf->cache != NULL)
 	{
-		conf_req_csr_parameters* req_params = void_params;
+		const conf_cache_header* header = (const conf_cache_header*)conf->cache;
+		const conf_cache_entry* entries = (const conf_cache_entry*)(conf->cache + sizeof(conf_cache_header) +
+																	header->num_sections * sizeof(uint32_t));
+		const char* strings = conf_cache_strings(conf);
+		uint32_t low = 0;
+		uint32_t high = header->num_entries;
 		
-		ret = locate_value(contents, start_line, end_line, "subjectKeyIdentifier", &(req_params->subject_key_identifier),1);
-		ret = locate_value(contents, start_line, end_line, "authorityKeyIdentifier", &(req_params->authority_key_identifier),1);
-		ret = locate_value(contents, start_line, end_line, "basicConstraints", &(req_params->basic_contraints),1);
-		ret = locate_value(contents, start_line, end_line, "keyUsage", &(req_params->key_usage),1);
-		ret = locate_value(contents, start_line, end_line, "extendedKeyUsage", &(req_params->extended_key_usage),1);
-		ret = locate_value(contents, start_line, end_line, "nsCertType", &(req_params->ns_cert_type),1);
+		while(low < high)
+		{
+			uint32_t mid = low + (high - low) / 2;
+			int cmp = strcmp(strings + entries[mid].section, section);
+			if(cmp == 0)
+			{
+				cmp = strcmp(strings + entries[mid].key, key);
+			}
+			if(cmp == 0)
+			{
+				return (char*)(strings + entries[mid].value);
+			}
+			if(cmp < 0)
+			{
+				low = mid + 1;
+			}
+			else
+			{
+				high = mid;
+			}
+		}
+		return NULL;
 	}
-	else if(reqtype == REQ_TYPE_CRT || reqtype == REQ_TYPE_EXTFILE)
+	
+	if(conf->sections == NULL || (keys = get_string_map_element(conf->sections, section)) == NULL)
 	{
-		conf_req_crt_parameters* ca_params = void_params;
-		
-		ret = locate_value(contents, start_line, end_line, "subjectKeyIdentifier", &(ca_params->subject_key_identifier),1);
-		ret = locate_value(contents, start_line, end_line, "authorityKeyIdentifier", &(ca_params->authority_key_identifier),1);
-		ret = locate_value(contents, start_line, end_line, "basicConstraints", &(ca_params->basic_contraints),1);
-		ret = locate_value(contents, start_line, end_line, "keyUsage", &(ca_params->key_usage),1);
-		ret = locate_value(contents, start_line, end_line, "extendedKeyUsage", &(ca_params->extended_key_usage),1);
-		ret = locate_value(contents, start_line, end_line, "nsCertType", &(ca_params->ns_cert_type),1);
+		return NULL;
 	}
 	
-	return ret;
+	return (char*)get_string_map_element(keys, key);
 }
 
-int parse_config_file(char* conffile, int reqtype, void* void_params)
+int copy_conf_value(conf_file* conf, const char* section, const char* key, char** value)
 {
-	int ret = 0;
-	char** contents = NULL;
-	unsigned long lines = 0;
+	char* found = get_conf_value(conf, section, key);
 	
-	if(conffile == NULL)
+	if(found == NULL)
 	{
-		mbedtlsclu_prio_printf(MBEDTLSCLU_NOTICE,"No config file provided. Skipping.\n");
-		return ret;
+		return -1;
 	}
+	if(*value != NULL)
+	{
+		// We already have a previous value, free it first
+		free(*value);
+	}
+	*value = strdup(found);
 	
-	if((ret = read_config_file(conffile, &contents, &lines)) != 0)
+	return 0;
+}
+
+/* Appends len bytes of s to the growing buffer *out */
+static void conf_append(char** out, size_t* out_len, size_t* out_size, const char* s, size_t len)
+{
+	if(*out_len + len + 1 > *out_size)
 	{
-		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"Failed to read config file\n");
-		return ret;
+		while(*out_len + len + 1 > *out_size)
+		{
+			*out_size *= 2;
+		}
+		*out = realloc(*out, *out_size);
 	}
+	memcpy(*out + *out_len, s, len);
+	*out_len += len;
+	(*out)[*out_len] = '\0';
+}
+
+/* Length of the variable name at s, openssl allows letters, digits and _ */
+static size_t conf_name_length(const char* s)
+{
+	size_t n = 0;
 	
-#ifdef DEBUG
-	// print the config file
-	for(int i = 0; i < lines; i++)
+	while(isalnum((unsigned char)s[n]) || s[n] == '_')
 	{
-		char* line = contents[i];
-		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"config_line %d: %s\n",i, line);
+		n++;
 	}
-#endif
 	
-	if(reqtype == REQ_TYPE_CSR && void_params != NULL)
+	return n;
+}
+
+/*
+ * Expands $var, ${var}, $(var), $section::var and $ENV::var in value the way openssl does. A plain
+ * var is looked up in section and then the default section, so only keys above it can be used.
+ * \$ is a literal $, and anything that has no value is left as written
+ */
+static char* expand_conf_value(conf_file* conf, const char* section, const char* value)
+{
+	size_t out_len = 0;
+	size_t out_size = strlen(value) + 1;
+	char* out = malloc(out_size);
+	const char* p = value;
+	
+	out[0] = '\0';
+	while(*p != '\0')
 	{
-		conf_req_csr_parameters* req_params = void_params;
-		// We need to hunt the "[ req ]" tag
-		int req_start_line = 0;
-		int req_end_line = 0;
-		if((ret = locate_tag(contents, lines, "req", &req_start_line, &req_end_line)) < 0)
+		const char* start = p;
+		const char* q;
+		char* var_section = NULL;
+		char* var_name = NULL;
+		char* found = NULL;
+		char close = '\0';
+		size_t n;
+		
+		if(p[0] == '\\' && p[1] == '$')
 		{
-			mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ req ] not found in config file\n");
-			free_null_terminated_string_array(contents);
-			ret = 0;
-			return ret;
+			conf_append(&out, &out_len, &out_size, "$", 1);
+			p += 2;
+			continue;
+		}
+		if(p[0] != '$')
+		{
+			for(q = p; *q != '\0' && *q != '$' && *q != '\\'; q++);
+			q = (q == p ? p + 1 : q);
+			conf_append(&out, &out_len, &out_size, p, q - p);
+			p = q;
+			continue;
 		}
-
-		ret = locate_value(contents, req_start_line, req_end_line, "default_keyfile", &(req_params->default_keyfile),1);
-		ret = locate_value(contents, req_start_line, req_end_line, "default_md", &(req_params->default_md),1);
-		ret = locate_value(contents, req_start_line, req_end_line, "distinguished_name", &(req_params->distinguished_name_tag),1);
-		ret = locate_value(contents, req_start_line, req_end_line, "x509_extensions", &(req_params->x509_extensions_tag),1);
 		
-		ret = 0;
-		if(req_params->distinguished_name_tag != NULL)
+		q = p + 1;
+		if(*q == '{' || *q == '(')
 		{
-			// We found a distinguished name tag to try and hunt
-			int dnt_start_line = 0;
-			int dnt_end_line = 0;
-			if((ret = locate_tag(contents, lines, req_params->distinguished_name_tag, &dnt_start_line, &dnt_end_line)) < 0)
+			close = (*q == '{' ? '}' : ')');
+			q++;
+		}
+		n = conf_name_length(q);
+		if(n > 0 && q[n] == ':' && q[n + 1] == ':')
+		{
+			var_section = strndup(q, n);
+			q += n + 2;
+			n = conf_name_length(q);
+		}
+		if(n > 0 && (close == '\0' || q[n] == close))
+		{
+			var_name = strndup(q, n);
+			p = q + n + (close != '\0' ? 1 : 0);
+			
+			if(var_section != NULL && strcmp(var_section, "ENV") == 0)
 			{
-				mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ %s ] not found in config file\n",req_params->distinguished_name_tag);
-				ret = 0;
+				found = getenv(var_name);
+				// Remembered so a cached copy of this file is not used once the variable changes
+				if(conf->env == NULL)
+				{
+					conf->env = initialize_string_map(1);
+				}
+				free(set_string_map_element(conf->env, var_name, strdup(var_name)));
 			}
-			else
+			else if(var_section != NULL)
 			{
-				ret = locate_value(contents, dnt_start_line, dnt_end_line, "countryName_default", &(req_params->default_country),1);
-				ret = locate_value(contents, dnt_start_line, dnt_end_line, "stateOrProvinceName_default", &(req_params->default_state),1);
-				ret = locate_value(contents, dnt_start_line, dnt_end_line, "localityName_default", &(req_params->default_locality),1);
-				ret = locate_value(contents, dnt_start_line, dnt_end_line, "0.organizationName_default", &(req_params->default_org),1);
-				ret = locate_value(contents, dnt_start_line, dnt_end_line, "organizationalUnitName_default", &(req_params->default_orgunit),1);
-				ret = locate_value(contents, dnt_start_line, dnt_end_line, "commonName_default", &(req_params->default_commonname),1);
-				ret = locate_value(contents, dnt_start_line, dnt_end_line, "emailAddress_default", &(req_params->default_email),1);
-				ret = locate_value(contents, dnt_start_line, dnt_end_line, "serialNumber_default", &(req_params->default_serial),1);
-				
-				ret = 0;
+				found = get_conf_value(conf, var_section, var_name);
 			}
-		}
-		if(req_params->x509_extensions_tag != NULL)
-		{
-			// We found a x509 extensions tag to try and hunt
-			int xet_start_line = 0;
-			int xet_end_line = 0;
-			if((ret = locate_tag(contents, lines, req_params->x509_extensions_tag, &xet_start_line, &xet_end_line)) < 0)
+			else if((found = get_conf_value(conf, section, var_name)) == NULL)
 			{
-				mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ %s ] not found in config file\n",req_params->x509_extensions_tag);
-				ret = 0;
+				found = get_conf_value(conf, CONF_DEFAULT_SECTION, var_name);
 			}
-			else
+		}
+		else
+		{
+			p = start + 1;
+		}
+		
+		if(found != NULL)
+		{
+			conf_append(&out, &out_len, &out_size, found, strlen(found));
+		}
+		else
+		{
+			if(var_name != NULL)
 			{
-				ret = parse_x509_extensions(contents, xet_start_line, xet_end_line, reqtype, (void*)req_params);
-				
-				ret = 0;
+				mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"conf: [ %s ] $%s has no value, left as is\n", section, var_name);
 			}
+			conf_append(&out, &out_len, &out_size, start, p - start);
 		}
+		free(var_section);
+		free(var_name);
 	}
-	else if(reqtype == REQ_TYPE_CRT && void_params != NULL)
+	
+	return out;
+}
+
+/* The keys of section, created empty the first time it is seen */
+static string_map* conf_section(conf_file* conf, const char* section)
+{
+	string_map* keys;
+	
+	if(conf->sections == NULL)
 	{
-		conf_req_crt_parameters* ca_params = void_params;
-		// We need to hunt the "[ ca ]" tag
-		int ca_start_line = 0;
-		int ca_end_line = 0;
+		conf->sections = initialize_string_map(1);
+	}
+	if((keys = get_string_map_element(conf->sections, section)) == NULL)
+	{
+		keys = initialize_string_map(1);
+		set_string_map_element(conf->sections, section, keys);
+	}
+	
+	return keys;
+}
+
+static void parse_conf_bytes(const char* conffile, char* data, unsigned long len, conf_file* conf)
+{
+	unsigned long i = 0;
+	char* section = NULL;
+	string_map* keys;
+	str_iter_t lines;
+	str_view_t view;
+	
+	section = strdup(CONF_DEFAULT_SECTION);
+	keys = conf_section(conf, section);
+	// Lines are terminated in place, so everything below edits data directly
+	initialize_str_iter(&lines, data, len, "\r\n", 2, STR_ITER_TERMINATE);
+	for(; next_str_piece(&lines, &view); i++)
+	{
+		char* line = (char*) view.str;
+		char* found;
 		
-		if((ret = locate_tag(contents, lines, "ca", &ca_start_line, &ca_end_line)) < 0)
+		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"config_line %lu: %s\n", i, line);
+		if((found = strchr(line, '#')) != NULL)
 		{
-			mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ ca ] not found in config file\n");
-			free_null_terminated_string_array(contents);
-			ret = 0;
-			return ret;
+			*found = '\0';
 		}
+		trim_flanking_whitespace(line);
 		
-		ret = locate_value(contents, ca_start_line, ca_end_line, "default_ca", &(ca_params->default_ca_tag),1);
-		
-		ret = 0;
-		if(ca_params->default_ca_tag != NULL)
+		if(line[0] == '[')
 		{
-			// We found a default ca tag to try and hunt
-			int dca_start_line = 0;
-			int dca_end_line = 0;
-			if((ret = locate_tag(contents, lines, ca_params->default_ca_tag, &dca_start_line, &dca_end_line)) < 0)
+			if((found = strchr(line, ']')) == NULL)
 			{
-				mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ %s ] not found in config file\n",ca_params->default_ca_tag);
-				ret = 0;
+				mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"%s line %lu: missing ], ignored\n", conffile, i + 1);
+				continue;
 			}
-			else
+			*found = '\0';
+			free(section);
+			section = strdup(trim_flanking_whitespace(line + 1));
+			keys = conf_section(conf, section);
+		}
+		else if((found = strchr(line, '=')) != NULL)
+		{
+			char* key;
+			char* value;
+			char* src;
+			char* dst;
+			
+			*found = '\0';
+			key = trim_flanking_whitespace(line);
+			value = trim_flanking_whitespace(found + 1);
+			// Strip quotes which may be added by easyrsa expand_ssl_config()
+			for(src = dst = value; *src != '\0'; src++)
 			{
-				ret = locate_value(contents, dca_start_line, dca_end_line, "dir", &(ca_params->pki_dir),1);
-				ret = locate_value(contents, dca_start_line, dca_end_line, "certs", &(ca_params->certs_dir),1);
-				ret = locate_value(contents, dca_start_line, dca_end_line, "crl_dir", &(ca_params->crl_dir),1);
-				ret = locate_value(contents, dca_start_line, dca_end_line, "database", &(ca_params->database),1);
-				ret = locate_value(contents, dca_start_line, dca_end_line, "new_certs_dir", &(ca_params->new_certs_dir),1);
-				
-				ret = locate_value(contents, dca_start_line, dca_end_line, "certificate", &(ca_params->certificate),1);
-				ret = locate_value(contents, dca_start_line, dca_end_line, "serial", &(ca_params->serial),1);
-				ret = locate_value(contents, dca_start_line, dca_end_line, "crl", &(ca_params->crl),1);
-				ret = locate_value(contents, dca_start_line, dca_end_line, "private_key", &(ca_params->private_key),1);
-				
-				ret = locate_value(contents, dca_start_line, dca_end_line, "x509_extensions", &(ca_params->x509_extensions_tag),1);
-				
-				ret = locate_value(contents, dca_start_line, dca_end_line, "crl_extensions", &(ca_params->crl_extensions_tag),1);
-				
-				ret = locate_value(contents, dca_start_line, dca_end_line, "default_days", &(ca_params->default_days),1);
-				ret = locate_value(contents, dca_start_line, dca_end_line, "default_crl_days", &(ca_params->default_crl_days),1);
-				ret = locate_value(contents, dca_start_line, dca_end_line, "default_md", &(ca_params->default_md),1);
-				
-				ret = locate_value(contents, dca_start_line, dca_end_line, "preserve", &(ca_params->preserve),1);
-				ret = locate_value(contents, dca_start_line, dca_end_line, "unique_subject", &(ca_params->unique_subject),1);
-				
-				ret = locate_value(contents, dca_start_line, dca_end_line, "policy", &(ca_params->policy_tag),1); // Don't chase
-				
-				ret = 0;
-				
-				if(ca_params->x509_extensions_tag != NULL)
-				{
-					// We found a x509 extensions tag to try and hunt
-					int xet_start_line = 0;
-					int xet_end_line = 0;
-					if((ret = locate_tag(contents, lines, ca_params->x509_extensions_tag, &xet_start_line, &xet_end_line)) < 0)
-					{
-						mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ %s ] not found in config file\n",ca_params->x509_extensions_tag);
-						ret = 0;
-					}
-					else
-					{
-						ret = parse_x509_extensions(contents, xet_start_line, xet_end_line, reqtype, (void*)ca_params);
-						
-						ret = 0;
-					}
-				}
-				
-				if(ca_params->crl_extensions_tag != NULL)
+				if(*src != '"')
 				{
-					// We found a CRL extensions tag to try and hunt
-					int cet_start_line = 0;
-					int cet_end_line = 0;
-					if((ret = locate_tag(contents, lines, ca_params->crl_extensions_tag, &cet_start_line, &cet_end_line)) < 0)
-					{
-						mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ %s ] not found in config file\n",ca_params->crl_extensions_tag);
-						ret = 0;
-					}
-					else
-					{
-						ret = parse_x509_extensions(contents, cet_start_line, cet_end_line, reqtype, (void*)ca_params);
-						
-						ret = 0;
-					}
+					*dst++ = *src;
 				}
 			}
+			*dst = '\0';
+			// Later values win, as they do in openssl
+			free(set_string_map_element(keys, key, expand_conf_value(conf, section, value)));
 		}
 	}
-	else if(reqtype == REQ_TYPE_EXTFILE && void_params != NULL)
-	{
-		// The extension file should not contain any tags, just key=value pairs
-		// So search the entire file 0..length
-		conf_req_crt_parameters* ca_params = void_params;
-		ret = parse_x509_extensions(contents, 0, lines, reqtype, (void*)ca_params);
-		
-		ret = 0;
-	}
 	
-	free_null_terminated_string_array(contents);
-	return ret;
+	free(section);
 }
 
-/*
- * Like memcmp, but case-insensitive and always returns -1 if different
- */
-static int x509_memcasecmp(const void *s1, const void *s2, size_t len)
+/* Named after a hash of the full path, so configs with the same name don't take turns */
+static char* conf_cache_name(const char* resolved, const char* cache_dir)
 {
-    size_t i;
-    unsigned char diff;
-    const unsigned char *n1 = s1, *n2 = s2;
-
-    for (i = 0; i < len; i++) {
-        diff = n1[i] ^ n2[i];
-
-        if (diff == 0) {
-            continue;
-        }
-
-        if (diff == 32 &&
-            ((n1[i] >= 'a' && n1[i] <= 'z') ||
-             (n1[i] >= 'A' && n1[i] <= 'Z'))) {
-            continue;
-        }
-
-        return -1;
-    }
-
-    return 0;
+	char name[64];
+	unsigned char hash[32];
+	
+	mbedtls_sha256_ret((const unsigned char*) resolved, strlen(resolved), hash, 0);
+	sprintf(name, "/mbedtls-clu-conf-%02x%02x%02x%02x%02x%02x%02x%02x.cache",
+			hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7]);
+	
+	return dynamic_strcat(2, cache_dir, name);
 }
 
-/*
- * Compare two X.509 strings, case-insensitive, and allowing for some encoding
- * variations (but not all).
- *
- * Return 0 if equal, -1 otherwise.
- */
-static int x509_string_cmp(const mbedtls_x509_buf *a, const mbedtls_x509_buf *b)
+char* conf_cache_path(const char* conffile, const char* cache_dir)
 {
-    if (a->tag == b->tag &&
-        a->len == b->len &&
-        memcmp(a->p, b->p, b->len) == 0) {
-        return 0;
-    }
-
-    if ((a->tag == MBEDTLS_ASN1_UTF8_STRING || a->tag == MBEDTLS_ASN1_PRINTABLE_STRING) &&
-        (b->tag == MBEDTLS_ASN1_UTF8_STRING || b->tag == MBEDTLS_ASN1_PRINTABLE_STRING) &&
-        a->len == b->len &&
-        x509_memcasecmp(a->p, b->p, b->len) == 0) {
-        return 0;
-    }
+	char* resolved;
+	char* cache_path;
+	
+	if((resolved = realpath(conffile, NULL)) == NULL)
+	{
+		return NULL;
+	}
+	cache_path = conf_cache_name(resolved, cache_dir);
+	free(resolved);
+	
+	return cache_path;
+}
 
-    return -1;
+/* Fills the identity part of header from st, the same way for writing and checking */
+static void conf_cache_identity(conf_cache_header* header, const struct stat* st, const unsigned char* hash)
+{
+	memset(header, 0, sizeof(conf_cache_header));
+	memcpy(header->magic, CONF_CACHE_MAGIC, sizeof(header->magic));
+	header->dev = (uint64_t) st->st_dev;
+	header->ino = (uint64_t) st->st_ino;
+	header->size = (uint64_t) st->st_size;
+	header->mtime_sec = (int64_t) st->st_mtim.tv_sec;
+	header->mtime_nsec = (int64_t) st->st_mtim.tv_nsec;
+	memcpy(header->hash, hash, sizeof(header->hash));
 }
 
 /*
- * Compare two X.509 Names (aka rdnSequence).
- *
- * See RFC 5280 section 7.1, though we don't implement the whole algorithm:
- * we sometimes return unequal when the full algorithm would return equal,
- * but never the other way. (In particular, we don't do Unicode normalisation
- * or space folding.)
- *
- * Return 0 if equal, -1 otherwise.
- *
- * Lifted from mbedtls/library/x509_crt.c
+ * Maps cache_path into conf if it was written from this very file and environment.
+ * Matching identity is trusted when the file is older than the cache, as any later change would
+ * have moved its mtime past the cache's. Otherwise the contents are hashed too.
+ * Returns 0 if conf can be used, -1 if the file has to be parsed
  */
-int x509_name_cmp(const mbedtls_x509_name *a, const mbedtls_x509_name *b)
+static int map_conf_cache(const char* cache_path, const char* conffile, const char* resolved,
+							const struct stat* st, conf_file* conf)
 {
-    /* Avoid recursion, it might not be optimised by the compiler */
-    while (a != NULL || b != NULL) {
-        if (a == NULL || b == NULL) {
-            return -1;
-        }
-
-        /* type */
-        if (a->oid.tag != b->oid.tag ||
+	int fd;
+	struct stat cache_st;
+	unsigned char* cache;
+	const conf_cache_header* header;
+	conf_cache_header expected;
+	const uint32_t* sections;
+	const conf_cache_entry* entries;
+	const conf_cache_env* env;
+	const char* strings;
+	uint64_t len;
+	
+	if((fd = open(cache_path, O_RDONLY)) < 0)
+	{
+		return -1;
+	}
+	// Only trust a cache we wrote ourselves
+	if(fstat(fd, &cache_st) != 0 || !S_ISREG(cache_st.st_mode) || cache_st.st_uid != geteuid() ||
+		(size_t) cache_st.st_size < sizeof(conf_cache_header))
+	{
+		close(fd);
+		return -1;
+	}
+	cache = mmap(NULL, cache_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(cache == MAP_FAILED)
+	{
+		return -1;
+	}
+	
+	header = (const conf_cache_header*)cache;
+	conf_cache_identity(&expected, st, header->hash);
+	len = sizeof(conf_cache_header) + (uint64_t) header->num_sections * sizeof(uint32_t) +
+			(uint64_t) header->num_entries * sizeof(conf_cache_entry) +
+			(uint64_t) header->num_env * sizeof(conf_cache_env) + header->strings_len;
+	if(memcmp(header, &expected, offsetof(conf_cache_header, path)) != 0 ||
+		len != (uint64_t) cache_st.st_size || header->strings_len == 0 ||
+		cache[cache_st.st_size - 1] != '\0')
+	{
+		goto invalid;
+	}
+	
+	if(st->st_mtim.tv_sec >= cache_st.st_mtim.tv_sec)
+	{
+		// Changed in the same second the cache was written, only the contents can tell
+		struct stat data_st;
+		unsigned char hash[32];
+		unsigned long data_len;
+		// One read, so the hash and the identity describe the same bytes
+		char* data = (char*) load_file(conffile, &data_st, &data_len);
+		
+		if(data == NULL)
+		{
+			goto invalid;
+		}
+		mbedtls_sha256_ret((const unsigned char*) data, data_len, hash, 0);
+		free(data);
+		if(memcmp(hash, header->hash, sizeof(hash)) != 0 || data_st.st_ino != st->st_ino ||
+			data_st.st_mtim.tv_sec != st->st_mtim.tv_sec || data_st.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+		{
+			goto invalid;
+		}
+	}
+	
+	sections = (const uint32_t*)(cache + sizeof(conf_cache_header));
+	entries = (const conf_cache_entry*)(sections + header->num_sections);
+	env = (const conf_cache_env*)(entries + header->num_entries);
+	strings = (const char*)(env + header->num_env);
+	if(header->path >= header->strings_len || strcmp(strings + header->path, resolved) != 0)
+	{
+		goto invalid;
+	}
+	for(uint32_t i = 0; i < header->num_sections; i++)
+	{
+		if(sections[i] >= header->strings_len)
+		{
+			goto invalid;
+		}
+	}
+	for(uint32_t i = 0; i < header->num_entries; i++)
+	{
+		if(entries[i].section >= header->strings_len || entries[i].key >= header->strings_len ||
+			entries[i].value >= header->strings_len)
+		{
+			goto invalid;
+		}
+	}
+	// Anything expanded from the environment must still expand the same way
+	for(uint32_t i = 0; i < header->num_env; i++)
+	{
+		const char* value;
+		if(env[i].name >= header->strings_len ||
+			(env[i].value != CONF_CACHE_UNSET && env[i].value >= header->strings_len))
+		{
+			goto invalid;
+		}
+		value = getenv(strings + env[i].name);
+		if((value == NULL) != (env[i].value == CONF_CACHE_UNSET) ||
+			(value != NULL && strcmp(value, strings + env[i].value) != 0))
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"conf: cache is stale, $ENV::%s changed\n", strings + env[i].name);
+			goto invalid;
+		}
+	}
+	
+	conf->cache = cache;
+	conf->cache_len = cache_st.st_size;
+	return 0;
+	
+invalid:
+	munmap(cache, cache_st.st_size);
+	return -1;
+}
+
+/* Appends s and its terminator to the string table, returning its offset */
+static uint32_t conf_cache_add_string(char** strings, size_t* len, size_t* size, const char* s)
+{
+	uint32_t offset = (uint32_t) *len;
+	
+	conf_append(strings, len, size, s, strlen(s) + 1);
+	
+	return offset;
+}
+
+static int conf_cache_write(int fd, const void* buf, size_t len)
+{
+	const unsigned char* p = buf;
+	ssize_t n;
+	
+	while(len > 0)
+	{
+		if((n = write(fd, p, len)) <= 0)
+		{
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	
+	return 0;
+}
+
+/* Writes conf to cache_path, through a temporary file so readers only ever see a whole cache */
+static int save_conf_cache(const char* cache_path, const char* resolved, const struct stat* st,
+							const unsigned char* hash, conf_file* conf)
+{
+	int ret = -1;
+	int fd = -1;
+	conf_cache_header header;
+	char** section_names = NULL;
+	char** env_names = NULL;
+	unsigned long num_sections = 0;
+	unsigned long num_env = 0;
+	uint32_t* sections = NULL;
+	conf_cache_entry* entries = NULL;
+	conf_cache_env* env = NULL;
+	unsigned long num_entries = 0;
+	unsigned long max_entries = 64;
+	char* strings;
+	size_t strings_len = 0;
+	size_t strings_size = 4096;
+	char* tmp_path = dynamic_strcat(2, cache_path, ".XXXXXX");
+	
+	conf_cache_identity(&header, st, hash);
+	strings = malloc(strings_size);
+	header.path = conf_cache_add_string(&strings, &strings_len, &strings_size, resolved);
+	
+	section_names = get_string_map_keys(conf->sections, &num_sections);
+	do_str_sort(section_names, num_sections);
+	sections = malloc(sizeof(uint32_t) * (num_sections + 1));
+	entries = malloc(sizeof(conf_cache_entry) * max_entries);
+	for(unsigned long i = 0; i < num_sections; i++)
+	{
+		string_map* keys = get_string_map_element(conf->sections, section_names[i]);
+		unsigned long num_keys = 0;
+		char** key_names = get_string_map_keys(keys, &num_keys);
+		
+		sections[i] = conf_cache_add_string(&strings, &strings_len, &strings_size, section_names[i]);
+		do_str_sort(key_names, num_keys);
+		for(unsigned long k = 0; k < num_keys; k++)
+		{
+			if(num_entries == max_entries)
+			{
+				max_entries *= 2;
+				entries = realloc(entries, sizeof(conf_cache_entry) * max_entries);
+			}
+			entries[num_entries].section = sections[i];
+			entries[num_entries].key = conf_cache_add_string(&strings, &strings_len, &strings_size, key_names[k]);
+			entries[num_entries].value = conf_cache_add_string(&strings, &strings_len, &strings_size,
+																(char*)get_string_map_element(keys, key_names[k]));
+			num_entries++;
+		}
+		free_null_terminated_string_array(key_names);
+	}
+	
+	if(conf->env != NULL)
+	{
+		env_names = get_string_map_keys(conf->env, &num_env);
+	}
+	env = malloc(sizeof(conf_cache_env) * (num_env + 1));
+	for(unsigned long i = 0; i < num_env; i++)
+	{
+		const char* value = getenv(env_names[i]);
+		env[i].name = conf_cache_add_string(&strings, &strings_len, &strings_size, env_names[i]);
+		env[i].value = (value == NULL ? CONF_CACHE_UNSET : conf_cache_add_string(&strings, &strings_len, &strings_size, value));
+	}
+	
+	if(strings_len >= CONF_CACHE_UNSET)
+	{
+		goto exit;
+	}
+	header.num_sections = num_sections;
+	header.num_entries = num_entries;
+	header.num_env = num_env;
+	header.strings_len = strings_len;
+	
+	if((fd = mkstemp(tmp_path)) < 0)
+	{
+		goto exit;
+	}
+	if(conf_cache_write(fd, &header, sizeof(header)) != 0 ||
+		conf_cache_write(fd, sections, sizeof(uint32_t) * num_sections) != 0 ||
+		conf_cache_write(fd, entries, sizeof(conf_cache_entry) * num_entries) != 0 ||
+		conf_cache_write(fd, env, sizeof(conf_cache_env) * num_env) != 0 ||
+		conf_cache_write(fd, strings, strings_len) != 0)
+	{
+		goto exit;
+	}
+	if(close(fd) != 0)
+	{
+		fd = -1;
+		goto exit;
+	}
+	fd = -1;
+	if(rename(tmp_path, cache_path) != 0)
+	{
+		goto exit;
+	}
+	ret = 0;
+	
+exit:
+	if(fd >= 0)
+	{
+		close(fd);
+	}
+	if(ret != 0)
+	{
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+	free(strings);
+	free(sections);
+	free(entries);
+	free(env);
+	free_null_terminated_string_array(section_names);
+	if(env_names != NULL)
+	{
+		free_null_terminated_string_array(env_names);
+	}
+	
+	return ret;
+}
+
+int load_conf_file(char* conffile, const char* cache_dir, conf_file* conf)
+{
+	int ret = 0;
+	struct stat st;
+	unsigned char hash[32];
+	char* data = NULL;
+	unsigned long len;
+	char* resolved = NULL;
+	char* cache_path = NULL;
+	
+	if(cache_dir != NULL && stat(conffile, &st) == 0 && (resolved = realpath(conffile, NULL)) != NULL &&
+		(cache_path = conf_cache_name(resolved, cache_dir)) != NULL &&
+		map_conf_cache(cache_path, conffile, resolved, &st, conf) == 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"conf: %s from cache %s\n", conffile, cache_path);
+		goto exit;
+	}
+	
+	if((data = (char*) load_file(conffile, &st, &len)) == NULL)
+	{
+		ret = -1;
+		goto exit;
+	}
+	// Hash before parsing, the parse edits the buffer in place
+	if(cache_path != NULL)
+	{
+		mbedtls_sha256_ret((const unsigned char*) data, len, hash, 0);
+	}
+	parse_conf_bytes(conffile, data, len, conf);
+	
+	if(cache_path != NULL)
+	{
+		if(save_conf_cache(cache_path, resolved, &st, hash, conf) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"conf: could not write cache %s: %s\n", cache_path, strerror(errno));
+		}
+	}
+	
+exit:
+	free(data);
+	free(resolved);
+	free(cache_path);
+	
+	return ret;
+}
+
+static void parse_x509_extensions(conf_file* conf, const char* section, int reqtype, void* void_params)
+{
+	if(reqtype == REQ_TYPE_CSR)
+	{
+		conf_req_csr_parameters* req_params = void_params;
+		
+		copy_conf_value(conf, section, "subjectKeyIdentifier", &(req_params->subject_key_identifier));
+		copy_conf_value(conf, section, "authorityKeyIdentifier", &(req_params->authority_key_identifier));
+		copy_conf_value(conf, section, "basicConstraints", &(req_params->basic_contraints));
+		copy_conf_value(conf, section, "keyUsage", &(req_params->key_usage));
+		copy_conf_value(conf, section, "extendedKeyUsage", &(req_params->extended_key_usage));
+		copy_conf_value(conf, section, "nsCertType", &(req_params->ns_cert_type));
+	}
+	else if(reqtype == REQ_TYPE_CRT || reqtype == REQ_TYPE_EXTFILE)
+	{
+		conf_req_crt_parameters* ca_params = void_params;
+		
+		copy_conf_value(conf, section, "subjectKeyIdentifier", &(ca_params->subject_key_identifier));
+		copy_conf_value(conf, section, "authorityKeyIdentifier", &(ca_params->authority_key_identifier));
+		copy_conf_value(conf, section, "basicConstraints", &(ca_params->basic_contraints));
+		copy_conf_value(conf, section, "keyUsage", &(ca_params->key_usage));
+		copy_conf_value(conf, section, "extendedKeyUsage", &(ca_params->extended_key_usage));
+		copy_conf_value(conf, section, "nsCertType", &(ca_params->ns_cert_type));
+	}
+}
+
+/* Parses the x509 extensions in section, warning if the config has no such section */
+static void chase_x509_extensions(conf_file* conf, const char* section, int reqtype, void* void_params)
+{
+	if(!has_conf_section(conf, section))
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ %s ] not found in config file\n", section);
+		return;
+	}
+	
+	parse_x509_extensions(conf, section, reqtype, void_params);
+}
+
+int parse_config_file(char* conffile, int reqtype, void* void_params)
+{
+	int ret = 0;
+	conf_file conf;
+	
+	if(conffile == NULL)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_NOTICE,"No config file provided. Skipping.\n");
+		return ret;
+	}
+	
+	conf_file_init(&conf);
+	if((ret = load_conf_file(conffile, getenv(MBEDTLS_ENV_CONF_CACHE), &conf)) != 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"Failed to read config file\n");
+		conf_file_free(&conf);
+		return ret;
+	}
+	
+	if(reqtype == REQ_TYPE_CSR && void_params != NULL)
+	{
+		conf_req_csr_parameters* req_params = void_params;
+		
+		if(!has_conf_section(&conf, "req"))
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ req ] not found in config file\n");
+			conf_file_free(&conf);
+			return ret;
+		}
+		
+		copy_conf_value(&conf, "req", "default_bits", &(req_params->default_bits));
+		copy_conf_value(&conf, "req", "default_keyfile", &(req_params->default_keyfile));
+		copy_conf_value(&conf, "req", "default_md", &(req_params->default_md));
+		copy_conf_value(&conf, "req", "distinguished_name", &(req_params->distinguished_name_tag));
+		copy_conf_value(&conf, "req", "x509_extensions", &(req_params->x509_extensions_tag));
+		
+		if(req_params->distinguished_name_tag != NULL)
+		{
+			// We found a distinguished name tag to try and hunt
+			const char* dnt = req_params->distinguished_name_tag;
+			if(!has_conf_section(&conf, dnt))
+			{
+				mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ %s ] not found in config file\n", dnt);
+			}
+			else
+			{
+				copy_conf_value(&conf, dnt, "countryName_default", &(req_params->default_country));
+				copy_conf_value(&conf, dnt, "stateOrProvinceName_default", &(req_params->default_state));
+				copy_conf_value(&conf, dnt, "localityName_default", &(req_params->default_locality));
+				copy_conf_value(&conf, dnt, "0.organizationName_default", &(req_params->default_org));
+				copy_conf_value(&conf, dnt, "organizationalUnitName_default", &(req_params->default_orgunit));
+				copy_conf_value(&conf, dnt, "commonName_default", &(req_params->default_commonname));
+				copy_conf_value(&conf, dnt, "emailAddress_default", &(req_params->default_email));
+				copy_conf_value(&conf, dnt, "serialNumber_default", &(req_params->default_serial));
+			}
+		}
+		if(req_params->x509_extensions_tag != NULL)
+		{
+			// We found a x509 extensions tag to try and hunt
+			chase_x509_extensions(&conf, req_params->x509_extensions_tag, reqtype, (void*)req_params);
+		}
+	}
+	else if(reqtype == REQ_TYPE_CRT && void_params != NULL)
+	{
+		conf_req_crt_parameters* ca_params = void_params;
+		
+		if(!has_conf_section(&conf, "ca"))
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ ca ] not found in config file\n");
+			conf_file_free(&conf);
+			return ret;
+		}
+		
+		copy_conf_value(&conf, "ca", "default_ca", &(ca_params->default_ca_tag));
+		
+		if(ca_params->default_ca_tag != NULL)
+		{
+			// We found a default ca tag to try and hunt
+			const char* dca = ca_params->default_ca_tag;
+			if(!has_conf_section(&conf, dca))
+			{
+				mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"[ %s ] not found in config file\n", dca);
+			}
+			else
+			{
+				copy_conf_value(&conf, dca, "dir", &(ca_params->pki_dir));
+				copy_conf_value(&conf, dca, "certs", &(ca_params->certs_dir));
+				copy_conf_value(&conf, dca, "crl_dir", &(ca_params->crl_dir));
+				copy_conf_value(&conf, dca, "database", &(ca_params->database));
+				copy_conf_value(&conf, dca, "new_certs_dir", &(ca_params->new_certs_dir));
+				
+				copy_conf_value(&conf, dca, "certificate", &(ca_params->certificate));
+				copy_conf_value(&conf, dca, "serial", &(ca_params->serial));
+				copy_conf_value(&conf, dca, "crl", &(ca_params->crl));
+				copy_conf_value(&conf, dca, "private_key", &(ca_params->private_key));
+				
+				copy_conf_value(&conf, dca, "x509_extensions", &(ca_params->x509_extensions_tag));
+				
+				copy_conf_value(&conf, dca, "crl_extensions", &(ca_params->crl_extensions_tag));
+				
+				copy_conf_value(&conf, dca, "default_days", &(ca_params->default_days));
+				copy_conf_value(&conf, dca, "default_crl_days", &(ca_params->default_crl_days));
+				copy_conf_value(&conf, dca, "default_md", &(ca_params->default_md));
+				
+				copy_conf_value(&conf, dca, "preserve", &(ca_params->preserve));
+				copy_conf_value(&conf, dca, "unique_subject", &(ca_params->unique_subject));
+				
+				copy_conf_value(&conf, dca, "policy", &(ca_params->policy_tag)); // Don't chase
+				
+				if(ca_params->x509_extensions_tag != NULL)
+				{
+					// We found a x509 extensions tag to try and hunt
+					chase_x509_extensions(&conf, ca_params->x509_extensions_tag, reqtype, (void*)ca_params);
+				}
+				
+				if(ca_params->crl_extensions_tag != NULL)
+				{
+					// We found a CRL extensions tag to try and hunt
+					chase_x509_extensions(&conf, ca_params->crl_extensions_tag, reqtype, (void*)ca_params);
+				}
+			}
+		}
+	}
+	else if(reqtype == REQ_TYPE_EXTFILE && void_params != NULL)
+	{
+		// The extension file should not contain any tags, just key=value pairs
+		// which all land in the default section
+		parse_x509_extensions(&conf, CONF_DEFAULT_SECTION, reqtype, void_params);
+	}
+	
+	conf_file_free(&conf);
+	return ret;
+}
+
+/*
+ * Like memcmp, but case-insensitive and always returns -1 if different
+ */
+static int x509_memcasecmp(const void *s1, const void *s2, size_t len)
+{
+    size_t i;
+    unsigned char diff;
+    const unsigned char *n1 = s1, *n2 = s2;
+
+    for (i = 0; i < len; i++) {
+        diff = n1[i] ^ n2[i];
+
+        if (diff == 0) {
+            continue;
+        }
+
+        if (diff == 32 &&
+            ((n1[i] >= 'a' && n1[i] <= 'z') ||
+             (n1[i] >= 'A' && n1[i] <= 'Z'))) {
+            continue;
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Compare two X.509 strings, case-insensitive, and allowing for some encoding
+ * variations (but not all).
+ *
+ * Return 0 if equal, -1 otherwise.
+ */
+static int x509_string_cmp(const mbedtls_x509_buf *a, const mbedtls_x509_buf *b)
+{
+    if (a->tag == b->tag &&
+        a->len == b->len &&
+        memcmp(a->p, b->p, b->len) == 0) {
+        return 0;
+    }
+
+    if ((a->tag == MBEDTLS_ASN1_UTF8_STRING || a->tag == MBEDTLS_ASN1_PRINTABLE_STRING) &&
+        (b->tag == MBEDTLS_ASN1_UTF8_STRING || b->tag == MBEDTLS_ASN1_PRINTABLE_STRING) &&
+        a->len == b->len &&
+        x509_memcasecmp(a->p, b->p, b->len) == 0) {
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Compare two X.509 Names (aka rdnSequence).
+ *
+ * See RFC 5280 section 7.1, though we don't implement the whole algorithm:
+ * we sometimes return unequal when the full algorithm would return equal,
+ * but never the other way. (In particular, we don't do Unicode normalisation
+ * or space folding.)
+ *
+ * Return 0 if equal, -1 otherwise.
+ *
+ * Lifted from mbedtls/library/x509_crt.c
+ */
+int x509_name_cmp(const mbedtls_x509_name *a, const mbedtls_x509_name *b)
+{
+    /* Avoid recursion, it might not be optimised by the compiler */
+    while (a != NULL || b != NULL) {
+        if (a == NULL || b == NULL) {
+            return -1;
+        }
+
+        /* type */
+        if (a->oid.tag != b->oid.tag ||
             a->oid.len != b->oid.len ||
             memcmp(a->oid.p, b->oid.p, b->oid.len) != 0) {
             return -1;
@@ -642,3 +1255,488 @@ int write_certificate(mbedtls_x509write_cert *crt, const char *output_file,
 
     return 0;
 }
+
+#if defined(MBEDTLSCLU_TEST_SEED)
+static unsigned char test_seed[MBEDTLSCLU_TEST_SEED_MAX];
+static size_t test_seed_len = 0;
+static unsigned long long test_seed_counter = 0;
+
+static int hex_nibble(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Stands in for mbedtls_entropy_func: block n of the stream is SHA-256(seed || n).
+ * Only called while seeding, which happens before any worker threads start
+ */
+static int test_seed_entropy(void *data, unsigned char *output, size_t len)
+{
+	int ret;
+	unsigned char input[MBEDTLSCLU_TEST_SEED_MAX + 8];
+	unsigned char block[32];
+	size_t use;
+	
+	(void) data;
+	
+	memcpy(input, test_seed, test_seed_len);
+	while(len > 0)
+	{
+		for(int i = 0; i < 8; i++)
+		{
+			input[test_seed_len + i] = (unsigned char)(test_seed_counter >> (56 - 8 * i));
+		}
+		test_seed_counter++;
+		
+		if((ret = mbedtls_sha256_ret(input, test_seed_len + 8, block, 0)) != 0)
+		{
+			return ret;
+		}
+		
+		use = (len < sizeof(block) ? len : sizeof(block));
+		memcpy(output, block, use);
+		output += use;
+		len -= use;
+	}
+	
+	return 0;
+}
+#endif /* MBEDTLSCLU_TEST_SEED */
+
+int mbedtlsclu_set_test_seed(const char* hex)
+{
+#if defined(MBEDTLSCLU_TEST_SEED)
+	size_t hexlen = strlen(hex);
+	int hi, lo;
+	
+	if(hexlen == 0 || hexlen % 2 != 0 || hexlen / 2 > MBEDTLSCLU_TEST_SEED_MAX)
+	{
+		return -1;
+	}
+	
+	for(size_t i = 0; i < hexlen / 2; i++)
+	{
+		if((hi = hex_nibble(hex[2 * i])) < 0 || (lo = hex_nibble(hex[2 * i + 1])) < 0)
+		{
+			return -1;
+		}
+		test_seed[i] = (unsigned char)((hi << 4) | lo);
+	}
+	test_seed_len = hexlen / 2;
+	test_seed_counter = 0;
+	
+	return 0;
+#else
+	(void) hex;
+	return -1;
+#endif /* MBEDTLSCLU_TEST_SEED */
+}
+
+int mbedtlsclu_test_seed_active(void)
+{
+#if defined(MBEDTLSCLU_TEST_SEED)
+	return (test_seed_len > 0);
+#else
+	return 0;
+#endif /* MBEDTLSCLU_TEST_SEED */
+}
+
+/*
+ * Worker DRBGs reseed from the shared entropy context on their own thread
+ * (every 10000 requests by default), and without MBEDTLS_THREADING_C the
+ * accumulator and sources have no locking of their own
+ */
+int mbedtlsclu_entropy_func(void *data, unsigned char *output, size_t len)
+{
+	int ret;
+	
+	pthread_mutex_lock(&entropy_lock);
+	ret = mbedtls_entropy_func(data, output, len);
+	pthread_mutex_unlock(&entropy_lock);
+	
+	return ret;
+}
+
+int mbedtlsclu_ctr_drbg_seed(mbedtls_ctr_drbg_context* ctr_drbg, mbedtls_entropy_context* entropy,
+								const unsigned char* custom, size_t len)
+{
+#if defined(MBEDTLSCLU_TEST_SEED)
+	int ret;
+	
+	if(test_seed_len > 0)
+	{
+		if((ret = mbedtls_ctr_drbg_seed(ctr_drbg, test_seed_entropy, NULL, custom, len)) != 0)
+		{
+			return ret;
+		}
+		// A reseed could come from a worker thread in any order, so never reseed
+		mbedtls_ctr_drbg_set_reseed_interval(ctr_drbg, INT_MAX);
+		return 0;
+	}
+#endif /* MBEDTLSCLU_TEST_SEED */
+	
+	return mbedtls_ctr_drbg_seed(ctr_drbg, mbedtlsclu_entropy_func, entropy, custom, len);
+}
+
+int mbedtlsclu_cpu_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	if(n < 1)
+	{
+		n = 1;
+	}
+	
+	return (int)n;
+}
+
+int mbedtlsclu_worker_threads(int threads, int dfl)
+{
+	// Under -seed each worker's stream is fixed but which jobs it claims is not
+	if(mbedtlsclu_test_seed_active())
+	{
+		if(threads > 1)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"WARNING: -seed with %d threads, output depends on how the workers are scheduled\n", threads);
+			return threads;
+		}
+		return 1;
+	}
+	
+	return (threads > 0 ? threads : dfl);
+}
+
+int mbedtlsclu_seed_ctr_drbgs(mbedtls_ctr_drbg_context* ctr_drbgs, int count,
+								mbedtls_entropy_context* entropy, const char* pers)
+{
+	int ret = 0;
+	char thread_pers[64];
+	
+	for(int i = 0; i < count; i++)
+	{
+		snprintf(thread_pers, sizeof(thread_pers), "%s-%d", pers, i);
+		if((ret = mbedtlsclu_ctr_drbg_seed(&ctr_drbgs[i], entropy,
+											(const unsigned char *) thread_pers,
+											strlen(thread_pers))) != 0)
+		{
+			return ret;
+		}
+	}
+	
+	return ret;
+}
+
+void mbedtlsclu_entropy_source_init(mbedtlsclu_entropy_source* src)
+{
+	memset(src, 0, sizeof(mbedtlsclu_entropy_source));
+#if defined(SYS_getrandom)
+	src->backend = MBEDTLSCLU_ENTROPY_GETRANDOM;
+#else
+	src->backend = MBEDTLSCLU_ENTROPY_DEVICE;
+#endif
+	src->fd = -1;
+}
+
+void mbedtlsclu_entropy_source_free(mbedtlsclu_entropy_source* src)
+{
+	if(src->fd >= 0)
+	{
+		close(src->fd);
+		src->fd = -1;
+	}
+}
+
+/* Opens /dev/random once. It is both the fallback source and what we poll() on while the pool is empty */
+static int entropy_source_open(mbedtlsclu_entropy_source* src)
+{
+	if(src->fd < 0)
+	{
+		src->fd = open("/dev/random", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	}
+	
+	return src->fd;
+}
+
+static ssize_t entropy_source_read(mbedtlsclu_entropy_source* src, unsigned char *output, size_t len)
+{
+	ssize_t n;
+	
+#if defined(SYS_getrandom)
+	if(src->backend == MBEDTLSCLU_ENTROPY_GETRANDOM)
+	{
+		n = syscall(SYS_getrandom, output, len, GRND_NONBLOCK | (src->random_pool ? GRND_RANDOM : 0));
+		if(n >= 0 || errno != ENOSYS)
+		{
+			return n;
+		}
+		// Kernel is older than 3.17
+		src->backend = MBEDTLSCLU_ENTROPY_DEVICE;
+	}
+#endif
+	
+	if(entropy_source_open(src) < 0)
+	{
+		return -1;
+	}
+	
+	return read(src->fd, output, len);
+}
+
+/*
+ * Non-blocking poll. Only waits (in poll(), never sleep()) when the kernel has nothing
+ * to give, and then for at most MBEDTLSCLU_ENTROPY_WAIT_MS. A short read is not an
+ * error: the entropy module keeps polling until it has gathered enough
+ */
+int mbedtlsclu_entropy_poll(void *data, unsigned char *output, size_t len, size_t *olen)
+{
+	mbedtlsclu_entropy_source* src = (mbedtlsclu_entropy_source*)data;
+	struct pollfd pfd;
+	ssize_t n;
+	
+	*olen = 0;
+	src->polls += 1;
+	
+	while((n = entropy_source_read(src, output, len)) < 0 && errno == EINTR)
+		;
+	
+	if(n < 0 && errno == EAGAIN)
+	{
+		src->waits += 1;
+		if(entropy_source_open(src) >= 0)
+		{
+			pfd.fd = src->fd;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, MBEDTLSCLU_ENTROPY_WAIT_MS);
+		}
+		while((n = entropy_source_read(src, output, len)) < 0 && errno == EINTR)
+			;
+		if(n < 0 && errno == EAGAIN)
+		{
+			// Still empty, let the entropy module call again
+			return 0;
+		}
+	}
+	
+	if(n < 0)
+	{
+		src->errors += 1;
+		src->last_errno = errno;
+		return MBEDTLS_ERR_ENTROPY_SOURCE_FAILED;
+	}
+	
+	if((size_t)n < len)
+	{
+		src->short_reads += 1;
+	}
+	src->bytes += n;
+	*olen = n;
+	
+	return 0;
+}
+
+int mbedtlsclu_entropy_add_source(mbedtls_entropy_context* entropy, mbedtlsclu_entropy_source* src)
+{
+	return mbedtls_entropy_add_source(entropy, mbedtlsclu_entropy_poll, src,
+									MBEDTLSCLU_ENTROPY_THRESHOLD, MBEDTLS_ENTROPY_SOURCE_STRONG);
+}
+
+void mbedtlsclu_entropy_report(const mbedtlsclu_entropy_source* src)
+{
+	if(src->polls == 0)
+	{
+		return;
+	}
+	
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Entropy source %s: %lu polls, %lu bytes, %lu short reads, %lu waits, %lu errors\n",
+							(src->backend == MBEDTLSCLU_ENTROPY_DEVICE ? "/dev/random" :
+								(src->random_pool ? "getrandom(GRND_RANDOM)" : "getrandom")),
+							src->polls, src->bytes, src->short_reads, src->waits, src->errors);
+	if(src->errors > 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"  ! Entropy source reported errors, last: %s\n", strerror(src->last_errno));
+	}
+}
+
+void mbedtlsclu_seed_file_init(mbedtlsclu_seed_file* sf)
+{
+	memset(sf, 0, sizeof(mbedtlsclu_seed_file));
+}
+
+void mbedtlsclu_seed_file_free(mbedtlsclu_seed_file* sf)
+{
+	free(sf->path);
+	free(sf->write_path);
+	mbedtls_platform_zeroize(sf->seed, sizeof(sf->seed));
+	sf->path = NULL;
+	sf->write_path = NULL;
+	sf->len = 0;
+}
+
+/* Same contract as mbedtls's NV seed source: the stored seed is handed out on every poll */
+static int seed_file_poll(void *data, unsigned char *output, size_t len, size_t *olen)
+{
+	mbedtlsclu_seed_file* sf = (mbedtlsclu_seed_file*)data;
+	
+	*olen = (len < sf->len ? len : sf->len);
+	memcpy(output, sf->seed, *olen);
+	
+	return 0;
+}
+
+/* Whether the kernel's pool is initialised, i.e. getrandom(2) without flags would not block */
+static int kernel_entropy_ready(void)
+{
+#if defined(SYS_getrandom)
+	unsigned char c;
+	
+	if(syscall(SYS_getrandom, &c, 1, GRND_NONBLOCK) < 0 && errno == EAGAIN)
+	{
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+/*
+ * mbedtls_entropy_init always registers the platform source and 2.28 has no call to take
+ * a source out again, so this edits the source table directly. It is the one place that
+ * relies on the layout of mbedtls_entropy_context, which is public in 2.x but private
+ * from 3.0 on, where this would have to become a context built by hand instead.
+ */
+static void entropy_remove_source(mbedtls_entropy_context* entropy, mbedtls_entropy_f_source_ptr f_source)
+{
+	for(int i = 0; i < entropy->source_count; i++)
+	{
+		if(entropy->source[i].f_source == f_source)
+		{
+			memmove(&entropy->source[i], &entropy->source[i + 1],
+					sizeof(entropy->source[0]) * (entropy->source_count - i - 1));
+			entropy->source_count -= 1;
+			return;
+		}
+	}
+}
+
+int mbedtlsclu_seed_file_load(mbedtlsclu_seed_file* sf, mbedtls_entropy_context* entropy)
+{
+	int ret;
+	FILE* f;
+	struct {
+		struct timespec now;
+		pid_t pid;
+	} nonce;
+	
+	if(sf->path == NULL)
+	{
+		return 0;
+	}
+	
+	if((f = fopen(sf->path, "rb")) == NULL)
+	{
+		// A missing seed file is expected on first use, -writerand will create it
+		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Seed file %s not found\n", sf->path);
+		return 0;
+	}
+	sf->len = fread(sf->seed, 1, sizeof(sf->seed), f);
+	fclose(f);
+	
+	if(sf->len < MBEDTLSCLU_SEED_FILE_MIN)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"  ! Seed file %s is too short (%zu bytes), ignoring it\n", sf->path, sf->len);
+		sf->len = 0;
+		return 0;
+	}
+	
+	if((ret = mbedtls_entropy_add_source(entropy, seed_file_poll, sf, sf->len, MBEDTLS_ENTROPY_SOURCE_STRONG)) != 0)
+	{
+		return ret;
+	}
+	
+	// Keep runs distinct even if the file could not be rewritten after the last one
+	clock_gettime(CLOCK_REALTIME, &nonce.now);
+	nonce.pid = getpid();
+	if((ret = mbedtls_entropy_update_manual(entropy, (const unsigned char*)&nonce, sizeof(nonce))) != 0)
+	{
+		return ret;
+	}
+	
+	if(!kernel_entropy_ready())
+	{
+		entropy_remove_source(entropy, mbedtls_platform_entropy_poll);
+		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Kernel entropy pool not ready, seeding from %s\n", sf->path);
+	}
+	
+	return 0;
+}
+
+int mbedtlsclu_seed_file_update(mbedtlsclu_seed_file* sf, mbedtls_ctr_drbg_context* ctr_drbg)
+{
+	int ret;
+	int fd;
+	char* path;
+	char* tmpfile;
+	unsigned char buf[MBEDTLSCLU_SEED_FILE_SIZE];
+	
+	path = (sf->write_path != NULL ? sf->write_path : sf->path);
+	if(path == NULL)
+	{
+		return 0;
+	}
+	
+	// A seed file written from the -seed stream would make later real runs predictable
+	if(mbedtlsclu_test_seed_active())
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"\n  !  -seed in effect, not writing %s\n", path);
+		return 0;
+	}
+	
+	if((ret = mbedtls_ctr_drbg_random(ctr_drbg, buf, sizeof(buf))) != 0)
+	{
+		return ret;
+	}
+	
+	// Replace atomically, a torn seed file would be rejected (or worse, half reused) next time
+	ret = MBEDTLS_ERR_ENTROPY_FILE_IO_ERROR;
+	tmpfile = dynamic_strcat(2, path, ".tmp");
+	if((fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0)
+	{
+		if(write(fd, buf, sizeof(buf)) == sizeof(buf) && fsync(fd) == 0)
+		{
+			ret = 0;
+		}
+		if(close(fd) != 0)
+		{
+			ret = MBEDTLS_ERR_ENTROPY_FILE_IO_ERROR;
+		}
+		if(ret == 0 && rename(tmpfile, path) != 0)
+		{
+			ret = MBEDTLS_ERR_ENTROPY_FILE_IO_ERROR;
+		}
+		if(ret != 0)
+		{
+			unlink(tmpfile);
+		}
+	}
+	free(tmpfile);
+	mbedtls_platform_zeroize(buf, sizeof(buf));
+	sf->updated = 1;
+	
+	return ret;
+}
+
+int mbedtlsclu_seed_file_finish(mbedtlsclu_seed_file* sf, mbedtls_ctr_drbg_context* ctr_drbg)
+{
+	// Before the DRBG is seeded its output is predictable, never write that
+	if(!sf->updated)
+	{
+		return 0;
+	}
+	
+	return mbedtlsclu_seed_file_update(sf, ctr_drbg);
+}
@@ -34,7 +34,9 @@
 #include "mbedtls/x509_crt.h"
 #include "mbedtls/error.h"
 #include "mbedtls/entropy.h"
+#include "mbedtls/entropy_poll.h"
 #include "mbedtls/ctr_drbg.h"
+#include "mbedtls/sha256.h"
 
 #define MBEDTLSCLU_NONE		-1
 #define MBEDTLSCLU_EMERG	0
@@ -55,8 +57,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include "erics_tools.h"
 #define malloc safe_malloc
@@ -70,6 +82,53 @@
 #define OPENSSL_ENV_CONF	"OPENSSL_CONF"
 #endif
 #define MBEDTLS_ENV_CONF	"MBEDTLS_CONF"
+/* Directory to cache parsed config files in, unset to always parse */
+#define MBEDTLS_ENV_CONF_CACHE	"MBEDTLS_CONF_CACHE"
+
+/*
+ * Entropy source used for -usedevrandom. Reads the kernel's pool with getrandom(2),
+ * GRND_NONBLOCK and only with GRND_RANDOM when random_pool is set (-randompool), falling
+ * back to a single /dev/random descriptor kept open for the whole run
+ */
+#define MBEDTLSCLU_ENTROPY_THRESHOLD	32
+#define MBEDTLSCLU_ENTROPY_WAIT_MS		1000	/* Longest wait for the pool in one poll */
+
+#define MBEDTLSCLU_ENTROPY_GETRANDOM	0
+#define MBEDTLSCLU_ENTROPY_DEVICE		1
+
+#if defined(MBEDTLS_FS_IO)
+#define USAGE_DEV_RANDOM \
+	"    -usedevrandom			Also poll the kernel's pool with getrandom(2) or /dev/random (default no)\n"	\
+	"    -randompool				As -usedevrandom, from the blocking pool with GRND_RANDOM (default no)\n"
+#else
+#define USAGE_DEV_RANDOM ""
+#endif /* MBEDTLS_FS_IO */
+
+/*
+ * Seed file for -rand/-writerand (like OpenSSL's RANDFILE). The seed is mixed in as a
+ * strong entropy source and replaced with fresh DRBG output once seeded and again at exit
+ */
+#define MBEDTLSCLU_SEED_FILE_SIZE		MBEDTLS_ENTROPY_BLOCK_SIZE
+#define MBEDTLSCLU_SEED_FILE_MIN		32
+
+#define USAGE_SEED_FILE \
+	"    -rand file				Load a seed file into the random number generator\n"	\
+	"    -writerand file		Write a new seed file at exit (default: the -rand file)\n"
+
+/*
+ * Deterministic seeding for -seed, only built with MBEDTLSCLU_TEST_SEED (make TEST_SEED=1).
+ * Every DRBG is seeded from a SHA-256 counter stream over the seed instead of the entropy
+ * context, so keys, primes and serials repeat from run to run. Threaded searches still race,
+ * so identical output needs -threads 1. NEVER use these keys
+ */
+#define MBEDTLSCLU_TEST_SEED_MAX		64
+
+#if defined(MBEDTLSCLU_TEST_SEED)
+#define USAGE_TEST_SEED \
+	"    -seed hex				UNSAFE: deterministic RNG for benchmarks and fixtures\n"
+#else
+#define USAGE_TEST_SEED ""
+#endif /* MBEDTLSCLU_TEST_SEED */
 
 #define FORMAT_PEM              0
 #define FORMAT_DER              1
@@ -79,10 +138,13 @@
 #define REQ_TYPE_EXTFILE		2
 #define REQ_TYPE_UNSPEC			-1
 
+#define CONF_DEFAULT_SECTION	"default"	/* Keys above the first [ section ] */
+
+/* Diagnostics go to stderr so they never mix with what a utility writes to stdout */
 extern int log_level;
 #define mbedtlsclu_prio_printf(priority,format,args...) \
 	if(priority <= log_level) \
-		mbedtls_printf(format, ## args);
+		mbedtls_fprintf(stderr, format, ## args);
 
 typedef struct conf_req_csr_parameters {
 	char* default_bits;
@@ -152,6 +214,19 @@ typedef struct conf_req_crt_parameters {
 }
 conf_req_crt_parameters;
 
+/*
+ * A config file parsed in one pass, section name -> string_map of key -> value.
+ * When it came from a valid cache, sections is NULL and lookups search the mapped cache instead
+ */
+typedef struct conf_file {
+	string_map* sections;
+	string_map* env;				/* $ENV:: names used, so the cache can check them */
+	
+	unsigned char* cache;			/* mmap of the cache file */
+	size_t cache_len;
+}
+conf_file;
+
 typedef struct ca_db_entry {
 	char* status;
 	char* expiration_date;
@@ -162,9 +237,37 @@ typedef struct ca_db_entry {
 }
 ca_db_entry;
 
+typedef struct mbedtlsclu_entropy_source {
+	int backend;
+	int fd;
+	int random_pool;			/* Add GRND_RANDOM to getrandom(2), set by -randompool */
+	
+	/* Health counters */
+	unsigned long polls;
+	unsigned long bytes;
+	unsigned long short_reads;
+	unsigned long waits;
+	unsigned long errors;
+	int last_errno;
+}
+mbedtlsclu_entropy_source;
+
+typedef struct mbedtlsclu_seed_file {
+	char* path;			/* -rand, NULL for none */
+	char* write_path;	/* -writerand, NULL to rewrite path */
+	
+	unsigned char seed[MBEDTLSCLU_SEED_FILE_SIZE];
+	size_t len;
+	int updated;
+}
+mbedtlsclu_seed_file;
+
 typedef struct ca_db {
 	ca_db_entry* ca_database_entries;
 	char* unique_subject;
+	
+	char* data;						/* the file as read, entries loaded from it point in here */
+	unsigned long data_len;
 }
 ca_db;
 
@@ -180,11 +283,25 @@ int print_mpi_hex_text(mbedtls_mpi* X, char* heading);
 /* Sets the default values of the structs */
 void initialise_conf_req_csr_parameters(conf_req_csr_parameters* X);
 void initialise_conf_req_crt_parameters(conf_req_crt_parameters* X);
+/* Frees every value found by parse_config_file and resets it to NULL */
+void free_conf_req_csr_parameters(conf_req_csr_parameters* X);
+void free_conf_req_crt_parameters(conf_req_crt_parameters* X);
 
 /* Config parsing functions */
-int read_config_file(char* conffile, char*** contents, unsigned long* lines);
-int locate_tag(char** haystack, unsigned long haystack_size, char* needle, int* needleLoc, int* endNeedleLoc);
-int locate_value(char** haystack, int startline, int endline, char* needle, char** value, int keepsearching);
+void conf_file_init(conf_file* conf);
+void conf_file_free(conf_file* conf);
+/*
+ * Reads every [ section ] and key = value of conffile, expanding $var as it goes. Returns 0 or -1.
+ * With a cache_dir the result is cached there and reused until the file or a $ENV:: it uses changes
+ */
+int load_conf_file(char* conffile, const char* cache_dir, conf_file* conf);
+/* The cache file of conffile in cache_dir, to be freed */
+char* conf_cache_path(const char* conffile, const char* cache_dir);
+int has_conf_section(conf_file* conf, const char* section);
+/* The value of key in section, NULL if either is missing */
+char* get_conf_value(conf_file* conf, const char* section, const char* key);
+/* Copies the value of key in section over *value. Returns 0 if found, -1 leaving *value alone */
+int copy_conf_value(conf_file* conf, const char* section, const char* key, char** value);
 int parse_config_file(char* conffile, int reqtype, void* void_params);
 
 int x509_name_cmp(const mbedtls_x509_name *a, const mbedtls_x509_name *b);
@@ -192,4 +309,46 @@ int x509_name_cmp(const mbedtls_x509_name *a, const mbedtls_x509_name *b);
 int write_certificate(mbedtls_x509write_cert *crt, const char *output_file,
                       int (*f_rng)(void *, unsigned char *, size_t),
                       void *p_rng);
+
+/* Entropy source for -usedevrandom */
+void mbedtlsclu_entropy_source_init(mbedtlsclu_entropy_source* src);
+void mbedtlsclu_entropy_source_free(mbedtlsclu_entropy_source* src);
+int mbedtlsclu_entropy_poll(void *data, unsigned char *output, size_t len, size_t *olen);
+int mbedtlsclu_entropy_add_source(mbedtls_entropy_context* entropy, mbedtlsclu_entropy_source* src);
+void mbedtlsclu_entropy_report(const mbedtlsclu_entropy_source* src);
+
+/* Seed file for -rand/-writerand */
+void mbedtlsclu_seed_file_init(mbedtlsclu_seed_file* sf);
+void mbedtlsclu_seed_file_free(mbedtlsclu_seed_file* sf);
+/* Reads sf->path and adds it to entropy. If the kernel pool is not ready yet the blocking
+ * platform source is dropped, so seeding does not stall on a fresh boot */
+int mbedtlsclu_seed_file_load(mbedtlsclu_seed_file* sf, mbedtls_entropy_context* entropy);
+/* Replaces the seed file with output from ctr_drbg, call as soon as it is seeded. Does nothing if neither path is set */
+int mbedtlsclu_seed_file_update(mbedtlsclu_seed_file* sf, mbedtls_ctr_drbg_context* ctr_drbg);
+/* Replaces the seed file again at exit, only if mbedtlsclu_seed_file_update was reached */
+int mbedtlsclu_seed_file_finish(mbedtlsclu_seed_file* sf, mbedtls_ctr_drbg_context* ctr_drbg);
+
+/* Sets the -seed value from a hex string. Returns -1 if it is not valid hex or too long */
+int mbedtlsclu_set_test_seed(const char* hex);
+/* Returns 1 if -seed is in effect */
+int mbedtlsclu_test_seed_active(void);
+/* mbedtls_entropy_func serialised by one process wide lock, for DRBGs used on worker threads */
+int mbedtlsclu_entropy_func(void *data, unsigned char *output, size_t len);
+/* mbedtls_ctr_drbg_seed from entropy, or from the -seed stream when it is set */
+int mbedtlsclu_ctr_drbg_seed(mbedtls_ctr_drbg_context* ctr_drbg, mbedtls_entropy_context* entropy,
+								const unsigned char* custom, size_t len);
+
+/* Returns the number of online processors, or 1 if this cannot be determined */
+int mbedtlsclu_cpu_count(void);
+/* The worker count from -threads, or dfl if it was not given (threads 0). Under -seed it
+ * defaults to 1 and warns when more are asked for, as the result is only repeatable on one */
+int mbedtlsclu_worker_threads(int threads, int dfl);
+
+/* Seeds count (already initialised) CTR_DRBG contexts from a single entropy context.
+ * Each context is personalised with pers and its index so the streams are independent.
+ * The entropy context is not thread safe, but every context seeded here (or by
+ * mbedtlsclu_ctr_drbg_seed) reseeds through mbedtlsclu_entropy_func, so workers may
+ * reseed from it concurrently */
+int mbedtlsclu_seed_ctr_drbgs(mbedtls_ctr_drbg_context* ctr_drbgs, int count,
+								mbedtls_entropy_context* entropy, const char* pers);
 #endif
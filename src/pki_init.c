@@ -0,0 +1,870 @@
+/* pki_init -	Bootstrap a PKI in one process: CA, server certificate,
+ *				DH parameters and any number of client certificates
+ *
+ *			The directory layout follows EasyRSA 3 (ca.crt, private/,
+ *			issued/, certs_by_serial/, index.txt, serial, dh.pem) so the
+ *			result can be managed afterwards with ca and req as usual.
+ *			Everything shares one parsed command line and one seeded
+ *			entropy pool, and the keys are generated in parallel.
+ *
+ * Copyright © 2024 by Michael Gray <support@lantisproject.com>
+ *
+ * This file is free software: you may copy, redistribute and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pki_init.h"
+#include "genpkey.h"
+#include "dhparam.h"
+
+#define DFL_PKI_DIR				"pki"
+#define DFL_CA_SUBJECT			"CN=Easy-RSA CA"
+#define DFL_SERVER_NAME			"server"
+#define DFL_CLIENT_PREFIX		"client"
+#define DFL_CA_DAYS				3650
+#define DFL_DAYS				825
+#define DFL_DH_BITS				2048
+#define DFL_MD					"SHA256"
+#define MAX_THREADS				256
+#define MAX_CLIENTS				65536
+
+#define USAGE \
+    "\n usage: pki-init [options]\n"																			\
+    "\n\n General options:\n"																					\
+    "    -help					Display this summary\n"															\
+    "    -pkidir dir			Directory to create the PKI in (default: " DFL_PKI_DIR ")\n"					\
+    "							NOTE: An existing PKI (ca.crt or index.txt) is never overwritten\n"			\
+    "    -threads n				Number of threads to use (default: all cpus)\n"									\
+    "\n\n Certificate options:\n"																				\
+    "    -subj val				CA subject (default: " DFL_CA_SUBJECT ")\n"										\
+    "    -server name			Server certificate name, CN=name (default: " DFL_SERVER_NAME ")\n"				\
+    "    -clients n				Number of client certificates (default: 0)\n"									\
+    "    -client_prefix val		Client certificates are named <val>1 to <val>n (default: " DFL_CLIENT_PREFIX ")\n"	\
+    "    -cadays +int			Number of days the CA cert is valid for (default: 3650)\n"						\
+    "    -days +int				Number of days the other certs are valid for (default: 825)\n"					\
+    "    -md val				Digest to use, such as sha256\n"												\
+    "\n\n Key options:\n"																						\
+    "    -newkey val			Key type for every key, [<alg>:]<nbits> or <alg>[:<curve or file>] (default: rsa:2048)\n"	\
+    "    -dhbits n				Size of the DH parameters, 0 for none (default: 2048)\n"						\
+    USAGE_DEV_RANDOM																							\
+    USAGE_SEED_FILE
+
+#if !defined(MBEDTLS_X509_CRT_WRITE_C) || !defined(MBEDTLS_PK_WRITE_C) || \
+    !defined(MBEDTLS_FS_IO) || !defined(MBEDTLS_ENTROPY_C) || \
+    !defined(MBEDTLS_CTR_DRBG_C) || !defined(MBEDTLS_PEM_WRITE_C) || \
+    !defined(MBEDTLS_GENPRIME)
+int pki_init_main(void)
+{
+    mbedtls_printf("MBEDTLS_X509_CRT_WRITE_C and/or MBEDTLS_PK_WRITE_C and/or "
+                   "MBEDTLS_FS_IO and/or MBEDTLS_ENTROPY_C and/or "
+                   "MBEDTLS_CTR_DRBG_C and/or MBEDTLS_PEM_WRITE_C and/or "
+                   "MBEDTLS_GENPRIME not defined.\n");
+    mbedtls_exit(0);
+}
+#else
+
+#define SET_OID(x, oid) \
+    do { x.len = MBEDTLS_OID_SIZE(oid); x.p = (unsigned char*)oid; } while( 0 )
+
+/* The CA, the server or a client: what gets generated and where it is written */
+typedef struct pki_init_entity {
+	int type;
+	char* subject;
+	char* keyfile;
+	char* crtfile;
+	mbedtls_pk_context key;
+	int ret;
+} pki_init_entity;
+
+/*
+ * Key generation: the entities are claimed by the workers in turn,
+ * each worker generating with its own DRBG
+ */
+typedef struct pki_init_queue {
+	pthread_mutex_t lock;
+	pki_init_entity* entities;
+	int num_entities;
+	int next_entity;
+	const genpkey_params* params;
+} pki_init_queue;
+
+typedef struct pki_init_worker {
+	pki_init_queue* queue;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+	pthread_t thread;
+} pki_init_worker;
+
+static void* pki_init_key_worker(void* arg)
+{
+	pki_init_worker* worker = (pki_init_worker*)arg;
+	pki_init_queue* queue = worker->queue;
+	pki_init_entity* entity;
+
+	while(1)
+	{
+		pthread_mutex_lock(&queue->lock);
+		if(queue->next_entity >= queue->num_entities)
+		{
+			pthread_mutex_unlock(&queue->lock);
+			break;
+		}
+		entity = &queue->entities[queue->next_entity];
+		queue->next_entity += 1;
+		pthread_mutex_unlock(&queue->lock);
+
+		if((entity->ret = genpkey_gen_key(&entity->key, queue->params, worker->ctr_drbg)) == 0)
+		{
+			entity->ret = genpkey_write_key(&entity->key, 0, FORMAT_PEM, entity->keyfile);
+		}
+	}
+
+	return NULL;
+}
+
+/* Generates and writes every entity's key using threads workers. Returns the first error */
+static int pki_init_gen_keys(pki_init_entity* entities, int num_entities, const genpkey_params* params,
+								int threads, mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	int ret = 0;
+	int started = 0;
+	pki_init_queue queue;
+	pki_init_worker* workers;
+
+	queue.entities = entities;
+	queue.num_entities = num_entities;
+	queue.next_entity = 0;
+	queue.params = params;
+	pthread_mutex_init(&queue.lock, NULL);
+	workers = (pki_init_worker*)malloc(sizeof(pki_init_worker) * threads);
+	for(int i = 0; i < threads; i++)
+	{
+		workers[i].queue = &queue;
+		workers[i].ctr_drbg = &ctr_drbgs[i];
+	}
+
+	for(started = 0; threads > 1 && started < threads; started++)
+	{
+		if(pthread_create(&workers[started].thread, NULL, pki_init_key_worker, &workers[started]) != 0)
+		{
+			break;
+		}
+	}
+	if(started == 0)
+	{
+		pki_init_key_worker(&workers[0]);
+	}
+	for(int i = 0; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	for(int i = 0; i < num_entities && ret == 0; i++)
+	{
+		if((ret = entities[i].ret) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not generate %s, returned -0x%04x\n",
+									entities[i].keyfile, (unsigned int) -ret);
+		}
+	}
+
+	pthread_mutex_destroy(&queue.lock);
+	free(workers);
+
+	return ret;
+}
+
+/* Writes len bytes of buf to path, returns 0 or -1 as write_certificate does */
+static int pki_init_write_file(const char* path, const unsigned char* buf, size_t len)
+{
+	FILE* f;
+
+	if((f = fopen(path, "w")) == NULL)
+	{
+		return -1;
+	}
+	if(fwrite(buf, 1, len, f) != len)
+	{
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	return 0;
+}
+
+/*
+ * Whether name can go into a file name under pkidir and a CN= subject as is. Path
+ * separators and .. would leave the directory, and , = + \ start a new RDN or attribute
+ */
+static int pki_init_valid_name(const char* name)
+{
+	return (name[0] != '\0' && strpbrk(name, "/\\,=+") == NULL && strstr(name, "..") == NULL);
+}
+
+/* Sets notbefore to now and notafter to days from now, both as YYYYMMDDHHMMSS */
+static void pki_init_validity(int days, char* notbefore, char* notafter)
+{
+	struct tm today, future;
+	const time_t ONEDAY = 24 * 60 * 60;
+	time_t timenow = time(NULL);
+	today = *gmtime(&timenow);
+	timenow += (days * ONEDAY);
+	future = *gmtime(&timenow);
+	sprintf(notbefore, "%04d%02d%02d%02d%02d%02d", today.tm_year + 1900, today.tm_mon + 1, today.tm_mday,
+			today.tm_hour, today.tm_min, today.tm_sec);
+	sprintf(notafter, "%04d%02d%02d%02d%02d%02d", future.tm_year + 1900, future.tm_mon + 1, future.tm_mday,
+			future.tm_hour, future.tm_min, future.tm_sec);
+}
+
+/*
+ * Issues entity's certificate signed by ca (which may be entity itself) with the
+ * extensions EasyRSA uses for that type, and writes it to entity->crtfile and,
+ * unless it is NULL, to copyfile
+ */
+static int pki_init_issue(pki_init_entity* entity, pki_init_entity* ca, mbedtls_mpi* serial,
+							const char* notbefore, const char* notafter, mbedtls_md_type_t md_alg,
+							const char* copyfile, mbedtls_ctr_drbg_context* ctr_drbg)
+{
+	int ret;
+	unsigned char output_buf[4096];
+	mbedtls_x509write_cert crt;
+	mbedtls_asn1_sequence ext_key_usage;
+	unsigned char key_usage;
+	unsigned char ns_cert_type;
+
+	mbedtls_x509write_crt_init(&crt);
+	memset(&ext_key_usage, 0, sizeof(ext_key_usage));
+	ext_key_usage.buf.tag = MBEDTLS_ASN1_OID;
+
+	mbedtls_x509write_crt_set_version(&crt, MBEDTLS_X509_CRT_VERSION_3);
+	mbedtls_x509write_crt_set_md_alg(&crt, md_alg);
+	mbedtls_x509write_crt_set_subject_key(&crt, &entity->key);
+	mbedtls_x509write_crt_set_issuer_key(&crt, &ca->key);
+
+	if((ret = mbedtls_x509write_crt_set_subject_name(&crt, entity->subject)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_issuer_name(&crt, ca->subject)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_serial(&crt, serial)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_validity(&crt, notbefore, notafter)) != 0)
+	{
+		goto exit;
+	}
+
+	if(entity->type == PKI_INIT_CA)
+	{
+		key_usage = MBEDTLS_X509_KU_KEY_CERT_SIGN | MBEDTLS_X509_KU_CRL_SIGN;
+		ns_cert_type = MBEDTLS_X509_NS_CERT_TYPE_SSL_CA;
+		ret = mbedtls_x509write_crt_set_basic_constraints(&crt, 1, -1);
+	}
+	else if(entity->type == PKI_INIT_SERVER)
+	{
+		key_usage = MBEDTLS_X509_KU_DIGITAL_SIGNATURE | MBEDTLS_X509_KU_KEY_ENCIPHERMENT;
+		ns_cert_type = MBEDTLS_X509_NS_CERT_TYPE_SSL_SERVER;
+		SET_OID(ext_key_usage.buf, MBEDTLS_OID_SERVER_AUTH);
+		ret = mbedtls_x509write_crt_set_basic_constraints(&crt, 0, -1);
+	}
+	else
+	{
+		key_usage = MBEDTLS_X509_KU_DIGITAL_SIGNATURE;
+		ns_cert_type = MBEDTLS_X509_NS_CERT_TYPE_SSL_CLIENT;
+		SET_OID(ext_key_usage.buf, MBEDTLS_OID_CLIENT_AUTH);
+		ret = mbedtls_x509write_crt_set_basic_constraints(&crt, 0, -1);
+	}
+	if(ret != 0)
+	{
+		goto exit;
+	}
+
+#if defined(MBEDTLS_SHA1_C)
+	if((ret = mbedtls_x509write_crt_set_subject_key_identifier(&crt)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_authority_key_identifier(&crt)) != 0)
+	{
+		goto exit;
+	}
+#endif
+
+	if((ret = mbedtls_x509write_crt_set_key_usage(&crt, key_usage)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_ns_cert_type(&crt, ns_cert_type)) != 0)
+	{
+		goto exit;
+	}
+	if(entity->type != PKI_INIT_CA &&
+		(ret = mbedtls_x509write_crt_set_ext_key_usage(&crt, &ext_key_usage)) != 0)
+	{
+		goto exit;
+	}
+
+	if((ret = mbedtls_x509write_crt_pem(&crt, output_buf, sizeof(output_buf),
+										mbedtls_ctr_drbg_random, ctr_drbg)) != 0)
+	{
+		goto exit;
+	}
+	if((ret = pki_init_write_file(entity->crtfile, output_buf, strlen((char*) output_buf))) == 0 && copyfile != NULL)
+	{
+		ret = pki_init_write_file(copyfile, output_buf, strlen((char*) output_buf));
+	}
+
+exit:
+	mbedtls_x509write_crt_free(&crt);
+
+	return ret;
+}
+
+/* Writes a line of the CA database (index.txt) for an issued certificate, as ca does */
+static void pki_init_write_index_line(FILE* fout, pki_init_entity* entity, mbedtls_mpi* serial, const char* notafter)
+{
+	char serialbuf[256];
+	size_t len = 0;
+	char* tmp_subject;
+
+	mbedtls_mpi_write_string(serial, 16, serialbuf, sizeof(serialbuf), &len);
+	tmp_subject = dynamic_replace(entity->subject, ",", "/");
+	// Remove leading 2 digits from 4 digit year representation and add "Z"
+	fprintf(fout, "V\t%sZ\t\t%s\tunknown\t/%s\n", notafter + 2, serialbuf, tmp_subject);
+	free(tmp_subject);
+}
+
+int pki_init_main(int argc, char** argv, int argi)
+{
+	int ret = 1;
+	int exit_code = MBEDTLS_EXIT_FAILURE;
+	int i;
+	char* p;
+	char buf[1024];
+	mbedtls_entropy_context entropy;
+	mbedtlsclu_entropy_source entropy_source;
+	mbedtlsclu_seed_file seed_file;
+	mbedtls_ctr_drbg_context ctr_drbg;
+	mbedtls_ctr_drbg_context* thread_ctr_drbgs = NULL;
+	const char* pers = "pki-init";
+	int use_dev_random = 0;
+	int threads = 0;
+
+	char* pkidir = NULL;
+	char* ca_subject = NULL;
+	char* server_name = NULL;
+	char* client_prefix = NULL;
+	int num_clients = 0;
+	int ca_days = DFL_CA_DAYS;
+	int days = DFL_DAYS;
+	char* md_alg_in = NULL;
+	mbedtls_md_type_t md_alg;
+	const mbedtls_md_info_t* md_info;
+	char* newkey_optsin = NULL;
+	genpkey_params key_params;
+	int dh_bits = DFL_DH_BITS;
+
+	pki_init_entity* entities = NULL;
+	int num_entities = 0;
+	char* path;
+	char* dbfile = NULL;
+	char notbefore[32];
+	char notafter[32];
+	char serialbuf[256];
+	size_t len;
+	mbedtls_mpi serial, G, P;
+	genprime_job job;
+	FILE* fout = NULL;
+
+	mbedtls_ctr_drbg_init(&ctr_drbg);
+	mbedtls_entropy_init(&entropy);
+	mbedtlsclu_entropy_source_init(&entropy_source);
+	mbedtlsclu_seed_file_init(&seed_file);
+	mbedtls_mpi_init(&serial); mbedtls_mpi_init(&G); mbedtls_mpi_init(&P);
+	genprime_init(&job, GENPRIME_TYPE_SAFE);
+	genpkey_params_init(&key_params);
+
+#if defined(MBEDTLS_USE_PSA_CRYPTO)
+	psa_status_t status = psa_crypto_init();
+	if (status != PSA_SUCCESS) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"Failed to initialize PSA Crypto implementation: %d\n",
+						(int) status);
+		goto exit;
+	}
+#endif /* MBEDTLS_USE_PSA_CRYPTO */
+
+	for(i = argi; i < argc; i++)
+	{
+		p = argv[i];
+
+		if(strcmp(p,"-help") == 0)
+		{
+usage:
+			mbedtls_printf(USAGE);
+			goto exit;
+		}
+		else if(strcmp(p,"-pkidir") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the directory. Advance i
+			i += 1;
+			pkidir = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-threads") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of threads. Advance i
+			i += 1;
+			threads = atoi(argv[i]);
+			if(threads < 1 || threads > MAX_THREADS)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-subj") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the CA subject. Advance i
+			i += 1;
+			ca_subject = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-server") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the server name. Advance i
+			i += 1;
+			server_name = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-clients") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of clients. Advance i
+			i += 1;
+			num_clients = atoi(argv[i]);
+			if(num_clients < 0 || num_clients > MAX_CLIENTS)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-client_prefix") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the client name prefix. Advance i
+			i += 1;
+			client_prefix = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-cadays") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of days. Advance i
+			i += 1;
+			ca_days = atoi(argv[i]);
+			if(ca_days <= 0)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-days") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of days. Advance i
+			i += 1;
+			days = atoi(argv[i]);
+			if(days <= 0)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-md") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the digest. Advance i
+			i += 1;
+			md_alg_in = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-newkey") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the key spec. Advance i
+			i += 1;
+			newkey_optsin = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-dhbits") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the DH size. Advance i
+			i += 1;
+			dh_bits = atoi(argv[i]);
+			if(dh_bits != 0 && (dh_bits < 1024 || dh_bits > MBEDTLS_MPI_MAX_BITS))
+			{
+				goto usage;
+			}
+		}
+#if defined(MBEDTLS_FS_IO)
+		else if(strcmp(p,"-usedevrandom") == 0)
+		{
+			use_dev_random = 1;
+		}
+		else if(strcmp(p,"-randompool") == 0)
+		{
+			use_dev_random = 1;
+			entropy_source.random_pool = 1;
+		}
+#endif /* MBEDTLS_FS_IO */
+		else if(strcmp(p,"-rand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.path = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-writerand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.write_path = strdup(argv[i]);
+		}
+		else
+		{
+			// unknown param
+			goto usage;
+		}
+	}
+
+	if(pkidir == NULL)
+	{
+		pkidir = strdup(DFL_PKI_DIR);
+	}
+	if(ca_subject == NULL)
+	{
+		ca_subject = strdup(DFL_CA_SUBJECT);
+	}
+	if(server_name == NULL)
+	{
+		server_name = strdup(DFL_SERVER_NAME);
+	}
+	if(client_prefix == NULL)
+	{
+		client_prefix = strdup(DFL_CLIENT_PREFIX);
+	}
+	if(md_alg_in == NULL)
+	{
+		md_alg_in = strdup(DFL_MD);
+	}
+	if(!pki_init_valid_name(server_name) || !pki_init_valid_name(client_prefix))
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  ! -server and -client_prefix must be non-empty and free of / .. , = + \\\n");
+		goto usage;
+	}
+
+	threads = mbedtlsclu_worker_threads(threads, mbedtlsclu_cpu_count());
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: pkidir: %s\n", pkidir);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: threads: %d\n", threads);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: subj: %s\n", ca_subject);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: server: %s\n", server_name);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: clients: %d\n", num_clients);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: client_prefix: %s\n", client_prefix);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: cadays: %d\n", ca_days);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: days: %d\n", days);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: md: %s\n", md_alg_in);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: newkey: %s\n", newkey_optsin);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: dhbits: %d\n", dh_bits);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: usedevrandom: %d\n", use_dev_random);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: randompool: %d\n", entropy_source.random_pool);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: rand: %s\n", seed_file.path);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: writerand: %s\n", seed_file.write_path);
+
+	// Compatibility with openssl-util lowercase digests
+	to_uppercase(md_alg_in);
+	if((md_info = mbedtls_md_info_from_string(md_alg_in)) == NULL)
+	{
+		mbedtls_printf("Invalid digest provided: %s\n", md_alg_in);
+		goto usage;
+	}
+	md_alg = mbedtls_md_get_type(md_info);
+
+	if(newkey_optsin != NULL && (ret = genpkey_parse_spec(newkey_optsin, &key_params, 0, 0, 0)) != 0)
+	{
+		if(ret == -1)
+		{
+			goto usage;
+		}
+		goto exit;
+	}
+
+	/*
+	 * 0. Refuse to touch an existing PKI
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Checking the PKI directory %s...", pkidir);
+	fflush(stdout);
+
+	dbfile = dynamic_strcat(2, pkidir, "/index.txt");
+	path = dynamic_strcat(2, pkidir, "/ca.crt");
+	ret = (path_exists(path) != PATH_DOES_NOT_EXIST || path_exists(dbfile) != PATH_DOES_NOT_EXIST);
+	free(path);
+	if(ret)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  %s already holds a PKI\n", pkidir);
+		goto exit;
+	}
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	/*
+	 * 1. Seed the PRNGs, one for us and one per worker
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Seeding the random number generators...");
+	fflush(stdout);
+
+	if (use_dev_random) {
+		if ((ret = mbedtlsclu_entropy_add_source(&entropy, &entropy_source)) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_entropy_add_source returned %d\n", ret);
+			goto exit;
+		}
+	}
+
+	if ((ret = mbedtlsclu_seed_file_load(&seed_file, &entropy)) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_seed_file_load returned %d\n", ret);
+		goto exit;
+	}
+
+	if ((ret = mbedtlsclu_ctr_drbg_seed(&ctr_drbg, &entropy,
+									 (const unsigned char *) pers,
+									 strlen(pers))) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_ctr_drbg_seed returned %d\n", ret);
+		goto exit;
+	}
+
+	thread_ctr_drbgs = (mbedtls_ctr_drbg_context*)malloc(sizeof(mbedtls_ctr_drbg_context) * threads);
+	for(int t = 0; t < threads; t++)
+	{
+		mbedtls_ctr_drbg_init(&thread_ctr_drbgs[t]);
+	}
+	if ((ret = mbedtlsclu_seed_ctr_drbgs(thread_ctr_drbgs, threads, &entropy, pers)) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_seed_ctr_drbgs returned %d\n", ret);
+		goto exit;
+	}
+
+	if ((ret = mbedtlsclu_seed_file_update(&seed_file, &ctr_drbg)) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"\n  !  Could not write seed file, mbedtlsclu_seed_file_update returned %d\n", ret);
+	}
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	/*
+	 * 2. DH parameters, with every thread on the safe prime search. This is the slowest
+	 * step and the one most likely to fail or be cut short, so it runs before anything is
+	 * written and an interrupted run leaves nothing behind to clean up
+	 */
+	if(dh_bits > 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Generating %d bit DH parameters, please wait...", dh_bits);
+		fflush(stdout);
+
+		mbedtls_mpi_lset(&G, 2);
+		if ((ret = genprime_add_search(&job, dh_bits)) < 0 ||
+			(ret = genprime_run(&job, threads, thread_ctr_drbgs)) != 0 ||
+			(ret = genprime_result(&job, 0, &P)) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  genprime_run returned -0x%04x\n", (unsigned int) -ret);
+			goto exit;
+		}
+		genprime_done(&job);
+
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+	}
+
+	/*
+	 * 3. Lay out the PKI directory
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Creating the PKI directory %s...", pkidir);
+	fflush(stdout);
+
+	ret = mkdir_p(pkidir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+	path = dynamic_strcat(2, pkidir, "/private");
+	ret = (ret != 0 ? ret : mkdir_p(path, S_IRWXU));
+	free(path);
+	path = dynamic_strcat(2, pkidir, "/issued");
+	ret = (ret != 0 ? ret : mkdir_p(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH));
+	free(path);
+	path = dynamic_strcat(2, pkidir, "/certs_by_serial");
+	ret = (ret != 0 ? ret : mkdir_p(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH));
+	free(path);
+	if(ret != 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not create the directories in %s\n", pkidir);
+		goto exit;
+	}
+
+	// The CA is always first, then the server and the clients in order
+	entities = (pki_init_entity*)calloc(2 + num_clients, sizeof(pki_init_entity));
+	entities[0].type = PKI_INIT_CA;
+	entities[0].subject = strdup(ca_subject);
+	entities[0].keyfile = dynamic_strcat(2, pkidir, "/private/ca.key");
+	entities[0].crtfile = dynamic_strcat(2, pkidir, "/ca.crt");
+	entities[1].type = PKI_INIT_SERVER;
+	entities[1].subject = dynamic_strcat(2, "CN=", server_name);
+	entities[1].keyfile = dynamic_strcat(4, pkidir, "/private/", server_name, ".key");
+	entities[1].crtfile = dynamic_strcat(4, pkidir, "/issued/", server_name, ".crt");
+	num_entities = 2;
+	for(int c = 1; c <= num_clients; c++, num_entities++)
+	{
+		snprintf(buf, sizeof(buf), "%s%d", client_prefix, c);
+		entities[num_entities].type = PKI_INIT_CLIENT;
+		entities[num_entities].subject = dynamic_strcat(2, "CN=", buf);
+		entities[num_entities].keyfile = dynamic_strcat(4, pkidir, "/private/", buf, ".key");
+		entities[num_entities].crtfile = dynamic_strcat(4, pkidir, "/issued/", buf, ".crt");
+	}
+	for(int e = 0; e < num_entities; e++)
+	{
+		mbedtls_pk_init(&entities[e].key);
+	}
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	/*
+	 * 4. Generate every key, in parallel
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Generating %d keys (%d thread%s)...", num_entities,
+							(threads < num_entities ? threads : num_entities),
+							((threads < num_entities ? threads : num_entities) == 1 ? "" : "s"));
+	fflush(stdout);
+
+	if ((ret = pki_init_gen_keys(entities, num_entities, &key_params,
+									(threads < num_entities ? threads : num_entities), thread_ctr_drbgs)) != 0) {
+		goto exit;
+	}
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	/*
+	 * 5. Issue the certificates. The CA is self signed with a random serial,
+	 * the rest are numbered from 1 as ca would
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Issuing %d certificates...", num_entities);
+	fflush(stdout);
+
+	// Bit 159 clear keeps the positive DER INTEGER within the 20 octets RFC 5280 allows
+	if ((ret = mbedtls_mpi_fill_random(&serial, 20, mbedtls_ctr_drbg_random, &ctr_drbg)) != 0 ||
+		(ret = mbedtls_mpi_set_bit(&serial, 159, 0)) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not make the CA serial, returned %d\n", ret);
+		goto exit;
+	}
+	pki_init_validity(ca_days, notbefore, notafter);
+	if ((ret = pki_init_issue(&entities[0], &entities[0], &serial, notbefore, notafter, md_alg, NULL, &ctr_drbg)) != 0) {
+		mbedtls_strerror(ret, buf, sizeof(buf));
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not issue %s, returned -0x%04x - %s\n",
+								entities[0].crtfile, (unsigned int) -ret, buf);
+		goto exit;
+	}
+
+	if ((fout = fopen(dbfile, "wb+")) == NULL) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not create %s\n", dbfile);
+		goto exit;
+	}
+
+	pki_init_validity(days, notbefore, notafter);
+	mbedtls_mpi_lset(&serial, 1);
+	for(int e = 1; e < num_entities; e++)
+	{
+		// EasyRSA also keeps a copy of each issued certificate by serial
+		mbedtls_mpi_write_string(&serial, 16, serialbuf, sizeof(serialbuf), &len);
+		path = dynamic_strcat(4, pkidir, "/certs_by_serial/", serialbuf, ".pem");
+		ret = pki_init_issue(&entities[e], &entities[0], &serial, notbefore, notafter, md_alg, path, &ctr_drbg);
+		free(path);
+		if (ret != 0) {
+			mbedtls_strerror(ret, buf, sizeof(buf));
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not issue %s, returned -0x%04x - %s\n",
+									entities[e].crtfile, (unsigned int) -ret, buf);
+			goto exit;
+		}
+
+		pki_init_write_index_line(fout, &entities[e], &serial, notafter);
+		mbedtls_mpi_add_int(&serial, &serial, 1);
+	}
+	fclose(fout);
+	fout = NULL;
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	/*
+	 * 6. The rest of the CA database: the attr file and the next serial
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Writing the CA database...");
+	fflush(stdout);
+
+	path = dynamic_strcat(2, dbfile, ".attr");
+	fout = fopen(path, "wb+");
+	free(path);
+	if (fout == NULL) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not create %s.attr\n", dbfile);
+		goto exit;
+	}
+	fprintf(fout, "unique_subject = no\n");
+	fclose(fout);
+
+	path = dynamic_strcat(2, pkidir, "/serial");
+	fout = fopen(path, "wb+");
+	free(path);
+	if (fout == NULL) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not create %s/serial\n", pkidir);
+		goto exit;
+	}
+	if ((ret = mbedtls_mpi_write_file(NULL, &serial, 16, fout)) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_mpi_write_file returned %d\n", ret);
+		goto exit;
+	}
+	fclose(fout);
+	fout = NULL;
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	/*
+	 * 7. The DH parameters found in step 2
+	 */
+	if(dh_bits > 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Writing the DH parameters...");
+		fflush(stdout);
+
+		path = dynamic_strcat(2, pkidir, "/dh.pem");
+		ret = write_dhm_params(&G, &P, 0, FORMAT_PEM, path);
+		free(path);
+		if (ret != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  write_dhm_params returned %d\n", ret);
+			goto exit;
+		}
+
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+	}
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . PKI created in %s: CA, %s and %d client%s\n", pkidir, server_name,
+							num_clients, (num_clients == 1 ? "" : "s"));
+
+	exit_code = MBEDTLS_EXIT_SUCCESS;
+
+exit:
+	if(fout != NULL)
+	{
+		fclose(fout);
+	}
+	for(int e = 0; e < num_entities; e++)
+	{
+		mbedtls_pk_free(&entities[e].key);
+		free(entities[e].subject);
+		free(entities[e].keyfile);
+		free(entities[e].crtfile);
+	}
+	free(entities);
+	free(dbfile);
+	genprime_free(&job);
+	mbedtls_mpi_free(&serial); mbedtls_mpi_free(&G); mbedtls_mpi_free(&P);
+	mbedtlsclu_seed_file_finish(&seed_file, &ctr_drbg);
+	mbedtlsclu_seed_file_free(&seed_file);
+	if(thread_ctr_drbgs != NULL)
+	{
+		for(int t = 0; t < threads; t++)
+		{
+			mbedtls_ctr_drbg_free(&thread_ctr_drbgs[t]);
+		}
+		free(thread_ctr_drbgs);
+	}
+	mbedtls_ctr_drbg_free(&ctr_drbg);
+	mbedtls_entropy_free(&entropy);
+	mbedtlsclu_entropy_report(&entropy_source);
+	mbedtlsclu_entropy_source_free(&entropy_source);
+#if defined(MBEDTLS_USE_PSA_CRYPTO)
+	mbedtls_psa_crypto_free();
+#endif /* MBEDTLS_USE_PSA_CRYPTO */
+
+	return exit_code;
+}
+#endif /* MBEDTLS_X509_CRT_WRITE_C && MBEDTLS_PK_WRITE_C && MBEDTLS_FS_IO &&
+          MBEDTLS_ENTROPY_C && MBEDTLS_CTR_DRBG_C && MBEDTLS_PEM_WRITE_C && MBEDTLS_GENPRIME */
@@ -0,0 +1,32 @@
+/* pki_init -	PKI bootstrap header file
+ *
+ * Copyright © 2024 by Michael Gray <support@lantisproject.com>
+ *
+ * This file is free software: you may copy, redistribute and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbedtlsclu_common.h"
+
+#include "mbedtls/oid.h"
+#include "mbedtls/md.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define PKI_INIT_CA			0
+#define PKI_INIT_SERVER		1
+#define PKI_INIT_CLIENT		2
+
+int pki_init_main(int argc, char** argv, int argi);
@@ -29,12 +29,33 @@
 #define OUTPUT_FORMAT_DEC	10
 #define OUTPUT_FORMAT_OCT	8
 #define OUTPUT_FORMAT_BIN	2
+#define OUTPUT_FORMAT_BASE64	64
+
+/*
+ * Output is generated and written a chunk at a time so memory use does not depend on numbytes.
+ * 48 input bytes make one 64 character base64 line, so every chunk but the last ends on a whole line
+ */
+#define RAND_BASE64_LINE	48
+#define RAND_CHUNK_SIZE		(RAND_BASE64_LINE * 1024)
+#define RAND_ENCODED_SIZE	(RAND_CHUNK_SIZE * 2 + 1)
+
+#define MAX_THREADS			256
+
+#define RAND_ERR_WRITE		-0x7F11	/* Writing the output failed */
+#define RAND_ERR_THREAD		-0x7F12	/* No worker thread could be started */
+#define RAND_SLOTS_PER_THREAD	2	/* Chunks in flight per thread while the writer catches up */
 
 #define USAGE \
     "\n usage: rand [options] [numbytes]\n"																	\
     "\n\n General options:\n"																				\
     "    -help					Display this summary\n"														\
+    "    -out outfile			Output file (default stdout)\n"											\
     "    -hex					Print random bytes as hex (DEFAULT)\n"										\
+    "    -base64				Print random bytes as base64\n"											\
+    "    -binary				Write the raw random bytes\n"												\
+    "    -threads n				Number of independent generators to run in parallel (default 1)\n"			\
+    USAGE_DEV_RANDOM																						\
+    USAGE_SEED_FILE																							\
 	"\n\n Parameters:\n"																					\
     "    [numbytes]				How many bytes of random data should be generated\n"
 
@@ -49,26 +70,313 @@ int req_main(void)
 }
 #else
 
+/* Encodes len bytes of in into out for output_format, returning the encoded length.
+ * last terminates the output with a newline for the text formats */
+static size_t rand_encode(int output_format, const unsigned char* in, size_t len, unsigned char* out, int last)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	size_t olen = 0;
+	size_t n;
+	
+	if(output_format == OUTPUT_FORMAT_BIN)
+	{
+		memcpy(out, in, len);
+		return len;
+	}
+	
+	if(output_format == OUTPUT_FORMAT_HEX)
+	{
+		for(size_t i = 0; i < len; i++)
+		{
+			out[olen++] = hex[in[i] >> 4];
+			out[olen++] = hex[in[i] & 0x0F];
+		}
+		if(last && olen > 0)
+		{
+			out[olen++] = '\n';
+		}
+		return olen;
+	}
+	
+	// Base64, one line per RAND_BASE64_LINE bytes
+	for(size_t i = 0; i < len; i += RAND_BASE64_LINE)
+	{
+		mbedtls_base64_encode(out + olen, RAND_ENCODED_SIZE - olen, &n, in + i,
+								(len - i < RAND_BASE64_LINE ? len - i : RAND_BASE64_LINE));
+		olen += n;
+		out[olen++] = '\n';
+	}
+	return olen;
+}
+
+/* Fills buf from the DRBG, in requests no larger than it accepts. Reseeding happens inside mbedtls_ctr_drbg_random */
+static int rand_fill(mbedtls_ctr_drbg_context* ctr_drbg, unsigned char* buf, size_t len)
+{
+	int ret;
+	size_t n;
+	
+	while(len > 0)
+	{
+		n = (len < MBEDTLS_CTR_DRBG_MAX_REQUEST ? len : MBEDTLS_CTR_DRBG_MAX_REQUEST);
+		if((ret = mbedtls_ctr_drbg_random(ctr_drbg, buf, n)) != 0)
+		{
+			return ret;
+		}
+		buf += n;
+		len -= n;
+	}
+	
+	return 0;
+}
+
+/* Writes numbytes of output from a single DRBG */
+static int rand_write_serial(FILE* fout, int output_format, unsigned long long numbytes,
+								mbedtls_ctr_drbg_context* ctr_drbg)
+{
+	int ret = 0;
+	unsigned char* buf;
+	unsigned char* encoded;
+	unsigned long long remaining;
+	size_t len, olen;
+	
+	buf = (unsigned char*)malloc(RAND_CHUNK_SIZE);
+	encoded = (unsigned char*)malloc(RAND_ENCODED_SIZE);
+	for(remaining = numbytes; remaining > 0; remaining -= len)
+	{
+		len = (remaining < RAND_CHUNK_SIZE ? remaining : RAND_CHUNK_SIZE);
+		if((ret = rand_fill(ctr_drbg, buf, len)) != 0)
+		{
+			break;
+		}
+		olen = rand_encode(output_format, buf, len, encoded, (remaining == len));
+		if(fwrite(encoded, 1, olen, fout) != olen)
+		{
+			ret = RAND_ERR_WRITE;
+			break;
+		}
+	}
+	
+	mbedtls_platform_zeroize(buf, RAND_CHUNK_SIZE);
+	mbedtls_platform_zeroize(encoded, RAND_ENCODED_SIZE);
+	free(buf);
+	free(encoded);
+	
+	return ret;
+}
+
+/*
+ * Parallel generation. Chunk k lives in slot k % num_slots of a ring; workers take the next chunk
+ * number, wait for its slot to be written out, fill and encode it with their own DRBG, and the
+ * main thread writes the chunks strictly in order
+ */
+typedef struct rand_slot {
+	unsigned long long seq;		/* Chunk this slot is waiting for or holding */
+	int full;
+	size_t olen;
+	unsigned char* buf;
+	unsigned char* encoded;
+} rand_slot;
+
+typedef struct rand_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t emptied;
+	rand_slot* slots;
+	int num_slots;
+	unsigned long long next_chunk;
+	unsigned long long num_chunks;
+	unsigned long long numbytes;
+	int output_format;
+	int ret;					/* First error, stops everyone */
+} rand_ring;
+
+/* Records the first error and wakes everyone up so they can see it. Called with the lock held */
+static void rand_ring_fail(rand_ring* ring, int ret)
+{
+	if(ring->ret == 0)
+	{
+		ring->ret = ret;
+	}
+	pthread_cond_broadcast(&ring->filled);
+	pthread_cond_broadcast(&ring->emptied);
+}
+
+typedef struct rand_worker {
+	rand_ring* ring;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+	pthread_t thread;
+} rand_worker;
+
+static void* rand_worker_run(void* arg)
+{
+	rand_worker* worker = (rand_worker*)arg;
+	rand_ring* ring = worker->ring;
+	rand_slot* slot;
+	unsigned long long k;
+	size_t len;
+	int ret;
+	
+	while(1)
+	{
+		pthread_mutex_lock(&ring->lock);
+		if(ring->ret != 0 || ring->next_chunk >= ring->num_chunks)
+		{
+			pthread_mutex_unlock(&ring->lock);
+			break;
+		}
+		k = ring->next_chunk;
+		ring->next_chunk += 1;
+		slot = &ring->slots[k % ring->num_slots];
+		while(ring->ret == 0 && slot->seq != k)
+		{
+			pthread_cond_wait(&ring->emptied, &ring->lock);
+		}
+		if(ring->ret != 0)
+		{
+			// Woken by a failure, the slot may still belong to another worker
+			pthread_mutex_unlock(&ring->lock);
+			break;
+		}
+		pthread_mutex_unlock(&ring->lock);
+		
+		len = (k == ring->num_chunks - 1 ? ring->numbytes - k * RAND_CHUNK_SIZE : RAND_CHUNK_SIZE);
+		if((ret = rand_fill(worker->ctr_drbg, slot->buf, len)) == 0)
+		{
+			slot->olen = rand_encode(ring->output_format, slot->buf, len, slot->encoded, (k == ring->num_chunks - 1));
+		}
+		
+		pthread_mutex_lock(&ring->lock);
+		if(ret != 0)
+		{
+			rand_ring_fail(ring, ret);
+		}
+		slot->full = 1;
+		pthread_cond_broadcast(&ring->filled);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	
+	return NULL;
+}
+
+/* Writes numbytes of output generated by threads workers, each drawing from its own DRBG */
+static int rand_write_parallel(FILE* fout, int output_format, unsigned long long numbytes,
+								int threads, mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	rand_ring ring;
+	rand_worker* workers;
+	rand_slot* slot;
+	int started;
+	int ret;
+	
+	memset(&ring, 0, sizeof(rand_ring));
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.filled, NULL);
+	pthread_cond_init(&ring.emptied, NULL);
+	ring.num_slots = threads * RAND_SLOTS_PER_THREAD;
+	ring.num_chunks = (numbytes + RAND_CHUNK_SIZE - 1) / RAND_CHUNK_SIZE;
+	ring.numbytes = numbytes;
+	ring.output_format = output_format;
+	ring.slots = (rand_slot*)malloc(sizeof(rand_slot) * ring.num_slots);
+	for(int i = 0; i < ring.num_slots; i++)
+	{
+		ring.slots[i].seq = i;
+		ring.slots[i].full = 0;
+		ring.slots[i].buf = (unsigned char*)malloc(RAND_CHUNK_SIZE);
+		ring.slots[i].encoded = (unsigned char*)malloc(RAND_ENCODED_SIZE);
+	}
+	
+	workers = (rand_worker*)malloc(sizeof(rand_worker) * threads);
+	for(started = 0; started < threads; started++)
+	{
+		workers[started].ring = &ring;
+		workers[started].ctr_drbg = &ctr_drbgs[started];
+		if(pthread_create(&workers[started].thread, NULL, rand_worker_run, &workers[started]) != 0)
+		{
+			break;
+		}
+	}
+	if(started == 0)
+	{
+		ring.ret = RAND_ERR_THREAD;
+	}
+	
+	for(unsigned long long k = 0; k < ring.num_chunks; k++)
+	{
+		slot = &ring.slots[k % ring.num_slots];
+		pthread_mutex_lock(&ring.lock);
+		while(ring.ret == 0 && !slot->full)
+		{
+			pthread_cond_wait(&ring.filled, &ring.lock);
+		}
+		ret = ring.ret;
+		pthread_mutex_unlock(&ring.lock);
+		if(ret != 0)
+		{
+			break;
+		}
+		
+		// Only this thread touches a full slot, so write it without holding the lock
+		ret = (fwrite(slot->encoded, 1, slot->olen, fout) == slot->olen ? 0 : RAND_ERR_WRITE);
+		
+		pthread_mutex_lock(&ring.lock);
+		if(ret != 0)
+		{
+			rand_ring_fail(&ring, ret);
+		}
+		slot->full = 0;
+		slot->seq = k + ring.num_slots;
+		pthread_cond_broadcast(&ring.emptied);
+		pthread_mutex_unlock(&ring.lock);
+	}
+	
+	for(int i = 0; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+	
+	for(int i = 0; i < ring.num_slots; i++)
+	{
+		mbedtls_platform_zeroize(ring.slots[i].buf, RAND_CHUNK_SIZE);
+		mbedtls_platform_zeroize(ring.slots[i].encoded, RAND_ENCODED_SIZE);
+		free(ring.slots[i].buf);
+		free(ring.slots[i].encoded);
+	}
+	free(ring.slots);
+	free(workers);
+	pthread_cond_destroy(&ring.filled);
+	pthread_cond_destroy(&ring.emptied);
+	pthread_mutex_destroy(&ring.lock);
+	
+	return ring.ret;
+}
+
 int rand_main(int argc, char** argv, int argi)
 {
     int ret = 1;
     int exit_code = MBEDTLS_EXIT_FAILURE;
     int i;
-    char *p;
+    char *p, *q;
     mbedtls_entropy_context entropy;
+    mbedtlsclu_entropy_source entropy_source;
+    mbedtlsclu_seed_file seed_file;
     mbedtls_ctr_drbg_context ctr_drbg;
     const char* pers = "rand";
 	
 	int output_format = OUTPUT_FORMAT_HEX;
-	int numbytes = 0;
-	mbedtls_mpi randval;
+	int use_dev_random = 0;
+	int threads = 0;
+	mbedtls_ctr_drbg_context* thread_ctr_drbgs = NULL;
+	unsigned long long numbytes = 0;
+	char* outfile = NULL;
+	FILE* fout = NULL;
 	
     /*
      * Set to sane values
      */
     mbedtls_ctr_drbg_init(&ctr_drbg);
     mbedtls_entropy_init(&entropy);
-	mbedtls_mpi_init(&randval);
+    mbedtlsclu_entropy_source_init(&entropy_source);
+    mbedtlsclu_seed_file_init(&seed_file);
 	
 #if defined(MBEDTLS_USE_PSA_CRYPTO)
     psa_status_t status = psa_crypto_init();
@@ -98,10 +406,61 @@ usage:
 		{
 			output_format = OUTPUT_FORMAT_HEX;
 		}
+		else if(strcmp(p,"-base64") == 0)
+		{
+			output_format = OUTPUT_FORMAT_BASE64;
+		}
+		else if(strcmp(p,"-binary") == 0)
+		{
+			output_format = OUTPUT_FORMAT_BIN;
+		}
+		else if(strcmp(p,"-threads") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of threads. Advance i
+			i += 1;
+			threads = atoi(argv[i]);
+			if(threads < 1 || threads > MAX_THREADS)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-out") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the filepath. Advance i
+			i += 1;
+			outfile = strdup(argv[i]);
+		}
+#if defined(MBEDTLS_FS_IO)
+		else if(strcmp(p,"-usedevrandom") == 0)
+		{
+			use_dev_random = 1;
+		}
+		else if(strcmp(p,"-randompool") == 0)
+		{
+			use_dev_random = 1;
+			entropy_source.random_pool = 1;
+		}
+#endif /* MBEDTLS_FS_IO */
+		else if(strcmp(p,"-rand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.path = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-writerand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.write_path = strdup(argv[i]);
+		}
 		else if(i == argc - 1)
 		{
 			// Last arg should be the number of bytes
-			numbytes = atoi(p);
+			numbytes = strtoull(p, &q, 10);
+			if(*p == '-' || *q != '\0')
+			{
+				goto usage;
+			}
 		}
 		else
 		{
@@ -109,8 +468,17 @@ usage:
 		}
 	}
 	
-	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: output_format: %s\n", (output_format == OUTPUT_FORMAT_HEX ? "HEX" : "??"));
-	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: numbytes: %d\n", numbytes);
+	threads = mbedtlsclu_worker_threads(threads, 1);
+	
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: output_format: %s\n", (output_format == OUTPUT_FORMAT_HEX ? "HEX" :
+															(output_format == OUTPUT_FORMAT_BASE64 ? "BASE64" : "BINARY")));
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: out: %s\n", outfile);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: numbytes: %llu\n", numbytes);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: threads: %d\n", threads);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: usedevrandom: %d\n", use_dev_random);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: randompool: %d\n", entropy_source.random_pool);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: rand: %s\n", seed_file.path);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: writerand: %s\n", seed_file.write_path);
 	
 	/*
      * 0. Seed the PRNG
@@ -118,28 +486,107 @@ usage:
     mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Seeding the random number generator...");
     fflush(stdout);
 
-    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    if (use_dev_random) {
+        if ((ret = mbedtlsclu_entropy_add_source(&entropy, &entropy_source)) != 0) {
+            mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_entropy_add_source returned %d", ret);
+            goto exit;
+        }
+    }
+
+    if ((ret = mbedtlsclu_seed_file_load(&seed_file, &entropy)) != 0) {
+        mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_seed_file_load returned %d", ret);
+        goto exit;
+    }
+
+    if ((ret = mbedtlsclu_ctr_drbg_seed(&ctr_drbg, &entropy,
                                      (const unsigned char *) pers,
                                      strlen(pers))) != 0) {
         mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_ctr_drbg_seed returned %d", ret);
         goto exit;
     }
 
+    if ((ret = mbedtlsclu_seed_file_update(&seed_file, &ctr_drbg)) != 0) {
+        mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"\n  !  Could not write seed file, mbedtlsclu_seed_file_update returned %d\n", ret);
+    }
+
+    if (threads > 1) {
+        // One independent stream per worker, seeded now while only this thread uses the entropy context
+        thread_ctr_drbgs = (mbedtls_ctr_drbg_context*)malloc(sizeof(mbedtls_ctr_drbg_context) * threads);
+        for (i = 0; i < threads; i++) {
+            mbedtls_ctr_drbg_init(&thread_ctr_drbgs[i]);
+        }
+        if ((ret = mbedtlsclu_seed_ctr_drbgs(thread_ctr_drbgs, threads, &entropy, pers)) != 0) {
+            mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_ctr_drbg_seed returned %d", ret);
+            goto exit;
+        }
+    }
+
     mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
 	
 	/*
      * 1. Generate random bytes
      */
-	mbedtls_mpi_fill_random(&randval, numbytes, mbedtls_ctr_drbg_random, &ctr_drbg);
-	mbedtls_mpi_write_file("", &randval, output_format, NULL);
+	if(outfile != NULL)
+	{
+		if((fout = fopen(outfile, "wb")) == NULL)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  Could not open %s: %s\n", outfile, strerror(errno));
+			goto exit;
+		}
+	}
+	else
+	{
+		fout = stdout;
+	}
+	
+	if(threads > 1)
+	{
+		ret = rand_write_parallel(fout, output_format, numbytes, threads, thread_ctr_drbgs);
+	}
+	else
+	{
+		ret = rand_write_serial(fout, output_format, numbytes, &ctr_drbg);
+	}
+	if(ret == RAND_ERR_WRITE)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  Write failed: %s\n", strerror(errno));
+		goto exit;
+	}
+	else if(ret != 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  Generating random bytes failed: %d\n", ret);
+		goto exit;
+	}
+	if(fflush(fout) != 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  Write failed: %s\n", strerror(errno));
+		goto exit;
+	}
 
     exit_code = MBEDTLS_EXIT_SUCCESS;
 
 exit:
 
-	mbedtls_mpi_free(&randval);
+	if(fout != NULL && fout != stdout && fclose(fout) != 0 && exit_code == MBEDTLS_EXIT_SUCCESS)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  Write failed: %s\n", strerror(errno));
+		exit_code = MBEDTLS_EXIT_FAILURE;
+	}
+	free(outfile);
+	if(thread_ctr_drbgs != NULL)
+	{
+		for(i = 0; i < threads; i++)
+		{
+			mbedtls_ctr_drbg_free(&thread_ctr_drbgs[i]);
+		}
+		free(thread_ctr_drbgs);
+	}
+    mbedtlsclu_seed_file_finish(&seed_file, &ctr_drbg);
+    mbedtlsclu_seed_file_free(&seed_file);
     mbedtls_ctr_drbg_free(&ctr_drbg);
     mbedtls_entropy_free(&entropy);
+    mbedtlsclu_entropy_report(&entropy_source);
+    mbedtlsclu_entropy_source_free(&entropy_source);
 #if defined(MBEDTLS_USE_PSA_CRYPTO)
     mbedtls_psa_crypto_free();
 #endif /* MBEDTLS_USE_PSA_CRYPTO */
@@ -18,4 +18,8 @@
 
 #include "mbedtlsclu_common.h"
 
+#include "mbedtls/base64.h"
+
+#include <pthread.h>
+
 int rand_main(int argc, char** argv, int argi);
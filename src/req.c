@@ -45,6 +45,8 @@
 #define DFL_DAYS				365
 #define DFL_VERSION				MBEDTLS_X509_CRT_VERSION_3
 
+#define MAX_THREADS				256
+
 #define USAGE \
     "\n usage: req [options]\n"																											\
     "\n\n General options:\n"																											\
@@ -53,6 +55,7 @@
     "							NOTE: Command line parameters will override any config file equivalents\n"								\
     "							Config file can also be set through environment variables\n"											\
     "							NOTE: Environment variable config file will override command line\n"									\
+    "							Set MBEDTLS_CONF_CACHE to a directory to cache the parsed config file\n"									\
 	"    -in infile				X.509 request input file\n"																				\
 	"\n\n Certificate options:\n"																										\
     "    -new					New request\n"																							\
@@ -66,7 +69,15 @@
     "    -key val				Key for signing\n"																						\
     "    -passin val			Private key and certificate password source\n"															\
     "    -newkey val			Generate new key with [<alg>:]<nbits> or <alg>[:<file>] or param:<file>\n"								\
+    "    -pkeyopt val			Set the new key's options as opt:value (rsa_keygen_bits, ec_paramgen_curve)\n"								\
     "    -keyout outfile		File to write private key to\n"																			\
+    "\n"																																\
+    "    -batchfile infile		Generate a new key and request for each line of infile (- for stdin)\n"												\
+    "							Lines are subject[<TAB>keyspec[<TAB>name]], keyspec as for -newkey (default: -newkey)\n"				\
+    "    -outdir dir			Directory to write <name>.key and <name>.csr to for -batchfile (name defaults to the row number)\n"			\
+    "    -threads n				Number of threads to use for -batchfile (default: 1)\n"												\
+    USAGE_DEV_RANDOM																																\
+    USAGE_SEED_FILE																																\
 	"\n\n Output options:\n"																											\
 	"    -out outfile			Output file\n"																							\
 	"    -outform PEM|DER		Output format (DER or PEM)\n"																			\
@@ -120,6 +131,8 @@ int write_certificate_request_buffer(mbedtls_x509write_csr *req, int format, cha
         *len = ret;
         //c = output_buf + sizeof(output_buf) - len;
 	}
+	
+	return 0;
 }
 
 int write_certificate_request(mbedtls_x509write_csr *req, int format, const char *output_file,
@@ -134,7 +147,7 @@ int write_certificate_request(mbedtls_x509write_csr *req, int format, const char
 
     memset(output_buf, 0, 4096);
 	
-	if((ret = write_certificate_request_buffer(req, format, output_buf, sizeof(output_buf), &len, f_rng, p_rng)) < 0)
+	if((ret = write_certificate_request_buffer(req, format, output_buf, sizeof(output_buf), &len, f_rng, p_rng)) != 0)
 	{
 		return ret;
 	}
@@ -158,6 +171,312 @@ int write_certificate_request(mbedtls_x509write_csr *req, int format, const char
     return 0;
 }
 
+/*
+ * Batch mode: one request per line of the batch file, as subject[<TAB>keyspec[<TAB>name]].
+ * Empty lines and lines starting with # are skipped. keyspec is a -newkey style spec and
+ * defaults to -newkey, name is the file name in outdir for <name>.key and <name>.csr and
+ * defaults to the row number. Workers claim rows in turn, each with its own DRBG
+ */
+typedef struct req_batch_entry {
+	int line;
+	char* subject;
+	char* name;
+	genpkey_params params;
+	int ret;
+	const char* reason;
+} req_batch_entry;
+
+typedef struct req_batch_queue {
+	pthread_mutex_t lock;
+	req_batch_entry* entries;
+	int num_entries;
+	int next_entry;
+	
+	const char* outdir;
+	mbedtls_md_type_t md_alg;
+	int output_format;
+} req_batch_queue;
+
+typedef struct req_batch_worker {
+	req_batch_queue* queue;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+	pthread_t thread;
+} req_batch_worker;
+
+static void req_batch_init(req_batch_queue* queue)
+{
+	memset(queue, 0, sizeof(req_batch_queue));
+}
+
+static void req_batch_free(req_batch_queue* queue)
+{
+	for(int i = 0; i < queue->num_entries; i++)
+	{
+		free(queue->entries[i].subject);
+		free(queue->entries[i].name);
+	}
+	free(queue->entries);
+	memset(queue, 0, sizeof(req_batch_queue));
+}
+
+/* Splits off the next tab separated column of line, trimmed. Returns NULL once there are none left */
+static char* req_batch_column(char** line)
+{
+	char* col = *line;
+	char* tab;
+	
+	if(col == NULL)
+	{
+		return NULL;
+	}
+	if((tab = strchr(col, '\t')) != NULL)
+	{
+		*tab = '\0';
+		*line = tab + 1;
+	}
+	else
+	{
+		*line = NULL;
+	}
+	
+	return trim_flanking_whitespace(col);
+}
+
+/*
+ * Reads every row of the batch file into queue, checking the subjects and key specs up front
+ * so a bad row fails the batch before any key is generated. Returns 0 or -1
+ */
+static int req_batch_load(req_batch_queue* queue, const char* path, const genpkey_params* defaults, int default_bits)
+{
+	int ret = 0;
+	int term;
+	int lineno = 0;
+	int capacity = 16;
+	unsigned long len;
+	unsigned long num_names;
+	char namebuf[32];
+	char* line;
+	char* rest;
+	char* subject;
+	char* keyspec;
+	char* name;
+	mbedtls_asn1_named_data* names;
+	req_batch_entry* entry;
+	buffered_reader reader;
+	string_map* used_names;
+	void* used_line;
+	int fd;
+	
+	// "-" streams the rows from stdin
+	if((fd = (strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY))) < 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not open batch file %s\n", path);
+		return -1;
+	}
+	
+	initialize_buffered_reader(&reader, fd, "\n", 1, 0);
+	// Output name -> the line that claimed it, so two rows never write the same files
+	used_names = initialize_string_map(1);
+	queue->entries = (req_batch_entry*)malloc(sizeof(req_batch_entry) * capacity);
+	do
+	{
+		term = buffered_read(&reader, &line, &len);
+		lineno += 1;
+		if(term == DYN_READ_ERROR)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  %s:%d: could not read the batch file, %s\n", path, lineno, strerror(reader.error));
+			ret = -1;
+			break;
+		}
+		
+		rest = line;
+		subject = req_batch_column(&rest);
+		if(subject[0] == '\0' || subject[0] == '#')
+		{
+			continue;
+		}
+		keyspec = req_batch_column(&rest);
+		name = req_batch_column(&rest);
+		
+		if(queue->num_entries == capacity)
+		{
+			capacity *= 2;
+			queue->entries = (req_batch_entry*)realloc(queue->entries, sizeof(req_batch_entry) * capacity);
+		}
+		entry = &queue->entries[queue->num_entries];
+		memset(entry, 0, sizeof(req_batch_entry));
+		entry->line = lineno;
+		entry->params = *defaults;
+		
+		names = NULL;
+		if(mbedtls_x509_string_to_names(&names, subject) != 0 || names == NULL)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  %s:%d: invalid subject name %s\n", path, lineno, subject);
+			ret = -1;
+		}
+		mbedtls_asn1_free_named_data_list(&names);
+		
+		if(ret == 0 && keyspec != NULL && keyspec[0] != '\0' &&
+			genpkey_parse_spec(keyspec, &entry->params, default_bits, 0, 0) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  %s:%d: invalid key spec\n", path, lineno);
+			ret = -1;
+		}
+		
+		if(name == NULL || name[0] == '\0')
+		{
+			snprintf(namebuf, sizeof(namebuf), "%06d", queue->num_entries + 1);
+			name = namebuf;
+		}
+		else if(ret == 0 && (strchr(name, '/') != NULL || name[0] == '.'))
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  %s:%d: invalid output name %s\n", path, lineno, name);
+			ret = -1;
+		}
+		
+		if(ret == 0 && (used_line = set_string_map_element(used_names, name, (void*)(intptr_t) lineno)) != NULL)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  %s:%d: output name %s is already used on line %d\n",
+									path, lineno, name, (int)(intptr_t) used_line);
+			ret = -1;
+		}
+		
+		if(ret == 0)
+		{
+			entry->subject = strdup(subject);
+			entry->name = strdup(name);
+			queue->num_entries += 1;
+		}
+	}
+	while(term != EOF && ret == 0);
+	free_buffered_reader(&reader);
+	destroy_string_map(used_names, DESTROY_MODE_IGNORE_VALUES, &num_names);
+	if(fd != STDIN_FILENO)
+	{
+		close(fd);
+	}
+	
+	return ret;
+}
+
+/* Generates the key and request for one row, writing <outdir>/<name>.key and <outdir>/<name>.csr */
+static int req_batch_gen(req_batch_queue* queue, req_batch_entry* entry, mbedtls_ctr_drbg_context* ctr_drbg)
+{
+	int ret;
+	mbedtls_pk_context key;
+	mbedtls_x509write_csr req;
+	char* keyfile = dynamic_strcat(4, queue->outdir, "/", entry->name, ".key");
+	char* csrfile = dynamic_strcat(4, queue->outdir, "/", entry->name, ".csr");
+	
+	mbedtls_pk_init(&key);
+	mbedtls_x509write_csr_init(&req);
+	
+	if((ret = genpkey_gen_key(&key, &entry->params, ctr_drbg)) != 0)
+	{
+		entry->reason = "key generation failed";
+		goto exit;
+	}
+	if((ret = genpkey_write_key(&key, 0, FORMAT_PEM, keyfile)) != 0)
+	{
+		entry->reason = "could not write key";
+		goto exit;
+	}
+	
+	mbedtls_x509write_csr_set_md_alg(&req, queue->md_alg);
+	if((ret = mbedtls_x509write_csr_set_subject_name(&req, entry->subject)) != 0)
+	{
+		entry->reason = "invalid subject name";
+		goto exit;
+	}
+	mbedtls_x509write_csr_set_key(&req, &key);
+	
+	if((ret = write_certificate_request(&req, queue->output_format, csrfile,
+										mbedtls_ctr_drbg_random, ctr_drbg)) != 0)
+	{
+		entry->reason = "could not write request";
+	}
+	
+exit:
+	mbedtls_x509write_csr_free(&req);
+	mbedtls_pk_free(&key);
+	free(keyfile);
+	free(csrfile);
+	
+	return ret;
+}
+
+static void* req_batch_worker_run(void* arg)
+{
+	req_batch_worker* worker = (req_batch_worker*)arg;
+	req_batch_queue* queue = worker->queue;
+	req_batch_entry* entry;
+	
+	while(1)
+	{
+		pthread_mutex_lock(&queue->lock);
+		if(queue->next_entry >= queue->num_entries)
+		{
+			pthread_mutex_unlock(&queue->lock);
+			break;
+		}
+		entry = &queue->entries[queue->next_entry];
+		queue->next_entry += 1;
+		pthread_mutex_unlock(&queue->lock);
+		
+		entry->ret = req_batch_gen(queue, entry, worker->ctr_drbg);
+	}
+	
+	return NULL;
+}
+
+/* Runs the batch with threads workers, one DRBG each. Returns the number of rows which failed */
+static int req_batch_run(req_batch_queue* queue, int threads, mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	int failed = 0;
+	int started = 0;
+	req_batch_worker* workers;
+	
+	queue->next_entry = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	workers = (req_batch_worker*)malloc(sizeof(req_batch_worker) * threads);
+	for(int i = 0; i < threads; i++)
+	{
+		workers[i].queue = queue;
+		workers[i].ctr_drbg = &ctr_drbgs[i];
+	}
+	
+	for(started = 0; threads > 1 && started < threads; started++)
+	{
+		if(pthread_create(&workers[started].thread, NULL, req_batch_worker_run, &workers[started]) != 0)
+		{
+			break;
+		}
+	}
+	if(started == 0)
+	{
+		req_batch_worker_run(&workers[0]);
+	}
+	for(int i = 0; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+	
+	for(int i = 0; i < queue->num_entries; i++)
+	{
+		if(queue->entries[i].ret != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  line %d (%s): %s, returned -0x%04x\n", queue->entries[i].line,
+									queue->entries[i].name, queue->entries[i].reason, (unsigned int) -queue->entries[i].ret);
+			failed += 1;
+		}
+	}
+	
+	pthread_mutex_destroy(&queue->lock);
+	free(workers);
+	
+	return failed;
+}
+
 int req_main(int argc, char** argv, int argi)
 {
     int ret = 1;
@@ -168,8 +487,11 @@ int req_main(int argc, char** argv, int argi)
     char *p, *q;
     mbedtls_x509write_csr req;
     mbedtls_entropy_context entropy;
+    mbedtlsclu_entropy_source entropy_source;
+    mbedtlsclu_seed_file seed_file;
     mbedtls_ctr_drbg_context ctr_drbg;
     const char* pers = "req";
+    int use_dev_random = 0;
 
 	int reqtype = REQ_TYPE_CSR;
 	int text = 0;
@@ -195,7 +517,13 @@ int req_main(int argc, char** argv, int argi)
 	int newkey = 0;
 	char* newkey_optsin = NULL;
 	char* newkey_outfile = NULL;
-	char* rsa_keysize = NULL;
+	genpkey_params newkey_params;
+	int pkeyopt_rsa_keysize = 0;
+	int pkeyopt_ec_curve = 0;
+	int default_bits = 0;
+#if defined(MBEDTLS_ECP_C)
+	const mbedtls_ecp_curve_info* curve_info;
+#endif
 	
 	int noenc = 1;
 	int newreq = 0;
@@ -204,8 +532,16 @@ int req_main(int argc, char** argv, int argi)
 	
 	int version = DFL_VERSION;
 	
+	char* batchfile = NULL;
+	char* outdir = NULL;
+	int threads = 0;
+	req_batch_queue batch;
+	mbedtls_ctr_drbg_context* thread_ctr_drbgs = NULL;
+	
 	conf_req_csr_parameters req_params;
 	initialise_conf_req_csr_parameters(&req_params);
+	genpkey_params_init(&newkey_params);
+	req_batch_init(&batch);
 	
     /*
      * Set to sane values
@@ -215,6 +551,8 @@ int req_main(int argc, char** argv, int argi)
     mbedtls_ctr_drbg_init(&ctr_drbg);
     memset(buf, 0, sizeof(buf));
     mbedtls_entropy_init(&entropy);
+    mbedtlsclu_entropy_source_init(&entropy_source);
+    mbedtlsclu_seed_file_init(&seed_file);
 	
 #if defined(MBEDTLS_USE_PSA_CRYPTO)
     psa_status_t status = psa_crypto_init();
@@ -322,6 +660,40 @@ usage:
 				goto usage;
 			}
 		}
+		else if(strcmp(p,"-pkeyopt") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the keyopt value. Advance i
+			i += 1;
+			p = argv[i];
+			if((q = strchr(p, ':')) == NULL)
+			{
+				goto usage;
+			}
+			*q++ = '\0';
+			
+			if(strcmp(p,"rsa_keygen_bits") == 0)
+			{
+				pkeyopt_rsa_keysize = atoi(q);
+				if(pkeyopt_rsa_keysize < 1024 || pkeyopt_rsa_keysize > MBEDTLS_MPI_MAX_BITS)
+				{
+					goto usage;
+				}
+			}
+#if defined(MBEDTLS_ECP_C)
+			else if(strcmp(p,"ec_paramgen_curve") == 0)
+			{
+				if((curve_info = mbedtls_ecp_curve_info_from_name(q)) == NULL)
+				{
+					goto usage;
+				}
+				pkeyopt_ec_curve = curve_info->grp_id;
+			}
+#endif /* MBEDTLS_ECP_C */
+			else
+			{
+				goto usage;
+			}
+		}
 		else if(strcmp(p,"-newkey") == 0 && i + 1 < argc)
 		{
 			// argv[i+1] should be the keyopts (similar options to pkeyopt). Advance i
@@ -353,6 +725,29 @@ usage:
 		{
 			text = 1;
 		}
+#if defined(MBEDTLS_FS_IO)
+		else if(strcmp(p,"-usedevrandom") == 0)
+		{
+			use_dev_random = 1;
+		}
+		else if(strcmp(p,"-randompool") == 0)
+		{
+			use_dev_random = 1;
+			entropy_source.random_pool = 1;
+		}
+#endif /* MBEDTLS_FS_IO */
+		else if(strcmp(p,"-rand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.path = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-writerand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.write_path = strdup(argv[i]);
+		}
 		else if(strcmp(p,"-out") == 0 && i + 1 < argc)
 		{
 			// argv[i+1] should be the filepath. Advance i
@@ -381,6 +776,28 @@ usage:
 		{
 			noout = 1;
 		}
+		else if(strcmp(p,"-batchfile") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the batch file. Advance i
+			i += 1;
+			batchfile = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-outdir") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the output directory. Advance i
+			i += 1;
+			outdir = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-threads") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of threads. Advance i
+			i += 1;
+			threads = atoi(argv[i]);
+			if(threads < 1 || threads > MAX_THREADS)
+			{
+				goto usage;
+			}
+		}
 		else
 		{
 			// Check if this is a md algorithm
@@ -407,10 +824,17 @@ usage:
 		}
 	}
 	
-	if(outfile == NULL && csr_infile == NULL)
+	if(outfile == NULL && csr_infile == NULL && batchfile == NULL)
 	{
 		goto usage;
 	}
+	if(batchfile != NULL && (outdir == NULL || csr_infile != NULL || key_filein != NULL || reqtype == REQ_TYPE_CRT || noout))
+	{
+		// Batch mode only makes new keys and requests
+		goto usage;
+	}
+	
+	threads = mbedtlsclu_worker_threads(threads, 1);
 	
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: out: %s\n", outfile);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: outform: %s\n", (output_format == FORMAT_PEM ? "PEM" : "DER"));
@@ -422,7 +846,16 @@ usage:
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: newkey: %d\n", newkey);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: newkey_opts: %s\n", newkey_optsin);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: newkey_outfile: %s\n", newkey_outfile);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: pkeyopt rsa_keygen_bits: %d\n", pkeyopt_rsa_keysize);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: pkeyopt ec_paramgen_curve: %d\n", pkeyopt_ec_curve);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: conffile: %s\n", conffilein);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: usedevrandom: %d\n", use_dev_random);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: randompool: %d\n", entropy_source.random_pool);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: rand: %s\n", seed_file.path);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: writerand: %s\n", seed_file.write_path);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: batchfile: %s\n", batchfile);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: outdir: %s\n", outdir);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: threads: %d\n", threads);
 	
 	// Check if the ENV has a config file defined
 	mbedtls_env_conf = getenv(MBEDTLS_ENV_CONF);
@@ -473,8 +906,25 @@ usage:
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"conf: key_usage %s\n", req_params.key_usage);
 	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"conf: ns_cert_type %s\n", req_params.ns_cert_type);
 	
+	if(req_params.default_bits != NULL)
+	{
+		default_bits = atoi(req_params.default_bits);
+	}
+	
 	// Set the keyfile
-	if(key_filein == NULL && req_params.default_keyfile == NULL)
+	if(batchfile != NULL)
+	{
+		// Every row gets a new key, written to outdir
+	}
+	else if(newkey)
+	{
+		// For a new key the config value is where it gets written
+		if(newkey_outfile == NULL && req_params.default_keyfile != NULL)
+		{
+			newkey_outfile = strdup(req_params.default_keyfile);
+		}
+	}
+	else if(key_filein == NULL && req_params.default_keyfile == NULL)
 	{
 		goto usage;
 	}
@@ -516,7 +966,7 @@ usage:
 	}
 	
 	// Set subject_name
-	if(subject_name == NULL && req_params.default_commonname == NULL)
+	if(batchfile == NULL && subject_name == NULL && req_params.default_commonname == NULL)
 	{
 		goto usage;
 	}
@@ -601,16 +1051,55 @@ usage:
 		goto exit;
 	}
 
+	if(batchfile != NULL)
+	{
+		// The -newkey spec (or rsa with default_bits) is the key for rows without their own
+		if(newkey_optsin == NULL)
+		{
+			newkey_optsin = strdup("rsa");
+		}
+		if((ret = genpkey_parse_spec(newkey_optsin, &newkey_params, default_bits,
+										pkeyopt_rsa_keysize, pkeyopt_ec_curve)) != 0)
+		{
+			if(ret == -1)
+			{
+				goto usage;
+			}
+			goto exit;
+		}
+		
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Reading the batch file...");
+		fflush(stdout);
+		
+		if((ret = req_batch_load(&batch, batchfile, &newkey_params, default_bits)) != 0)
+		{
+			goto exit;
+		}
+		batch.outdir = outdir;
+		batch.md_alg = md_alg;
+		batch.output_format = output_format;
+		
+		if(mkdir_p(outdir, S_IRWXU) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not create output directory %s\n", outdir);
+			goto exit;
+		}
+		
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok (%d requests)\n", batch.num_entries);
+		
+		if(threads > batch.num_entries)
+		{
+			threads = (batch.num_entries > 0 ? batch.num_entries : 1);
+		}
+	}
 	// Generate a new key if requested
-	if(newkey)
+	else if(newkey)
 	{
 		if(noout)
 		{
 			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"Can't ask for a new key AND noout\n");
 			goto usage;
 		}
-		char* algorithm = NULL;
-		
 		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"New Key Generation requested\n");
 		
 		if(newkey_optsin == NULL || newkey_outfile == NULL)
@@ -618,45 +1107,17 @@ usage:
 			goto usage;
 		}
 		
-		p = newkey_optsin;
-		if((q = strchr(p, ':')) == NULL)
-		{
-			goto usage;
-		}
-		*q++ = '\0';
-		
-		if(strcmp(p,"rsa") == 0)
+		if((ret = genpkey_parse_spec(newkey_optsin, &newkey_params, default_bits,
+										pkeyopt_rsa_keysize, pkeyopt_ec_curve)) != 0)
 		{
-			int tmpkeysize;
-			//rsa:bits
-			algorithm = strdup("rsa");
-			tmpkeysize = atoi(q);
-			if(tmpkeysize < 1024 || tmpkeysize > MBEDTLS_MPI_MAX_BITS)
+			if(ret == -1)
 			{
 				goto usage;
 			}
-			rsa_keysize = strdup(q);
-		}
-		else
-		{
-			//ec:paramfile we will support later (probably)
-			goto usage;
+			goto exit;
 		}
 		
-		char** genpkey_args = (char**)malloc(7*sizeof(char*));
-		genpkey_args[0] = strdup("genpkey");
-		genpkey_args[1] = strdup("-algorithm");
-		genpkey_args[2] = strdup(algorithm);
-		genpkey_args[3] = strdup("-pkeyopt");
-		genpkey_args[4] = dynamic_strcat(2,"rsa_keygen_bits:",rsa_keysize);
-		genpkey_args[5] = strdup("-out");
-		genpkey_args[6] = strdup(newkey_outfile);
-		mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"Calling genpkey internally\n");
-		genpkey_main(7,genpkey_args,1);
-		
-		free(algorithm);
-		free(rsa_keysize);
-		
+		// The key is generated in process once the DRBG is seeded, and only written out to keep
 		key_filein = newkey_outfile;
 	}
 	
@@ -680,15 +1141,64 @@ usage:
     mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Seeding the random number generator...");
     fflush(stdout);
 
-    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    if (use_dev_random) {
+        if ((ret = mbedtlsclu_entropy_add_source(&entropy, &entropy_source)) != 0) {
+            mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_entropy_add_source returned %d", ret);
+            goto exit;
+        }
+    }
+
+    if ((ret = mbedtlsclu_seed_file_load(&seed_file, &entropy)) != 0) {
+        mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_seed_file_load returned %d", ret);
+        goto exit;
+    }
+
+    if ((ret = mbedtlsclu_ctr_drbg_seed(&ctr_drbg, &entropy,
                                      (const unsigned char *) pers,
                                      strlen(pers))) != 0) {
         mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_ctr_drbg_seed returned %d", ret);
         goto exit;
     }
 
+    if ((ret = mbedtlsclu_seed_file_update(&seed_file, &ctr_drbg)) != 0) {
+        mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"\n  !  Could not write seed file, mbedtlsclu_seed_file_update returned %d\n", ret);
+    }
+
     mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
 
+	if(batchfile != NULL)
+	{
+		/*
+		 * 1. Generate the keys and requests. A single worker shares our DRBG,
+		 * more get their own, seeded in turn from the same entropy pool
+		 */
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Generating %d keys and requests (%d thread%s)...\n",
+								batch.num_entries, threads, (threads == 1 ? "" : "s"));
+		fflush(stdout);
+		
+		if(threads > 1)
+		{
+			thread_ctr_drbgs = (mbedtls_ctr_drbg_context*)malloc(sizeof(mbedtls_ctr_drbg_context) * threads);
+			for(int t = 0; t < threads; t++)
+			{
+				mbedtls_ctr_drbg_init(&thread_ctr_drbgs[t]);
+			}
+			if ((ret = mbedtlsclu_seed_ctr_drbgs(thread_ctr_drbgs, threads, &entropy, pers)) != 0) {
+				mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  mbedtlsclu_seed_ctr_drbgs returned %d\n", ret);
+				goto exit;
+			}
+		}
+		
+		if ((ret = req_batch_run(&batch, threads, (threads > 1 ? thread_ctr_drbgs : &ctr_drbg))) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  %d of %d requests failed\n", ret, batch.num_entries);
+			goto exit;
+		}
+		
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . %d requests written to %s\n", batch.num_entries, outdir);
+		exit_code = MBEDTLS_EXIT_SUCCESS;
+		goto exit;
+	}
+
 	/*
      * 1.0. Check the subject name for validity
      */
@@ -702,17 +1212,35 @@ usage:
 
     mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
 
-    /*
-     * 1.1. Load the key
-     */
-    mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Loading the private key ...");
-    fflush(stdout);
+    if (newkey) {
+        /*
+         * 1.1. Generate the key with our own DRBG and keep it
+         */
+        mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Generating the private key ...");
+        fflush(stdout);
 
-    ret = mbedtls_pk_parse_keyfile(&key, key_filein, key_passin);
+        if ((ret = genpkey_gen_key(&key, &newkey_params, &ctr_drbg)) != 0) {
+            mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  genpkey_gen_key returned %d", ret);
+            goto exit;
+        }
 
-    if (ret != 0) {
-        mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_pk_parse_keyfile returned %d", ret);
-        goto exit;
+        if ((ret = genpkey_write_key(&key, 0, FORMAT_PEM, newkey_outfile)) != 0) {
+            mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  genpkey_write_key returned %d", ret);
+            goto exit;
+        }
+    } else {
+        /*
+         * 1.1. Load the key
+         */
+        mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Loading the private key ...");
+        fflush(stdout);
+
+        ret = mbedtls_pk_parse_keyfile(&key, key_filein, key_passin);
+
+        if (ret != 0) {
+            mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_pk_parse_keyfile returned %d", ret);
+            goto exit;
+        }
     }
 
     mbedtls_x509write_csr_set_key(&req, &key);
@@ -1236,8 +1764,19 @@ exit:
 
     mbedtls_x509write_csr_free(&req);
     mbedtls_pk_free(&key);
+    mbedtlsclu_seed_file_finish(&seed_file, &ctr_drbg);
+    mbedtlsclu_seed_file_free(&seed_file);
     mbedtls_ctr_drbg_free(&ctr_drbg);
+    if (thread_ctr_drbgs != NULL) {
+        for (int t = 0; t < threads; t++) {
+            mbedtls_ctr_drbg_free(&thread_ctr_drbgs[t]);
+        }
+        free(thread_ctr_drbgs);
+    }
+    req_batch_free(&batch);
     mbedtls_entropy_free(&entropy);
+    mbedtlsclu_entropy_report(&entropy_source);
+    mbedtlsclu_entropy_source_free(&entropy_source);
 #if defined(MBEDTLS_USE_PSA_CRYPTO)
     mbedtls_psa_crypto_free();
 #endif /* MBEDTLS_USE_PSA_CRYPTO */
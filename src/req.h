@@ -23,9 +23,12 @@
 #include "mbedtls/md.h"
 
 #include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 int req_main(int argc, char** argv, int argi);
 
+/* Returns 0 or a negative mbedtls error. DER is written to the end of output_buf, PEM to the start */
 int write_certificate_request_buffer(mbedtls_x509write_csr *req, int format, char* output_buf,
                               size_t output_buf_size, size_t* len,
                               int (*f_rng)(void *, unsigned char *, size_t),
@@ -0,0 +1,1088 @@
+/* speed -	Benchmark the operations mbedtls-clu is built from
+ *
+ * Copyright © 2024 by Michael Gray <support@lantisproject.com>
+ *
+ * This file is free software: you may copy, redistribute and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every test times the same code paths the utilities use (genpkey_gen_key, write_certificate,
+ * mbedtls_x509write_crl_der, read_ca_database, parse_config_file) so the numbers can be used to
+ * size hardware and to catch regressions in the shipped binary.
+ * Each test is warmed up, then timed -runs times. Fast operations are batched until one sample
+ * takes at least -mintime, and every figure is per operation.
+ */
+
+#include "speed.h"
+#include "genpkey.h"
+#include "ca.h"
+
+#define DFL_RUNS				5
+#define DFL_WARMUP				1
+#define DFL_MIN_TIME_MS			10
+#define DFL_MAX_ROWS			100000
+#define DFL_TMPDIR				"/tmp"
+#define DFL_RSA_BITS			"1024,2048,3072,4096"
+#define DFL_CURVES				"secp256r1,secp384r1,secp521r1"
+#define DFL_FIXTURE_BITS		2048
+#define MAX_RUNS				10000
+#define MAX_LIST				8
+#define MAX_BATCH				(1UL << 24)
+#define SPEED_MAX_RESULTS		64
+
+#define SPEED_ISSUER			"CN=mbedtls-clu speed,O=mbedtls-clu"
+#define SPEED_NOT_BEFORE		"20240101000000"
+#define SPEED_NOT_AFTER			"20340101000000"
+#define SPEED_REVOKED			"20240601000000"
+
+#define SPEED_PEM_BEGIN_CRT		"-----BEGIN CERTIFICATE-----\n"
+#define SPEED_PEM_END_CRT		"-----END CERTIFICATE-----\n"
+#define SPEED_PEM_BUF_SIZE		8192
+
+#define USAGE \
+    "\n usage: speed [options]\n"																				\
+    "\n\n General options:\n"																					\
+    "    -help					Display this summary\n"															\
+    "    -tests list			Comma separated tests to run (default: all)\n"									\
+    "							rsa, ec, sign, csr, crl, db, config, pem\n"									\
+    "    -runs n				Timed runs per test, for the percentiles (default: 5)\n"						\
+    "    -warmup n				Untimed runs before each test (default: 1)\n"									\
+    "    -mintime ms			Batch fast operations until one run takes this long (default: 10)\n"			\
+    "    -tmpdir dir			Directory for the certificate, database and config files (default: " DFL_TMPDIR ")\n"	\
+    "\n\n Size options:\n"																						\
+    "    -rsa_bits list			RSA key sizes to generate (default: " DFL_RSA_BITS ")\n"							\
+    "    -curves list			EC curves to generate (default: " DFL_CURVES ")\n"								\
+    "    -max_rows n			Largest CRL and database to build, 1k to 1M rows (default: 100000)\n"			\
+    "\n\n Output options:\n"																					\
+    "    -json file				Also write the results as JSON, - for stdout instead of the table\n"
+
+#if !defined(MBEDTLS_X509_CRT_WRITE_C) || !defined(MBEDTLS_X509_CSR_WRITE_C) || \
+    !defined(MBEDTLS_X509_CSR_PARSE_C) || !defined(MBEDTLS_PEM_WRITE_C) || \
+    !defined(MBEDTLS_PEM_PARSE_C) || !defined(MBEDTLS_FS_IO) || \
+    !defined(MBEDTLS_ENTROPY_C) || !defined(MBEDTLS_CTR_DRBG_C) || \
+    !defined(MBEDTLS_GENPRIME)
+int speed_main(void)
+{
+    mbedtls_printf("MBEDTLS_X509_CRT_WRITE_C and/or MBEDTLS_X509_CSR_WRITE_C and/or "
+                   "MBEDTLS_X509_CSR_PARSE_C and/or MBEDTLS_PEM_WRITE_C and/or "
+                   "MBEDTLS_PEM_PARSE_C and/or MBEDTLS_FS_IO and/or "
+                   "MBEDTLS_ENTROPY_C and/or MBEDTLS_CTR_DRBG_C and/or "
+                   "MBEDTLS_GENPRIME not defined.\n");
+    mbedtls_exit(0);
+}
+#else
+
+static const struct {
+	const char* name;
+	int flag;
+} speed_tests[] = {
+	{ "rsa",	SPEED_TEST_RSA },
+	{ "ec",		SPEED_TEST_EC },
+	{ "sign",	SPEED_TEST_SIGN },
+	{ "csr",	SPEED_TEST_CSR },
+	{ "crl",	SPEED_TEST_CRL },
+	{ "db",		SPEED_TEST_DB },
+	{ "config",	SPEED_TEST_CONFIG },
+	{ "pem",	SPEED_TEST_PEM },
+	{ NULL,		0 }
+};
+
+static const unsigned long speed_crl_rows[] = { 1000, 10000, 100000, 0 };
+static const unsigned long speed_db_rows[] = { 10000, 100000, 1000000, 0 };
+
+/* All times are seconds per operation */
+typedef struct speed_result {
+	char test[24];
+	char param[24];
+	int runs;
+	unsigned long ops;
+	double mean;
+	double p50;
+	double p90;
+	double p99;
+	double min;
+	double max;
+	int ret;
+} speed_result;
+
+typedef struct speed_report {
+	speed_result results[SPEED_MAX_RESULTS];
+	int num_results;
+	int runs;
+	int warmup;
+	double min_time;
+} speed_report;
+
+/* One operation of a test, 0 on success */
+typedef int (*speed_op)(void* arg);
+
+typedef struct speed_keygen_ctx {
+	genpkey_params params;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+} speed_keygen_ctx;
+
+typedef struct speed_sign_ctx {
+	mbedtls_x509write_cert crt;
+	mbedtls_mpi serial;
+	const char* crtfile;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+} speed_sign_ctx;
+
+typedef struct speed_buf_ctx {
+	unsigned char* in;
+	size_t in_len;
+	unsigned char* out;
+	size_t out_size;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+	mbedtls_x509write_crl* crl;
+} speed_buf_ctx;
+
+static double speed_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int speed_cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of sorted samples */
+static double speed_percentile(const double* samples, int n, int p)
+{
+	int idx = (p * n + 99) / 100;
+
+	return samples[idx > 0 ? idx - 1 : 0];
+}
+
+/*
+ * Warms up, calibrates the batch for fast operations (batch != 0) and records report->runs samples.
+ * The result is kept even on failure so the report shows which test failed
+ */
+static int speed_run(speed_report* report, const char* test, const char* param, speed_op op, void* arg, int batch)
+{
+	int ret = 0;
+	unsigned long ops = 1;
+	double start;
+	double* samples = NULL;
+	speed_result* result;
+
+	if(report->num_results >= SPEED_MAX_RESULTS)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"  !  Too many results, skipping %s %s\n", test, param);
+		return 0;
+	}
+	result = &report->results[report->num_results++];
+	memset(result, 0, sizeof(speed_result));
+	snprintf(result->test, sizeof(result->test), "%s", test);
+	snprintf(result->param, sizeof(result->param), "%s", param);
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . %s %s...", test, param);
+	fflush(stdout);
+
+	for(int w = 0; w < report->warmup; w++)
+	{
+		if((ret = op(arg)) != 0)
+		{
+			goto exit;
+		}
+	}
+
+	// Double the batch until a single run is long enough for the clock
+	while(batch && ops < MAX_BATCH)
+	{
+		start = speed_now();
+		for(unsigned long o = 0; o < ops; o++)
+		{
+			if((ret = op(arg)) != 0)
+			{
+				goto exit;
+			}
+		}
+		if(speed_now() - start >= report->min_time)
+		{
+			break;
+		}
+		ops *= 2;
+	}
+
+	samples = malloc(report->runs * sizeof(double));
+	for(int r = 0; r < report->runs; r++)
+	{
+		start = speed_now();
+		for(unsigned long o = 0; o < ops; o++)
+		{
+			if((ret = op(arg)) != 0)
+			{
+				goto exit;
+			}
+		}
+		samples[r] = (speed_now() - start) / ops;
+		result->mean += samples[r];
+	}
+
+	qsort(samples, report->runs, sizeof(double), speed_cmp_double);
+	result->runs = report->runs;
+	result->ops = ops;
+	result->mean /= report->runs;
+	result->p50 = speed_percentile(samples, report->runs, 50);
+	result->p90 = speed_percentile(samples, report->runs, 90);
+	result->p99 = speed_percentile(samples, report->runs, 99);
+	result->min = samples[0];
+	result->max = samples[report->runs - 1];
+
+exit:
+	free(samples);
+	result->ret = ret;
+	if(ret != 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  %s %s returned -0x%04x\n", test, param, (unsigned int) -ret);
+	}
+	else
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+	}
+
+	return ret;
+}
+
+static int speed_keygen(void* arg)
+{
+	int ret;
+	speed_keygen_ctx* ctx = (speed_keygen_ctx*)arg;
+	mbedtls_pk_context key;
+
+	mbedtls_pk_init(&key);
+	ret = genpkey_gen_key(&key, &ctx->params, ctx->ctr_drbg);
+	mbedtls_pk_free(&key);
+
+	return ret;
+}
+
+static int speed_sign(void* arg)
+{
+	speed_sign_ctx* ctx = (speed_sign_ctx*)arg;
+
+	return write_certificate(&ctx->crt, ctx->crtfile, mbedtls_ctr_drbg_random, ctx->ctr_drbg);
+}
+
+static int speed_csr_parse(void* arg)
+{
+	int ret;
+	speed_buf_ctx* ctx = (speed_buf_ctx*)arg;
+	mbedtls_x509_csr csr;
+
+	mbedtls_x509_csr_init(&csr);
+	ret = mbedtls_x509_csr_parse(&csr, ctx->in, ctx->in_len);
+	mbedtls_x509_csr_free(&csr);
+
+	return ret;
+}
+
+static int speed_crl_write(void* arg)
+{
+	int ret;
+	speed_buf_ctx* ctx = (speed_buf_ctx*)arg;
+
+	ret = mbedtls_x509write_crl_der(ctx->crl, ctx->out, ctx->out_size, mbedtls_ctr_drbg_random, ctx->ctr_drbg);
+
+	return (ret < 0 ? ret : 0);
+}
+
+static int speed_db_load(void* arg)
+{
+	int ret;
+	ca_db database;
+	unsigned long database_len = 0;
+
+	if((ret = read_ca_database((char*)arg, &database, &database_len)) != 0)
+	{
+		return MBEDTLS_ERR_X509_FILE_IO_ERROR;
+	}
+	free_ca_database(&database, database_len);
+
+	return 0;
+}
+
+static int speed_config_req(void* arg)
+{
+	int ret;
+	conf_req_csr_parameters params;
+
+	initialise_conf_req_csr_parameters(&params);
+	ret = parse_config_file((char*)arg, REQ_TYPE_CSR, &params);
+	free_conf_req_csr_parameters(&params);
+
+	return ret;
+}
+
+static int speed_config_ca(void* arg)
+{
+	int ret;
+	conf_req_crt_parameters params;
+
+	initialise_conf_req_crt_parameters(&params);
+	ret = parse_config_file((char*)arg, REQ_TYPE_CRT, &params);
+	free_conf_req_crt_parameters(&params);
+
+	return ret;
+}
+
+static int speed_pem_encode(void* arg)
+{
+	size_t olen;
+	speed_buf_ctx* ctx = (speed_buf_ctx*)arg;
+
+	return mbedtls_pem_write_buffer(SPEED_PEM_BEGIN_CRT, SPEED_PEM_END_CRT, ctx->in, ctx->in_len,
+									ctx->out, ctx->out_size, &olen);
+}
+
+static int speed_pem_decode(void* arg)
+{
+	int ret;
+	size_t use_len;
+	speed_buf_ctx* ctx = (speed_buf_ctx*)arg;
+	mbedtls_pem_context pem;
+
+	mbedtls_pem_init(&pem);
+	ret = mbedtls_pem_read_buffer(&pem, "-----BEGIN CERTIFICATE-----", "-----END CERTIFICATE-----",
+									ctx->in, NULL, 0, &use_len);
+	mbedtls_pem_free(&pem);
+
+	return ret;
+}
+
+/* A self signed CA certificate for key, ready for write_certificate */
+static int speed_setup_crt(speed_sign_ctx* ctx, mbedtls_pk_context* key)
+{
+	int ret;
+
+	mbedtls_x509write_crt_set_version(&ctx->crt, MBEDTLS_X509_CRT_VERSION_3);
+	mbedtls_x509write_crt_set_md_alg(&ctx->crt, MBEDTLS_MD_SHA256);
+	mbedtls_x509write_crt_set_subject_key(&ctx->crt, key);
+	mbedtls_x509write_crt_set_issuer_key(&ctx->crt, key);
+
+	if((ret = mbedtls_x509write_crt_set_subject_name(&ctx->crt, SPEED_ISSUER)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_issuer_name(&ctx->crt, SPEED_ISSUER)) != 0 ||
+		(ret = mbedtls_mpi_lset(&ctx->serial, 1)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_serial(&ctx->crt, &ctx->serial)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_validity(&ctx->crt, SPEED_NOT_BEFORE, SPEED_NOT_AFTER)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_basic_constraints(&ctx->crt, 1, -1)) != 0)
+	{
+		return ret;
+	}
+#if defined(MBEDTLS_SHA1_C)
+	if((ret = mbedtls_x509write_crt_set_subject_key_identifier(&ctx->crt)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_authority_key_identifier(&ctx->crt)) != 0)
+	{
+		return ret;
+	}
+#endif /* MBEDTLS_SHA1_C */
+
+	return 0;
+}
+
+/* Writes an index.txt with rows entries, one in ten revoked */
+static int speed_write_db(const char* path, unsigned long rows)
+{
+	FILE* f;
+
+	if((f = fopen(path, "wb")) == NULL)
+	{
+		return -1;
+	}
+
+	for(unsigned long r = 1; r <= rows; r++)
+	{
+		if(r % 10 == 0)
+		{
+			fprintf(f, "R\t340101000000Z\t240601000000Z\t%06lX\tunknown\t/CN=client%lu/O=mbedtls-clu\n", r, r);
+		}
+		else
+		{
+			fprintf(f, "V\t340101000000Z\t\t%06lX\tunknown\t/CN=client%lu/O=mbedtls-clu\n", r, r);
+		}
+	}
+
+	return (fclose(f) == 0 ? 0 : -1);
+}
+
+/* An EasyRSA style openssl-easyrsa.cnf, the shape req and ca parse in practice */
+static int speed_write_config(const char* path)
+{
+	FILE* f;
+	struct timeval tv[2];
+
+	if((f = fopen(path, "wb")) == NULL)
+	{
+		return -1;
+	}
+
+	fprintf(f,
+		"# mbedtls-clu speed config\n"
+		"RANDFILE		= $ENV::EASYRSA_PKI/.rnd\n\n"
+		"[ ca ]\n"
+		"default_ca	= CA_default\n\n"
+		"[ CA_default ]\n"
+		"dir		= /etc/easy-rsa/pki\n"
+		"certs		= $dir\n"
+		"crl_dir		= $dir\n"
+		"database	= $dir/index.txt\n"
+		"new_certs_dir	= $dir/certs_by_serial\n"
+		"certificate	= $dir/ca.crt\n"
+		"serial		= $dir/serial\n"
+		"crl		= $dir/crl.pem\n"
+		"private_key	= $dir/private/ca.key\n"
+		"RANDFILE	= $dir/.rand\n"
+		"x509_extensions	= basic_exts\n"
+		"crl_extensions	= crl_ext\n"
+		"default_days	= 825\n"
+		"default_crl_days= 180\n"
+		"default_md	= sha256\n"
+		"preserve	= no\n"
+		"unique_subject	= no\n"
+		"policy		= policy_anything\n\n"
+		"[ policy_match ]\n"
+		"countryName		= match\n"
+		"stateOrProvinceName	= match\n"
+		"organizationName	= match\n"
+		"organizationalUnitName	= optional\n"
+		"commonName		= supplied\n"
+		"name			= optional\n"
+		"emailAddress		= optional\n\n"
+		"[ policy_anything ]\n"
+		"countryName		= optional\n"
+		"stateOrProvinceName	= optional\n"
+		"localityName		= optional\n"
+		"organizationName	= optional\n"
+		"organizationalUnitName	= optional\n"
+		"commonName		= supplied\n"
+		"name			= optional\n"
+		"emailAddress		= optional\n\n"
+		"[ req ]\n"
+		"default_bits		= 2048\n"
+		"default_keyfile 	= privkey.pem\n"
+		"default_md		= sha256\n"
+		"distinguished_name	= cn_only\n"
+		"x509_extensions		= easyrsa_ca\n\n"
+		"[ cn_only ]\n"
+		"commonName		= Common Name (eg: your user, host, or server name)\n"
+		"commonName_max		= 64\n"
+		"commonName_default	= ChangeMe\n\n"
+		"[ org ]\n"
+		"countryName			= Country Name (2 letter code)\n"
+		"countryName_default		= US\n"
+		"countryName_min			= 2\n"
+		"countryName_max			= 2\n"
+		"stateOrProvinceName		= State or Province Name (full name)\n"
+		"stateOrProvinceName_default	= California\n"
+		"localityName			= Locality Name (eg, city)\n"
+		"localityName_default		= San Francisco\n"
+		"0.organizationName		= Organization Name (eg, company)\n"
+		"0.organizationName_default	= Copyleft Certificate Co\n"
+		"organizationalUnitName		= Organizational Unit Name (eg, section)\n"
+		"organizationalUnitName_default	= My Organizational Unit\n"
+		"commonName			= Common Name (eg: your user, host, or server name)\n"
+		"commonName_max			= 64\n"
+		"commonName_default		= ChangeMe\n"
+		"emailAddress			= Email Address\n"
+		"emailAddress_default		= me@example.net\n"
+		"emailAddress_max		= 64\n\n"
+		"[ basic_exts ]\n"
+		"basicConstraints	= CA:FALSE\n"
+		"subjectKeyIdentifier	= hash\n"
+		"authorityKeyIdentifier	= keyid,issuer:always\n\n"
+		"[ easyrsa_ca ]\n"
+		"subjectKeyIdentifier=hash\n"
+		"authorityKeyIdentifier=keyid:always,issuer:always\n"
+		"basicConstraints = CA:true\n"
+		"keyUsage = cRLSign, keyCertSign\n\n"
+		"[ crl_ext ]\n"
+		"authorityKeyIdentifier=keyid:always,issuer:always\n");
+
+	if(fclose(f) != 0)
+	{
+		return -1;
+	}
+
+	// An hour old like an installed config, new files are always hashed by the config cache
+	tv[0].tv_sec = tv[1].tv_sec = time(NULL) - 3600;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+
+	return utimes(path, tv);
+}
+
+static void speed_format_time(double t, char* buf, size_t len)
+{
+	if(t >= 1.0)
+		snprintf(buf, len, "%.2fs", t);
+	else if(t >= 1e-3)
+		snprintf(buf, len, "%.2fms", t * 1e3);
+	else if(t >= 1e-6)
+		snprintf(buf, len, "%.2fus", t * 1e6);
+	else
+		snprintf(buf, len, "%.0fns", t * 1e9);
+}
+
+static void speed_print_table(const speed_report* report)
+{
+	char t[6][16];
+
+	mbedtls_printf("\n %-14s %-12s %5s %9s %12s %10s %10s %10s %10s %10s %10s\n",
+					"test", "param", "runs", "ops/run", "ops/s", "mean", "p50", "p90", "p99", "min", "max");
+	for(int r = 0; r < report->num_results; r++)
+	{
+		const speed_result* result = &report->results[r];
+
+		if(result->ret != 0)
+		{
+			mbedtls_printf(" %-14s %-12s failed -0x%04x\n", result->test, result->param, (unsigned int) -result->ret);
+			continue;
+		}
+		speed_format_time(result->mean, t[0], sizeof(t[0]));
+		speed_format_time(result->p50, t[1], sizeof(t[1]));
+		speed_format_time(result->p90, t[2], sizeof(t[2]));
+		speed_format_time(result->p99, t[3], sizeof(t[3]));
+		speed_format_time(result->min, t[4], sizeof(t[4]));
+		speed_format_time(result->max, t[5], sizeof(t[5]));
+		mbedtls_printf(" %-14s %-12s %5d %9lu %12.1f %10s %10s %10s %10s %10s %10s\n",
+						result->test, result->param, result->runs, result->ops,
+						(result->p50 > 0 ? 1.0 / result->p50 : 0.0), t[0], t[1], t[2], t[3], t[4], t[5]);
+	}
+}
+
+static int speed_write_json(const speed_report* report, const char* path)
+{
+	FILE* f = stdout;
+
+	if(strcmp(path, "-") != 0 && (f = fopen(path, "wb")) == NULL)
+	{
+		return -1;
+	}
+
+	fprintf(f, "{\n  \"version\": \"%s\",\n  \"library\": \"%s\",\n  \"cpus\": %d,\n"
+				"  \"runs\": %d,\n  \"warmup\": %d,\n  \"results\": [",
+				MBEDTLSCLU_VERSION, MBEDTLS_VERSION_STRING_FULL, mbedtlsclu_cpu_count(),
+				report->runs, report->warmup);
+	for(int r = 0; r < report->num_results; r++)
+	{
+		const speed_result* result = &report->results[r];
+
+		fprintf(f, "%s\n    {\"test\": \"%s\", \"param\": \"%s\", \"ret\": %d, \"runs\": %d, \"ops_per_run\": %lu, "
+					"\"ops_per_sec\": %.3f, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+					"\"p99_us\": %.3f, \"min_us\": %.3f, \"max_us\": %.3f}",
+					(r == 0 ? "" : ","), result->test, result->param, result->ret, result->runs, result->ops,
+					(result->p50 > 0 ? 1.0 / result->p50 : 0.0), result->mean * 1e6, result->p50 * 1e6,
+					result->p90 * 1e6, result->p99 * 1e6, result->min * 1e6, result->max * 1e6);
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	if(f != stdout)
+	{
+		return (fclose(f) == 0 ? 0 : -1);
+	}
+	fflush(f);
+
+	return 0;
+}
+
+/* Splits a comma separated list in place. Returns the number of entries, or -1 if there are too many */
+static int speed_split_list(char* list, char** entries, int max_entries)
+{
+	int n = 0;
+	char* saveptr = NULL;
+
+	for(char* tok = strtok_r(list, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr))
+	{
+		if(n == max_entries)
+		{
+			return -1;
+		}
+		entries[n++] = tok;
+	}
+
+	return n;
+}
+
+int speed_main(int argc, char** argv, int argi)
+{
+	int ret = 1;
+	int exit_code = MBEDTLS_EXIT_FAILURE;
+	int failed = 0;
+	char* p;
+	char param[24];
+	const char* pers = "mbedtls-clu-speed";
+
+	int tests = SPEED_TEST_ALL;
+	char* tests_in = NULL;
+	char* rsa_bits_in = NULL;
+	char* curves_in = NULL;
+	char* tmpdir = NULL;
+	char* json_out = NULL;
+	int min_time_ms = DFL_MIN_TIME_MS;
+	unsigned long max_rows = DFL_MAX_ROWS;
+	char* list[MAX_LIST];
+	int list_len;
+
+	char* crtfile = NULL;
+	char* dbfile = NULL;
+	char* conffile = NULL;
+	char* cache_env = NULL;
+	char* cache_file = NULL;
+	unsigned char* der_buf = NULL;
+	unsigned char* pem_buf = NULL;
+	unsigned char* crl_buf = NULL;
+	unsigned char csr_buf[4096];
+
+	speed_report* report = NULL;
+	speed_keygen_ctx keygen;
+	speed_sign_ctx sign;
+	speed_buf_ctx buf_ctx;
+	mbedtls_pk_context fixture_key;
+	mbedtls_x509write_csr csr;
+	mbedtls_x509write_crl crl;
+	mbedtls_x509write_crl scratch_crl;
+	mbedtls_x509write_crl_revoked_cert** tail;
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context ctr_drbg;
+
+	report = calloc(1, sizeof(speed_report));
+	report->runs = DFL_RUNS;
+	report->warmup = DFL_WARMUP;
+	genpkey_params_init(&keygen.params);
+	keygen.ctr_drbg = &ctr_drbg;
+	memset(&sign, 0, sizeof(sign));
+	mbedtls_x509write_crt_init(&sign.crt);
+	mbedtls_mpi_init(&sign.serial);
+	sign.ctr_drbg = &ctr_drbg;
+	memset(&buf_ctx, 0, sizeof(buf_ctx));
+	buf_ctx.ctr_drbg = &ctr_drbg;
+	mbedtls_pk_init(&fixture_key);
+	mbedtls_x509write_csr_init(&csr);
+	mbedtls_x509write_crl_init(&crl);
+	mbedtls_ctr_drbg_init(&ctr_drbg);
+	mbedtls_entropy_init(&entropy);
+
+	for(int i = argi; i < argc; i++)
+	{
+		p = argv[i];
+		if(strcmp(p,"-help") == 0)
+		{
+usage:
+			mbedtls_printf(USAGE);
+			goto exit;
+		}
+		else if(strcmp(p,"-tests") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the list of tests. Advance i
+			i += 1;
+			tests_in = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-runs") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of runs. Advance i
+			i += 1;
+			report->runs = atoi(argv[i]);
+			if(report->runs < 1 || report->runs > MAX_RUNS)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-warmup") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of warm up runs. Advance i
+			i += 1;
+			report->warmup = atoi(argv[i]);
+			if(report->warmup < 0 || report->warmup > MAX_RUNS)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-mintime") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the minimum run time in ms. Advance i
+			i += 1;
+			min_time_ms = atoi(argv[i]);
+			if(min_time_ms < 1)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-tmpdir") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the directory. Advance i
+			i += 1;
+			tmpdir = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-rsa_bits") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the list of key sizes. Advance i
+			i += 1;
+			rsa_bits_in = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-curves") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the list of curves. Advance i
+			i += 1;
+			curves_in = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-max_rows") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of rows. Advance i
+			i += 1;
+			max_rows = strtoul(argv[i], NULL, 10);
+			if(max_rows < 1000)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-json") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the JSON output file. Advance i
+			i += 1;
+			json_out = strdup(argv[i]);
+		}
+		else
+		{
+			// unknown param
+			goto usage;
+		}
+	}
+
+	if(rsa_bits_in == NULL)
+	{
+		rsa_bits_in = strdup(DFL_RSA_BITS);
+	}
+	if(curves_in == NULL)
+	{
+		curves_in = strdup(DFL_CURVES);
+	}
+	if(tmpdir == NULL)
+	{
+		tmpdir = strdup(DFL_TMPDIR);
+	}
+	report->min_time = min_time_ms / 1000.0;
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: tests: %s\n", tests_in);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: runs: %d\n", report->runs);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: warmup: %d\n", report->warmup);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: mintime: %d\n", min_time_ms);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: tmpdir: %s\n", tmpdir);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: rsa_bits: %s\n", rsa_bits_in);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: curves: %s\n", curves_in);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: max_rows: %lu\n", max_rows);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: json: %s\n", json_out);
+
+	if(tests_in != NULL)
+	{
+		char* tests_copy = strdup(tests_in);
+
+		tests = 0;
+		list_len = speed_split_list(tests_copy, list, MAX_LIST);
+		for(int l = 0; l < list_len; l++)
+		{
+			int t;
+			for(t = 0; speed_tests[t].name != NULL && strcmp(speed_tests[t].name, list[l]) != 0; t++);
+			if(speed_tests[t].name == NULL)
+			{
+				mbedtls_printf("Unknown test: %s\n", list[l]);
+				free(tests_copy);
+				goto usage;
+			}
+			tests |= speed_tests[t].flag;
+		}
+		free(tests_copy);
+		if(list_len <= 0)
+		{
+			goto usage;
+		}
+	}
+
+	crtfile = malloc(strlen(tmpdir) + 64);
+	dbfile = malloc(strlen(tmpdir) + 64);
+	conffile = malloc(strlen(tmpdir) + 64);
+	sprintf(crtfile, "%s/mbedtls-clu-speed.%d.crt", tmpdir, (int) getpid());
+	sprintf(dbfile, "%s/mbedtls-clu-speed.%d.txt", tmpdir, (int) getpid());
+	sprintf(conffile, "%s/mbedtls-clu-speed.%d.cnf", tmpdir, (int) getpid());
+
+	/*
+	 * 0. Seed the PRNG
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Seeding the random number generator...");
+	fflush(stdout);
+
+	if ((ret = mbedtlsclu_ctr_drbg_seed(&ctr_drbg, &entropy,
+										(const unsigned char *) pers,
+										strlen(pers))) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_ctr_drbg_seed returned %d\n", ret);
+		goto exit;
+	}
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	/*
+	 * 1. Key generation
+	 */
+	if(tests & SPEED_TEST_RSA)
+	{
+		list_len = speed_split_list(rsa_bits_in, list, MAX_LIST);
+		keygen.params.algo = MBEDTLS_PK_RSA;
+		for(int l = 0; l < list_len; l++)
+		{
+			keygen.params.rsa_keysize = atoi(list[l]);
+			if(keygen.params.rsa_keysize < 1024 || keygen.params.rsa_keysize > MBEDTLS_MPI_MAX_BITS)
+			{
+				mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"  !  Skipping RSA key size %s\n", list[l]);
+				continue;
+			}
+			snprintf(param, sizeof(param), "%d", keygen.params.rsa_keysize);
+			failed += (speed_run(report, "rsa_keygen", param, speed_keygen, &keygen, 0) != 0);
+		}
+	}
+
+#if defined(MBEDTLS_ECP_C)
+	if(tests & SPEED_TEST_EC)
+	{
+		const mbedtls_ecp_curve_info* curve_info;
+
+		list_len = speed_split_list(curves_in, list, MAX_LIST);
+		keygen.params.algo = MBEDTLS_PK_ECKEY;
+		for(int l = 0; l < list_len; l++)
+		{
+			if((curve_info = mbedtls_ecp_curve_info_from_name(list[l])) == NULL)
+			{
+				mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"  !  Skipping unknown curve %s\n", list[l]);
+				continue;
+			}
+			keygen.params.ec_curve = curve_info->grp_id;
+			failed += (speed_run(report, "ec_keygen", list[l], speed_keygen, &keygen, 0) != 0);
+		}
+	}
+#endif /* MBEDTLS_ECP_C */
+
+	/*
+	 * 2. Everything else signs with, or parses output of, one RSA fixture key
+	 */
+	if(tests & (SPEED_TEST_SIGN | SPEED_TEST_CSR | SPEED_TEST_CRL | SPEED_TEST_PEM))
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Generating the %d bit fixture key...", DFL_FIXTURE_BITS);
+		fflush(stdout);
+
+		keygen.params.algo = MBEDTLS_PK_RSA;
+		keygen.params.rsa_keysize = DFL_FIXTURE_BITS;
+		if((ret = genpkey_gen_key(&fixture_key, &keygen.params, &ctr_drbg)) != 0 ||
+			(ret = speed_setup_crt(&sign, &fixture_key)) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Fixture setup returned -0x%04x\n", (unsigned int) -ret);
+			goto exit;
+		}
+
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+	}
+
+	if(tests & SPEED_TEST_SIGN)
+	{
+		sign.crtfile = crtfile;
+		snprintf(param, sizeof(param), "rsa%d", DFL_FIXTURE_BITS);
+		failed += (speed_run(report, "cert_sign", param, speed_sign, &sign, 1) != 0);
+		unlink(crtfile);
+	}
+
+	if(tests & SPEED_TEST_CSR)
+	{
+		mbedtls_x509write_csr_set_md_alg(&csr, MBEDTLS_MD_SHA256);
+		mbedtls_x509write_csr_set_key(&csr, &fixture_key);
+		if((ret = mbedtls_x509write_csr_set_subject_name(&csr, SPEED_ISSUER)) != 0 ||
+			(ret = mbedtls_x509write_csr_pem(&csr, csr_buf, sizeof(csr_buf), mbedtls_ctr_drbg_random, &ctr_drbg)) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  mbedtls_x509write_csr_pem returned -0x%04x\n", (unsigned int) -ret);
+			goto exit;
+		}
+		buf_ctx.in = csr_buf;
+		buf_ctx.in_len = strlen((char*)csr_buf) + 1;
+		snprintf(param, sizeof(param), "rsa%d", DFL_FIXTURE_BITS);
+		failed += (speed_run(report, "csr_parse", param, speed_csr_parse, &buf_ctx, 1) != 0);
+	}
+
+	/*
+	 * 3. CRLs, built with the revocation list appended in order like ca -gencrl does
+	 */
+	for(int s = 0; (tests & SPEED_TEST_CRL) && speed_crl_rows[s] != 0 && speed_crl_rows[s] <= max_rows; s++)
+	{
+		char serial[20];
+
+		mbedtls_x509write_crl_free(&crl);
+		mbedtls_x509write_crl_init(&crl);
+		mbedtls_x509write_crl_set_version(&crl, MBEDTLS_X509_CRL_VERSION_2);
+		mbedtls_x509write_crl_set_issuer_key(&crl, &fixture_key);
+		mbedtls_x509write_crl_set_md_alg(&crl, MBEDTLS_MD_SHA256);
+		if((ret = mbedtls_x509write_crl_set_validity(&crl, SPEED_NOT_BEFORE, SPEED_NOT_AFTER)) != 0 ||
+			(ret = mbedtls_x509write_crl_set_issuer_name(&crl, SPEED_ISSUER)) != 0 ||
+			(ret = mbedtls_x509write_crl_set_authority_key_identifier(&crl)) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  CRL setup returned -0x%04x\n", (unsigned int) -ret);
+			goto exit;
+		}
+
+		// Adding walks the list to its end, so add each entry to a scratch CRL and link it on here
+		tail = &crl.revoked_certificates;
+		for(unsigned long r = 1; r <= speed_crl_rows[s]; r++)
+		{
+			snprintf(serial, sizeof(serial), "%lX", r);
+			scratch_crl.revoked_certificates = NULL;
+			if((ret = mbedtls_x509write_crl_add_revoked_cert(&scratch_crl, serial, SPEED_REVOKED)) != 0)
+			{
+				goto exit;
+			}
+			*tail = scratch_crl.revoked_certificates;
+			tail = &(*tail)->next;
+		}
+
+		free(crl_buf);
+		buf_ctx.out_size = speed_crl_rows[s] * 64 + 4096;
+		crl_buf = malloc(buf_ctx.out_size);
+		buf_ctx.out = crl_buf;
+		buf_ctx.crl = &crl;
+		snprintf(param, sizeof(param), "%lu", speed_crl_rows[s]);
+		failed += (speed_run(report, "crl_write", param, speed_crl_write, &buf_ctx, 0) != 0);
+	}
+
+	/*
+	 * 4. CA database
+	 */
+	for(int s = 0; (tests & SPEED_TEST_DB) && speed_db_rows[s] != 0 && speed_db_rows[s] <= max_rows; s++)
+	{
+		if(speed_write_db(dbfile, speed_db_rows[s]) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  Could not write %s\n", dbfile);
+			unlink(dbfile);
+			goto exit;
+		}
+		snprintf(param, sizeof(param), "%lu", speed_db_rows[s]);
+		failed += (speed_run(report, "db_load", param, speed_db_load, dbfile, 0) != 0);
+		unlink(dbfile);
+	}
+
+	/*
+	 * 5. Config file
+	 */
+	if(tests & SPEED_TEST_CONFIG)
+	{
+		if(speed_write_config(conffile) != 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  Could not write %s\n", conffile);
+			unlink(conffile);
+			goto exit;
+		}
+		// Parsed every time first, then again through the cache in tmpdir
+		cache_env = getenv(MBEDTLS_ENV_CONF_CACHE);
+		cache_env = (cache_env != NULL ? strdup(cache_env) : NULL);
+		unsetenv(MBEDTLS_ENV_CONF_CACHE);
+		failed += (speed_run(report, "config_parse", "req", speed_config_req, conffile, 1) != 0);
+		failed += (speed_run(report, "config_parse", "ca", speed_config_ca, conffile, 1) != 0);
+		setenv(MBEDTLS_ENV_CONF_CACHE, tmpdir, 1);
+		failed += (speed_run(report, "config_parse", "req cached", speed_config_req, conffile, 1) != 0);
+		failed += (speed_run(report, "config_parse", "ca cached", speed_config_ca, conffile, 1) != 0);
+		if((cache_file = conf_cache_path(conffile, tmpdir)) != NULL)
+		{
+			unlink(cache_file);
+			free(cache_file);
+		}
+		if(cache_env != NULL)
+		{
+			setenv(MBEDTLS_ENV_CONF_CACHE, cache_env, 1);
+			free(cache_env);
+		}
+		else
+		{
+			unsetenv(MBEDTLS_ENV_CONF_CACHE);
+		}
+		unlink(conffile);
+	}
+
+	/*
+	 * 6. PEM, using the fixture certificate
+	 */
+	if(tests & SPEED_TEST_PEM)
+	{
+		der_buf = malloc(SPEED_PEM_BUF_SIZE);
+		pem_buf = malloc(SPEED_PEM_BUF_SIZE);
+		if((ret = mbedtls_x509write_crt_der(&sign.crt, der_buf, SPEED_PEM_BUF_SIZE,
+											mbedtls_ctr_drbg_random, &ctr_drbg)) < 0)
+		{
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  mbedtls_x509write_crt_der returned -0x%04x\n", (unsigned int) -ret);
+			goto exit;
+		}
+		// The DER is written at the end of the buffer
+		buf_ctx.in = der_buf + SPEED_PEM_BUF_SIZE - ret;
+		buf_ctx.in_len = ret;
+		buf_ctx.out = pem_buf;
+		buf_ctx.out_size = SPEED_PEM_BUF_SIZE;
+		failed += (speed_run(report, "pem_encode", "cert", speed_pem_encode, &buf_ctx, 1) != 0);
+
+		// pem_buf now holds the encoded certificate
+		buf_ctx.in = pem_buf;
+		buf_ctx.in_len = strlen((char*)pem_buf) + 1;
+		failed += (speed_run(report, "pem_decode", "cert", speed_pem_decode, &buf_ctx, 1) != 0);
+	}
+
+	// With -json - stdout carries only the JSON, the progress already went to stderr
+	if(json_out == NULL || strcmp(json_out, "-") != 0)
+	{
+		speed_print_table(report);
+	}
+
+	if(json_out != NULL && speed_write_json(report, json_out) != 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"  !  Could not write %s\n", json_out);
+		goto exit;
+	}
+
+	if(failed == 0)
+	{
+		exit_code = MBEDTLS_EXIT_SUCCESS;
+	}
+
+exit:
+	mbedtls_x509write_crt_free(&sign.crt);
+	mbedtls_mpi_free(&sign.serial);
+	mbedtls_x509write_csr_free(&csr);
+	mbedtls_x509write_crl_free(&crl);
+	mbedtls_pk_free(&fixture_key);
+	mbedtls_ctr_drbg_free(&ctr_drbg);
+	mbedtls_entropy_free(&entropy);
+
+	free(report);
+	free(tests_in);
+	free(rsa_bits_in);
+	free(curves_in);
+	free(tmpdir);
+	free(json_out);
+	free(crtfile);
+	free(dbfile);
+	free(conffile);
+	free(der_buf);
+	free(pem_buf);
+	free(crl_buf);
+
+	return exit_code;
+}
+#endif
@@ -0,0 +1,40 @@
+/* speed -	Benchmark header file
+ *
+ * Copyright © 2024 by Michael Gray <support@lantisproject.com>
+ *
+ * This file is free software: you may copy, redistribute and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbedtlsclu_common.h"
+
+#include "mbedtls/x509_csr.h"
+#include "mbedtls/pem.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/version.h"
+
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define SPEED_TEST_RSA			0x01
+#define SPEED_TEST_EC			0x02
+#define SPEED_TEST_SIGN			0x04
+#define SPEED_TEST_CSR			0x08
+#define SPEED_TEST_CRL			0x10
+#define SPEED_TEST_DB			0x20
+#define SPEED_TEST_CONFIG		0x40
+#define SPEED_TEST_PEM			0x80
+#define SPEED_TEST_ALL			0xff
+
+int speed_main(int argc, char** argv, int argi);
@@ -0,0 +1,929 @@
+/* workload -	Fabricate PKI state at scale for testing
+ *
+ * Copyright © 2024 by Michael Gray <support@lantisproject.com>
+ *
+ * This file is free software: you may copy, redistribute and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Writes the EasyRSA layout ca reads (ca.crt, private/ca.key, index.txt, index.txt.attr,
+ * serial and certs_by_serial/<serial>.pem), plus reqs/<name>.req CSRs, at any scale.
+ * The CA and every certificate and CSR share a single cheap key so the run is bound by
+ * signing, which is spread over -threads workers each with its own copy of the key.
+ * The rows are planned up front from one DRBG and dated from a fixed epoch under -seed,
+ * so with -seed the database is identical from run to run.
+ */
+
+#include "workload.h"
+#include "genpkey.h"
+
+#define DFL_PKI_DIR				"pki-workload"
+#define DFL_CA_SUBJECT			"CN=Workload CA"
+#define DFL_CLIENT_PREFIX		"client"
+#define DFL_REQ_PREFIX			"request"
+#define DFL_ROWS				10000
+#define DFL_REVOKED				10
+#define DFL_EXPIRED				5
+#define DFL_DAYS				825
+#define DFL_MD					"SHA256"
+#if defined(MBEDTLS_ECP_C)
+#define DFL_NEWKEY				"ec:secp256r1"
+#else
+#define DFL_NEWKEY				"rsa:1024"
+#endif
+#define MAX_THREADS				256
+#define MAX_ROWS				10000000
+#define WORKLOAD_CHUNK			64			/* Jobs claimed by a worker at a time */
+#define ONEDAY					(24 * 60 * 60)
+#define SEED_EPOCH				((time_t) 1609459200)	/* 2021-01-01, "now" under -seed */
+#define KEY_PEM_SIZE			16000
+
+#define USAGE \
+    "\n usage: workload [options]\n"																			\
+    "\n\n General options:\n"																					\
+    "    -help					Display this summary\n"															\
+    "    -pkidir dir			Directory to create the PKI in (default: " DFL_PKI_DIR ")\n"					\
+    "							NOTE: An existing PKI (ca.crt or index.txt) is never overwritten\n"			\
+    "    -threads n				Number of threads to use (default: all cpus)\n"									\
+    "\n\n Database options:\n"																					\
+    "    -rows n				Rows in index.txt, each with a certificate (default: 10000)\n"					\
+    "    -revoked pct			Percentage of rows revoked (default: 10)\n"										\
+    "    -expired pct			Percentage of rows expired (default: 5)\n"										\
+    "    -dupsubj pct			Percentage of rows reusing an earlier subject (default: 0)\n"					\
+    "							NOTE: index.txt.attr gets unique_subject = no when this is set\n"			\
+    "    -client_prefix val		Subjects are CN=<val><n> (default: " DFL_CLIENT_PREFIX ")\n"					\
+    "    -nocerts				Only write the database, no certificate files\n"								\
+    "    -csrs n				Also write n CSRs to reqs/ (default: 0)\n"										\
+    "\n\n Certificate options:\n"																				\
+    "    -subj val				CA subject (default: " DFL_CA_SUBJECT ")\n"										\
+    "    -days +int				Validity of each certificate (default: 825)\n"									\
+    "    -md val				Digest to use, such as sha256\n"												\
+    "    -newkey val			The one key for the CA and every certificate (default: " DFL_NEWKEY ")\n"		\
+    USAGE_DEV_RANDOM																							\
+    USAGE_SEED_FILE
+
+#if !defined(MBEDTLS_X509_CRT_WRITE_C) || !defined(MBEDTLS_X509_CSR_WRITE_C) || \
+    !defined(MBEDTLS_PK_WRITE_C) || !defined(MBEDTLS_PK_PARSE_C) || \
+    !defined(MBEDTLS_FS_IO) || !defined(MBEDTLS_ENTROPY_C) || \
+    !defined(MBEDTLS_CTR_DRBG_C) || !defined(MBEDTLS_PEM_WRITE_C)
+int workload_main(void)
+{
+    mbedtls_printf("MBEDTLS_X509_CRT_WRITE_C and/or MBEDTLS_X509_CSR_WRITE_C and/or "
+                   "MBEDTLS_PK_WRITE_C and/or MBEDTLS_PK_PARSE_C and/or "
+                   "MBEDTLS_FS_IO and/or MBEDTLS_ENTROPY_C and/or "
+                   "MBEDTLS_CTR_DRBG_C and/or MBEDTLS_PEM_WRITE_C not defined.\n");
+    mbedtls_exit(0);
+}
+#else
+
+/* One row of index.txt and the certificate behind it */
+typedef struct workload_row {
+	char status;					/* V, R or E */
+	unsigned long serial;
+	unsigned long subject;			/* Client number, repeats with -dupsubj */
+	time_t notbefore;
+	time_t notafter;
+	time_t revoked;
+	int ret;
+} workload_row;
+
+/*
+ * Certificates then CSRs, claimed by the workers WORKLOAD_CHUNK jobs at a time.
+ * The first error stops every worker
+ */
+typedef struct workload_queue {
+	pthread_mutex_t lock;
+	workload_row* rows;
+	unsigned long num_certs;
+	unsigned long num_csrs;
+	unsigned long next_job;
+	int ret;
+
+	const char* pkidir;
+	const char* ca_subject;
+	const char* client_prefix;
+	const unsigned char* key_pem;
+	mbedtls_md_type_t md_alg;
+} workload_queue;
+
+typedef struct workload_worker {
+	workload_queue* queue;
+	mbedtls_ctr_drbg_context* ctr_drbg;
+	pthread_t thread;
+} workload_worker;
+
+/* The clock the dates are taken from, fixed under -seed so the database repeats */
+static time_t workload_now(void)
+{
+	return (mbedtlsclu_test_seed_active() ? SEED_EPOCH : time(NULL));
+}
+
+/* Serial in hex with an even number of digits, as ca and openssl write them */
+static void workload_serial(unsigned long serial, char* buf, size_t len)
+{
+	int n = snprintf(buf, len, "%lX", serial);
+
+	if(n % 2 == 1)
+	{
+		snprintf(buf, len, "0%lX", serial);
+	}
+}
+
+/* YYYYMMDDHHMMSS, the index takes it from the third digit with a Z */
+static void workload_time(time_t t, char* buf)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	sprintf(buf, "%04d%02d%02d%02d%02d%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+static unsigned long workload_rand(mbedtls_ctr_drbg_context* ctr_drbg, unsigned long n)
+{
+	unsigned char r[4];
+
+	if(n == 0 || mbedtls_ctr_drbg_random(ctr_drbg, r, sizeof(r)) != 0)
+	{
+		return 0;
+	}
+
+	return (((unsigned long) r[0] << 24) | (r[1] << 16) | (r[2] << 8) | r[3]) % n;
+}
+
+/* Writes len bytes of buf to path, returns 0 or -1 as write_certificate does */
+static int workload_write_file(const char* path, const unsigned char* buf, size_t len)
+{
+	FILE* f;
+
+	if((f = fopen(path, "w")) == NULL)
+	{
+		return -1;
+	}
+	if(fwrite(buf, 1, len, f) != len)
+	{
+		fclose(f);
+		return -1;
+	}
+
+	return (fclose(f) == 0 ? 0 : -1);
+}
+
+/*
+ * Issues the certificate for row (or the self signed CA when row is NULL) and writes it to path.
+ * The subject and issuer keys are both key, the one key of the workload
+ */
+static int workload_issue(workload_queue* queue, workload_row* row, mbedtls_pk_context* key,
+							const char* path, mbedtls_ctr_drbg_context* ctr_drbg)
+{
+	int ret;
+	unsigned char output_buf[4096];
+	char subject[256];
+	char notbefore[32];
+	char notafter[32];
+	mbedtls_x509write_cert crt;
+	mbedtls_mpi serial;
+
+	mbedtls_x509write_crt_init(&crt);
+	mbedtls_mpi_init(&serial);
+
+	mbedtls_x509write_crt_set_version(&crt, MBEDTLS_X509_CRT_VERSION_3);
+	mbedtls_x509write_crt_set_md_alg(&crt, queue->md_alg);
+	mbedtls_x509write_crt_set_subject_key(&crt, key);
+	mbedtls_x509write_crt_set_issuer_key(&crt, key);
+
+	if(row == NULL)
+	{
+		time_t now = workload_now();
+		snprintf(subject, sizeof(subject), "%s", queue->ca_subject);
+		workload_time(now - 365 * ONEDAY, notbefore);
+		workload_time(now + 3650 * ONEDAY, notafter);
+		ret = mbedtls_mpi_lset(&serial, 1);
+	}
+	else
+	{
+		snprintf(subject, sizeof(subject), "CN=%s%lu", queue->client_prefix, row->subject);
+		workload_time(row->notbefore, notbefore);
+		workload_time(row->notafter, notafter);
+		ret = mbedtls_mpi_lset(&serial, (mbedtls_mpi_sint) row->serial);
+	}
+
+	if(ret != 0 ||
+		(ret = mbedtls_x509write_crt_set_subject_name(&crt, subject)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_issuer_name(&crt, queue->ca_subject)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_serial(&crt, &serial)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_validity(&crt, notbefore, notafter)) != 0 ||
+		(ret = mbedtls_x509write_crt_set_basic_constraints(&crt, (row == NULL), -1)) != 0)
+	{
+		goto exit;
+	}
+
+	if((ret = mbedtls_x509write_crt_pem(&crt, output_buf, sizeof(output_buf),
+										mbedtls_ctr_drbg_random, ctr_drbg)) != 0)
+	{
+		goto exit;
+	}
+	ret = workload_write_file(path, output_buf, strlen((char*) output_buf));
+
+exit:
+	mbedtls_x509write_crt_free(&crt);
+	mbedtls_mpi_free(&serial);
+
+	return ret;
+}
+
+static int workload_request(workload_queue* queue, unsigned long n, mbedtls_pk_context* key,
+							const char* path, mbedtls_ctr_drbg_context* ctr_drbg)
+{
+	int ret;
+	unsigned char output_buf[4096];
+	char subject[256];
+	mbedtls_x509write_csr csr;
+
+	mbedtls_x509write_csr_init(&csr);
+	mbedtls_x509write_csr_set_md_alg(&csr, queue->md_alg);
+	mbedtls_x509write_csr_set_key(&csr, key);
+
+	snprintf(subject, sizeof(subject), "CN=%s%lu", DFL_REQ_PREFIX, n);
+	if((ret = mbedtls_x509write_csr_set_subject_name(&csr, subject)) == 0 &&
+		(ret = mbedtls_x509write_csr_pem(&csr, output_buf, sizeof(output_buf),
+										mbedtls_ctr_drbg_random, ctr_drbg)) == 0)
+	{
+		ret = workload_write_file(path, output_buf, strlen((char*) output_buf));
+	}
+
+	mbedtls_x509write_csr_free(&csr);
+
+	return ret;
+}
+
+static void* workload_run_worker(void* arg)
+{
+	int ret;
+	workload_worker* worker = (workload_worker*)arg;
+	workload_queue* queue = worker->queue;
+	unsigned long total = queue->num_certs + queue->num_csrs;
+	unsigned long first, last;
+	char* path = malloc(strlen(queue->pkidir) + 64);
+	char serialbuf[32];
+	mbedtls_pk_context key;
+
+	// Signing with a shared key is not thread safe, every worker parses its own copy
+	mbedtls_pk_init(&key);
+	ret = mbedtls_pk_parse_key(&key, queue->key_pem, strlen((const char*) queue->key_pem) + 1, NULL, 0);
+
+	while(1)
+	{
+		pthread_mutex_lock(&queue->lock);
+		if(ret != 0 && queue->ret == 0)
+		{
+			queue->ret = ret;
+		}
+		if(queue->ret != 0 || queue->next_job >= total)
+		{
+			pthread_mutex_unlock(&queue->lock);
+			break;
+		}
+		first = queue->next_job;
+		last = (total - first < WORKLOAD_CHUNK ? total : first + WORKLOAD_CHUNK);
+		queue->next_job = last;
+		pthread_mutex_unlock(&queue->lock);
+
+		for(unsigned long j = first; j < last && ret == 0; j++)
+		{
+			if(j < queue->num_certs)
+			{
+				workload_serial(queue->rows[j].serial, serialbuf, sizeof(serialbuf));
+				sprintf(path, "%s/certs_by_serial/%s.pem", queue->pkidir, serialbuf);
+				ret = queue->rows[j].ret = workload_issue(queue, &queue->rows[j], &key, path, worker->ctr_drbg);
+			}
+			else
+			{
+				sprintf(path, "%s/reqs/%s%lu.req", queue->pkidir, DFL_REQ_PREFIX, j - queue->num_certs + 1);
+				ret = workload_request(queue, j - queue->num_certs + 1, &key, path, worker->ctr_drbg);
+			}
+			if(ret != 0)
+			{
+				mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"\n  !  Could not write %s, returned -0x%04x\n", path, (unsigned int) -ret);
+			}
+		}
+	}
+
+	mbedtls_pk_free(&key);
+	free(path);
+
+	return NULL;
+}
+
+/* Signs and writes every certificate and CSR using threads workers. Returns the first error */
+static int workload_run(workload_queue* queue, int threads, mbedtls_ctr_drbg_context* ctr_drbgs)
+{
+	int started = 0;
+	workload_worker* workers;
+
+	queue->next_job = 0;
+	queue->ret = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	workers = (workload_worker*)malloc(sizeof(workload_worker) * threads);
+	for(int i = 0; i < threads; i++)
+	{
+		workers[i].queue = queue;
+		workers[i].ctr_drbg = &ctr_drbgs[i];
+	}
+
+	for(started = 0; threads > 1 && started < threads; started++)
+	{
+		if(pthread_create(&workers[started].thread, NULL, workload_run_worker, &workers[started]) != 0)
+		{
+			break;
+		}
+	}
+	if(started == 0)
+	{
+		workload_run_worker(&workers[0]);
+	}
+	for(int i = 0; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	pthread_mutex_destroy(&queue->lock);
+	free(workers);
+
+	return queue->ret;
+}
+
+/*
+ * Decides each row's state and dates. Valid rows were issued within the last year,
+ * expired rows ran out within the last year and revoked rows were revoked since issue
+ */
+static void workload_plan(workload_row* rows, unsigned long num_rows, int revoked_pct, int expired_pct,
+							int dupsubj_pct, int days, mbedtls_ctr_drbg_context* ctr_drbg)
+{
+	time_t now = workload_now();
+	unsigned long pick;
+
+	for(unsigned long r = 0; r < num_rows; r++)
+	{
+		workload_row* row = &rows[r];
+
+		row->serial = r + 2;	/* 1 is the CA's */
+		row->subject = r + 1;
+		if(r > 0 && (int) workload_rand(ctr_drbg, 100) < dupsubj_pct)
+		{
+			row->subject = rows[workload_rand(ctr_drbg, r)].subject;
+		}
+
+		pick = workload_rand(ctr_drbg, 100);
+		if(pick < (unsigned long) expired_pct)
+		{
+			row->status = 'E';
+			row->notafter = now - (time_t)(1 + workload_rand(ctr_drbg, 365)) * ONEDAY;
+			row->notbefore = row->notafter - (time_t) days * ONEDAY;
+		}
+		else
+		{
+			row->status = (pick < (unsigned long)(expired_pct + revoked_pct) ? 'R' : 'V');
+			row->notbefore = now - (time_t) workload_rand(ctr_drbg, 365) * ONEDAY;
+			row->notafter = row->notbefore + (time_t) days * ONEDAY;
+			if(row->status == 'R')
+			{
+				row->revoked = row->notbefore + (time_t) workload_rand(ctr_drbg, (unsigned long)(now - row->notbefore) + 1);
+			}
+		}
+	}
+}
+
+/* Writes index.txt in serial order, the way ca leaves it */
+static int workload_write_index(const char* dbfile, workload_row* rows, unsigned long num_rows, const char* client_prefix)
+{
+	FILE* fout;
+	char serialbuf[32];
+	char notafter[32];
+	char revoked[32];
+
+	if((fout = fopen(dbfile, "wb+")) == NULL)
+	{
+		return -1;
+	}
+
+	for(unsigned long r = 0; r < num_rows; r++)
+	{
+		workload_serial(rows[r].serial, serialbuf, sizeof(serialbuf));
+		workload_time(rows[r].notafter, notafter);
+		revoked[0] = '\0';
+		if(rows[r].status == 'R')
+		{
+			workload_time(rows[r].revoked, revoked);
+		}
+		// Remove leading 2 digits from 4 digit year representation and add "Z"
+		fprintf(fout, "%c\t%sZ\t%s%s\t%s\tunknown\t/CN=%s%lu\n", rows[r].status, notafter + 2,
+				(revoked[0] != '\0' ? revoked + 2 : ""), (revoked[0] != '\0' ? "Z" : ""),
+				serialbuf, client_prefix, rows[r].subject);
+	}
+
+	return (fclose(fout) == 0 ? 0 : -1);
+}
+
+int workload_main(int argc, char** argv, int argi)
+{
+	int ret = 1;
+	int exit_code = MBEDTLS_EXIT_FAILURE;
+	int i;
+	char* p;
+	char buf[1024];
+	mbedtls_entropy_context entropy;
+	mbedtlsclu_entropy_source entropy_source;
+	mbedtlsclu_seed_file seed_file;
+	mbedtls_ctr_drbg_context ctr_drbg;
+	mbedtls_ctr_drbg_context* thread_ctr_drbgs = NULL;
+	const char* pers = "workload";
+	int use_dev_random = 0;
+	int threads = 0;
+
+	char* pkidir = NULL;
+	char* ca_subject = NULL;
+	char* client_prefix = NULL;
+	unsigned long num_rows = DFL_ROWS;
+	unsigned long num_csrs = 0;
+	int revoked_pct = DFL_REVOKED;
+	int expired_pct = DFL_EXPIRED;
+	int dupsubj_pct = 0;
+	int nocerts = 0;
+	int days = DFL_DAYS;
+	char* md_alg_in = NULL;
+	const mbedtls_md_info_t* md_info;
+	char* newkey_optsin = NULL;
+	genpkey_params key_params;
+
+	workload_queue queue;
+	workload_row* rows = NULL;
+	mbedtls_pk_context key;
+	unsigned char* key_pem = NULL;
+	char* path;
+	char* dbfile = NULL;
+	char serialbuf[32];
+	double start;
+	struct timespec ts;
+	FILE* fout = NULL;
+
+	memset(&queue, 0, sizeof(queue));
+	mbedtls_pk_init(&key);
+	mbedtls_ctr_drbg_init(&ctr_drbg);
+	mbedtls_entropy_init(&entropy);
+	mbedtlsclu_entropy_source_init(&entropy_source);
+	mbedtlsclu_seed_file_init(&seed_file);
+	genpkey_params_init(&key_params);
+
+#if defined(MBEDTLS_USE_PSA_CRYPTO)
+	psa_status_t status = psa_crypto_init();
+	if (status != PSA_SUCCESS) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR,"Failed to initialize PSA Crypto implementation: %d\n",
+						(int) status);
+		goto exit;
+	}
+#endif /* MBEDTLS_USE_PSA_CRYPTO */
+
+	for(i = argi; i < argc; i++)
+	{
+		p = argv[i];
+
+		if(strcmp(p,"-help") == 0)
+		{
+usage:
+			mbedtls_printf(USAGE);
+			goto exit;
+		}
+		else if(strcmp(p,"-pkidir") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the directory. Advance i
+			i += 1;
+			pkidir = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-threads") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of threads. Advance i
+			i += 1;
+			threads = atoi(argv[i]);
+			if(threads < 1 || threads > MAX_THREADS)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-rows") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of rows. Advance i
+			i += 1;
+			num_rows = strtoul(argv[i], NULL, 10);
+			if(num_rows < 1 || num_rows > MAX_ROWS)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-revoked") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the percentage. Advance i
+			i += 1;
+			revoked_pct = atoi(argv[i]);
+			if(revoked_pct < 0 || revoked_pct > 100)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-expired") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the percentage. Advance i
+			i += 1;
+			expired_pct = atoi(argv[i]);
+			if(expired_pct < 0 || expired_pct > 100)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-dupsubj") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the percentage. Advance i
+			i += 1;
+			dupsubj_pct = atoi(argv[i]);
+			if(dupsubj_pct < 0 || dupsubj_pct > 100)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-client_prefix") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the prefix. Advance i
+			i += 1;
+			client_prefix = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-nocerts") == 0)
+		{
+			nocerts = 1;
+		}
+		else if(strcmp(p,"-csrs") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of CSRs. Advance i
+			i += 1;
+			num_csrs = strtoul(argv[i], NULL, 10);
+			if(num_csrs > MAX_ROWS)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-subj") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the CA subject. Advance i
+			i += 1;
+			ca_subject = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-days") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the number of days. Advance i
+			i += 1;
+			days = atoi(argv[i]);
+			if(days <= 0)
+			{
+				goto usage;
+			}
+		}
+		else if(strcmp(p,"-md") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the digest. Advance i
+			i += 1;
+			md_alg_in = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-newkey") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the key spec. Advance i
+			i += 1;
+			newkey_optsin = strdup(argv[i]);
+		}
+#if defined(MBEDTLS_FS_IO)
+		else if(strcmp(p,"-usedevrandom") == 0)
+		{
+			use_dev_random = 1;
+		}
+		else if(strcmp(p,"-randompool") == 0)
+		{
+			use_dev_random = 1;
+			entropy_source.random_pool = 1;
+		}
+#endif /* MBEDTLS_FS_IO */
+		else if(strcmp(p,"-rand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.path = strdup(argv[i]);
+		}
+		else if(strcmp(p,"-writerand") == 0 && i + 1 < argc)
+		{
+			// argv[i+1] should be the seed file. Advance i
+			i += 1;
+			seed_file.write_path = strdup(argv[i]);
+		}
+		else
+		{
+			// unknown param
+			goto usage;
+		}
+	}
+
+	if(pkidir == NULL)
+	{
+		pkidir = strdup(DFL_PKI_DIR);
+	}
+	if(ca_subject == NULL)
+	{
+		ca_subject = strdup(DFL_CA_SUBJECT);
+	}
+	if(client_prefix == NULL)
+	{
+		client_prefix = strdup(DFL_CLIENT_PREFIX);
+	}
+	if(md_alg_in == NULL)
+	{
+		md_alg_in = strdup(DFL_MD);
+	}
+	if(newkey_optsin == NULL)
+	{
+		newkey_optsin = strdup(DFL_NEWKEY);
+	}
+
+	threads = mbedtlsclu_worker_threads(threads, mbedtlsclu_cpu_count());
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: pkidir: %s\n", pkidir);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: threads: %d\n", threads);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: rows: %lu\n", num_rows);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: revoked: %d\n", revoked_pct);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: expired: %d\n", expired_pct);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: dupsubj: %d\n", dupsubj_pct);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: client_prefix: %s\n", client_prefix);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: nocerts: %d\n", nocerts);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: csrs: %lu\n", num_csrs);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: subj: %s\n", ca_subject);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: days: %d\n", days);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: md: %s\n", md_alg_in);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: newkey: %s\n", newkey_optsin);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: usedevrandom: %d\n", use_dev_random);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: randompool: %d\n", entropy_source.random_pool);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: rand: %s\n", seed_file.path);
+	mbedtlsclu_prio_printf(MBEDTLSCLU_DEBUG,"cl: writerand: %s\n", seed_file.write_path);
+
+	if(revoked_pct + expired_pct > 100)
+	{
+		mbedtls_printf("-revoked and -expired add up to more than 100\n");
+		goto usage;
+	}
+
+	// Compatibility with openssl-util lowercase digests
+	to_uppercase(md_alg_in);
+	if((md_info = mbedtls_md_info_from_string(md_alg_in)) == NULL)
+	{
+		mbedtls_printf("Invalid digest provided: %s\n", md_alg_in);
+		goto usage;
+	}
+	queue.md_alg = mbedtls_md_get_type(md_info);
+
+	if((ret = genpkey_parse_spec(newkey_optsin, &key_params, 0, 0, 0)) != 0)
+	{
+		if(ret == -1)
+		{
+			goto usage;
+		}
+		goto exit;
+	}
+
+	/*
+	 * 0. Lay out the PKI directory, refusing to touch an existing PKI
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Creating the PKI directory %s...", pkidir);
+	fflush(stdout);
+
+	dbfile = dynamic_strcat(2, pkidir, "/index.txt");
+	path = dynamic_strcat(2, pkidir, "/ca.crt");
+	ret = (path_exists(path) != PATH_DOES_NOT_EXIST || path_exists(dbfile) != PATH_DOES_NOT_EXIST);
+	free(path);
+	if(ret)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  %s already holds a PKI\n", pkidir);
+		goto exit;
+	}
+
+	ret = mkdir_p(pkidir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+	path = dynamic_strcat(2, pkidir, "/private");
+	ret = (ret != 0 ? ret : mkdir_p(path, S_IRWXU));
+	free(path);
+	path = dynamic_strcat(2, pkidir, "/certs_by_serial");
+	ret = (ret != 0 ? ret : mkdir_p(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH));
+	free(path);
+	path = dynamic_strcat(2, pkidir, "/reqs");
+	ret = (ret != 0 || num_csrs == 0 ? ret : mkdir_p(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH));
+	free(path);
+	if(ret != 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not create the directories in %s\n", pkidir);
+		goto exit;
+	}
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	/*
+	 * 1. Seed the PRNGs, one for us and one per worker
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Seeding the random number generators...");
+	fflush(stdout);
+
+	if (use_dev_random) {
+		if ((ret = mbedtlsclu_entropy_add_source(&entropy, &entropy_source)) != 0) {
+			mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_entropy_add_source returned %d\n", ret);
+			goto exit;
+		}
+	}
+
+	if ((ret = mbedtlsclu_seed_file_load(&seed_file, &entropy)) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_seed_file_load returned %d\n", ret);
+		goto exit;
+	}
+
+	if ((ret = mbedtlsclu_ctr_drbg_seed(&ctr_drbg, &entropy,
+									 (const unsigned char *) pers,
+									 strlen(pers))) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtls_ctr_drbg_seed returned %d\n", ret);
+		goto exit;
+	}
+
+	// Every signature draws from a worker DRBG, so at 100k+ rows they all reseed from
+	// &entropy mid-run. Seeding them here routes those reseeds through mbedtlsclu_entropy_func
+	thread_ctr_drbgs = (mbedtls_ctr_drbg_context*)malloc(sizeof(mbedtls_ctr_drbg_context) * threads);
+	for(int t = 0; t < threads; t++)
+	{
+		mbedtls_ctr_drbg_init(&thread_ctr_drbgs[t]);
+	}
+	if ((ret = mbedtlsclu_seed_ctr_drbgs(thread_ctr_drbgs, threads, &entropy, pers)) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  mbedtlsclu_seed_ctr_drbgs returned %d\n", ret);
+		goto exit;
+	}
+
+	if ((ret = mbedtlsclu_seed_file_update(&seed_file, &ctr_drbg)) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"\n  !  Could not write seed file, mbedtlsclu_seed_file_update returned %d\n", ret);
+	}
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	/*
+	 * 2. The one key, and the CA certificate made with it
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Generating the %s key and the CA...", newkey_optsin);
+	fflush(stdout);
+
+	key_pem = malloc(KEY_PEM_SIZE);
+	path = dynamic_strcat(2, pkidir, "/private/ca.key");
+	if ((ret = genpkey_gen_key(&key, &key_params, &ctr_drbg)) != 0 ||
+		(ret = genpkey_write_key(&key, 0, FORMAT_PEM, path)) != 0 ||
+		(ret = mbedtls_pk_write_key_pem(&key, key_pem, KEY_PEM_SIZE)) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not generate %s, returned -0x%04x\n",
+								path, (unsigned int) -ret);
+		free(path);
+		goto exit;
+	}
+	free(path);
+
+	queue.pkidir = pkidir;
+	queue.ca_subject = ca_subject;
+	queue.client_prefix = client_prefix;
+	queue.key_pem = key_pem;
+	path = dynamic_strcat(2, pkidir, "/ca.crt");
+	ret = workload_issue(&queue, NULL, &key, path, &ctr_drbg);
+	free(path);
+	if (ret != 0) {
+		mbedtls_strerror(ret, buf, sizeof(buf));
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not issue the CA, returned -0x%04x - %s\n",
+								(unsigned int) -ret, buf);
+		goto exit;
+	}
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	/*
+	 * 3. Plan the rows, then sign their certificates and the CSRs
+	 */
+	rows = (workload_row*)calloc(num_rows, sizeof(workload_row));
+	workload_plan(rows, num_rows, revoked_pct, expired_pct, dupsubj_pct, days, &ctr_drbg);
+
+	queue.rows = rows;
+	queue.num_certs = (nocerts ? 0 : num_rows);
+	queue.num_csrs = num_csrs;
+	if(queue.num_certs + queue.num_csrs > 0)
+	{
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Writing %lu certificates and %lu CSRs (%d thread%s)...",
+								queue.num_certs, queue.num_csrs, threads, (threads == 1 ? "" : "s"));
+		fflush(stdout);
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		start = ts.tv_sec + ts.tv_nsec / 1e9;
+		if ((ret = workload_run(&queue, threads, thread_ctr_drbgs)) != 0) {
+			goto exit;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok (%.1fs)\n", ts.tv_sec + ts.tv_nsec / 1e9 - start);
+	}
+
+	/*
+	 * 4. The CA database: index.txt, the attr file and the next serial
+	 */
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO,"  . Writing the CA database (%lu rows)...", num_rows);
+	fflush(stdout);
+
+	if (workload_write_index(dbfile, rows, num_rows, client_prefix) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not write %s\n", dbfile);
+		goto exit;
+	}
+
+	path = dynamic_strcat(2, dbfile, ".attr");
+	fout = fopen(path, "wb+");
+	free(path);
+	if (fout == NULL) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not create %s.attr\n", dbfile);
+		goto exit;
+	}
+	fprintf(fout, "unique_subject = %s\n", (dupsubj_pct > 0 ? "no" : "yes"));
+	fclose(fout);
+
+	path = dynamic_strcat(2, pkidir, "/serial");
+	fout = fopen(path, "wb+");
+	free(path);
+	if (fout == NULL) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," failed\n  !  Could not create %s/serial\n", pkidir);
+		goto exit;
+	}
+	workload_serial(num_rows + 2, serialbuf, sizeof(serialbuf));
+	fprintf(fout, "%s\n", serialbuf);
+	fclose(fout);
+	fout = NULL;
+
+	mbedtlsclu_prio_printf(MBEDTLSCLU_INFO," ok\n");
+
+	exit_code = MBEDTLS_EXIT_SUCCESS;
+
+exit:
+	if(fout != NULL)
+	{
+		fclose(fout);
+	}
+
+	if(exit_code != MBEDTLS_EXIT_SUCCESS && ret != 0)
+	{
+#ifdef MBEDTLS_ERROR_C
+		mbedtls_strerror(ret, buf, sizeof(buf));
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," - ERROR - %s\n", buf);
+#else
+		mbedtlsclu_prio_printf(MBEDTLSCLU_ERR," - ERROR\n");
+#endif
+	}
+
+	if ((ret = mbedtlsclu_seed_file_finish(&seed_file, &ctr_drbg)) != 0) {
+		mbedtlsclu_prio_printf(MBEDTLSCLU_WARNING,"  !  Could not write seed file, mbedtlsclu_seed_file_finish returned %d\n", ret);
+	}
+
+	if(thread_ctr_drbgs != NULL)
+	{
+		for(int t = 0; t < threads; t++)
+		{
+			mbedtls_ctr_drbg_free(&thread_ctr_drbgs[t]);
+		}
+		free(thread_ctr_drbgs);
+	}
+	if(key_pem != NULL)
+	{
+		mbedtls_platform_zeroize(key_pem, KEY_PEM_SIZE);
+		free(key_pem);
+	}
+	free(rows);
+	mbedtls_pk_free(&key);
+	mbedtls_ctr_drbg_free(&ctr_drbg);
+	mbedtls_entropy_free(&entropy);
+	mbedtlsclu_seed_file_free(&seed_file);
+	mbedtlsclu_entropy_source_free(&entropy_source);
+
+	free(pkidir);
+	free(ca_subject);
+	free(client_prefix);
+	free(md_alg_in);
+	free(newkey_optsin);
+	free(dbfile);
+
+	return exit_code;
+}
+#endif